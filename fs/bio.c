@@ -494,6 +494,38 @@ struct bio *bio_clone(struct bio *bio, gfp_t gfp_mask)
 }
 EXPORT_SYMBOL(bio_clone);
 
+/**
+ *	bio_clone_bioset	-	clone a bio from a private bio_set
+ *	@bio: bio to clone
+ *	@gfp_mask: allocation priority
+ *	@bs: bio_set to allocate from
+ *
+ *	Like bio_clone(), but the clone and its own copy of the used part of
+ *	the bio_vec array come from @bs, so a %__GFP_WAIT allocation always
+ *	succeeds for up to %BIO_MAX_PAGES vectors.  The caller must set
+ *	->bi_destructor to give the bio back to @bs.
+ */
+struct bio *bio_clone_bioset(struct bio *bio, gfp_t gfp_mask,
+			     struct bio_set *bs)
+{
+	struct bio *b = bio_alloc_bioset(gfp_mask, bio->bi_vcnt, bs);
+
+	if (!b)
+		return NULL;
+
+	memcpy(b->bi_io_vec, bio->bi_io_vec,
+	       bio->bi_vcnt * sizeof(struct bio_vec));
+	b->bi_sector = bio->bi_sector;
+	b->bi_bdev = bio->bi_bdev;
+	b->bi_flags |= 1 << BIO_CLONED;
+	b->bi_rw = bio->bi_rw;
+	b->bi_vcnt = bio->bi_vcnt;
+	b->bi_size = bio->bi_size;
+	b->bi_idx = bio->bi_idx;
+	return b;
+}
+EXPORT_SYMBOL(bio_clone_bioset);
+
 /**
  *	bio_get_nr_vecs		- return approx number of vecs
  *	@bdev:  I/O target
@@ -36,6 +36,7 @@
 #include <linux/fs.h>
 #include <linux/time.h>
 #include <linux/backing-dev.h>
+#include <linux/workqueue.h>
 #include <linux/pnfs_osd_xdr.h>
 #include "common.h"
 
@@ -65,6 +66,7 @@ struct exofs_layout {
 
 	enum exofs_inode_layout_gen_functions lay_func;
 
+	atomic_t	*s_busy;		/* Reads in flight per device */
 	unsigned	s_numdevs;		/* Num of devices in array    */
 	struct osd_dev	*s_ods[0];		/* Variable length            */
 };
@@ -141,6 +143,10 @@ struct exofs_io_state {
 	unsigned		out_attr_len;
 	struct osd_attr 	*out_attr;
 
+	/* Read mirror failover */
+	bool			is_read;
+	struct work_struct	failover_work;
+
 	/* Variable array of size numdevs */
 	unsigned numdevs;
 	struct exofs_per_dev_state {
@@ -149,6 +155,10 @@ struct exofs_io_state {
 		loff_t offset;
 		unsigned length;
 		unsigned dev;
+		unsigned mirror;	/* reads: mirror actually used */
+		unsigned tries;		/* reads: mirrors failed so far */
+		bool resubmit;		/* reads: sent again by failover */
+		atomic_t *busy;		/* reads: accounted in s_busy */
 	} per_dev[];
 };
 
@@ -238,6 +248,9 @@ int exofs_sbi_read(struct exofs_io_state *ios);
 
 int extract_attr_from_ios(struct exofs_io_state *ios, struct osd_attr *attr);
 
+int exofs_init_mirror_bios(void);
+void exofs_destroy_mirror_bios(void);
+
 int exofs_oi_truncate(struct exofs_i_info *oi, u64 new_len);
 static inline int exofs_oi_write(struct exofs_i_info *oi,
 				 struct exofs_io_state *ios)
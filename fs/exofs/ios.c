@@ -23,6 +23,7 @@
  */
 
 #include <linux/slab.h>
+#include <linux/module.h>
 #include <scsi/scsi_device.h>
 #include <asm/div64.h>
 
@@ -31,6 +32,19 @@
 #define EXOFS_DBGMSG2(M...) do {} while (0)
 /* #define EXOFS_DBGMSG2 EXOFS_DBGMSG */
 
+/* Which device of a mirror group serves a read */
+enum exofs_read_policy {
+	EXOFS_READ_FIRST = 0,		/* always the first mirror */
+	EXOFS_READ_ROUND_ROBIN = 1,	/* rotate by object and stripe unit */
+	EXOFS_READ_LEAST_BUSY = 2,	/* fewest reads in flight on the osd */
+};
+
+static unsigned int mirror_read_policy = EXOFS_READ_ROUND_ROBIN;
+module_param(mirror_read_policy, uint, 0644);
+MODULE_PARM_DESC(mirror_read_policy, "Mirror selection for reads: "
+		 "0 first, 1 round-robin by object and stripe unit, "
+		 "2 least busy osd");
+
 void exofs_make_credential(u8 cred_a[OSD_CAP_LEN], const struct osd_obj_id *obj)
 {
 	osd_sec_init_nosec_doall_caps(cred_a, obj, false, true);
@@ -101,6 +115,8 @@ void exofs_put_io_state(struct exofs_io_state *ios)
 
 			if (per_dev->or)
 				osd_end_request(per_dev->or);
+			if (per_dev->busy)
+				atomic_dec(per_dev->busy);
 			if (per_dev->bio)
 				bio_put(per_dev->bio);
 		}
@@ -139,11 +155,20 @@ static void _sync_done(struct exofs_io_state *ios, void *p)
 	complete(waiting);
 }
 
+static bool _sbi_read_failover_needed(struct exofs_io_state *ios);
+static void _sbi_read_failover_work(struct work_struct *work);
+
 static void _last_io(struct kref *kref)
 {
 	struct exofs_io_state *ios = container_of(
 					kref, struct exofs_io_state, kref);
 
+	if (ios->is_read && _sbi_read_failover_needed(ios)) {
+		/* We are called with ints-off from the block layer */
+		INIT_WORK(&ios->failover_work, _sbi_read_failover_work);
+		schedule_work(&ios->failover_work);
+		return;
+	}
 	ios->done(ios, ios->private);
 }
 
@@ -533,13 +558,66 @@ out:
 	return ret;
 }
 
-static int _sbi_write_mirror(struct exofs_io_state *ios, int cur_comp)
+/*
+ * Mirrored writeback clones the master bio for each mirror out of this
+ * pool, so it does not depend on kmalloc succeeding.  Each clone gets its
+ * own bio_vec copy: completion may update the vector in place.
+ *
+ * The clones live until the whole io_state completes.  exofs_sbi_write()
+ * takes all of an io_state's clones under exofs_mirror_bio_mutex, so no
+ * two writers can each sit on part of the pool waiting for the rest;
+ * those that need more clones than the pool holds use kmalloc.
+ */
+#define EXOFS_MIRROR_BIOS 64
+
+static struct bio_set *exofs_mirror_bio_set;
+static DEFINE_MUTEX(exofs_mirror_bio_mutex);
+
+int exofs_init_mirror_bios(void)
+{
+	exofs_mirror_bio_set = bioset_create(EXOFS_MIRROR_BIOS, 0);
+	return exofs_mirror_bio_set ? 0 : -ENOMEM;
+}
+
+void exofs_destroy_mirror_bios(void)
+{
+	bioset_free(exofs_mirror_bio_set);
+}
+
+static void exofs_mirror_bio_destructor(struct bio *bio)
+{
+	bio_free(bio, exofs_mirror_bio_set);
+}
+
+static struct bio *exofs_mirror_bio(struct bio *master, bool from_pool)
+{
+	struct bio *bio = NULL;
+
+	if (from_pool)
+		bio = bio_clone_bioset(master, GFP_NOIO, exofs_mirror_bio_set);
+	if (bio) {
+		bio->bi_destructor = exofs_mirror_bio_destructor;
+	} else {
+		/* Not from the pool, or too many vectors for it */
+		bio = bio_kmalloc(GFP_NOIO, master->bi_max_vecs);
+		if (unlikely(!bio))
+			return NULL;
+		__bio_clone(bio, master);
+	}
+	bio->bi_bdev = NULL;
+	bio->bi_next = NULL;
+	return bio;
+}
+
+static int _sbi_write_mirror(struct exofs_io_state *ios, int cur_comp,
+			     bool from_pool)
 {
 	struct exofs_per_dev_state *master_dev = &ios->per_dev[cur_comp];
 	unsigned dev = ios->per_dev[cur_comp].dev;
 	unsigned last_comp = cur_comp + ios->layout->mirrors_p1;
 	int ret = 0;
 
+	ios->is_read = false;
 	if (ios->pages && !master_dev->length)
 		return 0; /* Just an empty slot */
 
@@ -547,7 +625,7 @@ static int _sbi_write_mirror(struct exofs_io_state *ios, int cur_comp)
 		struct exofs_per_dev_state *per_dev = &ios->per_dev[cur_comp];
 		struct osd_request *or;
 
-		or = osd_start_request(exofs_ios_od(ios, dev), GFP_KERNEL);
+		or = osd_start_request(exofs_ios_od(ios, dev), GFP_NOIO);
 		if (unlikely(!or)) {
 			EXOFS_ERR("%s: osd_start_request failed\n", __func__);
 			ret = -ENOMEM;
@@ -560,19 +638,15 @@ static int _sbi_write_mirror(struct exofs_io_state *ios, int cur_comp)
 			struct bio *bio;
 
 			if (per_dev != master_dev) {
-				bio = bio_kmalloc(GFP_KERNEL,
-						  master_dev->bio->bi_max_vecs);
+				bio = exofs_mirror_bio(master_dev->bio,
+						       from_pool);
 				if (unlikely(!bio)) {
 					EXOFS_DBGMSG(
-					      "Failed to allocate BIO size=%u\n",
-					      master_dev->bio->bi_max_vecs);
+					      "Failed to allocate mirror BIO\n");
 					ret = -ENOMEM;
 					goto out;
 				}
 
-				__bio_clone(bio, master_dev->bio);
-				bio->bi_bdev = NULL;
-				bio->bi_next = NULL;
 				per_dev->length = master_dev->length;
 				per_dev->bio =  bio;
 				per_dev->dev = dev;
@@ -616,8 +690,25 @@ out:
 	return ret;
 }
 
+/* How many mirror bios exofs_sbi_write() will clone for @ios */
+static unsigned _sbi_mirror_bios(struct exofs_io_state *ios)
+{
+	unsigned mirrors_p1 = ios->layout->mirrors_p1;
+	unsigned n = 0;
+	int i;
+
+	if (!ios->pages || mirrors_p1 == 1)
+		return 0;
+	for (i = 0; i < ios->numdevs; i += mirrors_p1)
+		if (ios->per_dev[i].length)
+			n += mirrors_p1 - 1;
+	return n;
+}
+
 int exofs_sbi_write(struct exofs_io_state *ios)
 {
+	unsigned nr_clones;
+	bool from_pool;
 	int i;
 	int ret;
 
@@ -625,32 +716,91 @@ int exofs_sbi_write(struct exofs_io_state *ios)
 	if (unlikely(ret))
 		return ret;
 
+	nr_clones = _sbi_mirror_bios(ios);
+	from_pool = nr_clones && nr_clones <= EXOFS_MIRROR_BIOS;
+	if (from_pool)
+		mutex_lock(&exofs_mirror_bio_mutex);
 	for (i = 0; i < ios->numdevs; i += ios->layout->mirrors_p1) {
-		ret = _sbi_write_mirror(ios, i);
+		ret = _sbi_write_mirror(ios, i, from_pool);
 		if (unlikely(ret))
-			return ret;
+			break;
 	}
+	if (from_pool)
+		mutex_unlock(&exofs_mirror_bio_mutex);
+	if (unlikely(ret))
+		return ret;
 
 	ret = exofs_io_execute(ios);
 	return ret;
 }
 
+/* Choose which mirror of the group starting at cur_comp to read from */
+static unsigned _sbi_read_pick_mirror(struct exofs_io_state *ios,
+				      unsigned cur_comp)
+{
+	struct exofs_per_dev_state *per_dev = &ios->per_dev[cur_comp];
+	struct exofs_layout *layout = ios->layout;
+	unsigned mirrors_p1 = layout->mirrors_p1;
+	unsigned rr, m, i, busy, best_busy;
+
+	if (mirrors_p1 == 1)
+		return 0;
+
+	/* Different objects, consecutive stripe units of an object and
+	 * neighbouring groups all start on different mirrors.
+	 */
+	rr = (unsigned)ios->obj.id + cur_comp / mirrors_p1 +
+	     (unsigned)div_u64(per_dev->offset, layout->stripe_unit);
+	rr %= mirrors_p1;
+
+	switch (mirror_read_policy) {
+	case EXOFS_READ_FIRST:
+		return 0;
+	case EXOFS_READ_LEAST_BUSY:
+		if (!layout->s_busy)
+			return rr;
+		/* ties go round-robin so an idle group still spreads reads */
+		m = rr;
+		best_busy = UINT_MAX;
+		for (i = 0; i < mirrors_p1; i++) {
+			unsigned cand = (rr + i) % mirrors_p1;
+			unsigned od_id = exofs_layout_od_id(layout, ios->obj.id,
+							per_dev->dev + cand);
+
+			busy = atomic_read(&layout->s_busy[od_id]);
+			if (busy < best_busy) {
+				best_busy = busy;
+				m = cand;
+			}
+		}
+		return m;
+	case EXOFS_READ_ROUND_ROBIN:
+	default:
+		return rr;
+	}
+}
+
 static int _sbi_read_mirror(struct exofs_io_state *ios, unsigned cur_comp)
 {
 	struct osd_request *or;
 	struct exofs_per_dev_state *per_dev = &ios->per_dev[cur_comp];
-	unsigned first_dev = (unsigned)ios->obj.id;
+	unsigned first_dev;
 
 	if (ios->pages && !per_dev->length)
 		return 0; /* Just an empty slot */
 
-	first_dev = per_dev->dev + first_dev % ios->layout->mirrors_p1;
+	first_dev = per_dev->dev + per_dev->mirror;
 	or = osd_start_request(exofs_ios_od(ios, first_dev), GFP_KERNEL);
 	if (unlikely(!or)) {
 		EXOFS_ERR("%s: osd_start_request failed\n", __func__);
 		return -ENOMEM;
 	}
 	per_dev->or = or;
+	if (ios->layout->s_busy) {
+		per_dev->busy = &ios->layout->s_busy[
+			exofs_layout_od_id(ios->layout, ios->obj.id, first_dev)];
+		atomic_inc(per_dev->busy);
+	}
 
 	if (ios->pages) {
 		osd_req_read(or, &ios->obj, per_dev->offset,
@@ -691,7 +841,9 @@ int exofs_sbi_read(struct exofs_io_state *ios)
 	if (unlikely(ret))
 		return ret;
 
+	ios->is_read = true;
 	for (i = 0; i < ios->numdevs; i += ios->layout->mirrors_p1) {
+		ios->per_dev[i].mirror = _sbi_read_pick_mirror(ios, i);
 		ret = _sbi_read_mirror(ios, i);
 		if (unlikely(ret))
 			return ret;
@@ -701,6 +853,159 @@ int exofs_sbi_read(struct exofs_io_state *ios)
 	return ret;
 }
 
+/*
+ * A read that failed on one mirror is retried on the next one before the
+ * caller's done is called.  Only done when every failed component still
+ * has an untried mirror; otherwise the caller sees the error as before.
+ */
+static bool _sbi_read_failover_needed(struct exofs_io_state *ios)
+{
+	unsigned mirrors_p1 = ios->layout->mirrors_p1;
+	bool needed = false;
+	unsigned i;
+
+	if (mirrors_p1 == 1)
+		return false;
+
+	for (i = 0; i < ios->numdevs; i += mirrors_p1) {
+		struct exofs_per_dev_state *per_dev = &ios->per_dev[i];
+		struct osd_sense_info osi;
+
+		if (!per_dev->or)
+			continue;
+		if (likely(!osd_req_decode_sense(per_dev->or, &osi)) ||
+		    osi.osd_err_pri == OSD_ERR_PRI_CLEAR_PAGES)
+			continue;
+		if (per_dev->tries + 1 >= mirrors_p1)
+			return false;
+		needed = true;
+	}
+	return needed;
+}
+
+/* Make a fresh copy of per_dev's bio for resubmission to another mirror */
+static struct bio *_sbi_read_reclone_bio(struct exofs_io_state *ios,
+					 struct exofs_per_dev_state *per_dev)
+{
+	struct request_queue *q = osd_request_queue(
+			exofs_ios_od(ios, per_dev->dev + per_dev->mirror));
+	struct bio *old = per_dev->bio;
+	struct bio *bio;
+	struct bio_vec *bv;
+	unsigned i;
+
+	bio = bio_kmalloc(GFP_KERNEL, old->bi_vcnt);
+	if (unlikely(!bio))
+		return NULL;
+
+	__bio_for_each_segment(bv, old, i, 0) {
+		if (bio_add_pc_page(q, bio, bv->bv_page, bv->bv_len,
+				    bv->bv_offset) != bv->bv_len) {
+			bio_put(bio);
+			return NULL;
+		}
+	}
+	return bio;
+}
+
+static int _sbi_read_failover_one(struct exofs_io_state *ios,
+				  unsigned cur_comp)
+{
+	struct exofs_per_dev_state *per_dev = &ios->per_dev[cur_comp];
+	unsigned mirrors_p1 = ios->layout->mirrors_p1;
+	struct osd_request *failed_or = per_dev->or;
+	unsigned failed_mirror = per_dev->mirror;
+	struct bio *bio = NULL;
+	int ret;
+
+	per_dev->mirror = (per_dev->mirror + 1) % mirrors_p1;
+	if (per_dev->bio) {
+		bio = _sbi_read_reclone_bio(ios, per_dev);
+		if (unlikely(!bio)) {
+			ret = -ENOMEM;
+			goto err;
+		}
+	}
+
+	if (per_dev->busy) {
+		atomic_dec(per_dev->busy);
+		per_dev->busy = NULL;
+	}
+	per_dev->or = NULL;
+	ret = _sbi_read_mirror(ios, cur_comp);
+	if (likely(!ret))
+		ret = osd_finalize_request(per_dev->or, 0, ios->cred, NULL);
+	if (unlikely(ret)) {
+		if (per_dev->or)
+			osd_end_request(per_dev->or);
+		if (per_dev->busy) {
+			atomic_dec(per_dev->busy);
+			per_dev->busy = NULL;
+		}
+		per_dev->or = failed_or;
+		goto err;
+	}
+
+	EXOFS_DBGMSG("read(0x%llx) comp %u failed, retrying on mirror %u\n",
+		     _LLU(ios->obj.id), cur_comp, per_dev->mirror);
+	osd_end_request(failed_or);
+	if (bio) {
+		bio_put(per_dev->bio);
+		per_dev->bio = bio;
+	}
+	per_dev->tries++;
+	per_dev->resubmit = true;
+	return 0;
+
+err:
+	if (bio)
+		bio_put(bio);
+	per_dev->mirror = failed_mirror;
+	return ret;
+}
+
+static void _sbi_read_failover_work(struct work_struct *work)
+{
+	struct exofs_io_state *ios = container_of(work, struct exofs_io_state,
+						  failover_work);
+	unsigned mirrors_p1 = ios->layout->mirrors_p1;
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < ios->numdevs; i += mirrors_p1) {
+		struct exofs_per_dev_state *per_dev = &ios->per_dev[i];
+		struct osd_sense_info osi;
+
+		per_dev->resubmit = false;
+		if (!per_dev->or)
+			continue;
+		if (likely(!osd_req_decode_sense(per_dev->or, &osi)) ||
+		    osi.osd_err_pri == OSD_ERR_PRI_CLEAR_PAGES)
+			continue;
+
+		ret = _sbi_read_failover_one(ios, i);
+		if (unlikely(ret)) {
+			/* Give up; the caller sees the original error. A
+			 * retry already sent on another group may still be
+			 * running, so let it finish first.
+			 */
+			ios->is_read = false;
+			break;
+		}
+	}
+
+	kref_init(&ios->kref);
+	for (i = 0; i < ios->numdevs; i += mirrors_p1) {
+		struct exofs_per_dev_state *per_dev = &ios->per_dev[i];
+
+		if (!per_dev->resubmit)
+			continue;
+		kref_get(&ios->kref);
+		osd_execute_request_async(per_dev->or, _done_io, ios);
+	}
+	kref_put(&ios->kref, _last_io);
+}
+
 int extract_attr_from_ios(struct exofs_io_state *ios, struct osd_attr *attr)
 {
 	struct osd_attr cur_attr = {.attr_page = 0}; /* start with zeros */
@@ -273,6 +273,7 @@ void exofs_free_sbi(struct exofs_sb_info *sbi)
 			osduld_put_device(od);
 		}
 	}
+	kfree(sbi->layout.s_busy);
 	kfree(sbi);
 }
 
@@ -462,6 +463,13 @@ static int exofs_read_lookup_dev_table(struct exofs_sb_info **psbi,
 		*psbi = sbi;
 	}
 
+	sbi->layout.s_busy = kcalloc(numdevs, sizeof(*sbi->layout.s_busy),
+				     GFP_KERNEL);
+	if (unlikely(!sbi->layout.s_busy)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	for (i = 0; i < numdevs; i++) {
 		struct exofs_fscb fscb;
 		struct osd_dev_info odi;
@@ -822,11 +830,17 @@ static int __init init_exofs(void)
 	if (err)
 		goto out;
 
-	err = register_filesystem(&exofs_type);
+	err = exofs_init_mirror_bios();
 	if (err)
 		goto out_d;
 
+	err = register_filesystem(&exofs_type);
+	if (err)
+		goto out_b;
+
 	return 0;
+out_b:
+	exofs_destroy_mirror_bios();
 out_d:
 	destroy_inodecache();
 out:
@@ -836,6 +850,7 @@ out:
 static void __exit exit_exofs(void)
 {
 	unregister_filesystem(&exofs_type);
+	exofs_destroy_mirror_bios();
 	destroy_inodecache();
 }
 
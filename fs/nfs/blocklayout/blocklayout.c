@@ -34,6 +34,7 @@
 
 #include <linux/buffer_head.h> /* various write calls */
 #include <linux/bio.h> /* struct bio */
+#include <linux/blkdev.h> /* blk_unplug */
 #include <linux/vmalloc.h>
 #include "blocklayout.h"
 
@@ -97,6 +98,19 @@ dont_like_caller(struct nfs_page *req)
 	}
 }
 
+/*
+ * O_DIRECT requests come in user pages rather than nfs_pages.  The bio
+ * code below moves whole pages and has no read-modify-write for partial
+ * blocks, so only take direct requests aligned to @align; anything else
+ * goes to the MDS.
+ */
+static bool
+bl_direct_io_ok(loff_t offset, size_t count, unsigned pgbase, size_t align)
+{
+	return !(pgbase & ~PAGE_CACHE_MASK) &&
+	       !((offset | count) & (align - 1));
+}
+
 static enum pnfs_try_status
 bl_commit(struct nfs_write_data *nfs_data,
 	  int sync)
@@ -146,17 +160,120 @@ static inline void put_parallel(struct parallel_io *p)
 	kref_put(&p->refcnt, destroy_parallel);
 }
 
-static struct bio *
-bl_submit_bio(int rw, struct bio *bio)
+/*
+ * Bios for one nfs_read_data/nfs_write_data are built as large as the
+ * disk layout allows: a bio is only closed when the next page does not
+ * follow it on the same device, so extents that map contiguously share a
+ * bio.  Each bio is submitted as soon as it is closed, since it comes
+ * from fs_bio_set and holding several back could stall the mempool; the
+ * queues stay plugged meanwhile and are kicked once the request is mapped.
+ */
+#define BL_BATCH_QUEUES 8
+
+struct bl_bio_batch {
+	int			bb_rw;
+	bio_end_io_t		*bb_end_io;
+	struct parallel_io	*bb_par;
+	struct bio		*bb_bio;	/* being built */
+	int			bb_nr_queues;
+	struct request_queue	*bb_queues[BL_BATCH_QUEUES]; /* to unplug */
+};
+
+static void
+bl_init_batch(struct bl_bio_batch *bb, int rw, bio_end_io_t *end_io,
+	      struct parallel_io *par)
+{
+	bb->bb_rw = rw;
+	bb->bb_end_io = end_io;
+	bb->bb_par = par;
+	bb->bb_bio = NULL;
+	bb->bb_nr_queues = 0;
+}
+
+static void
+bl_unplug_batch(struct bl_bio_batch *bb)
+{
+	int i;
+
+	for (i = 0; i < bb->bb_nr_queues; i++)
+		blk_unplug(bb->bb_queues[i]);
+	bb->bb_nr_queues = 0;
+}
+
+/* Remember the queue of a submitted bio, so it can be unplugged later */
+static void
+bl_note_queue(struct bl_bio_batch *bb, struct request_queue *q)
 {
-	if (bio) {
-		get_parallel(bio->bi_private);
-		dprintk("%s submitting %s bio %u@%llu\n", __func__,
-			rw == READ ? "read" : "write",
-			bio->bi_size, (u64)bio->bi_sector);
-		submit_bio(rw, bio);
+	int i;
+
+	for (i = 0; i < bb->bb_nr_queues; i++)
+		if (bb->bb_queues[i] == q)
+			return;
+	if (bb->bb_nr_queues == BL_BATCH_QUEUES)
+		bl_unplug_batch(bb);
+	bb->bb_queues[bb->bb_nr_queues++] = q;
+}
+
+static void
+bl_close_bio(struct bl_bio_batch *bb)
+{
+	struct bio *bio = bb->bb_bio;
+
+	if (!bio)
+		return;
+	bb->bb_bio = NULL;
+	get_parallel(bb->bb_par);
+	bl_note_queue(bb, bdev_get_queue(bio->bi_bdev));
+	dprintk("%s submitting %s bio %u@%llu\n", __func__,
+		bb->bb_rw == READ ? "read" : "write",
+		bio->bi_size, (u64)bio->bi_sector);
+	submit_bio(bb->bb_rw, bio);
+}
+
+/* Add page, which maps to isect within be, to the batch.  pages_left
+ * sizes a new bio.  Returns nonzero if the page could not be added.
+ */
+static int
+bl_add_page(struct bl_bio_batch *bb, struct pnfs_block_extent *be,
+	    sector_t isect, struct page *page, int pages_left)
+{
+	sector_t disk_sect = isect - be->be_f_offset + be->be_v_offset;
+	struct bio *bio = bb->bb_bio;
+
+	if (bio && (bio->bi_bdev != be->be_mdev ||
+		    bio->bi_sector + (bio->bi_size >> 9) != disk_sect))
+		bl_close_bio(bb);
+	for (;;) {
+		bio = bb->bb_bio;
+		if (!bio) {
+			bio = bio_alloc(GFP_NOIO,
+					min_t(int, pages_left, BIO_MAX_PAGES));
+			if (!bio)
+				return -ENOMEM;
+			bio->bi_sector = disk_sect;
+			bio->bi_bdev = be->be_mdev;
+			bio->bi_end_io = bb->bb_end_io;
+			bio->bi_private = bb->bb_par;
+			bb->bb_bio = bio;
+		}
+		if (bio_add_page(bio, page, PAGE_SIZE, 0))
+			return 0;
+		if (!bio->bi_vcnt) {
+			/* Not even one page fits a fresh bio */
+			bb->bb_bio = NULL;
+			bio_put(bio);
+			return -EIO;
+		}
+		bl_close_bio(bb);
 	}
-	return NULL;
+}
+
+/* Submit the bio still being built and kick every queue that was used */
+static void
+bl_finish_batch(struct bl_bio_batch *bb)
+{
+	bl_close_bio(bb);
+	bl_unplug_batch(bb);
 }
 
 static inline void
@@ -173,6 +290,29 @@ bl_done_with_rpage(struct page *page, const int ok)
 	/* Page is unlocked via rpc_release.  Should really be done here. */
 }
 
+/* User pages of an O_DIRECT read keep their flags; on failure the
+ * whole request is sent again through the MDS.
+ */
+static inline void
+bl_read_page_done(struct nfs_read_data *rdata, struct page *page, int ok)
+{
+	if (!(rdata->pdata.pnfsflags & PNFS_DIRECT_IO))
+		bl_done_with_rpage(page, ok);
+	else if (!ok)
+		rdata->pdata.pnfs_error = -EAGAIN;
+}
+
+static void bl_end_io_direct_read(struct bio *bio, int err)
+{
+	struct parallel_io *par = bio->bi_private;
+	struct nfs_read_data *rdata = par->data;
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		rdata->pdata.pnfs_error = -EAGAIN;
+	bio_put(bio);
+	put_parallel(par);
+}
+
 /* This is basically copied from mpage_end_io_read */
 static void bl_end_io_read(struct bio *bio, int err)
 {
@@ -223,7 +363,7 @@ bl_read_pagelist(struct nfs_read_data *rdata,
 		 unsigned nr_pages)
 {
 	int i, hole;
-	struct bio *bio = NULL;
+	struct bl_bio_batch bb;
 	struct pnfs_block_extent *be = NULL, *cow_read = NULL;
 	sector_t isect, extent_length = 0;
 	struct parallel_io *par;
@@ -235,11 +375,16 @@ bl_read_pagelist(struct nfs_read_data *rdata,
 	dprintk("%s enter nr_pages %u offset %lld count %Zd\n", __func__,
 	       nr_pages, f_offset, count);
 
-	if (dont_like_caller(rdata->req)) {
+	if (rdata->pdata.pnfsflags & PNFS_DIRECT_IO) {
+		if (!bl_direct_io_ok(f_offset, count, rdata->args.pgbase,
+				     PAGE_CACHE_SIZE)) {
+			dprintk("%s unaligned direct read\n", __func__);
+			goto use_mds;
+		}
+	} else if (dont_like_caller(rdata->req)) {
 		dprintk("%s dont_like_caller failed\n", __func__);
 		goto use_mds;
-	}
-	if ((nr_pages == 1) && PagePnfsErr(rdata->req->wb_page)) {
+	} else if ((nr_pages == 1) && PagePnfsErr(rdata->req->wb_page)) {
 		/* We want to fall back to mds in case of read_page
 		 * after error on read_pages.
 		 */
@@ -253,6 +398,9 @@ bl_read_pagelist(struct nfs_read_data *rdata,
 	par->call_ops.rpc_call_done = bl_rpc_do_nothing;
 	par->pnfs_callback = bl_end_par_io_read;
 	/* At this point, we can no longer jump to use_mds */
+	bl_init_batch(&bb, READ,
+		      rdata->pdata.pnfsflags & PNFS_DIRECT_IO ?
+		      bl_end_io_direct_read : bl_end_io_read, par);
 
 	isect = (sector_t) (f_offset >> 9);
 	/* Code assumes extents are page-aligned */
@@ -261,13 +409,12 @@ bl_read_pagelist(struct nfs_read_data *rdata,
 			/* We've used up the previous extent */
 			put_extent(be);
 			put_extent(cow_read);
-			bio = bl_submit_bio(READ, bio);
 			/* Get the next one */
 			be = find_get_extent(BLK_LSEG2EXT(rdata->pdata.lseg),
 					     isect, &cow_read);
 			if (!be) {
 				/* Error out this page */
-				bl_done_with_rpage(pages[i], 0);
+				bl_read_page_done(rdata, pages[i], 0);
 				break;
 			}
 			extent_length = be->be_length -
@@ -280,36 +427,20 @@ bl_read_pagelist(struct nfs_read_data *rdata,
 		}
 		hole = is_hole(be, isect);
 		if (hole && !cow_read) {
-			bio = bl_submit_bio(READ, bio);
 			/* Fill hole w/ zeroes w/o accessing device */
 			dprintk("%s Zeroing page for hole\n", __func__);
 			zero_user(pages[i], 0,
 				  min_t(int, PAGE_CACHE_SIZE, count));
 			print_page(pages[i]);
-			bl_done_with_rpage(pages[i], 1);
+			bl_read_page_done(rdata, pages[i], 1);
 		} else {
 			struct pnfs_block_extent *be_read;
 
 			be_read = (hole && cow_read) ? cow_read : be;
-			for (;;) {
-				if (!bio) {
-					bio = bio_alloc(GFP_NOIO, nr_pages - i);
-					if (!bio) {
-						/* Error out this page */
-						bl_done_with_rpage(pages[i], 0);
-						break;
-					}
-					bio->bi_sector = isect -
-						be_read->be_f_offset +
-						be_read->be_v_offset;
-					bio->bi_bdev = be_read->be_mdev;
-					bio->bi_end_io = bl_end_io_read;
-					bio->bi_private = par;
-				}
-				if (bio_add_page(bio, pages[i], PAGE_SIZE, 0))
-					break;
-				bio = bl_submit_bio(READ, bio);
-			}
+			if (bl_add_page(&bb, be_read, isect, pages[i],
+					nr_pages - i))
+				/* Error out this page */
+				bl_read_page_done(rdata, pages[i], 0);
 		}
 		isect += PAGE_CACHE_SIZE >> 9;
 		extent_length -= PAGE_CACHE_SIZE >> 9;
@@ -322,7 +453,7 @@ bl_read_pagelist(struct nfs_read_data *rdata,
 	}
 	put_extent(be);
 	put_extent(cow_read);
-	bl_submit_bio(READ, bio);
+	bl_finish_batch(&bb);
 	put_parallel(par);
 	return PNFS_ATTEMPTED;
 
@@ -374,6 +505,26 @@ bl_done_with_wpage(struct page *page, const int ok)
 	/* end_page_writeback called in rpc_release.  Should be done here. */
 }
 
+static inline void
+bl_write_page_done(struct nfs_write_data *wdata, struct page *page, int ok)
+{
+	if (!(wdata->pdata.pnfsflags & PNFS_DIRECT_IO))
+		bl_done_with_wpage(page, ok);
+	else if (!ok)
+		wdata->pdata.pnfs_error = -EAGAIN;
+}
+
+static void bl_end_io_direct_write(struct bio *bio, int err)
+{
+	struct parallel_io *par = bio->bi_private;
+	struct nfs_write_data *wdata = par->data;
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		wdata->pdata.pnfs_error = -EAGAIN;
+	bio_put(bio);
+	put_parallel(par);
+}
+
 /* This is basically copied from mpage_end_io_read */
 static void bl_end_io_write(struct bio *bio, int err)
 {
@@ -402,7 +553,7 @@ static void bl_write_cleanup(struct work_struct *work)
 	dprintk("%s enter\n", __func__);
 	task = container_of(work, struct rpc_task, u.tk_work);
 	wdata = container_of(task, struct nfs_write_data, task);
-	if (!wdata->task.tk_status) {
+	if (!wdata->task.tk_status && !wdata->pdata.pnfs_error) {
 		/* Marks for LAYOUTCOMMIT */
 		/* BUG - this should be called after each bio, not after
 		 * all finish, unless have some way of storing success/failure
@@ -432,7 +583,7 @@ bl_write_pagelist(struct nfs_write_data *wdata,
 		  int sync)
 {
 	int i;
-	struct bio *bio = NULL;
+	struct bl_bio_batch bb;
 	struct pnfs_block_extent *be = NULL;
 	sector_t isect, extent_length = 0;
 	struct parallel_io *par;
@@ -442,11 +593,19 @@ bl_write_pagelist(struct nfs_write_data *wdata,
 	int pg_index = wdata->args.pgbase >> PAGE_CACHE_SHIFT;
 
 	dprintk("%s enter, %Zu@%lld\n", __func__, count, offset);
-	if (!wdata->req->wb_lseg) {
+	if (wdata->pdata.pnfsflags & PNFS_DIRECT_IO) {
+		size_t align = max_t(size_t, PAGE_CACHE_SIZE,
+			BLK_LSEG2EXT(wdata->pdata.lseg)->bl_blocksize << 9);
+
+		if (!bl_direct_io_ok(offset, count, wdata->args.pgbase,
+				     align)) {
+			dprintk("%s unaligned direct write\n", __func__);
+			return PNFS_NOT_ATTEMPTED;
+		}
+	} else if (!wdata->req->wb_lseg) {
 		dprintk("%s no lseg, falling back to MDS\n", __func__);
 		return PNFS_NOT_ATTEMPTED;
-	}
-	if (dont_like_caller(wdata->req)) {
+	} else if (dont_like_caller(wdata->req)) {
 		dprintk("%s dont_like_caller failed\n", __func__);
 		return PNFS_NOT_ATTEMPTED;
 	}
@@ -464,49 +623,36 @@ bl_write_pagelist(struct nfs_write_data *wdata,
 	par->call_ops.rpc_call_done = bl_rpc_do_nothing;
 	par->pnfs_callback = bl_end_par_io_write;
 	/* At this point, have to be more careful with error handling */
+	bl_init_batch(&bb, WRITE,
+		      wdata->pdata.pnfsflags & PNFS_DIRECT_IO ?
+		      bl_end_io_direct_write : bl_end_io_write, par);
 
 	isect = (sector_t) ((offset & (long)PAGE_CACHE_MASK) >> 9);
 	for (i = pg_index; i < nr_pages; i++) {
 		if (!extent_length) {
 			/* We've used up the previous extent */
 			put_extent(be);
-			bio = bl_submit_bio(WRITE, bio);
 			/* Get the next one */
 			be = find_get_extent(BLK_LSEG2EXT(wdata->pdata.lseg),
 					     isect, NULL);
 			if (!be || !is_writable(be, isect)) {
 				/* FIXME */
-				bl_done_with_wpage(pages[i], 0);
+				bl_write_page_done(wdata, pages[i], 0);
 				break;
 			}
 			extent_length = be->be_length -
 				(isect - be->be_f_offset);
 		}
-		for (;;) {
-			if (!bio) {
-				bio = bio_alloc(GFP_NOIO, nr_pages - i);
-				if (!bio) {
-					/* Error out this page */
-					/* FIXME */
-					bl_done_with_wpage(pages[i], 0);
-					break;
-				}
-				bio->bi_sector = isect - be->be_f_offset +
-					be->be_v_offset;
-				bio->bi_bdev = be->be_mdev;
-				bio->bi_end_io = bl_end_io_write;
-				bio->bi_private = par;
-			}
-			if (bio_add_page(bio, pages[i], PAGE_SIZE, 0))
-				break;
-			bio = bl_submit_bio(WRITE, bio);
-		}
+		if (bl_add_page(&bb, be, isect, pages[i], nr_pages - i))
+			/* Error out this page */
+			/* FIXME */
+			bl_write_page_done(wdata, pages[i], 0);
 		isect += PAGE_CACHE_SIZE >> 9;
 		extent_length -= PAGE_CACHE_SIZE >> 9;
 	}
 	wdata->res.count = (isect << 9) - (offset & (long)PAGE_CACHE_MASK);
 	put_extent(be);
-	bl_submit_bio(WRITE, bio);
+	bl_finish_batch(&bb);
 	put_parallel(par);
 	return PNFS_ATTEMPTED;
 }
@@ -519,31 +665,21 @@ release_extents(struct pnfs_block_layout *bl,
 	int i;
 	struct pnfs_block_extent *be;
 
+	struct rb_node *n;
+
 	spin_lock(&bl->bl_ext_lock);
+	write_seqcount_begin(&bl->bl_ext_seq);
 	for (i = 0; i < EXTENT_LISTS; i++) {
-		while (!list_empty(&bl->bl_extents[i])) {
-			be = list_first_entry(&bl->bl_extents[i],
-					      struct pnfs_block_extent,
-					      be_node);
-			list_del(&be->be_node);
+		while ((n = rb_first(&bl->bl_extents[i])) != NULL) {
+			be = rb_entry(n, struct pnfs_block_extent, be_rbnode);
+			rb_erase(n, &bl->bl_extents[i]);
 			put_extent(be);
 		}
 	}
+	write_seqcount_end(&bl->bl_ext_seq);
 	spin_unlock(&bl->bl_ext_lock);
 }
 
-static void
-release_inval_marks(struct pnfs_inval_markings *marks)
-{
-	struct pnfs_inval_tracking *pos, *temp;
-
-	list_for_each_entry_safe(pos, temp, &marks->im_tree.mtt_stub, it_link) {
-		list_del(&pos->it_link);
-		kfree(pos);
-	}
-	return;
-}
-
 /* Note we are relying on caller locking to prevent nasty races. */
 static void
 bl_free_layout_hdr(struct pnfs_layout_hdr *lo)
@@ -566,8 +702,9 @@ bl_alloc_layout_hdr(struct inode *inode)
 	if (!bl)
 		return NULL;
 	spin_lock_init(&bl->bl_ext_lock);
-	INIT_LIST_HEAD(&bl->bl_extents[0]);
-	INIT_LIST_HEAD(&bl->bl_extents[1]);
+	seqcount_init(&bl->bl_ext_seq);
+	bl->bl_extents[0] = RB_ROOT;
+	bl->bl_extents[1] = RB_ROOT;
 	INIT_LIST_HEAD(&bl->bl_commit);
 	bl->bl_count = 0;
 	bl->bl_blocksize = NFS_SERVER(inode)->pnfs_blksize >> 9;
@@ -1119,6 +1256,7 @@ static struct pnfs_layoutdriver_type blocklayout_type = {
 	.set_layoutdriver		= bl_set_layoutdriver,
 	.clear_layoutdriver		= bl_clear_layoutdriver,
 	.pg_test			= bl_pg_test,
+	.flags				= PNFS_LAYOUT_DIRECT_IO,
 };
 
 static int __init nfs4blocklayout_init(void)
@@ -1127,9 +1265,14 @@ static int __init nfs4blocklayout_init(void)
 
 	dprintk("%s: NFSv4 Block Layout Driver Registering...\n", __func__);
 
+	ret = bl_init_inval_cache();
+	if (ret)
+		return ret;
 	ret = pnfs_register_layoutdriver(&blocklayout_type);
 	if (!ret)
 		bl_pipe_init();
+	else
+		bl_destroy_inval_cache();
 	return ret;
 }
 
@@ -1140,6 +1283,8 @@ static void __exit nfs4blocklayout_exit(void)
 
 	pnfs_unregister_layoutdriver(&blocklayout_type);
 	bl_pipe_exit();
+	rcu_barrier();	/* extents are freed through call_rcu */
+	bl_destroy_inval_cache();
 }
 
 module_init(nfs4blocklayout_init);
@@ -33,6 +33,8 @@
 #define FS_NFS_NFS4BLOCKLAYOUT_H
 
 #include <linux/nfs_fs.h>
+#include <linux/rbtree.h>
+#include <linux/seqlock.h>
 #include <linux/dm-ioctl.h> /* Needed for struct dm_ioctl*/
 #include "../pnfs.h"
 
@@ -109,29 +111,41 @@ enum exstate4 {
 	PNFS_BLOCK_NONE_DATA		= 3  /* unmapped, it's a hole */
 };
 
-#define MY_MAX_TAGS (15) /* tag bitnums used must be less than this */
+/* Tags tracked for sectors of INVALID extents */
+enum {
+	EXTENT_INITIALIZED	= 0,
+	EXTENT_WRITTEN		= 1,
+	EXTENT_TAGS		= 2,
+};
 
-struct my_tree_t {
-	sector_t		mtt_step_size;	/* Internal sector alignment */
-	struct list_head	mtt_stub; /* Should be a radix tree */
+/*
+ * For each tag, the tagged sectors are kept as an rbtree of disjoint,
+ * non-adjacent [it_start, it_end) intervals, coalesced as they are added.
+ * Interval boundaries are multiples of tt_step_size.
+ */
+struct pnfs_inval_tree {
+	sector_t		tt_step_size;	/* Internal sector alignment */
+	struct rb_root		tt_root[EXTENT_TAGS];
 };
 
 struct pnfs_inval_markings {
 	spinlock_t	im_lock;
-	struct my_tree_t im_tree;	/* Sectors that need LAYOUTCOMMIT */
+	struct pnfs_inval_tree im_tree;	/* Sectors that need LAYOUTCOMMIT */
 	sector_t	im_block_size;	/* Server blocksize in sectors */
 };
 
 struct pnfs_inval_tracking {
-	struct list_head it_link;
-	int		 it_sector;
-	int		 it_tags;
+	struct rb_node	it_node;
+	sector_t	it_start;
+	sector_t	it_end;		/* exclusive */
 };
 
 /* sector_t fields are all in 512-byte sectors */
 struct pnfs_block_extent {
 	struct kref	be_refcnt;
-	struct list_head be_node;	/* link into lseg list */
+	struct rb_node	be_rbnode;	/* link into bl_extents[] tree */
+	struct list_head be_node;	/* staging list during LAYOUTGET */
+	struct rcu_head	be_rcu;
 	struct nfs4_deviceid be_devid;  /* STUB - remevable??? */
 	struct block_device *be_mdev;
 	sector_t	be_f_offset;	/* the starting offset in the file */
@@ -153,11 +167,14 @@ struct pnfs_block_short_extent {
 static inline void
 INIT_INVAL_MARKS(struct pnfs_inval_markings *marks, sector_t blocksize)
 {
+	int i;
+
 	spin_lock_init(&marks->im_lock);
-	INIT_LIST_HEAD(&marks->im_tree.mtt_stub);
+	for (i = 0; i < EXTENT_TAGS; i++)
+		marks->im_tree.tt_root[i] = RB_ROOT;
 	marks->im_block_size = blocksize;
-	marks->im_tree.mtt_step_size = min((sector_t)PAGE_CACHE_SECTORS,
-					   blocksize);
+	marks->im_tree.tt_step_size = min((sector_t)PAGE_CACHE_SECTORS,
+					  blocksize);
 }
 
 enum extentclass4 {
@@ -177,8 +194,9 @@ static inline int choose_list(enum exstate4 state)
 struct pnfs_block_layout {
 	struct pnfs_layout_hdr bl_layout;
 	struct pnfs_inval_markings bl_inval; /* tracks INVAL->RW transition */
-	spinlock_t		bl_ext_lock;   /* Protects list manipulation */
-	struct list_head	bl_extents[EXTENT_LISTS]; /* R and RW extents */
+	spinlock_t		bl_ext_lock;   /* Protects tree manipulation */
+	seqcount_t		bl_ext_seq;    /* Lockless bl_extents lookups */
+	struct rb_root		bl_extents[EXTENT_LISTS]; /* R and RW extents */
 	struct list_head	bl_commit;	/* Needs layout commit */
 	unsigned int		bl_count;	/* entries in bl_commit */
 	sector_t		bl_blocksize;  /* Server blocksize in sectors */
@@ -274,6 +292,9 @@ void put_extent(struct pnfs_block_extent *be);
 struct pnfs_block_extent *alloc_extent(void);
 struct pnfs_block_extent *get_extent(struct pnfs_block_extent *be);
 int is_sector_initialized(struct pnfs_inval_markings *marks, sector_t isect);
+void release_inval_marks(struct pnfs_inval_markings *marks);
+int bl_init_inval_cache(void);
+void bl_destroy_inval_cache(void);
 int encode_pnfs_block_layoutupdate(struct pnfs_block_layout *bl,
 				   struct xdr_stream *xdr,
 				   const struct nfs4_layoutcommit_args *arg);
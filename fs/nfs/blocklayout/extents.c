@@ -33,13 +33,6 @@
 #include "blocklayout.h"
 #define NFSDBG_FACILITY         NFSDBG_PNFS_LD
 
-/* Bit numbers */
-#define EXTENT_INITIALIZED 0
-#define EXTENT_WRITTEN     1
-#define EXTENT_IN_COMMIT   2
-#define INTERNAL_EXISTS    MY_MAX_TAGS
-#define INTERNAL_MASK      ((1 << INTERNAL_EXISTS) - 1)
-
 /* Returns largest t<=s s.t. t%base==0 */
 static inline sector_t normalize(sector_t s, int base)
 {
@@ -52,131 +45,138 @@ static inline sector_t normalize_up(sector_t s, int base)
 	return normalize(s + base - 1, base);
 }
 
-/* Complete stub using list while determine API wanted */
+static struct kmem_cache *bl_inval_cachep;
 
-/* Returns tags, or negative */
-static int32_t _find_entry(struct my_tree_t *tree, u64 s)
+int bl_init_inval_cache(void)
 {
+	bl_inval_cachep = kmem_cache_create("bl_inval_tracking",
+					    sizeof(struct pnfs_inval_tracking),
+					    0, 0, NULL);
+	return bl_inval_cachep ? 0 : -ENOMEM;
+}
+
+void bl_destroy_inval_cache(void)
+{
+	kmem_cache_destroy(bl_inval_cachep);
+}
+
+/* Returns the interval tagged with tag that contains s, or NULL */
+static struct pnfs_inval_tracking *
+_find_entry(struct pnfs_inval_tree *tree, u64 s, int32_t tag)
+{
+	struct rb_node *n = tree->tt_root[tag].rb_node;
 	struct pnfs_inval_tracking *pos;
 
-	dprintk("%s(%llu) enter\n", __func__, s);
-	list_for_each_entry_reverse(pos, &tree->mtt_stub, it_link) {
-		if (pos->it_sector > s)
-			continue;
-		else if (pos->it_sector == s)
-			return pos->it_tags & INTERNAL_MASK;
+	dprintk("%s(%llu, %i) enter\n", __func__, s, tag);
+	while (n) {
+		pos = rb_entry(n, struct pnfs_inval_tracking, it_node);
+		if (s < pos->it_start)
+			n = n->rb_left;
+		else if (s >= pos->it_end)
+			n = n->rb_right;
 		else
-			break;
+			return pos;
 	}
-	return -ENOENT;
+	return NULL;
 }
 
 static inline
-int _has_tag(struct my_tree_t *tree, u64 s, int32_t tag)
+int _has_tag(struct pnfs_inval_tree *tree, u64 s, int32_t tag)
 {
-	int32_t tags;
-
-	dprintk("%s(%llu, %i) enter\n", __func__, s, tag);
-	s = normalize(s, tree->mtt_step_size);
-	tags = _find_entry(tree, s);
-	if ((tags < 0) || !(tags & (1 << tag)))
-		return 0;
-	else
-		return 1;
+	s = normalize(s, tree->tt_step_size);
+	return _find_entry(tree, s, tag) != NULL;
 }
 
-/* Creates entry with tag, or if entry already exists, unions tag to it.
- * If storage is not NULL, newly created entry will use it.
- * Returns number of entries added, or negative on error.
+/* Tags [s, s + length), rounded out to the step size.  The interval is
+ * merged with any it overlaps or abuts, so at most one new entry is
+ * needed; it is taken from *storage, which the caller preloaded.
+ * Returns 0, or -ENOMEM if a new entry was needed and *storage was NULL.
  */
-static int _add_entry(struct my_tree_t *tree, u64 s, int32_t tag,
-		      struct pnfs_inval_tracking *storage)
+static int _set_range(struct pnfs_inval_tree *tree, int32_t tag, u64 s,
+		      u64 length, struct pnfs_inval_tracking **storage)
 {
-	int found = 0;
-	struct pnfs_inval_tracking *pos;
+	struct rb_root *root = &tree->tt_root[tag];
+	struct rb_node **p = &root->rb_node, *parent = NULL, *n;
+	struct pnfs_inval_tracking *pos, *next, *new;
+	u64 start, end;
 
-	dprintk("%s(%llu, %i, %p) enter\n", __func__, s, tag, storage);
-	list_for_each_entry_reverse(pos, &tree->mtt_stub, it_link) {
-		if (pos->it_sector > s)
-			continue;
-		else if (pos->it_sector == s) {
-			found = 1;
-			break;
+	dprintk("%s(%i, %llu, %llu) enter\n", __func__, tag, s, length);
+	start = normalize(s, tree->tt_step_size);
+	end = normalize_up(s + length, tree->tt_step_size);
+
+	/* Find the leftmost interval ending at or after start */
+	pos = NULL;
+	n = root->rb_node;
+	while (n) {
+		next = rb_entry(n, struct pnfs_inval_tracking, it_node);
+		if (next->it_end >= start) {
+			pos = next;
+			n = n->rb_left;
 		} else
-			break;
+			n = n->rb_right;
 	}
-	if (found) {
-		pos->it_tags |= (1 << tag);
-		return 0;
-	} else {
-		struct pnfs_inval_tracking *new;
-		if (storage)
-			new = storage;
-		else {
-			new = kmalloc(sizeof(*new), GFP_KERNEL);
-			if (!new)
-				return -ENOMEM;
+
+	if (pos && pos->it_start <= end) {
+		/* Grow pos over [start, end), swallowing what it reaches */
+		pos->it_start = min(pos->it_start, (sector_t)start);
+		pos->it_end = max(pos->it_end, (sector_t)end);
+		while ((n = rb_next(&pos->it_node)) != NULL) {
+			next = rb_entry(n, struct pnfs_inval_tracking, it_node);
+			if (next->it_start > pos->it_end)
+				break;
+			pos->it_end = max(pos->it_end, next->it_end);
+			rb_erase(&next->it_node, root);
+			kmem_cache_free(bl_inval_cachep, next);
 		}
-		new->it_sector = s;
-		new->it_tags = (1 << tag);
-		list_add(&new->it_link, &pos->it_link);
-		return 1;
+		return 0;
 	}
-}
-
-/* XXXX Really want option to not create */
-/* Over range, unions tag with existing entries, else creates entry with tag */
-static int _set_range(struct my_tree_t *tree, int32_t tag, u64 s, u64 length)
-{
-	u64 i;
 
-	dprintk("%s(%i, %llu, %llu) enter\n", __func__, tag, s, length);
-	for (i = normalize(s, tree->mtt_step_size); i < s + length;
-	     i += tree->mtt_step_size)
-		if (_add_entry(tree, i, tag, NULL))
-			return -ENOMEM;
+	new = *storage;
+	if (!new)
+		return -ENOMEM;
+	*storage = NULL;
+	new->it_start = start;
+	new->it_end = end;
+	while (*p) {
+		parent = *p;
+		pos = rb_entry(parent, struct pnfs_inval_tracking, it_node);
+		if (start < pos->it_start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new->it_node, parent, p);
+	rb_insert_color(&new->it_node, root);
 	return 0;
 }
 
-/* Ensure that future operations on given range of tree will not malloc */
-static int _preload_range(struct my_tree_t *tree, u64 offset, u64 length)
+/* Allocate, outside of im_lock, the entry a _set_range might need */
+static struct pnfs_inval_tracking *_preload_range(void)
 {
-	u64 start, end, s;
-	int count, i, used = 0, status = -ENOMEM;
-	struct pnfs_inval_tracking **storage;
-
-	dprintk("%s(%llu, %llu) enter\n", __func__, offset, length);
-	start = normalize(offset, tree->mtt_step_size);
-	end = normalize_up(offset + length, tree->mtt_step_size);
-	count = (int)(end - start) / (int)tree->mtt_step_size;
-
-	/* Pre-malloc what memory we might need */
-	storage = kmalloc(sizeof(*storage) * count, GFP_KERNEL);
-	if (!storage)
-		return -ENOMEM;
-	for (i = 0; i < count; i++) {
-		storage[i] = kmalloc(sizeof(struct pnfs_inval_tracking),
-				     GFP_KERNEL);
-		if (!storage[i])
-			goto out_cleanup;
-	}
-
-	/* Now need lock - HOW??? */
+	return kmem_cache_alloc(bl_inval_cachep, GFP_NOFS);
+}
 
-	for (s = start; s < end; s += tree->mtt_step_size)
-		used += _add_entry(tree, s, INTERNAL_EXISTS, storage[used]);
+static void _release_preload(struct pnfs_inval_tracking *storage)
+{
+	if (storage)
+		kmem_cache_free(bl_inval_cachep, storage);
+}
 
-	/* Unlock - HOW??? */
-	status = 0;
+void release_inval_marks(struct pnfs_inval_markings *marks)
+{
+	struct rb_root *root;
+	struct rb_node *n;
+	int i;
 
- out_cleanup:
-	for (i = used; i < count; i++) {
-		if (!storage[i])
-			break;
-		kfree(storage[i]);
+	for (i = 0; i < EXTENT_TAGS; i++) {
+		root = &marks->im_tree.tt_root[i];
+		while ((n = rb_first(root)) != NULL) {
+			rb_erase(n, root);
+			kmem_cache_free(bl_inval_cachep,
+					rb_entry(n, struct pnfs_inval_tracking,
+						 it_node));
+		}
 	}
-	kfree(storage);
-	return status;
 }
 
 static void set_needs_init(sector_t *array, sector_t offset)
@@ -217,35 +217,17 @@ int is_sector_initialized(struct pnfs_inval_markings *marks, sector_t isect)
 	return rv;
 }
 
-/* Assume start, end already sector aligned */
+/* Assume start, end already sector aligned.  Intervals are coalesced, so
+ * the range is fully tagged only if a single interval covers it.
+ */
 static int
-_range_has_tag(struct my_tree_t *tree, u64 start, u64 end, int32_t tag)
+_range_has_tag(struct pnfs_inval_tree *tree, u64 start, u64 end, int32_t tag)
 {
 	struct pnfs_inval_tracking *pos;
-	u64 expect = 0;
 
 	dprintk("%s(%llu, %llu, %i) enter\n", __func__, start, end, tag);
-	list_for_each_entry_reverse(pos, &tree->mtt_stub, it_link) {
-		if (pos->it_sector >= end)
-			continue;
-		if (!expect) {
-			if ((pos->it_sector == end - tree->mtt_step_size) &&
-			    (pos->it_tags & (1 << tag))) {
-				expect = pos->it_sector - tree->mtt_step_size;
-				if (expect < start)
-					return 1;
-				continue;
-			} else {
-				return 0;
-			}
-		}
-		if (pos->it_sector != expect || !(pos->it_tags & (1 << tag)))
-			return 0;
-		expect -= tree->mtt_step_size;
-		if (expect < start)
-			return 1;
-	}
-	return 0;
+	pos = _find_entry(tree, start, tag);
+	return pos && end <= pos->it_end;
 }
 
 static int is_range_written(struct pnfs_inval_markings *marks,
@@ -271,6 +253,7 @@ int mark_initialized_sectors(struct pnfs_inval_markings *marks,
 {
 	sector_t s, start, end;
 	sector_t *array = NULL; /* Pages to mark */
+	struct pnfs_inval_tracking *storage;
 
 	dprintk("%s(offset=%llu,len=%llu) enter\n",
 		__func__, (u64)offset, (u64)length);
@@ -286,7 +269,8 @@ int mark_initialized_sectors(struct pnfs_inval_markings *marks,
 
 	start = normalize(offset, marks->im_block_size);
 	end = normalize_up(offset + length, marks->im_block_size);
-	if (_preload_range(&marks->im_tree, start, end - start))
+	storage = _preload_range();
+	if (!storage)
 		goto outerr;
 
 	spin_lock(&marks->im_lock);
@@ -298,7 +282,8 @@ int mark_initialized_sectors(struct pnfs_inval_markings *marks,
 		if (!_has_tag(&marks->im_tree, s, EXTENT_INITIALIZED))
 			set_needs_init(array, s);
 	}
-	if (_set_range(&marks->im_tree, EXTENT_INITIALIZED, offset, length))
+	if (_set_range(&marks->im_tree, EXTENT_INITIALIZED, offset, length,
+		       &storage))
 		goto out_unlock;
 	for (s = normalize_up(offset + length, PAGE_CACHE_SECTORS);
 	     s < end; s += PAGE_CACHE_SECTORS) {
@@ -308,6 +293,7 @@ int mark_initialized_sectors(struct pnfs_inval_markings *marks,
 	}
 
 	spin_unlock(&marks->im_lock);
+	_release_preload(storage);
 
 	if (pages) {
 		if (array[0] == ~0) {
@@ -320,6 +306,7 @@ int mark_initialized_sectors(struct pnfs_inval_markings *marks,
 
  out_unlock:
 	spin_unlock(&marks->im_lock);
+	_release_preload(storage);
  outerr:
 	if (pages) {
 		kfree(array);
@@ -334,13 +321,17 @@ int mark_initialized_sectors(struct pnfs_inval_markings *marks,
 int mark_written_sectors(struct pnfs_inval_markings *marks,
 			 sector_t offset, sector_t length)
 {
+	struct pnfs_inval_tracking *storage;
 	int status;
 
 	dprintk("%s(offset=%llu,len=%llu) enter\n", __func__,
 		(u64)offset, (u64)length);
+	storage = _preload_range();
 	spin_lock(&marks->im_lock);
-	status = _set_range(&marks->im_tree, EXTENT_WRITTEN, offset, length);
+	status = _set_range(&marks->im_tree, EXTENT_WRITTEN, offset, length,
+			    &storage);
 	spin_unlock(&marks->im_lock);
+	_release_preload(storage);
 	return status;
 }
 
@@ -500,6 +491,13 @@ static void print_bl_extent(struct pnfs_block_extent *be)
 	}
 }
 
+static void
+free_extent_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct pnfs_block_extent, be_rcu));
+}
+
+/* Lockless lookups may still be looking at be, see find_get_extent */
 static void
 destroy_extent(struct kref *kref)
 {
@@ -507,7 +505,7 @@ destroy_extent(struct kref *kref)
 
 	be = container_of(kref, struct pnfs_block_extent, be_refcnt);
 	dprintk("%s be=%p\n", __func__, be);
-	kfree(be);
+	call_rcu(&be->be_rcu, free_extent_rcu);
 }
 
 void
@@ -541,17 +539,85 @@ get_extent(struct pnfs_block_extent *be)
 	return be;
 }
 
-void print_elist(struct list_head *list)
+void print_elist(struct rb_root *root)
 {
-	struct pnfs_block_extent *be;
+	struct rb_node *n;
+
 	dprintk("****************\n");
 	dprintk("Extent list looks like:\n");
-	list_for_each_entry(be, list, be_node) {
-		print_bl_extent(be);
-	}
+	for (n = rb_first(root); n; n = rb_next(n))
+		print_bl_extent(rb_entry(n, struct pnfs_block_extent,
+					 be_rbnode));
 	dprintk("****************\n");
 }
 
+static inline struct pnfs_block_extent *
+ext_entry(struct rb_node *n)
+{
+	return n ? rb_entry(n, struct pnfs_block_extent, be_rbnode) : NULL;
+}
+
+/*
+ * Each bl_extents[] tree is keyed on be_f_offset.  Writers hold
+ * bl_ext_lock and bump bl_ext_seq around every change; lookups walk the
+ * tree under RCU only and retry if bl_ext_seq moved.  Extents are never
+ * modified once in a tree (they are replaced instead) and are freed
+ * through call_rcu, so a lockless walker always sees valid memory.
+ * Nodes must be fully initialized before they become reachable.
+ */
+static void
+_ext_link(struct rb_root *root, struct pnfs_block_extent *new)
+{
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (new->be_f_offset < ext_entry(parent)->be_f_offset)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	new->be_rbnode.rb_parent_color = (unsigned long)parent;
+	new->be_rbnode.rb_left = new->be_rbnode.rb_right = NULL;
+	smp_wmb();
+	*p = &new->be_rbnode;
+	rb_insert_color(&new->be_rbnode, root);
+}
+
+static void
+_ext_replace(struct rb_root *root, struct pnfs_block_extent *old,
+	     struct pnfs_block_extent *new)
+{
+	new->be_rbnode = old->be_rbnode;
+	smp_wmb();
+	rb_replace_node(&old->be_rbnode, &new->be_rbnode, root);
+}
+
+/* A walk racing with rebalancing may wander; give up and let the
+ * sequence check send us around again.
+ */
+#define BL_EXT_MAX_DEPTH	(2 * BITS_PER_LONG)
+
+/* Returns the extent in root containing isect, or NULL.  No reference. */
+static struct pnfs_block_extent *
+_ext_lookup(struct rb_root *root, sector_t isect)
+{
+	struct rb_node *n = rcu_dereference_raw(root->rb_node);
+	struct pnfs_block_extent *be;
+	int depth = 0;
+
+	while (n && depth++ < BL_EXT_MAX_DEPTH) {
+		be = ext_entry(n);
+		if (isect < be->be_f_offset)
+			n = rcu_dereference_raw(n->rb_left);
+		else if (isect >= be->be_f_offset + be->be_length)
+			n = rcu_dereference_raw(n->rb_right);
+		else
+			return be;
+	}
+	return NULL;
+}
+
 static inline int
 extents_consistent(struct pnfs_block_extent *old, struct pnfs_block_extent *new)
 {
@@ -563,10 +629,10 @@ extents_consistent(struct pnfs_block_extent *old, struct pnfs_block_extent *new)
 		  new->be_mdev == old->be_mdev));
 }
 
-/* Adds new to appropriate list in bl, modifying new and removing existing
+/* Adds new to appropriate tree in bl, modifying new and removing existing
  * extents as appropriate to deal with overlaps.
  *
- * See find_get_extent for list constraints.
+ * See find_get_extent for tree constraints.
  *
  * Refcount on new is already set.  If end up not using it, or error out,
  * need to put the reference.
@@ -577,21 +643,33 @@ int
 add_and_merge_extent(struct pnfs_block_layout *bl,
 		     struct pnfs_block_extent *new)
 {
-	struct pnfs_block_extent *be, *tmp;
+	struct pnfs_block_extent *be, *next;
 	sector_t end = new->be_f_offset + new->be_length;
-	struct list_head *list;
+	struct rb_root *root;
+	struct rb_node *n;
+	int status = 0;
 
 	dprintk("%s enter with be=%p\n", __func__, new);
 	print_bl_extent(new);
-	list = &bl->bl_extents[choose_list(new->be_state)];
-	print_elist(list);
+	root = &bl->bl_extents[choose_list(new->be_state)];
+	print_elist(root);
+
+	/* Find the first extent that ends after new starts */
+	be = NULL;
+	n = root->rb_node;
+	while (n) {
+		next = ext_entry(n);
+		if (new->be_f_offset < next->be_f_offset + next->be_length) {
+			be = next;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
 
-	/* Scan for proper place to insert, extending new to the left
-	 * as much as possible.
-	 */
-	list_for_each_entry_safe_reverse(be, tmp, list, be_node) {
-		if (new->be_f_offset >= be->be_f_offset + be->be_length)
-			break;
+	write_seqcount_begin(&bl->bl_ext_seq);
+	/* Walk the extents new overlaps, extending new to replace them */
+	for (; be && be->be_f_offset < end; be = next) {
+		next = ext_entry(rb_next(&be->be_rbnode));
 		if (new->be_f_offset >= be->be_f_offset) {
 			if (end <= be->be_f_offset + be->be_length) {
 				/* new is a subset of existing be*/
@@ -599,7 +677,7 @@ add_and_merge_extent(struct pnfs_block_layout *bl,
 					dprintk("%s: new is subset, ignoring\n",
 						__func__);
 					put_extent(new);
-					return 0;
+					goto out;
 				} else {
 					goto out_err;
 				}
@@ -613,7 +691,7 @@ add_and_merge_extent(struct pnfs_block_layout *bl,
 					new->be_f_offset = be->be_f_offset;
 					new->be_v_offset = be->be_v_offset;
 					dprintk("%s: removing %p\n", __func__, be);
-					list_del(&be->be_node);
+					rb_erase(&be->be_rbnode, root);
 					put_extent(be);
 				} else {
 					goto out_err;
@@ -624,12 +702,12 @@ add_and_merge_extent(struct pnfs_block_layout *bl,
 			if (extents_consistent(be, new)) {
 				/* extend new to fully replace be */
 				dprintk("%s: removing %p\n", __func__, be);
-				list_del(&be->be_node);
+				rb_erase(&be->be_rbnode, root);
 				put_extent(be);
 			} else {
 				goto out_err;
 			}
-		} else if (end > be->be_f_offset) {
+		} else {
 			/*           |<--   be   -->|
 			 *|<--   new   -->| */
 			if (extents_consistent(new, be)) {
@@ -637,70 +715,110 @@ add_and_merge_extent(struct pnfs_block_layout *bl,
 				new->be_length += be->be_f_offset + be->be_length -
 					new->be_f_offset - new->be_length;
 				dprintk("%s: removing %p\n", __func__, be);
-				list_del(&be->be_node);
+				rb_erase(&be->be_rbnode, root);
 				put_extent(be);
 			} else {
 				goto out_err;
 			}
 		}
 	}
-	/* Note that if we never hit the above break, be will not point to a
-	 * valid extent.  However, in that case &be->be_node==list.
-	 */
-	list_add(&new->be_node, &be->be_node);
+	_ext_link(root, new);
 	dprintk("%s: inserting new\n", __func__);
-	print_elist(list);
-	/* STUB - The per-list consistency checks have all been done,
-	 * should now check cross-list consistency.
+	print_elist(root);
+	/* STUB - The per-tree consistency checks have all been done,
+	 * should now check cross-tree consistency.
 	 */
-	return 0;
+ out:
+	write_seqcount_end(&bl->bl_ext_seq);
+	return status;
 
  out_err:
 	put_extent(new);
-	return -EIO;
+	status = -EIO;
+	goto out;
+}
+
+/* Looks isect up in both trees, taking references on what it finds.
+ * Returns -EAGAIN if a lockless lookup ran into a dying extent.
+ */
+static int
+__find_get_extent(struct pnfs_block_layout *bl, sector_t isect,
+		  struct pnfs_block_extent **retp,
+		  struct pnfs_block_extent **cowp)
+{
+	struct pnfs_block_extent *be, *cow, *ret;
+	int i;
+
+	cow = ret = NULL;
+	for (i = 0; i < EXTENT_LISTS; i++) {
+		if (ret &&
+		    (!cowp || ret->be_state != PNFS_BLOCK_INVALID_DATA))
+			break;
+		be = _ext_lookup(&bl->bl_extents[i], isect);
+		if (!be)
+			continue;
+		/* We have found an extent */
+		dprintk("%s Get %p (%i)\n", __func__, be,
+			atomic_read(&be->be_refcnt.refcount));
+		if (!atomic_inc_not_zero(&be->be_refcnt.refcount)) {
+			put_extent(ret);
+			return -EAGAIN;
+		}
+		if (!ret)
+			ret = be;
+		else if (be->be_state != PNFS_BLOCK_READ_DATA)
+			put_extent(be);
+		else
+			cow = be;
+	}
+	*retp = ret;
+	if (cowp)
+		*cowp = cow;
+	return 0;
 }
 
 /* Returns extent, or NULL.  If a second READ extent exists, it is returned
  * in cow_read, if given.
  *
- * The extents are kept in two seperate ordered lists, one for READ and NONE,
- * one for READWRITE and INVALID.  Within each list, we assume:
- * 1. Extents are ordered by file offset.
+ * The extents are kept in two seperate trees, one for READ and NONE,
+ * one for READWRITE and INVALID.  Within each tree, we assume:
+ * 1. Extents are keyed by file offset.
  * 2. For any given isect, there is at most one extents that matches.
+ *
+ * The lookup is lockless; if writers keep getting in the way, fall back
+ * to bl_ext_lock.
  */
+#define BL_EXT_LOOKUP_RETRIES	3
+
 struct pnfs_block_extent *
 find_get_extent(struct pnfs_block_layout *bl, sector_t isect,
 	    struct pnfs_block_extent **cow_read)
 {
-	struct pnfs_block_extent *be, *cow, *ret;
-	int i;
+	struct pnfs_block_extent *cow = NULL, *ret;
+	struct pnfs_block_extent **cowp = cow_read ? &cow : NULL;
+	unsigned int seq;
+	int tries;
 
 	dprintk("%s enter with isect %llu\n", __func__, (u64)isect);
-	cow = ret = NULL;
-	spin_lock(&bl->bl_ext_lock);
-	for (i = 0; i < EXTENT_LISTS; i++) {
-		if (ret &&
-		    (!cow_read || ret->be_state != PNFS_BLOCK_INVALID_DATA))
-			break;
-		list_for_each_entry_reverse(be, &bl->bl_extents[i], be_node) {
-			if (isect >= be->be_f_offset + be->be_length)
-				break;
-			if (isect >= be->be_f_offset) {
-				/* We have found an extent */
-				dprintk("%s Get %p (%i)\n", __func__, be,
-					atomic_read(&be->be_refcnt.refcount));
-				kref_get(&be->be_refcnt);
-				if (!ret)
-					ret = be;
-				else if (be->be_state != PNFS_BLOCK_READ_DATA)
-					put_extent(be);
-				else
-					cow = be;
-				break;
-			}
+	rcu_read_lock();
+	for (tries = 0; tries < BL_EXT_LOOKUP_RETRIES; tries++) {
+		seq = read_seqcount_begin(&bl->bl_ext_seq);
+		if (__find_get_extent(bl, isect, &ret, cowp))
+			continue;
+		if (!read_seqcount_retry(&bl->bl_ext_seq, seq)) {
+			rcu_read_unlock();
+			goto out;
 		}
+		put_extent(ret);
+		put_extent(cow);
+		cow = NULL;
 	}
+	rcu_read_unlock();
+
+	spin_lock(&bl->bl_ext_lock);
+	__find_get_extent(bl, isect, &ret, cowp);
 	spin_unlock(&bl->bl_ext_lock);
+ out:
 	if (cow_read)
 		*cow_read = cow;
 	print_bl_extent(ret);
@@ -711,26 +829,10 @@ find_get_extent(struct pnfs_block_layout *bl, sector_t isect,
 static struct pnfs_block_extent *
 find_get_extent_locked(struct pnfs_block_layout *bl, sector_t isect)
 {
-	struct pnfs_block_extent *be, *ret = NULL;
-	int i;
+	struct pnfs_block_extent *ret;
 
 	dprintk("%s enter with isect %llu\n", __func__, (u64)isect);
-	for (i = 0; i < EXTENT_LISTS; i++) {
-		if (ret)
-			break;
-		list_for_each_entry_reverse(be, &bl->bl_extents[i], be_node) {
-			if (isect >= be->be_f_offset + be->be_length)
-				break;
-			if (isect >= be->be_f_offset) {
-				/* We have found an extent */
-				dprintk("%s Get %p (%i)\n", __func__, be,
-					atomic_read(&be->be_refcnt.refcount));
-				kref_get(&be->be_refcnt);
-				ret = be;
-				break;
-			}
-		}
-	}
+	__find_get_extent(bl, isect, &ret, NULL);
 	print_bl_extent(ret);
 	return ret;
 }
@@ -803,28 +905,28 @@ _prep_new_extent(struct pnfs_block_extent *new,
 	new->be_inval = orig->be_inval;
 }
 
-/* Tries to merge be with extent in front of it in list.
+/* Tries to merge be with extent in front of it in the tree.
  * Frees storage if not used.
  */
 static struct pnfs_block_extent *
-_front_merge(struct pnfs_block_extent *be, struct list_head *head,
+_front_merge(struct pnfs_block_extent *be, struct rb_root *root,
 	     struct pnfs_block_extent *storage)
 {
 	struct pnfs_block_extent *prev;
 
-	if (!storage)
+	if (!storage || !be)
 		goto no_merge;
-	if (&be->be_node == head || be->be_node.prev == head)
+	prev = ext_entry(rb_prev(&be->be_rbnode));
+	if (!prev)
 		goto no_merge;
-	prev = list_entry(be->be_node.prev, struct pnfs_block_extent, be_node);
 	if ((prev->be_f_offset + prev->be_length != be->be_f_offset) ||
 	    !extents_consistent(prev, be))
 		goto no_merge;
 	_prep_new_extent(storage, prev, prev->be_f_offset,
 			 prev->be_length + be->be_length, prev->be_state);
-	list_replace(&prev->be_node, &storage->be_node);
+	_ext_replace(root, prev, storage);
 	put_extent(prev);
-	list_del(&be->be_node);
+	rb_erase(&be->be_rbnode, root);
 	put_extent(be);
 	return storage;
 
@@ -837,8 +939,9 @@ static u64
 set_to_rw(struct pnfs_block_layout *bl, u64 offset, u64 length)
 {
 	u64 rv = offset + length;
-	struct pnfs_block_extent *be, *e1, *e2, *e3, *new, *old;
+	struct pnfs_block_extent *be, *e1, *e2, *e3, *new;
 	struct pnfs_block_extent *children[3];
+	struct rb_root *root = &bl->bl_extents[RW_EXTENT];
 	struct pnfs_block_extent *merge1 = NULL, *merge2 = NULL;
 	int i = 0, j;
 
@@ -882,27 +985,27 @@ set_to_rw(struct pnfs_block_layout *bl, u64 offset, u64 length)
 	} else
 		merge2 = e3;
 
-	/* Remove be from list, and insert the e* */
-	/* We don't get refs on e*, since this list is the base reference
+	/* Remove be from tree, and insert the e* */
+	/* We don't get refs on e*, since this tree is the base reference
 	 * set when init'ed.
 	 */
 	if (i < 3)
 		children[i] = NULL;
+	write_seqcount_begin(&bl->bl_ext_seq);
 	new = children[0];
-	list_replace(&be->be_node, &new->be_node);
+	_ext_replace(root, be, new);
 	put_extent(be);
-	new = _front_merge(new, &bl->bl_extents[RW_EXTENT], merge1);
+	new = _front_merge(new, root, merge1);
 	for (j = 1; j < i; j++) {
-		old = new;
 		new = children[j];
-		list_add(&new->be_node, &old->be_node);
+		_ext_link(root, new);
 	}
 	if (merge2) {
 		/* This is a HACK, should just create a _back_merge function */
-		new = list_entry(new->be_node.next,
-				 struct pnfs_block_extent, be_node);
-		new = _front_merge(new, &bl->bl_extents[RW_EXTENT], merge2);
+		new = ext_entry(rb_next(&new->be_rbnode));
+		new = _front_merge(new, root, merge2);
 	}
+	write_seqcount_end(&bl->bl_ext_seq);
 	spin_unlock(&bl->bl_ext_lock);
 
 	/* Since we removed the base reference above, be is now scheduled for
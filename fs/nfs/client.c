@@ -1076,6 +1076,9 @@ static void nfs_server_copy_userdata(struct nfs_server *target, struct nfs_serve
 	target->acdirmax = source->acdirmax;
 	target->caps = source->caps;
 	target->options = source->options;
+#ifdef CONFIG_NFS_V4
+	target->ds_nconnect = source->ds_nconnect;
+#endif
 }
 
 /*
@@ -1369,6 +1372,38 @@ error:
 }
 EXPORT_SYMBOL(nfs4_set_client);
 
+/*
+ * Open another RPC client to the server behind clp, on a transport of its
+ * own.  Callers that own the nfs_client's session can spread RPCs across
+ * several of these to trunk the session over multiple connections.
+ */
+struct rpc_clnt *nfs4_create_trunked_rpcclient(struct nfs_client *clp,
+		const struct rpc_timeout *timeparms)
+{
+	struct rpc_clnt *clnt = clp->cl_rpcclient;
+	struct rpc_create_args args = {
+		.net		= clnt->cl_xprt->xprt_net,
+		.protocol	= clp->cl_proto,
+		.address	= (struct sockaddr *)&clp->cl_addr,
+		.addrsize	= clp->cl_addrlen,
+		.timeout	= timeparms,
+		.servername	= clp->cl_hostname,
+		.program	= &nfs_program,
+		.version	= clp->rpc_ops->version,
+		.authflavor	= clnt->cl_auth->au_flavor,
+		.flags		= RPC_CLNT_CREATE_DISCRTRY,
+	};
+
+	if (!clnt->cl_xprt->resvport)
+		args.flags |= RPC_CLNT_CREATE_NONPRIVPORT;
+
+	clnt = rpc_create(&args);
+	dprintk("%s: %s returns %ld\n", __func__, clp->cl_hostname,
+		IS_ERR(clnt) ? PTR_ERR(clnt) : 0L);
+	return clnt;
+}
+EXPORT_SYMBOL_GPL(nfs4_create_trunked_rpcclient);
+
 
 /*
  * Session has been established, and the client marked ready.
@@ -1491,6 +1526,7 @@ static int nfs4_init_server(struct nfs_server *server,
 	server->acdirmax = data->acdirmax * HZ;
 
 	server->port = data->nfs_server.port;
+	server->ds_nconnect = data->ds_nconnect;
 
 	error = nfs_init_server_rpcclient(server, &timeparms, data->auth_flavors[0]);
 
@@ -13,6 +13,7 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/nfs_fs.h>
+#include <linux/nfs_idmap.h>
 
 #include "../internal.h"
 #include "../pnfs.h"
@@ -22,6 +23,9 @@
 
 #define NFSDBG_FACILITY         NFSDBG_PNFS_LD
 
+static void cohort_rpl_log_init(struct cohort_rpl_log *log);
+static void cohort_rpl_log_free_recs(struct list_head *recs);
+
 static int
 cohort_rpl_set_layoutdriver(struct nfs_server *nfss,
                             const struct nfs_fh *mntfh)
@@ -67,6 +71,9 @@ cohort_rpl_free_lseg(struct pnfs_layout_segment *lseg)
 	dprintk("--> %s\n", __func__);
 
         rpl = COHORT_RPL_LSEG(lseg);
+	/* A queued flush holds a reference, so the log is empty by now */
+	WARN_ON(!list_empty(&rpl->log.rl_recs));
+	cohort_rpl_log_free_recs(&rpl->log.rl_recs);
 	pnfs_put_deviceid(nfss->nfs_client->cl_devid_cache,
 			  &rpl->dsaddr->deviceid);
 	_cohort_rpl_free_lseg(rpl);
@@ -143,6 +150,7 @@ cohort_rpl_alloc_lseg(struct pnfs_layout_hdr *layoutid,
                       GFP_KERNEL);
 	if (!rpl)
 		return NULL;
+	cohort_rpl_log_init(&rpl->log);
 
 	rc = cohort_rpl_decode_layout(layoutid, rpl, lgr, &id);
 	if (rc != 0 || cohort_rpl_check_layout(layoutid, rpl, lgr, &id)) {
@@ -295,26 +303,6 @@ out_err:
     return (code);
 }
 
-static inline int
-nfs41_call_sync(struct nfs_server *server,
-                struct nfs_client *client,
-                struct rpc_message *msg,
-                struct nfs4_sequence_args *seq_args,
-                struct nfs4_sequence_res *seq_res,
-                int cache_reply)
-{
-    int code;
-
-    /* set up seq_args with client session */
-    seq_args->sa_session = client->cl_session;
-
-    /* call with supplied client */
-    code = client->cl_mvops->call_sync(
-        server, msg, seq_args, seq_res, cache_reply);
-
-    return (code);
-}
-
 /* RINTEGRITY RPC support */
 
 struct cohort_rintegrity_data {
@@ -344,10 +332,756 @@ cohort_alloc_rintegrity_data(void)
     return data;
 }
 
-static inline void
-cohort_rpl_updatedata_create(struct nfs4_createdata *data)
+/*
+ * Replica fan-out
+ *
+ * Once the primary MDS has executed a namespace operation, the same
+ * compound is mirrored to every replica rmds in the layout device
+ * (ds_list[1..ds_num-1]; ds_list[0] is the primary).  Each mirror runs as
+ * its own async rpc_task on the replica session, so the caller pays one
+ * round trip regardless of the number of replicas.  The caller sleeps
+ * only until cohort_rpl_quorum is satisfied; stragglers complete on
+ * nfsiod and release their private copies of the arguments themselves.
+ * Synchronous fan-outs (log flushes outside syscall context) instead
+ * wait for every replica, so they need not pin the superblock.
+ */
+enum {
+	COHORT_RPL_QUORUM_ALL = 0,
+	COHORT_RPL_QUORUM_MAJORITY,
+	COHORT_RPL_QUORUM_PRIMARY_PLUS_N,
+};
+
+static unsigned int cohort_rpl_quorum = COHORT_RPL_QUORUM_ALL;
+module_param(cohort_rpl_quorum, uint, 0644);
+MODULE_PARM_DESC(cohort_rpl_quorum, "Replica acks awaited per metadata op "
+		 "(0 = all, 1 = majority, 2 = primary plus cohort_rpl_quorum_n)");
+
+static unsigned int cohort_rpl_quorum_n = 1;
+module_param(cohort_rpl_quorum_n, uint, 0644);
+MODULE_PARM_DESC(cohort_rpl_quorum_n, "Replica acks awaited in primary "
+		 "plus N mode");
+
+struct cohort_rpl_fanout {
+	atomic_t		rf_count;
+	spinlock_t		rf_lock;
+	u32			rf_quorum;
+	u32			rf_pending;
+	u32			rf_acked;
+	int			rf_status;
+	int			rf_sync;
+	struct super_block	*rf_sb;
+	struct completion	rf_done;
+};
+
+struct cohort_rpl_call {
+	struct cohort_rpl_fanout	*rc_fanout;
+	struct nfs_client		*rc_client;
+	struct nfs_server		*rc_server;
+	struct rpc_message		rc_msg;
+	struct nfs4_sequence_args	*rc_seq_args;
+	struct nfs4_sequence_res	*rc_seq_res;
+	unsigned int			rc_accounted : 1;
+	void				(*rc_free)(struct cohort_rpl_call *);
+};
+
+/* Number of replica acks the current policy requires out of nreplicas */
+static u32
+cohort_rpl_quorum_needed(u32 nreplicas)
+{
+	switch (cohort_rpl_quorum) {
+	case COHORT_RPL_QUORUM_MAJORITY:
+		/* majority of primary + replicas; the primary already acked */
+		return (nreplicas + 1) / 2;
+	case COHORT_RPL_QUORUM_PRIMARY_PLUS_N:
+		return min_t(u32, cohort_rpl_quorum_n, nreplicas);
+	default:
+		return nreplicas;
+	}
+}
+
+static struct cohort_rpl_fanout *
+cohort_rpl_fanout_alloc(struct inode *d_ino, u32 nreplicas, int sync)
+{
+	struct cohort_rpl_fanout *rf;
+
+	rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+	if (!rf)
+		return NULL;
+	atomic_set(&rf->rf_count, 1);
+	spin_lock_init(&rf->rf_lock);
+	rf->rf_quorum = cohort_rpl_quorum_needed(nreplicas);
+	rf->rf_pending = nreplicas;
+	rf->rf_sync = sync;
+	init_completion(&rf->rf_done);
+	if (!sync) {
+		if (rf->rf_quorum == 0)
+			complete_all(&rf->rf_done);
+		/* Stragglers may outlive the syscall; pin the superblock */
+		rf->rf_sb = d_ino->i_sb;
+		nfs_sb_active(rf->rf_sb);
+	}
+	return rf;
+}
+
+static void
+cohort_rpl_fanout_put(struct cohort_rpl_fanout *rf)
+{
+	if (atomic_dec_and_test(&rf->rf_count)) {
+		if (rf->rf_sb)
+			nfs_sb_deactive(rf->rf_sb);
+		kfree(rf);
+	}
+}
+
+/*
+ * Record the outcome of one replica.  rf_done fires as soon as the quorum
+ * is met, or as soon as it can no longer be met, unless the fan-out is
+ * synchronous.
+ */
+static void
+cohort_rpl_fanout_account(struct cohort_rpl_fanout *rf, int status)
+{
+	spin_lock(&rf->rf_lock);
+	rf->rf_pending--;
+	if (status == 0)
+		rf->rf_acked++;
+	else if (rf->rf_status == 0)
+		rf->rf_status = status;
+	if (rf->rf_pending == 0 ||
+	    (!rf->rf_sync && (rf->rf_acked >= rf->rf_quorum ||
+			      rf->rf_acked + rf->rf_pending < rf->rf_quorum)))
+		complete_all(&rf->rf_done);
+	spin_unlock(&rf->rf_lock);
+}
+
+static int
+cohort_rpl_fanout_wait(struct cohort_rpl_fanout *rf)
+{
+	int status;
+
+	if (rf->rf_sync)
+		wait_for_completion(&rf->rf_done);
+	else {
+		status = wait_for_completion_killable(&rf->rf_done);
+		if (status)
+			return status;
+	}
+	spin_lock(&rf->rf_lock);
+	if (rf->rf_acked >= rf->rf_quorum)
+		status = 0;
+	else
+		status = rf->rf_status ? rf->rf_status : -EIO;
+	dprintk("%s acked %u/%u pending %u status %d\n", __func__,
+		rf->rf_acked, rf->rf_quorum, rf->rf_pending, status);
+	spin_unlock(&rf->rf_lock);
+	return status;
+}
+
+static void
+cohort_rpl_call_prepare(struct rpc_task *task, void *calldata)
+{
+	struct cohort_rpl_call *call = calldata;
+
+	if (nfs4_setup_sequence(call->rc_server, call->rc_client->cl_session,
+				call->rc_seq_args, call->rc_seq_res, 1, task))
+		return;
+	rpc_call_start(task);
+}
+
+static void
+cohort_rpl_call_done(struct rpc_task *task, void *calldata)
+{
+	struct cohort_rpl_call *call = calldata;
+
+	if (!nfs41_sequence_done(task, call->rc_seq_res))
+		return;
+	dprintk("%s client %p status %d\n", __func__, call->rc_client,
+		task->tk_status);
+	call->rc_accounted = 1;
+	cohort_rpl_fanout_account(call->rc_fanout, task->tk_status);
+}
+
+static void
+cohort_rpl_call_release(void *calldata)
+{
+	struct cohort_rpl_call *call = calldata;
+	struct cohort_rpl_fanout *rf = call->rc_fanout;
+
+	/* task never reached rpc_call_done */
+	if (!call->rc_accounted)
+		cohort_rpl_fanout_account(rf, -EIO);
+	nfs_put_client(call->rc_client);
+	call->rc_free(call);
+	cohort_rpl_fanout_put(rf);
+}
+
+static const struct rpc_call_ops cohort_rpl_call_ops = {
+	.rpc_call_prepare = cohort_rpl_call_prepare,
+	.rpc_call_done = cohort_rpl_call_done,
+	.rpc_release = cohort_rpl_call_release,
+};
+
+/*
+ * Launch call against replica ds_idx of lseg.  Ownership of call passes
+ * to the fan-out in all cases.
+ */
+static void
+cohort_rpl_fanout_start(struct cohort_rpl_fanout *rf,
+			struct pnfs_layout_segment *lseg, u32 ds_idx,
+			struct cohort_rpl_call *call)
+{
+	struct cohort_replication_layout_rmds *rmds;
+	struct rpc_task *task;
+	struct rpc_task_setup task_setup_data = {
+		.rpc_message = &call->rc_msg,
+		.callback_ops = &cohort_rpl_call_ops,
+		.callback_data = call,
+		.workqueue = nfsiod_workqueue,
+		.flags = RPC_TASK_ASYNC,
+	};
+
+	rmds = cohort_rpl_prepare_ds(lseg, ds_idx);
+	if (!rmds) {
+		dprintk("%s couldnt instantiate replica rmds[%u]\n", __func__,
+			ds_idx);
+		call->rc_free(call);
+		cohort_rpl_fanout_account(rf, NFS4ERR_STALE);
+		return;
+	}
+	dprintk("%s rmds[%u] %p ds_session %p\n", __func__, ds_idx, rmds,
+		rmds->ds_client->cl_session);
+
+	call->rc_fanout = rf;
+	atomic_inc(&rf->rf_count);
+	call->rc_client = rmds->ds_client;
+	atomic_inc(&call->rc_client->cl_count);
+
+	task_setup_data.rpc_client = call->rc_client->cl_rpcclient;
+	task = rpc_run_task(&task_setup_data);
+	if (!IS_ERR(task))
+		rpc_put_task(task);
+}
+
+/*
+ * Mirror one operation to every replica in lseg, using alloc_call to
+ * build a private copy of the compound for each, and wait for quorum
+ * (or, if sync, for every replica; d_ino may then be NULL).
+ */
+static int
+cohort_rpl_fanout(struct inode *d_ino, struct pnfs_layout_segment *lseg,
+		  struct cohort_rpl_call *(*alloc_call)(void *), void *arg,
+		  int sync)
+{
+	struct cohort_replication_layout_rmds_addr *dsaddr;
+	struct cohort_rpl_fanout *rf;
+	struct cohort_rpl_call *call;
+	int status;
+	u32 i;
+
+	if (!lseg)
+		return NFS4ERR_STALE;
+	dsaddr = COHORT_RPL_LSEG(lseg)->dsaddr;
+	if (dsaddr->ds_num < 2)
+		return 0;
+
+	rf = cohort_rpl_fanout_alloc(d_ino, dsaddr->ds_num - 1, sync);
+	if (!rf)
+		return -ENOMEM;
+	for (i = 1; i < dsaddr->ds_num; i++) {
+		call = alloc_call(arg);
+		if (!call) {
+			cohort_rpl_fanout_account(rf, -ENOMEM);
+			continue;
+		}
+		cohort_rpl_fanout_start(rf, lseg, i, call);
+	}
+	status = cohort_rpl_fanout_wait(rf);
+	cohort_rpl_fanout_put(rf);
+	return status;
+}
+
+/*
+ * Replica log
+ *
+ * CREATE (other than symlinks, whose target lives in page data) and
+ * REMOVE carry no client state, so rather than being mirrored one by one
+ * they are appended to a per-lseg log.  The log is shipped to each replica
+ * as multi-op compounds once cohort_rpl_log_ops records or
+ * cohort_rpl_log_bytes of encoded ops accumulate, or cohort_rpl_log_delay_ms
+ * after the first unflushed record.  LAYOUTCOMMIT reports the sequence
+ * number of the last record acked by quorum.
+ */
+static unsigned int cohort_rpl_log_ops = 16;
+module_param(cohort_rpl_log_ops, uint, 0644);
+MODULE_PARM_DESC(cohort_rpl_log_ops, "Replica log records held before a "
+		 "flush (0 disables the log)");
+
+static unsigned int cohort_rpl_log_bytes = 4096;
+module_param(cohort_rpl_log_bytes, uint, 0644);
+MODULE_PARM_DESC(cohort_rpl_log_bytes, "Encoded replica log bytes held "
+		 "before a flush");
+
+static unsigned int cohort_rpl_log_delay_ms = 10;
+module_param(cohort_rpl_log_delay_ms, uint, 0644);
+MODULE_PARM_DESC(cohort_rpl_log_delay_ms, "Longest a replica log record "
+		 "is held before a flush");
+
+/* One compound's worth of records, shared by the per-replica calls */
+struct cohort_rpl_log_batch {
+	struct kref		lb_kref;
+	struct list_head	lb_recs;
+	u32			lb_nrecs;
+	struct nfs_server	*lb_server;
+};
+
+struct cohort_rpl_log_call {
+	struct cohort_rpl_call		lc_call;
+	struct cohort_rpl_log_batch	*lc_batch;
+	struct cohort_rpl_log_args	lc_arg;
+	struct cohort_rpl_log_res	lc_res;
+};
+
+static inline int
+cohort_rpl_log_enabled(void)
+{
+	return cohort_rpl_log_ops != 0;
+}
+
+static void
+cohort_rpl_log_free_recs(struct list_head *recs)
+{
+	struct cohort_rpl_log_rec *rec, *tmp;
+
+	list_for_each_entry_safe(rec, tmp, recs, lr_list) {
+		list_del(&rec->lr_list);
+		kfree(rec);
+	}
+}
+
+static void
+cohort_rpl_log_batch_free(struct kref *kref)
+{
+	struct cohort_rpl_log_batch *batch =
+		container_of(kref, struct cohort_rpl_log_batch, lb_kref);
+
+	cohort_rpl_log_free_recs(&batch->lb_recs);
+	kfree(batch);
+}
+
+static void
+cohort_rpl_free_log_call(struct cohort_rpl_call *call)
+{
+	struct cohort_rpl_log_call *lc =
+		container_of(call, struct cohort_rpl_log_call, lc_call);
+
+	kref_put(&lc->lc_batch->lb_kref, cohort_rpl_log_batch_free);
+	kfree(lc);
+}
+
+static struct cohort_rpl_call *
+cohort_rpl_alloc_log_call(void *arg)
+{
+	struct cohort_rpl_log_batch *batch = arg;
+	struct cohort_rpl_log_call *lc;
+
+	lc = kzalloc(sizeof(*lc), GFP_KERNEL);
+	if (!lc)
+		return NULL;
+
+	kref_get(&batch->lb_kref);
+	lc->lc_batch = batch;
+	lc->lc_arg.recs = &batch->lb_recs;
+	lc->lc_res.recs = &batch->lb_recs;
+
+	lc->lc_call.rc_server = batch->lb_server;
+	lc->lc_call.rc_msg.rpc_proc =
+		&nfs4_procedures[NFSPROC4_CLNT_COHORT_RPL_LOG];
+	lc->lc_call.rc_msg.rpc_argp = &lc->lc_arg;
+	lc->lc_call.rc_msg.rpc_resp = &lc->lc_res;
+	lc->lc_call.rc_seq_args = &lc->lc_arg.seq_args;
+	lc->lc_call.rc_seq_res = &lc->lc_res.seq_res;
+	lc->lc_call.rc_free = cohort_rpl_free_log_call;
+	return &lc->lc_call;
+}
+
+/* Bound on what encode_attrs() emits for iap, as it reckons it */
+static unsigned int
+cohort_rpl_log_attrs_bytes(const struct iattr *iap, const struct nfs_fh *fh)
+{
+	unsigned int len = 16;
+
+	if (iap->ia_valid & ATTR_SIZE)
+		len += 8;
+	if (iap->ia_valid & ATTR_MODE)
+		len += 4;
+	if (iap->ia_valid & ATTR_UID)
+		len += 4 + IDMAP_NAMESZ;
+	if (iap->ia_valid & ATTR_GID)
+		len += 4 + IDMAP_NAMESZ;
+	if (iap->ia_valid & (ATTR_ATIME_SET | ATTR_ATIME))
+		len += 16;
+	if (iap->ia_valid & (ATTR_MTIME_SET | ATTR_MTIME))
+		len += 16;
+	if (fh)
+		len += 4 + fh->size;
+	return len;
+}
+
+static struct cohort_rpl_log_rec *
+cohort_rpl_log_alloc_rec(u32 op, const struct nfs_fh *dir_fh,
+			 const struct qstr *name)
+{
+	struct cohort_rpl_log_rec *rec;
+
+	rec = kzalloc(sizeof(*rec) + name->len + 1, GFP_KERNEL);
+	if (!rec)
+		return NULL;
+
+	INIT_LIST_HEAD(&rec->lr_list);
+	rec->lr_op = op;
+	rec->lr_dir_fh = *dir_fh;
+	memcpy(rec->lr_namebuf, name->name, name->len);
+	rec->lr_name.name = rec->lr_namebuf;
+	rec->lr_name.len = name->len;
+	rec->lr_name.hash = name->hash;
+	/* PUTFH, then the op and its component name */
+	rec->lr_bytes = 8 + dir_fh->size + 8 + (XDR_QUADLEN(name->len) << 2);
+	return rec;
+}
+
+static struct cohort_rpl_log_rec *
+cohort_rpl_log_create_rec(struct nfs4_createdata *data)
+{
+	struct cohort_rpl_log_rec *rec;
+
+	rec = cohort_rpl_log_alloc_rec(OP_CREATE, data->arg.dir_fh,
+				       data->arg.name);
+	if (!rec)
+		return NULL;
+
+	rec->lr_attrs = *data->arg.attrs;
+	rec->lr_crt_fh = *data->res.fh;
+	rec->lr_create.ftype = data->arg.ftype;
+	rec->lr_create.u = data->arg.u;
+	rec->lr_create.name = &rec->lr_name;
+	rec->lr_create.server = data->arg.server;
+	rec->lr_create.attrs = &rec->lr_attrs;
+	rec->lr_create.dir_fh = &rec->lr_dir_fh;
+	rec->lr_create.crt_fh = &rec->lr_crt_fh;
+	rec->lr_create.bitmask = data->arg.bitmask;
+	/* objtype and device specdata */
+	rec->lr_bytes += 8 + cohort_rpl_log_attrs_bytes(&rec->lr_attrs,
+							&rec->lr_crt_fh);
+	return rec;
+}
+
+/*
+ * Largest number of ops (less SEQUENCE) every replica session will
+ * accept in one compound.
+ */
+static u32
+cohort_rpl_log_max_ops(struct pnfs_layout_segment *lseg)
+{
+	struct cohort_replication_layout_rmds_addr *dsaddr;
+	struct cohort_replication_layout_rmds *rmds;
+	struct nfs4_session *session;
+	u32 i, max_ops = COHORT_RPL_LOG_MAXOPS;
+
+	dsaddr = COHORT_RPL_LSEG(lseg)->dsaddr;
+	for (i = 1; i < dsaddr->ds_num; i++) {
+		rmds = cohort_rpl_prepare_ds(lseg, i);
+		if (!rmds)
+			continue;
+		session = rmds->ds_client->cl_session;
+		if (session && session->fc_attrs.max_ops - 1 < max_ops)
+			max_ops = session->fc_attrs.max_ops - 1;
+	}
+	/* always room for PUTFH plus one op */
+	return max_t(u32, max_ops, 2);
+}
+
+/*
+ * Ship every logged record to the replicas, in compounds no larger than
+ * the replica sessions allow.  Batches leave in sequence order.  A batch
+ * the replicas may have applied only in part cannot be resent, so after
+ * a failure the log is failed for good: the rest is discarded, further
+ * records are refused, and no new layout of this iomode is fetched.
+ */
+static int
+cohort_rpl_log_flush(struct pnfs_layout_segment *lseg, struct inode *d_ino,
+		     int sync)
+{
+	struct cohort_rpl_log *log = &COHORT_RPL_LSEG(lseg)->log;
+	struct cohort_rpl_log_batch *batch;
+	struct cohort_rpl_log_rec *rec, *prev;
+	LIST_HEAD(recs);
+	u32 max_ops, nops, ops, bytes;
+	int committed = 0, status = 0;
+	u64 last;
+
+	mutex_lock(&log->rl_flush_mutex);
+	spin_lock(&log->rl_lock);
+	list_splice_init(&log->rl_recs, &recs);
+	log->rl_count = 0;
+	log->rl_bytes = 0;
+	status = log->rl_error;
+	spin_unlock(&log->rl_lock);
+	if (status) {
+		cohort_rpl_log_free_recs(&recs);
+		goto out_unlock;
+	}
+	if (list_empty(&recs))
+		goto out_unlock;
+
+	max_ops = cohort_rpl_log_max_ops(lseg);
+	while (!list_empty(&recs)) {
+		batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+		if (!batch) {
+			status = -ENOMEM;
+			break;
+		}
+		kref_init(&batch->lb_kref);
+		INIT_LIST_HEAD(&batch->lb_recs);
+		batch->lb_server = NFS_SERVER(lseg->layout->inode);
+
+		nops = bytes = 0;
+		prev = NULL;
+		while (!list_empty(&recs)) {
+			rec = list_first_entry(&recs, struct cohort_rpl_log_rec,
+					       lr_list);
+			/* REMOVE leaves the directory as the current fh */
+			rec->lr_putfh = !(prev && prev->lr_op == OP_REMOVE &&
+					  !nfs_compare_fh(&prev->lr_dir_fh,
+							  &rec->lr_dir_fh));
+			ops = rec->lr_putfh ? 2 : 1;
+			if (prev && (nops + ops > max_ops ||
+				     bytes + rec->lr_bytes >
+				     COHORT_RPL_LOG_MAXBYTES))
+				break;
+			list_move_tail(&rec->lr_list, &batch->lb_recs);
+			batch->lb_nrecs++;
+			nops += ops;
+			bytes += rec->lr_bytes;
+			prev = rec;
+		}
+		last = prev->lr_seq;
+
+		dprintk("%s lseg %p batch %u recs %u ops through seq %llu\n",
+			__func__, lseg, batch->lb_nrecs, nops, last);
+		status = cohort_rpl_fanout(d_ino, lseg,
+					   cohort_rpl_alloc_log_call, batch,
+					   sync);
+		kref_put(&batch->lb_kref, cohort_rpl_log_batch_free);
+		if (status)
+			break;
+
+		spin_lock(&log->rl_lock);
+		log->rl_committed = last;
+		spin_unlock(&log->rl_lock);
+		committed = 1;
+	}
+
+	if (status) {
+		printk(KERN_WARNING "%s: replica log flush failed (%d), "
+		       "replicas behind at seq %llu, failing layout\n",
+		       __func__, status,
+		       (unsigned long long)log->rl_committed);
+		spin_lock(&log->rl_lock);
+		log->rl_error = status;
+		list_splice_init(&log->rl_recs, &recs);
+		log->rl_count = 0;
+		log->rl_bytes = 0;
+		spin_unlock(&log->rl_lock);
+		cohort_rpl_log_free_recs(&recs);
+		set_bit(lo_fail_bit(lseg->range.iomode),
+			&lseg->layout->plh_flags);
+	}
+	if (committed)
+		pnfs_need_layoutcommit(NFS_I(lseg->layout->inode), NULL);
+out_unlock:
+	mutex_unlock(&log->rl_flush_mutex);
+	return status;
+}
+
+/*
+ * The queued flush holds a reference on the lseg, its inode and the
+ * super block, so the log never outlives them and free_lseg, which may
+ * run from rpciod, has nothing left to send.  The last put of the lseg
+ * can happen here, which frees the work item itself.
+ */
+static void
+cohort_rpl_log_work(struct work_struct *work)
+{
+	struct cohort_rpl_log *log =
+		container_of(work, struct cohort_rpl_log, rl_work.work);
+	struct cohort_replication_layout_segment *rpl =
+		container_of(log, struct cohort_replication_layout_segment,
+			     log);
+	struct pnfs_layout_segment *lseg = &rpl->generic_hdr;
+	struct inode *ino = lseg->layout->inode;
+	struct super_block *sb = ino->i_sb;
+
+	cohort_rpl_log_flush(lseg, NULL, 1);
+	put_lseg(lseg);
+	iput(ino);
+	nfs_sb_deactive(sb);
+}
+
+/* Flush lseg's log after cohort_rpl_log_delay_ms, unless already queued */
+static void
+cohort_rpl_log_schedule(struct pnfs_layout_segment *lseg)
+{
+	struct cohort_rpl_log *log = &COHORT_RPL_LSEG(lseg)->log;
+	struct inode *ino = igrab(lseg->layout->inode);
+
+	if (!ino) {
+		/* inode on its way out: don't leave the log behind */
+		cohort_rpl_log_flush(lseg, NULL, 1);
+		return;
+	}
+	get_lseg(lseg);
+	nfs_sb_active(ino->i_sb);
+	if (!schedule_delayed_work(&log->rl_work,
+				   msecs_to_jiffies(cohort_rpl_log_delay_ms))) {
+		/* already queued; none of these are the last reference */
+		nfs_sb_deactive(ino->i_sb);
+		put_lseg(lseg);
+		iput(ino);
+	}
+}
+
+static void
+cohort_rpl_log_init(struct cohort_rpl_log *log)
+{
+	spin_lock_init(&log->rl_lock);
+	INIT_LIST_HEAD(&log->rl_recs);
+	mutex_init(&log->rl_flush_mutex);
+	INIT_DELAYED_WORK(&log->rl_work, cohort_rpl_log_work);
+}
+
+/*
+ * Queue rec on lseg's log, flushing at once if that crosses a
+ * threshold.  Ownership of rec passes to the log.
+ */
+static int
+cohort_rpl_log_submit(struct pnfs_layout_segment *lseg, struct inode *d_ino,
+		      struct cohort_rpl_log_rec *rec)
+{
+	struct cohort_rpl_log *log = &COHORT_RPL_LSEG(lseg)->log;
+	int full;
+
+	if (!rec)
+		return -ENOMEM;
+	if (COHORT_RPL_LSEG(lseg)->dsaddr->ds_num < 2) {
+		kfree(rec);
+		return 0;
+	}
+
+	spin_lock(&log->rl_lock);
+	if (log->rl_error) {
+		int status = log->rl_error;
+
+		spin_unlock(&log->rl_lock);
+		kfree(rec);
+		return status;
+	}
+	rec->lr_seq = ++log->rl_seq;
+	list_add_tail(&rec->lr_list, &log->rl_recs);
+	log->rl_count++;
+	log->rl_bytes += rec->lr_bytes;
+	full = log->rl_count >= min_t(u32, cohort_rpl_log_ops,
+				      COHORT_RPL_LOG_MAXOPS) ||
+	       log->rl_bytes >= min_t(u32, cohort_rpl_log_bytes,
+				      COHORT_RPL_LOG_MAXBYTES);
+	spin_unlock(&log->rl_lock);
+
+	if (full)
+		return cohort_rpl_log_flush(lseg, d_ino, 0);
+	cohort_rpl_log_schedule(lseg);
+	return 0;
+}
+
+/* CREATE mirror */
+
+struct cohort_rpl_create_call {
+	struct cohort_rpl_call	cr_call;
+	struct nfs4_create_arg	cr_arg;
+	struct nfs4_create_res	cr_res;
+	struct qstr		cr_name;
+	struct iattr		cr_attrs;
+	struct nfs_fh		cr_dir_fh;
+	struct nfs_fh		cr_crt_fh;
+	struct nfs_fh		cr_fh;
+	struct nfs_fattr	cr_fattr;
+	struct nfs_fattr	cr_dir_fattr;
+	struct page		*cr_page;
+	unsigned char		cr_namebuf[0];
+};
+
+static void
+cohort_rpl_free_create_call(struct cohort_rpl_call *call)
+{
+	struct cohort_rpl_create_call *cr =
+		container_of(call, struct cohort_rpl_create_call, cr_call);
+
+	if (cr->cr_page)
+		put_page(cr->cr_page);
+	kfree(cr);
+}
+
+/*
+ * Copy everything the CREATE encoder and decoder touch, since the
+ * primary's nfs4_createdata is freed once the quorum is reached.  The
+ * replica is asked to create the object under the primary's new fh.
+ */
+static struct cohort_rpl_call *
+cohort_rpl_alloc_create_call(void *arg)
 {
-    data->arg.crt_fh = data->res.fh;
+	struct nfs4_createdata *data = arg;
+	struct cohort_rpl_create_call *cr;
+
+	cr = kzalloc(sizeof(*cr) + data->arg.name->len + 1, GFP_KERNEL);
+	if (!cr)
+		return NULL;
+
+	memcpy(cr->cr_namebuf, data->arg.name->name, data->arg.name->len);
+	cr->cr_name.name = cr->cr_namebuf;
+	cr->cr_name.len = data->arg.name->len;
+	cr->cr_name.hash = data->arg.name->hash;
+	cr->cr_attrs = *data->arg.attrs;
+	cr->cr_dir_fh = *data->arg.dir_fh;
+	cr->cr_crt_fh = *data->res.fh;
+
+	cr->cr_arg.ftype = data->arg.ftype;
+	cr->cr_arg.u = data->arg.u;
+	if (cr->cr_arg.ftype == NF4LNK) {
+		/* symlink targets live in a single page */
+		cr->cr_page = data->arg.u.symlink.pages[0];
+		get_page(cr->cr_page);
+		cr->cr_arg.u.symlink.pages = &cr->cr_page;
+	}
+	cr->cr_arg.name = &cr->cr_name;
+	cr->cr_arg.server = data->arg.server;
+	cr->cr_arg.attrs = &cr->cr_attrs;
+	cr->cr_arg.dir_fh = &cr->cr_dir_fh;
+	cr->cr_arg.crt_fh = &cr->cr_crt_fh;
+	cr->cr_arg.bitmask = data->arg.bitmask;
+
+	cr->cr_res.server = data->res.server;
+	cr->cr_res.fh = &cr->cr_fh;
+	cr->cr_res.fattr = &cr->cr_fattr;
+	cr->cr_res.dir_fattr = &cr->cr_dir_fattr;
+	nfs_fattr_init(cr->cr_res.fattr);
+	nfs_fattr_init(cr->cr_res.dir_fattr);
+
+	cr->cr_call.rc_server = (struct nfs_server *)data->arg.server;
+	cr->cr_call.rc_msg.rpc_proc = data->msg.rpc_proc;
+	cr->cr_call.rc_msg.rpc_argp = &cr->cr_arg;
+	cr->cr_call.rc_msg.rpc_resp = &cr->cr_res;
+	cr->cr_call.rc_seq_args = &cr->cr_arg.seq_args;
+	cr->cr_call.rc_seq_res = &cr->cr_res.seq_res;
+	cr->cr_call.rc_free = cohort_rpl_free_create_call;
+	return &cr->cr_call;
 }
 
 static int
@@ -356,7 +1090,6 @@ cohort_rpl_create(struct nfs_server *server, struct inode *d_ino,
 {
     struct pnfs_layout_hdr *lo;
     struct pnfs_layout_segment *lseg;
-    struct cohort_replication_layout_rmds *rmds;
     struct inode *s_ino = server->s_ino;
 
     int code2, code = -EINVAL;
@@ -370,28 +1103,26 @@ cohort_rpl_create(struct nfs_server *server, struct inode *d_ino,
     dprintk("%s found replication layout (%p, %p)\n", __func__,
             lo, lseg);
 
-    /* XXX Finish */
     dprintk_fh(__func__, "dir_fh", data->arg.dir_fh);
     dprintk_fh(__func__, "fh", data->res.fh);
 
-    /* Ok, for now, we know 1 is the the fixed ds offset of the replica MDS
-     * (0 is offset of the primary MDS). */
-    rmds = cohort_rpl_prepare_ds(lseg, 1);
-    if (!rmds) {
-        dprintk("%s couldnt instantiate replica rmds\n", __func__);
+    if (!lseg) {
         code = NFS4ERR_STALE;
         goto out_postamble;
     }
-    dprintk("%s rmds[1] %p ds_session %p\n", __func__, rmds,
-        rmds->ds_client->cl_session);
 
-    /* Update call for mirror at DS (e.g., set FH) */
-    cohort_rpl_updatedata_create(data);
+    if (cohort_rpl_log_enabled() && data->arg.ftype != NF4LNK) {
+        code = cohort_rpl_log_submit(lseg, d_ino,
+                                     cohort_rpl_log_create_rec(data));
+        goto out_postamble;
+    }
 
-    /* Session-aware call_sync wrapper */
-    code = nfs41_call_sync(server, rmds->ds_client, &data->msg,
-                           &data->arg.seq_args, &data->res.seq_res,
-                           1 /* cache reply */);
+    /* keep the replicas in primary order */
+    code = cohort_rpl_log_flush(lseg, d_ino, 0);
+    if (code)
+        goto out_postamble;
+    code = cohort_rpl_fanout(d_ino, lseg, cohort_rpl_alloc_create_call, data,
+                             0);
 #if 1 /* XXX Disabled pending working server! */
     if (!code)
         pnfs_need_layoutcommit(NFS_I(s_ino), NULL);
@@ -404,6 +1135,60 @@ out_postamble:
     return (code);
 }
 
+/* REMOVE mirror */
+
+struct cohort_rpl_remove_call {
+	struct cohort_rpl_call	rm_call;
+	struct nfs_removeargs	rm_arg;
+	struct nfs_removeres	rm_res;
+	struct nfs_fh		rm_fh;
+	struct nfs_fattr	rm_dir_attr;
+	unsigned char		rm_namebuf[0];
+};
+
+static void
+cohort_rpl_free_remove_call(struct cohort_rpl_call *call)
+{
+	kfree(container_of(call, struct cohort_rpl_remove_call, rm_call));
+}
+
+struct cohort_rpl_remove_ctx {
+	struct rpc_message	*msg;
+	struct nfs_removeargs	*arg;
+	struct nfs_removeres	*res;
+};
+
+static struct cohort_rpl_call *
+cohort_rpl_alloc_remove_call(void *arg)
+{
+	struct cohort_rpl_remove_ctx *ctx = arg;
+	struct cohort_rpl_remove_call *rm;
+
+	rm = kzalloc(sizeof(*rm) + ctx->arg->name.len + 1, GFP_KERNEL);
+	if (!rm)
+		return NULL;
+
+	memcpy(rm->rm_namebuf, ctx->arg->name.name, ctx->arg->name.len);
+	rm->rm_fh = *ctx->arg->fh;
+	rm->rm_arg.fh = &rm->rm_fh;
+	rm->rm_arg.name = ctx->arg->name;
+	rm->rm_arg.name.name = rm->rm_namebuf;
+	rm->rm_arg.bitmask = ctx->arg->bitmask;
+
+	rm->rm_res.server = ctx->res->server;
+	rm->rm_res.dir_attr = &rm->rm_dir_attr;
+	nfs_fattr_init(rm->rm_res.dir_attr);
+
+	rm->rm_call.rc_server = (struct nfs_server *)ctx->res->server;
+	rm->rm_call.rc_msg = *ctx->msg;
+	rm->rm_call.rc_msg.rpc_argp = &rm->rm_arg;
+	rm->rm_call.rc_msg.rpc_resp = &rm->rm_res;
+	rm->rm_call.rc_seq_args = &rm->rm_arg.seq_args;
+	rm->rm_call.rc_seq_res = &rm->rm_res.seq_res;
+	rm->rm_call.rc_free = cohort_rpl_free_remove_call;
+	return &rm->rm_call;
+}
+
 static int
 cohort_rpl_remove(struct nfs_server *server, struct inode *d_ino,
                   struct rpc_message *msg, struct nfs_removeargs *arg,
@@ -411,8 +1196,12 @@ cohort_rpl_remove(struct nfs_server *server, struct inode *d_ino,
 {
     struct pnfs_layout_hdr *lo;
     struct pnfs_layout_segment *lseg;
-    struct cohort_replication_layout_rmds *rmds;
     struct inode *s_ino = server->s_ino;
+    struct cohort_rpl_remove_ctx ctx = {
+        .msg = msg,
+        .arg = arg,
+        .res = res,
+    };
 
     int code2, code = -EINVAL;
 
@@ -424,21 +1213,16 @@ cohort_rpl_remove(struct nfs_server *server, struct inode *d_ino,
     dprintk("%s found replication layout (%p, %p)\n", __func__,
             lo, lseg);
 
-    /* Ok, for now, we know 1 is the the fixed ds offset of the replica MDS
-     * (0 is offset of the primary MDS). */
-    rmds = cohort_rpl_prepare_ds(lseg, 1);
-    if (!rmds) {
-        dprintk("%s couldnt instantiate replica rmds\n", __func__);
-        code = NFS4ERR_STALE;
+    if (lseg && cohort_rpl_log_enabled()) {
+        code = cohort_rpl_log_submit(lseg, d_ino,
+                                     cohort_rpl_log_alloc_rec(OP_REMOVE,
+                                                              arg->fh,
+                                                              &arg->name));
         goto out_postamble;
     }
-    dprintk("%s rmds[1] %p ds_session %p\n", __func__, rmds,
-        rmds->ds_client->cl_session);
 
-    /* Session-aware call_sync wrapper */
-    code = nfs41_call_sync(server, rmds->ds_client, msg, &arg->seq_args,
-                           &res->seq_res,
-                           1 /* cache reply */);
+    code = cohort_rpl_fanout(d_ino, lseg, cohort_rpl_alloc_remove_call, &ctx,
+                             0);
 #if 1 /* XXX Disabled pending working server! */
     if (!code)
         pnfs_need_layoutcommit(NFS_I(s_ino), NULL);
@@ -451,12 +1235,69 @@ out_postamble:
     return (code);
 }
 
+/* OPEN (create) mirror */
+
+struct cohort_rpl_open_call {
+	struct cohort_rpl_call	op_call;
+	struct nfs4_opendata	*op_data;
+	struct nfs_openargs	op_arg;
+	struct nfs_openres	op_res;
+	struct nfs_fattr	op_f_attr;
+	struct nfs_fattr	op_dir_attr;
+};
+
+static void
+cohort_rpl_free_open_call(struct cohort_rpl_call *call)
+{
+	struct cohort_rpl_open_call *op =
+		container_of(call, struct cohort_rpl_open_call, op_call);
+
+	nfs4_opendata_put(op->op_data);
+	kfree(op);
+}
+
+/*
+ * The OPEN arguments point into the opendata (name, attrs, seqid), so
+ * each mirror holds an opendata reference rather than deep copying.
+ */
+static struct cohort_rpl_call *
+cohort_rpl_alloc_open_call(void *arg)
+{
+	struct nfs4_opendata *data = arg;
+	struct cohort_rpl_open_call *op;
+
+	op = kzalloc(sizeof(*op), GFP_KERNEL);
+	if (!op)
+		return NULL;
+
+	kref_get(&data->kref);
+	op->op_data = data;
+	op->op_arg = data->o_arg;
+	memset(&op->op_arg.seq_args, 0, sizeof(op->op_arg.seq_args));
+
+	op->op_res.f_attr = &op->op_f_attr;
+	op->op_res.dir_attr = &op->op_dir_attr;
+	op->op_res.seqid = data->o_arg.seqid;
+	op->op_res.server = data->o_arg.server;
+	nfs_fattr_init(op->op_res.f_attr);
+	nfs_fattr_init(op->op_res.dir_attr);
+
+	op->op_call.rc_server = (struct nfs_server *)data->o_arg.server;
+	op->op_call.rc_msg.rpc_proc = &nfs4_procedures[NFSPROC4_CLNT_OPEN];
+	op->op_call.rc_msg.rpc_argp = &op->op_arg;
+	op->op_call.rc_msg.rpc_resp = &op->op_res;
+	op->op_call.rc_msg.rpc_cred = data->owner->so_cred;
+	op->op_call.rc_seq_args = &op->op_arg.seq_args;
+	op->op_call.rc_seq_res = &op->op_res.seq_res;
+	op->op_call.rc_free = cohort_rpl_free_open_call;
+	return &op->op_call;
+}
+
 int cohort_rpl_open(struct nfs_server *server, struct inode *d_ino,
                     struct nfs4_opendata *data)
 {
     struct pnfs_layout_hdr *lo;
     struct pnfs_layout_segment *lseg;
-    struct cohort_replication_layout_rmds *rmds;
     struct inode *s_ino = server->s_ino;
     int code2, code = -EINVAL;
 
@@ -475,26 +1316,15 @@ int cohort_rpl_open(struct nfs_server *server, struct inode *d_ino,
     dprintk("%s found replication layout (%p, %p)\n", __func__,
             lo, lseg);
 
-    /* Ok, for now, we know 1 is the the fixed ds offset of the replica MDS
-     * (0 is offset of the primary MDS). */
-    rmds = cohort_rpl_prepare_ds(lseg, 1);
-    if (!rmds) {
-        dprintk("%s couldnt instantiate replica rmds\n", __func__);
-        code = NFS4ERR_STALE;
-        goto out_postamble;
+    /* XXX OPENs replicated in this way would need to be closed.  Rather
+     * than hook ordinary close, I propose to create a special open
+     * compound which contains a close of the just-opened fh (later).  */
+    if (lseg) {
+        code = cohort_rpl_log_flush(lseg, d_ino, 0);
+        if (code)
+            goto out_postamble;
     }
-    dprintk("%s rmds[1] %p ds_session %p\n", __func__, rmds,
-        rmds->ds_client->cl_session);
-
-    /* XXX Update existing opendata for execution on the replicas.  This
-     * is a temporary mechanism, since OPENs replicated in this way
-     * would need to be closed.  Rather than hook ordinary close, I 
-     * propose to create a special open compound which contains a close
-     * of the just-opened fh (later).  */
-    data->ch_flags = COHORT_OPEN_FLAG_REPLICA;
-    data->o_arg.seq_args.sa_session = rmds->ds_client->cl_session;
-    data->ch_client = rmds->ds_client->cl_rpcclient;
-    code = _nfs4_proc_open(data);
+    code = cohort_rpl_fanout(d_ino, lseg, cohort_rpl_alloc_open_call, data, 0);
 
 #if 1 /* XXX Disabled pending working server! */
     if (!code)
@@ -519,6 +1349,13 @@ cohort_rpl_setup_layoutcommit(struct pnfs_layout_hdr *lo,
     struct nfs_server *nfss = NFS_SERVER(lo->inode);
 #endif
     struct cohort_replication_layoutupdate4 *lou_data;
+    struct pnfs_layout_segment *lseg;
+    struct cohort_rpl_log *log;
+    struct pnfs_layout_range range = {
+        .iomode = IOMODE_RW,
+        .offset = 0ULL,
+        .length = NFS4_MAX_UINT64,
+    };
 
     dprintk("%s enter\n", __func__);
 
@@ -535,6 +1372,20 @@ cohort_rpl_setup_layoutcommit(struct pnfs_layout_hdr *lo,
     lou_data->len = 0; /* XXX no ops to remind us to Finish */
     lou_data->si_list = NULL;
 
+    /* report how far the replica log has been acked */
+    lou_data->seq = 0;
+    spin_lock(&lo->inode->i_lock);
+    lseg = pnfs_find_lseg(lo, &range);
+    if (lseg) {
+        log = &COHORT_RPL_LSEG(lseg)->log;
+        spin_lock(&log->rl_lock);
+        lou_data->seq = log->rl_committed;
+        spin_unlock(&log->rl_lock);
+    }
+    spin_unlock(&lo->inode->i_lock);
+    /* pnfs_find_lseg referenced it */
+    put_lseg(lseg);
+
     args->layoutdriver_data = lou_data;
         
     return (0);
@@ -546,11 +1397,24 @@ cohort_rpl_encode_layoutcommit(struct pnfs_layout_hdr *lo,
                                struct xdr_stream *xdr,
                                const struct nfs4_layoutcommit_args *args)
 {
-    dprintk("--> %s\n", __func__);
-
-    /* XXX Finish! */
-
-    return;
+    const struct cohort_replication_layoutupdate4 *lou_data =
+        args->layoutdriver_data;
+    __be32 *start, *p;
+    int i;
+
+    dprintk("--> %s seq %llu\n", __func__, lou_data->seq);
+
+    start = xdr_reserve_space(xdr, 4);
+    p = xdr_reserve_space(xdr, 12);
+    p = xdr_encode_hyper(p, lou_data->seq);
+    *p = cpu_to_be32(lou_data->len);
+    for (i = 0; i < lou_data->len; i++) {
+        p = xdr_reserve_space(xdr, 4 +
+                              (XDR_QUADLEN(lou_data->si_list[i]->len) << 2));
+        xdr_encode_opaque(p, lou_data->si_list[i]->data,
+                          lou_data->si_list[i]->len);
+    }
+    *start = cpu_to_be32((xdr->p - start - 1) * 4);
 }
 
 static void
@@ -15,11 +15,8 @@
 #include "../pnfs.h"
 
 struct cohort_replication_layout_rmds {
-	struct list_head	ds_node;  /* nfs4_pnfs_dev_hlist dev_dslist */
-	u32			ds_ip_addr;
-	u32			ds_port;
+	struct pnfs_ds_node	ds_node;
 	struct nfs_client	*ds_client;
-	atomic_t		ds_count;
 };
 
 struct cohort_replication_layout_rmds_addr {
@@ -28,10 +25,24 @@ struct cohort_replication_layout_rmds_addr {
 	struct cohort_replication_layout_rmds	*ds_list[1];
 };
 
+/* Namespace ops awaiting a batched flush to the replicas */
+struct cohort_rpl_log {
+	spinlock_t		rl_lock;
+	struct list_head	rl_recs;	/* cohort_rpl_log_rec */
+	u32			rl_count;
+	u32			rl_bytes;
+	u64			rl_seq;		/* last sequence appended */
+	u64			rl_committed;	/* last sequence quorum-acked */
+	int			rl_error;	/* sticky, set by a failed flush */
+	struct mutex		rl_flush_mutex;	/* batches leave in order */
+	struct delayed_work	rl_work;
+};
+
 struct cohort_replication_layout_segment {
 	struct pnfs_layout_segment generic_hdr;
 	struct cohort_replication_layout_rmds_addr *dsaddr;
 	struct nfs_fh fh; /* unused, temporary */
+	struct cohort_rpl_log log;
 };
 
 static inline struct cohort_replication_layout_segment *
@@ -52,14 +52,13 @@
 /*
  * Data server cache
  *
- * Like data servers, Cohort rmdses can be mapped to different device ids.
+ * Like data servers, Cohort rmdses can be mapped to different device ids,
+ * and share the pnfs_ds_node cache under their own layout type.
  * reference is also counting as for nfs4_pnfs_ds
  *   - set to 1 on allocation
  *   - incremented when a device id maps a data server already in the cache.
  *   - decremented when deviceid is removed from the cache.
  */
-DEFINE_SPINLOCK(cohort_rmds_cache_lock);
-static LIST_HEAD(cohort_rmds_cache);
 
 /* Debug routines */
 void
@@ -69,12 +68,15 @@ print_rmds(struct cohort_replication_layout_rmds *rmds)
 		printk("%s NULL device\n", __func__);
 		return;
 	}
-	printk("        ip_addr %x port %hu\n"
+	printk("        remote %s\n"
 		"        ref count %d\n"
+		"        session %s (error %d)\n"
 		"        client %p\n"
 		"        cl_exchange_flags %x\n",
-		ntohl(rmds->ds_ip_addr), ntohs(rmds->ds_port),
-		atomic_read(&rmds->ds_count), rmds->ds_client,
+		rmds->ds_node.dn_remotestr,
+		atomic_read(&rmds->ds_node.dn_ref),
+		pnfs_ds_state_name(&rmds->ds_node), rmds->ds_node.dn_error,
+		rmds->ds_client,
 		rmds->ds_client ? rmds->ds_client->cl_exchange_flags : 0);
 }
 
@@ -99,54 +101,35 @@ void cohort_rpl_print_deviceid(struct nfs4_deviceid *id)
 		p[0], p[1], p[2], p[3]);
 }
 
-/* rmds_cache_lock is held */
-static struct cohort_replication_layout_rmds *
-_cohort_rmds_lookup_locked(u32 ip_addr, u32 port)
-{
-	struct cohort_replication_layout_rmds *ds;
-
-	dprintk("_rmds_lookup: ip_addr=%x port=%hu\n",
-			ntohl(ip_addr), ntohs(port));
-
-	list_for_each_entry(ds, &cohort_rmds_cache, ds_node) {
-		if (ds->ds_ip_addr == ip_addr &&
-		    ds->ds_port == port) {
-			return ds;
-		}
-	}
-	return NULL;
-}
-
-/* Create an rpc to the data server defined in 'dev_list' */
+/*
+ * Create an rpc to the data server defined in 'dev_list'.  Called through
+ * pnfs_ds_connect(), which serializes connects to the same replica.
+ */
 static int
-cohort_rpl_rmds_create(struct nfs_server *mds_srv,
-                       struct cohort_replication_layout_rmds *ds)
+cohort_rpl_rmds_create(struct nfs_server *mds_srv, struct pnfs_ds_node *node)
 {
+	struct cohort_replication_layout_rmds *ds =
+		container_of(node, struct cohort_replication_layout_rmds,
+			     ds_node);
 	struct nfs_server	*tmp;
-	struct sockaddr_in	sin;
+	struct sockaddr		*ds_addr = (struct sockaddr *)&ds->ds_node.dn_addr;
 	struct rpc_clnt		*mds_clnt = mds_srv->client;
 	struct nfs_client	*clp = mds_srv->nfs_client;
 	struct sockaddr		*mds_addr;
 	int err = 0;
 
-	dprintk("--> %s ip:port %x:%hu au_flavor %d\n", __func__,
-		ntohl(ds->ds_ip_addr), ntohs(ds->ds_port),
+	dprintk("--> %s %s au_flavor %d\n", __func__, ds->ds_node.dn_remotestr,
 		mds_clnt->cl_auth->au_flavor);
 
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = ds->ds_ip_addr;
-	sin.sin_port = ds->ds_port;
-
 	/*
 	 * If this DS is also the MDS, use the MDS session only if the
 	 * MDS exchangeid flags show the EXCHGID4_FLAG_USE_PNFS_DS pNFS role.
 	 */
 	mds_addr = (struct sockaddr *)&clp->cl_addr;
-	if (nfs_sockaddr_cmp((struct sockaddr *)&sin, mds_addr)) {
+	if (nfs_sockaddr_cmp(ds_addr, mds_addr)) {
 		if (!(clp->cl_exchange_flags & EXCHGID4_FLAG_USE_PNFS_DS)) {
-			printk(KERN_INFO
-			       "ip:port %x:%hu is not a pNFS Data Server\n",
-			       ntohl(ds->ds_ip_addr), ntohs(ds->ds_port));
+			printk(KERN_INFO "%s is not a pNFS Data Server\n",
+			       ds->ds_node.dn_remotestr);
 			err = -ENODEV;
 		} else {
 			atomic_inc(&clp->cl_count);
@@ -158,8 +141,10 @@ cohort_rpl_rmds_create(struct nfs_server *mds_srv,
 
 	/* Temporay server for nfs4_set_client */
 	tmp = kzalloc(sizeof(struct nfs_server), GFP_KERNEL);
-	if (!tmp)
+	if (!tmp) {
+		err = -ENOMEM;
 		goto out;
+	}
 
 	/*
 	 * Set a retrans, timeout interval, and authflavor equual to the MDS
@@ -168,8 +153,8 @@ cohort_rpl_rmds_create(struct nfs_server *mds_srv,
 	 */
 	err = nfs4_set_client(tmp,
 			      mds_srv->nfs_client->cl_hostname,
-			      (struct sockaddr *)&sin,
-			      sizeof(struct sockaddr),
+			      ds_addr,
+			      ds->ds_node.dn_addrlen,
 			      mds_srv->nfs_client->cl_ipaddr,
 			      mds_clnt->cl_auth->au_flavor,
 			      IPPROTO_TCP,
@@ -195,8 +180,8 @@ cohort_rpl_rmds_create(struct nfs_server *mds_srv,
          * since exhange_flags wasn't designed for 3rd party extensions.
          */
 	if (!(clp->cl_exchange_flags & EXCHGID4_FLAG_USE_PNFS_DS)) {
-		printk(KERN_INFO "ip:port %x:%hu is not a pNFS Data Server\n",
-		       ntohl(ds->ds_ip_addr), ntohs(ds->ds_port));
+		printk(KERN_INFO "%s is not a pNFS Data Server\n",
+		       ds->ds_node.dn_remotestr);
 		err = -ENODEV;
 		goto out_put;
 	}
@@ -212,9 +197,8 @@ cohort_rpl_rmds_create(struct nfs_server *mds_srv,
 	clear_bit(NFS4CLNT_SESSION_RESET, &clp->cl_state);
 	ds->ds_client = clp;
 
-	dprintk("%s: ip=%x, port=%hu, rpcclient %p\n", __func__,
-				ntohl(ds->ds_ip_addr), ntohs(ds->ds_port),
-				clp->cl_rpcclient);
+	dprintk("%s: %s rpcclient %p\n", __func__, ds->ds_node.dn_remotestr,
+		clp->cl_rpcclient);
 out_free:
 	kfree(tmp);
 out:
@@ -247,14 +231,8 @@ cohort_rpl_free_deviceid(struct cohort_replication_layout_rmds_addr *dsaddr)
 
 	for (i = 0; i < dsaddr->ds_num; i++) {
 		ds = dsaddr->ds_list[i];
-		if (ds != NULL) {
-			if (atomic_dec_and_lock(&ds->ds_count,
-						&cohort_rmds_cache_lock)) {
-				list_del_init(&ds->ds_node);
-				spin_unlock(&cohort_rmds_cache_lock);
-				destroy_ds(ds);
-			}
-		}
+		if (ds != NULL && pnfs_put_ds(&ds->ds_node))
+			destroy_ds(ds);
 	}
 	kfree(dsaddr);
 }
@@ -271,107 +249,50 @@ cohort_rpl_free_deviceid_callback(struct pnfs_deviceid_node *device)
 }
 
 static struct cohort_replication_layout_rmds *
-cohort_replication_layout_rmds_add(struct inode *inode, u32 ip_addr, u32 port)
+cohort_replication_layout_rmds_add(struct inode *inode, struct sockaddr *sap,
+                                   size_t salen)
 {
-	struct cohort_replication_layout_rmds *tmp_ds, *ds;
+	struct net *net = NFS_SERVER(inode)->client->cl_xprt->xprt_net;
+	struct cohort_replication_layout_rmds *ds;
+	struct pnfs_ds_node *node;
+
+	node = pnfs_find_get_ds(LAYOUT4_COHORT_REPLICATION, net, sap);
+	if (node)
+		return container_of(node, struct cohort_replication_layout_rmds,
+				    ds_node);
 
-	ds = kzalloc(sizeof(*tmp_ds), GFP_KERNEL);
+	ds = kzalloc(sizeof(*ds), GFP_KERNEL);
 	if (!ds)
-		goto out;
+		return NULL;
+	pnfs_init_ds_node(&ds->ds_node, LAYOUT4_COHORT_REPLICATION, net, sap,
+			  salen);
 
-	spin_lock(&cohort_rmds_cache_lock);
-	tmp_ds = _cohort_rmds_lookup_locked(ip_addr, port);
-	if (tmp_ds == NULL) {
-		ds->ds_ip_addr = ip_addr;
-		ds->ds_port = port;
-		atomic_set(&ds->ds_count, 1);
-		INIT_LIST_HEAD(&ds->ds_node);
-		ds->ds_client = NULL;
-		list_add(&ds->ds_node, &cohort_rmds_cache);
-		dprintk("%s add new rmds ip 0x%x\n", __func__,
-			ds->ds_ip_addr);
-	} else {
+	node = pnfs_add_ds(&ds->ds_node);
+	if (node != &ds->ds_node) {
 		kfree(ds);
-		atomic_inc(&tmp_ds->ds_count);
-		dprintk("%s rmds found ip 0x%x, inc'ed ds_count to %d\n",
-			__func__, tmp_ds->ds_ip_addr,
-			atomic_read(&tmp_ds->ds_count));
-		ds = tmp_ds;
+		ds = container_of(node, struct cohort_replication_layout_rmds,
+				  ds_node);
 	}
-	spin_unlock(&cohort_rmds_cache_lock);
-out:
 	return ds;
 }
 
 /*
- * Currently only support ipv4.  Original comment notwithstanding,
- * this routine has no idea of the length of any multipath list it
- * is (partially) decoding.  Shareable.
+ * Original comment notwithstanding, this routine has no idea of the
+ * length of any multipath list it is (partially) decoding.  Shareable.
  */
 static struct cohort_replication_layout_rmds *
 cohort_rpl_decode_and_add_ds(__be32 **pp, struct inode *inode)
 {
-	struct cohort_replication_layout_rmds *ds = NULL;
-	char *buf;
-	const char *ipend, *pstr;
-	u32 ip_addr, port;
-	int nlen, rlen, i;
-	int tmp[2];
-	__be32 *r_netid, *r_addr, *p = *pp;
+	struct sockaddr_storage ss;
+	size_t salen;
 
         dprintk("%s -->\n", __func__);
 
-	/* r_netid */
-	nlen = be32_to_cpup(p++);
-	r_netid = p;
-	p += XDR_QUADLEN(nlen);
-
-	/* r_addr */
-	rlen = be32_to_cpup(p++);
-	r_addr = p;
-	p += XDR_QUADLEN(rlen);
-	*pp = p;
-
-	/* Check that netid is "tcp" */
-	if (nlen != 3 ||  memcmp((char *)r_netid, "tcp", 3)) {
-		dprintk("%s: ERROR: non ipv4 TCP r_netid\n", __func__);
-		goto out_err;
-	}
-
-	/* ipv6 length plus port is legal */
-	if (rlen > INET6_ADDRSTRLEN + 8) {
-		dprintk("%s Invalid address, length %d\n", __func__,
-			rlen);
-		goto out_err;
-	}
-
-	buf = kmalloc(rlen + 1, GFP_KERNEL);
-	buf[rlen] = '\0';
-	memcpy(buf, r_addr, rlen);
-
-	/* replace the port dots with dashes for the in4_pton() delimiter*/
-	for (i = 0; i < 2; i++) {
-		char *res = strrchr(buf, '.');
-		*res = '-';
-	}
-
-	/* Currently only support ipv4 address */
-	if (in4_pton(buf, rlen, (u8 *)&ip_addr, '-', &ipend) == 0) {
-		dprintk("%s: Only ipv4 addresses supported\n", __func__);
-		goto out_free;
-	}
-
-	/* port */
-	pstr = ipend;
-	sscanf(pstr, "-%d-%d", &tmp[0], &tmp[1]);
-	port = htons((tmp[0] << 8) | (tmp[1]));
-
-	ds = cohort_replication_layout_rmds_add(inode, ip_addr, port);
-	dprintk("%s Decoded address and port %s\n", __func__, buf);
-out_free:
-	kfree(buf);
-out_err:
-	return ds;
+	salen = pnfs_decode_ds_addr(pp, (struct sockaddr *)&ss, sizeof(ss));
+	if (salen == 0)
+		return NULL;
+	return cohort_replication_layout_rmds_add(inode, (struct sockaddr *)&ss,
+						  salen);
 }
 
 /*
@@ -425,6 +346,7 @@ cohort_rpl_decode_and_add_device(struct inode *inode, struct pnfs_device *dev)
 {
 	struct cohort_replication_layout_rmds_addr *dsaddr;
 	struct pnfs_deviceid_node *d;
+	int i;
 
 	dsaddr = cohort_rpl_decode_device(inode, dev);
 	if (!dsaddr) {
@@ -435,9 +357,16 @@ cohort_rpl_decode_and_add_device(struct inode *inode, struct pnfs_device *dev)
 
 	d = pnfs_add_deviceid(NFS_SERVER(inode)->nfs_client->cl_devid_cache,
 			      &dsaddr->deviceid);
-
-	return container_of(d, struct cohort_replication_layout_rmds_addr,
-                            deviceid);
+	dsaddr = container_of(d, struct cohort_replication_layout_rmds_addr,
+			      deviceid);
+
+	/* Bring up all replica sessions in parallel ahead of I/O */
+	for (i = 0; i < dsaddr->ds_num; i++)
+		if (dsaddr->ds_list[i])
+			pnfs_ds_connect_async(NFS_SERVER(inode), d,
+					      &dsaddr->ds_list[i]->ds_node,
+					      cohort_rpl_rmds_create);
+	return dsaddr;
 }
 
 /*
@@ -572,6 +501,7 @@ struct cohort_replication_layout_rmds *
 cohort_rpl_prepare_ds(struct pnfs_layout_segment *lseg, u32 ds_idx)
 {
 	struct cohort_replication_layout_rmds_addr *dsaddr;
+	int err;
 
 	dsaddr = COHORT_RPL_LSEG(lseg)->dsaddr;
 	if (dsaddr->ds_list[ds_idx] == NULL) {
@@ -580,16 +510,13 @@ cohort_rpl_prepare_ds(struct pnfs_layout_segment *lseg, u32 ds_idx)
 		return NULL;
 	}
 
-	if (!dsaddr->ds_list[ds_idx]->ds_client) {
-		int err;
-
-		err = cohort_rpl_rmds_create(NFS_SERVER(lseg->layout->inode),
-                                             dsaddr->ds_list[ds_idx]);
-		if (err) {
-			printk(KERN_ERR "%s nfs4_pnfs_ds_create error %d\n",
-			       __func__, err);
-			return NULL;
-		}
+	err = pnfs_ds_connect(NFS_SERVER(lseg->layout->inode),
+			      &dsaddr->ds_list[ds_idx]->ds_node,
+			      cohort_rpl_rmds_create);
+	if (err) {
+		printk(KERN_ERR "%s nfs4_pnfs_ds_create error %d\n",
+		       __func__, err);
+		return NULL;
 	}
 	return dsaddr->ds_list[ds_idx];
 }
@@ -56,6 +56,7 @@
 
 #include "internal.h"
 #include "iostat.h"
+#include "pnfs.h"
 
 #define NFSDBG_FACILITY		NFSDBG_VFS
 
@@ -271,14 +272,34 @@ static const struct rpc_call_ops nfs_read_direct_ops = {
 	.rpc_release = nfs_direct_read_release,
 };
 
+/*
+ * Send one direct read to the data servers if @lseg is set and the
+ * layout driver takes it, otherwise to the MDS.  Once a layout driver
+ * has taken the request it owns its completion, just as the RPC layer
+ * does.  Drops the caller's reference on @lseg.
+ */
 static long nfs_direct_read_execute(struct nfs_read_data *data,
 				    struct rpc_task_setup *task_setup_data,
-				    struct rpc_message *msg)
+				    struct rpc_message *msg,
+				    struct pnfs_layout_segment *lseg)
 {
 	struct inode *inode = data->inode;
 	struct rpc_task *task;
 
 	nfs_fattr_init(&data->fattr);
+	if (lseg) {
+		enum pnfs_try_status trypnfs;
+
+		trypnfs = pnfs_direct_try_to_read(data,
+				task_setup_data->callback_ops, lseg);
+		put_lseg(lseg);
+		if (trypnfs == PNFS_ATTEMPTED)
+			return 0;
+	}
+	if (pnfs_enabled_sb(NFS_SERVER(inode)))
+		nfs_add_pnfs_stats(inode, NFSIOS_PNFS_MDSREADBYTES,
+				   data->args.count);
+
 	msg->rpc_argp = &data->args;
 	msg->rpc_resp = &data->res;
 
@@ -305,10 +326,12 @@ static long nfs_direct_read_execute(struct nfs_read_data *data,
 
 /*
  * For each rsize'd chunk of the user's buffer, dispatch an NFS READ
- * operation.  If nfs_readdata_alloc() or get_user_pages() fails,
- * bail and stop sending more reads.  Read length accounting is
- * handled automatically by nfs_direct_read_result().  Otherwise, if
- * no requests have been sent, just return an error.
+ * operation.  With a layout, chunks follow pnfs_direct_get_lseg()
+ * instead and go to the data servers.  If nfs_readdata_alloc() or
+ * get_user_pages() fails, bail and stop sending more reads.  Read
+ * length accounting is handled automatically by
+ * nfs_direct_read_result().  Otherwise, if no requests have been sent,
+ * just return an error.
  */
 static ssize_t nfs_direct_read_schedule_segment(struct nfs_direct_req *dreq,
 						const struct iovec *iov,
@@ -335,27 +358,36 @@ static ssize_t nfs_direct_read_schedule_segment(struct nfs_direct_req *dreq,
 
 	do {
 		struct nfs_read_data *data;
+		struct pnfs_layout_segment *lseg;
 		size_t bytes;
 
 		pgbase = user_addr & ~PAGE_MASK;
-		bytes = min(rsize,count);
+		bytes = count;
+		lseg = pnfs_direct_get_lseg(inode, ctx, pos, &bytes,
+					    IOMODE_READ);
+		if (!lseg)
+			bytes = min(rsize,count);
 
 		result = -ENOMEM;
 		data = nfs_readdata_alloc(nfs_page_array_len(pgbase, bytes));
-		if (unlikely(!data))
+		if (unlikely(!data)) {
+			put_lseg(lseg);
 			break;
+		}
 
 		down_read(&current->mm->mmap_sem);
 		result = get_user_pages(current, current->mm, user_addr,
 					data->npages, 1, 0, data->pagevec, NULL);
 		up_read(&current->mm->mmap_sem);
 		if (result < 0) {
+			put_lseg(lseg);
 			nfs_readdata_free(data);
 			break;
 		}
 		if ((unsigned)result < data->npages) {
 			bytes = result * PAGE_SIZE;
 			if (bytes <= pgbase) {
+				put_lseg(lseg);
 				nfs_direct_release_pages(data->pagevec, result);
 				nfs_readdata_free(data);
 				break;
@@ -380,7 +412,7 @@ static ssize_t nfs_direct_read_schedule_segment(struct nfs_direct_req *dreq,
 		data->res.eof = 0;
 		data->res.count = bytes;
 
-		if (nfs_direct_read_execute(data, &task_setup_data, &msg))
+		if (nfs_direct_read_execute(data, &task_setup_data, &msg, lseg))
 			break;
 
 		started += bytes;
@@ -473,7 +505,8 @@ static void nfs_direct_free_writedata(struct nfs_direct_req *dreq)
 #if defined(CONFIG_NFS_V3) || defined(CONFIG_NFS_V4)
 static long nfs_direct_write_execute(struct nfs_write_data *data,
 				     struct rpc_task_setup *task_setup_data,
-				     struct rpc_message *msg);
+				     struct rpc_message *msg,
+				     struct pnfs_layout_segment *lseg);
 
 static void nfs_direct_write_reschedule(struct nfs_direct_req *dreq)
 {
@@ -499,7 +532,8 @@ static void nfs_direct_write_reschedule(struct nfs_direct_req *dreq)
 
 		get_dreq(dreq);
 
-		/* Use stable writes */
+		/* Use stable writes, through the MDS */
+		pnfs_direct_write_reset(data);
 		data->args.stable = NFS_FILE_SYNC;
 
 		/*
@@ -513,7 +547,7 @@ static void nfs_direct_write_reschedule(struct nfs_direct_req *dreq)
 		 * Reuse data->task; data->args should not have changed
 		 * since the original request was sent.
 		 */
-		nfs_direct_write_execute(data, &task_setup_data, &msg);
+		nfs_direct_write_execute(data, &task_setup_data, &msg, NULL);
 	}
 
 	if (put_dreq(dreq))
@@ -629,6 +663,9 @@ static void nfs_direct_write_complete(struct nfs_direct_req *dreq, struct inode
 				nfs_commit_free(dreq->commit_data);
 			nfs_direct_free_writedata(dreq);
 			nfs_zap_mapping(inode, inode->i_mapping);
+			/* Data server writes leave a LAYOUTCOMMIT for write_inode */
+			if (layoutcommit_needed(NFS_I(inode)))
+				__mark_inode_dirty(inode, I_DIRTY_DATASYNC);
 			nfs_direct_complete(dreq);
 	}
 }
@@ -661,6 +698,25 @@ static void nfs_direct_write_result(struct rpc_task *task, void *calldata)
 		return;
 }
 
+/*
+ * A write to the data servers leaves the MDS size stale until the
+ * LAYOUTCOMMIT, and nfs_update_inode() ignores the size in GETATTR
+ * replies while one is pending, so extend i_size here the way
+ * nfs_grow_file() does for buffered writes.
+ */
+static void nfs_direct_grow_file(struct nfs_write_data *data)
+{
+	struct inode *inode = data->inode;
+	loff_t end = data->args.offset + data->res.count;
+
+	spin_lock(&inode->i_lock);
+	if (i_size_read(inode) < end) {
+		i_size_write(inode, end);
+		nfs_inc_stats(inode, NFSIOS_EXTENDWRITE);
+	}
+	spin_unlock(&inode->i_lock);
+}
+
 /*
  * NB: Return the value of the first error return code.  Subsequent
  *     errors after the first one are ignored.
@@ -670,6 +726,7 @@ static void nfs_direct_write_release(void *calldata)
 	struct nfs_write_data *data = calldata;
 	struct nfs_direct_req *dreq = (struct nfs_direct_req *) data->req;
 	int status = data->task.tk_status;
+	int grow = 0;
 
 	spin_lock(&dreq->lock);
 
@@ -682,8 +739,14 @@ static void nfs_direct_write_release(void *calldata)
 		goto out_unlock;
 
 	dreq->count += data->res.count;
-
-	if (data->res.verf->committed != NFS_FILE_SYNC) {
+	grow = pnfs_direct_write_by_layout(data) && data->res.count;
+
+	/*
+	 * Writes handed to a layout driver were sent FLUSH_STABLE, and a
+	 * COMMIT to the MDS would not cover data on the data servers.
+	 */
+	if (data->res.verf->committed != NFS_FILE_SYNC &&
+	    !pnfs_direct_write_by_layout(data)) {
 		switch (dreq->flags) {
 			case 0:
 				memcpy(&dreq->verf, &data->verf, sizeof(dreq->verf));
@@ -699,6 +762,8 @@ static void nfs_direct_write_release(void *calldata)
 out_unlock:
 	spin_unlock(&dreq->lock);
 
+	if (grow)
+		nfs_direct_grow_file(data);
 	if (put_dreq(dreq))
 		nfs_direct_write_complete(dreq, data->inode);
 }
@@ -711,13 +776,31 @@ static const struct rpc_call_ops nfs_write_direct_ops = {
 	.rpc_release = nfs_direct_write_release,
 };
 
+/*
+ * Like nfs_direct_read_execute(): try the layout driver first when
+ * there is a layout segment, and drop the caller's reference on it.
+ */
 static long nfs_direct_write_execute(struct nfs_write_data *data,
 				     struct rpc_task_setup *task_setup_data,
-				     struct rpc_message *msg)
+				     struct rpc_message *msg,
+				     struct pnfs_layout_segment *lseg)
 {
 	struct inode *inode = data->inode;
 	struct rpc_task *task;
 
+	if (lseg) {
+		enum pnfs_try_status trypnfs;
+
+		trypnfs = pnfs_direct_try_to_write(data,
+				task_setup_data->callback_ops, lseg);
+		put_lseg(lseg);
+		if (trypnfs == PNFS_ATTEMPTED)
+			return 0;
+	}
+	if (pnfs_enabled_sb(NFS_SERVER(inode)))
+		nfs_add_pnfs_stats(inode, NFSIOS_PNFS_MDSWRITTENBYTES,
+				   data->args.count);
+
 	task_setup_data->task = &data->task;
 	task_setup_data->callback_data = data;
 	msg->rpc_argp = &data->args;
@@ -743,7 +826,9 @@ static long nfs_direct_write_execute(struct nfs_write_data *data,
 
 /*
  * For each wsize'd chunk of the user's buffer, dispatch an NFS WRITE
- * operation.  If nfs_writedata_alloc() or get_user_pages() fails,
+ * operation.  With a layout, chunks follow pnfs_direct_get_lseg()
+ * instead and are written stable to the data servers, falling back to
+ * the MDS per chunk.  If nfs_writedata_alloc() or get_user_pages() fails,
  * bail and stop sending more writes.  Write length accounting is
  * handled automatically by nfs_direct_write_result().  Otherwise, if
  * no requests have been sent, just return an error.
@@ -773,27 +858,36 @@ static ssize_t nfs_direct_write_schedule_segment(struct nfs_direct_req *dreq,
 
 	do {
 		struct nfs_write_data *data;
+		struct pnfs_layout_segment *lseg;
 		size_t bytes;
 
 		pgbase = user_addr & ~PAGE_MASK;
-		bytes = min(wsize,count);
+		bytes = count;
+		lseg = pnfs_direct_get_lseg(inode, ctx, pos, &bytes,
+					    IOMODE_RW);
+		if (!lseg)
+			bytes = min(wsize,count);
 
 		result = -ENOMEM;
 		data = nfs_writedata_alloc(nfs_page_array_len(pgbase, bytes));
-		if (unlikely(!data))
+		if (unlikely(!data)) {
+			put_lseg(lseg);
 			break;
+		}
 
 		down_read(&current->mm->mmap_sem);
 		result = get_user_pages(current, current->mm, user_addr,
 					data->npages, 0, 0, data->pagevec, NULL);
 		up_read(&current->mm->mmap_sem);
 		if (result < 0) {
+			put_lseg(lseg);
 			nfs_writedata_free(data);
 			break;
 		}
 		if ((unsigned)result < data->npages) {
 			bytes = result * PAGE_SIZE;
 			if (bytes <= pgbase) {
+				put_lseg(lseg);
 				nfs_direct_release_pages(data->pagevec, result);
 				nfs_writedata_free(data);
 				break;
@@ -816,13 +910,13 @@ static ssize_t nfs_direct_write_schedule_segment(struct nfs_direct_req *dreq,
 		data->args.pgbase = pgbase;
 		data->args.pages = data->pagevec;
 		data->args.count = bytes;
-		data->args.stable = sync;
+		data->args.stable = lseg ? NFS_FILE_SYNC : sync;
 		data->res.fattr = &data->fattr;
 		data->res.count = bytes;
 		data->res.verf = &data->verf;
 		nfs_fattr_init(&data->fattr);
 
-		if (nfs_direct_write_execute(data, &task_setup_data, &msg))
+		if (nfs_direct_write_execute(data, &task_setup_data, &msg, lseg))
 			break;
 
 		started += bytes;
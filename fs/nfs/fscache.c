@@ -535,3 +535,85 @@ void __nfs_readpage_to_fscache(struct inode *inode, struct page *page, int sync)
 				      NFSIOS_FSCACHE_PAGES_WRITTEN_OK, 1);
 	}
 }
+
+/*
+ * Pages read through a layout are stored in the cache from nfsiod instead of
+ * from the read completion, which runs in rpciod or in the layout driver's
+ * completion work.  One batch covers the pages of one read.
+ */
+struct nfs_fscache_store {
+	struct work_struct	work;
+	struct inode		*inode;
+	unsigned int		npages;
+	unsigned int		max;
+	struct page		*pages[0];
+};
+
+static void nfs_fscache_store_work(struct work_struct *work)
+{
+	struct nfs_fscache_store *store =
+		container_of(work, struct nfs_fscache_store, work);
+	struct inode *inode = store->inode;
+	unsigned int i;
+
+	dfprintk(FSCACHE, "NFS: fscache store (0x%p/%u)\n",
+		 inode, store->npages);
+
+	for (i = 0; i < store->npages; i++) {
+		struct page *page = store->pages[i];
+
+		lock_page(page);
+		/* skip pages truncated or invalidated since the read */
+		if (page->mapping == inode->i_mapping && PageUptodate(page))
+			nfs_readpage_to_fscache(inode, page, 0);
+		unlock_page(page);
+		page_cache_release(page);
+	}
+	iput(inode);
+	kfree(store);
+}
+
+struct nfs_fscache_store *__nfs_fscache_store_alloc(struct inode *inode,
+						    unsigned int npages)
+{
+	struct nfs_fscache_store *store;
+
+	store = kmalloc(sizeof(*store) + npages * sizeof(struct page *),
+			GFP_NOFS);
+	if (!store)
+		return NULL;
+	store->inode = igrab(inode);
+	if (!store->inode) {
+		kfree(store);
+		return NULL;
+	}
+	INIT_WORK(&store->work, nfs_fscache_store_work);
+	store->npages = 0;
+	store->max = npages;
+	return store;
+}
+
+/*
+ * Queue a page newly fetched from a data server for storage in the cache
+ * - PG_fscache must be set on the page, which must still be locked
+ */
+void __nfs_fscache_store_add(struct nfs_fscache_store *store,
+			     struct page *page)
+{
+	if (store->npages == store->max) {
+		__nfs_readpage_to_fscache(store->inode, page, 0);
+		return;
+	}
+	page_cache_get(page);
+	store->pages[store->npages++] = page;
+}
+
+/*
+ * Hand a batch to nfsiod.  The batch is queued even when empty so that the
+ * inode reference is never dropped from the read completion.
+ */
+void nfs_fscache_store_submit(struct nfs_fscache_store *store)
+{
+	if (store)
+		queue_work(nfsiod_workqueue, &store->work);
+}
@@ -17,6 +17,8 @@
 #include <linux/nfs4_mount.h>
 #include <linux/fscache.h>
 
+struct nfs_fscache_store;
+
 #ifdef CONFIG_NFS_FSCACHE
 
 /*
@@ -93,6 +95,11 @@ extern int __nfs_readpages_from_fscache(struct nfs_open_context *,
 					struct inode *, struct address_space *,
 					struct list_head *, unsigned *);
 extern void __nfs_readpage_to_fscache(struct inode *, struct page *, int);
+extern struct nfs_fscache_store *__nfs_fscache_store_alloc(struct inode *,
+							   unsigned int);
+extern void __nfs_fscache_store_add(struct nfs_fscache_store *,
+				    struct page *);
+extern void nfs_fscache_store_submit(struct nfs_fscache_store *);
 
 /*
  * wait for a page to complete writing to the cache
@@ -154,6 +161,27 @@ static inline void nfs_readpage_to_fscache(struct inode *inode,
 		__nfs_readpage_to_fscache(inode, page, sync);
 }
 
+/*
+ * Start a batch of pages to be stored in the cache from nfsiod.
+ */
+static inline struct nfs_fscache_store *
+nfs_fscache_store_alloc(struct inode *inode, unsigned int npages)
+{
+	if (NFS_I(inode)->fscache)
+		return __nfs_fscache_store_alloc(inode, npages);
+	return NULL;
+}
+
+/*
+ * Add a page newly fetched from the server to a batch.
+ */
+static inline void nfs_fscache_store_add(struct nfs_fscache_store *store,
+					 struct page *page)
+{
+	if (PageFsCache(page))
+		__nfs_fscache_store_add(store, page);
+}
+
 /*
  * indicate the client caching state as readable text
  */
@@ -213,6 +241,15 @@ static inline int nfs_readpages_from_fscache(struct nfs_open_context *ctx,
 static inline void nfs_readpage_to_fscache(struct inode *inode,
 					   struct page *page, int sync) {}
 
+static inline struct nfs_fscache_store *
+nfs_fscache_store_alloc(struct inode *inode, unsigned int npages)
+{
+	return NULL;
+}
+static inline void nfs_fscache_store_add(struct nfs_fscache_store *store,
+					 struct page *page) {}
+static inline void nfs_fscache_store_submit(struct nfs_fscache_store *store) {}
+
 static inline const char *nfs_server_fscache_state(struct nfs_server *server)
 {
 	return "no ";
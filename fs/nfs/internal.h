@@ -90,6 +90,7 @@ struct nfs_parsed_mount_data {
 	char			*client_address;
 	unsigned int		version;
 	unsigned int		minorversion;
+	unsigned int		ds_nconnect;
 	char			*fscache_uniq;
 
 	struct {
@@ -113,6 +114,9 @@ struct nfs_parsed_mount_data {
 	struct security_mnt_opts lsm_opts;
 };
 
+/* Upper bound on the ds_nconnect mount option */
+#define NFS_MAX_DS_NCONNECT	16
+
 /* mount_clnt.c */
 struct nfs_mount_request {
 	struct sockaddr		*sap;
@@ -163,6 +167,8 @@ extern int nfs4_set_client(struct nfs_server *server,
 		rpc_authflavor_t authflavour,
 		int proto, const struct rpc_timeout *timeparms,
 		u32 minorversion);
+extern struct rpc_clnt *nfs4_create_trunked_rpcclient(struct nfs_client *clp,
+		const struct rpc_timeout *timeparms);
 #ifdef CONFIG_PROC_FS
 extern int __init nfs_fs_proc_init(void);
 extern void nfs_fs_proc_exit(void);
@@ -20,6 +20,9 @@ struct nfs_iostats {
 	unsigned long long	fscache[__NFSIOS_FSCACHEMAX];
 #endif
 	unsigned long		events[__NFSIOS_COUNTSMAX];
+#ifdef CONFIG_NFS_V4_1
+	unsigned long long	pnfs[__NFSIOS_PNFSCLASSES][__NFSIOS_PNFSMAX];
+#endif
 } ____cacheline_aligned;
 
 static inline void nfs_inc_server_stats(const struct nfs_server *server,
@@ -57,6 +60,44 @@ static inline void nfs_add_fscache_stats(struct inode *inode,
 }
 #endif
 
+#ifdef CONFIG_NFS_V4_1
+static inline void nfs_add_server_pnfs_stats(const struct nfs_server *server,
+					     enum nfs_stat_pnfsclasses class,
+					     enum nfs_stat_pnfscounters stat,
+					     long addend)
+{
+	this_cpu_add(server->io_stats->pnfs[class][stat], addend);
+}
+
+/* Directories use the metadata layout driver, everything else data */
+static inline void nfs_add_pnfs_stats(const struct inode *inode,
+				      enum nfs_stat_pnfscounters stat,
+				      long addend)
+{
+	nfs_add_server_pnfs_stats(NFS_SERVER(inode),
+				  S_ISDIR(inode->i_mode) ?
+					NFSIOS_PNFS_META : NFSIOS_PNFS_DATA,
+				  stat, addend);
+}
+
+static inline void nfs_inc_pnfs_stats(const struct inode *inode,
+				      enum nfs_stat_pnfscounters stat)
+{
+	nfs_add_pnfs_stats(inode, stat, 1);
+}
+#else
+static inline void nfs_add_pnfs_stats(const struct inode *inode,
+				      enum nfs_stat_pnfscounters stat,
+				      long addend)
+{
+}
+
+static inline void nfs_inc_pnfs_stats(const struct inode *inode,
+				      enum nfs_stat_pnfscounters stat)
+{
+}
+#endif /* CONFIG_NFS_V4_1 */
+
 static inline struct nfs_iostats __percpu *nfs_alloc_iostats(void)
 {
 	return alloc_percpu(struct nfs_iostats);
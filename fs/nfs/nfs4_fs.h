@@ -258,6 +258,8 @@ extern int nfs4_setup_sequence(const struct nfs_server *server,
 		struct nfs4_session *ds_session,
 		struct nfs4_sequence_args *args, struct nfs4_sequence_res *res,
 		int cache_reply, struct rpc_task *task);
+extern int nfs41_sequence_done(struct rpc_task *task,
+		struct nfs4_sequence_res *res);
 extern void nfs4_destroy_session(struct nfs4_session *session);
 extern struct nfs4_session *nfs4_alloc_session(struct nfs_client *clp);
 extern int nfs4_proc_exchange_id(struct nfs_client *, struct rpc_cred *);
@@ -365,8 +367,6 @@ struct nfs4_createdata {
 	struct nfs_fattr fh_fattr;
 };
 
-#define COHORT_OPEN_FLAG_REPLICA   (1U << 0)
-
 struct nfs4_opendata {
 	struct kref kref;
 	struct nfs_openargs o_arg;
@@ -384,14 +384,11 @@ struct nfs4_opendata {
 	unsigned int rpc_done : 1;
 	int rpc_status;
 	int cancelled;
-#if defined(CONFIG_PNFS_COHORT)
-	u32 ch_flags;
-	struct rpc_clnt *ch_client;
-#endif
 };
 
 /* XXX Cohort */
 extern int _nfs4_proc_open(struct nfs4_opendata *data);
+extern void nfs4_opendata_put(struct nfs4_opendata *p);
 
 #else
 
@@ -189,8 +189,7 @@ filelayout_read_pagelist(struct nfs_read_data *data, unsigned nr_pages)
 		printk(KERN_ERR "%s: prepare_ds failed, use MDS\n", __func__);
 		return PNFS_NOT_ATTEMPTED;
 	}
-	dprintk("%s USE DS:ip %x %hu\n", __func__,
-		ntohl(ds->ds_ip_addr), ntohs(ds->ds_port));
+	dprintk("%s USE DS: %s\n", __func__, ds->ds_node.dn_remotestr);
 
 	/* just try the first data server for the index..*/
 	data->fldata.ds_nfs_client = ds->ds_clp;
@@ -209,7 +208,7 @@ filelayout_read_pagelist(struct nfs_read_data *data, unsigned nr_pages)
 	data->fldata.orig_offset = offset;
 
 	/* Perform an asynchronous read */
-	nfs_initiate_read(data, ds->ds_clp->cl_rpcclient,
+	nfs_initiate_read(data, nfs4_fl_ds_rpcclient(ds),
 			  &filelayout_read_call_ops);
 
 	data->pdata.pnfs_error = 0;
@@ -234,9 +233,9 @@ filelayout_write_pagelist(struct nfs_write_data *data, unsigned nr_pages, int sy
 		printk(KERN_ERR "%s: prepare_ds failed, use MDS\n", __func__);
 		return PNFS_NOT_ATTEMPTED;
 	}
-	dprintk("%s ino %lu sync %d req %Zu@%llu DS:%x:%hu\n", __func__,
+	dprintk("%s ino %lu sync %d req %Zu@%llu DS: %s\n", __func__,
 		data->inode->i_ino, sync, (size_t) data->args.count, offset,
-		ntohl(ds->ds_ip_addr), ntohs(ds->ds_port));
+		ds->ds_node.dn_remotestr);
 
 	data->fldata.ds_nfs_client = ds->ds_clp;
 	fh = nfs4_fl_select_ds_fh(lseg, offset);
@@ -253,7 +252,7 @@ filelayout_write_pagelist(struct nfs_write_data *data, unsigned nr_pages, int sy
 	 * Perform an asynchronous write The offset will be reset in the
 	 * call_ops->rpc_call_done() routine
 	 */
-	nfs_initiate_write(data, ds->ds_clp->cl_rpcclient,
+	nfs_initiate_write(data, nfs4_fl_ds_rpcclient(ds),
 			   &filelayout_write_call_ops, sync);
 
 	data->pdata.pnfs_error = 0;
@@ -349,6 +348,7 @@ static void
 _filelayout_free_lseg(struct nfs4_filelayout_segment *fl)
 {
 	filelayout_free_fh_array(fl);
+	kfree(fl->commit_buckets);
 	kfree(fl);
 }
 
@@ -431,6 +431,35 @@ filelayout_alloc_lseg(struct pnfs_layout_hdr *layoutid,
 		_filelayout_free_lseg(fl);
 		return NULL;
 	}
+
+	/*
+	 * A COMMIT goes to a data server filehandle: one per stripe for
+	 * dense layouts, one per data server for sparse ones.
+	 */
+	if (!fl->commit_through_mds) {
+		int i;
+
+		if (fl->stripe_type == STRIPE_DENSE)
+			fl->num_buckets = fl->dsaddr->stripe_count;
+		else
+			fl->num_buckets = fl->dsaddr->ds_num;
+		fl->commit_buckets = kcalloc(fl->num_buckets,
+					     sizeof(struct nfs4_fl_commit_bucket),
+					     GFP_KERNEL);
+		if (!fl->commit_buckets) {
+			struct nfs_client *clp;
+
+			clp = NFS_SERVER(layoutid->inode)->nfs_client;
+			pnfs_put_deviceid(clp->cl_devid_cache,
+					  &fl->dsaddr->deviceid);
+			_filelayout_free_lseg(fl);
+			return NULL;
+		}
+		for (i = 0; i < fl->num_buckets; i++) {
+			INIT_LIST_HEAD(&fl->commit_buckets[i].link);
+			INIT_LIST_HEAD(&fl->commit_buckets[i].written);
+		}
+	}
 	return &fl->generic_hdr;
 }
 
@@ -487,145 +516,128 @@ static struct rpc_call_ops filelayout_commit_call_ops = {
 	.rpc_release = filelayout_write_release,
 };
 
+/*
+ * Return the commit bucket for a request, or NULL if it is to be
+ * committed through the MDS.
+ */
+static struct nfs4_fl_commit_bucket *
+filelayout_commit_bucket(struct nfs_page *req)
+{
+	struct pnfs_layout_segment *lseg = req->wb_lseg;
+	struct nfs4_filelayout_segment *flseg;
+	loff_t offset;
+	u32 i;
+
+	if (!lseg)
+		return NULL;
+	flseg = FILELAYOUT_LSEG(lseg);
+	if (flseg->commit_through_mds)
+		return NULL;
+	offset = (loff_t)req->wb_index << PAGE_CACHE_SHIFT;
+	if (flseg->stripe_type == STRIPE_DENSE)
+		i = nfs4_fl_calc_j_index(lseg, offset);
+	else
+		i = nfs4_fl_calc_ds_index(lseg, offset);
+	return &flseg->commit_buckets[i];
+}
+
+/*
+ * Send the COMMIT for one bucket's worth of requests, which all share
+ * an lseg and a data server filehandle.
+ */
+static void
+filelayout_initiate_ds_commit(struct nfs_write_data *dsdata,
+			      const struct rpc_call_ops *release_ops, int sync)
+{
+	struct nfs_page *req = nfs_list_entry(dsdata->pages.next);
+	loff_t file_offset = (loff_t)req->wb_index << PAGE_CACHE_SHIFT;
+	struct nfs4_pnfs_ds *ds;
+	struct nfs_fh *fh;
+
+	ds = nfs4_fl_prepare_ds(req->wb_lseg,
+				nfs4_fl_calc_ds_index(req->wb_lseg,
+						      file_offset));
+	if (!ds) {
+		/* Trigger retry of this chunk through MDS */
+		dsdata->task.tk_status = -EIO;
+		release_ops->rpc_release(dsdata);
+		return;
+	}
+	dsdata->fldata.ds_nfs_client = ds->ds_clp;
+	fh = nfs4_fl_select_ds_fh(req->wb_lseg, file_offset);
+	if (fh)
+		dsdata->args.fh = fh;
+	dprintk("%s: Initiating commit: %llu USE DS:\n",
+		__func__, file_offset);
+	ifdebug(FACILITY)
+		print_ds(ds);
+
+	nfs_initiate_commit(dsdata, nfs4_fl_ds_rpcclient(ds),
+			    &filelayout_commit_call_ops, sync);
+}
+
 /*
  * Execute a COMMIT op to the MDS or to each data server on which a page
  * in 'pages' exists.
- * Invoke the pnfs_commit_complete callback.
+ *
+ * Requests are sorted in a single pass into the commit buckets of their
+ * own lseg, so pages covered by different layout segments never share a
+ * COMMIT.  The buckets are preallocated with the lseg; the only memory
+ * taken here is one mempool-backed nfs_write_data per extra COMMIT.
+ * Callers hold NFS_INO_COMMIT, which serialises use of the buckets.
  */
 enum pnfs_try_status
 filelayout_commit(struct nfs_write_data *data, int sync)
 {
-	LIST_HEAD(head);
-	struct nfs_page *req;
-	loff_t file_offset = 0;
-	u16 idx, i;
-	struct list_head **ds_page_list = NULL;
-	u16 *indices_used;
-	int num_indices_seen = 0;
-	bool used_mds = false;
-	const struct rpc_call_ops *call_ops;
-	struct rpc_clnt *clnt;
-	struct nfs_write_data **clone_list = NULL;
+	LIST_HEAD(buckets);
+	LIST_HEAD(mds_pages);
+	struct nfs4_fl_commit_bucket *b, *tmp;
 	struct nfs_write_data *dsdata;
-	struct nfs4_pnfs_ds *ds;
+	struct nfs_page *req;
 
 	dprintk("%s data %p sync %d\n", __func__, data, sync);
 
-	/* Alloc room for both in one go */
-	ds_page_list = kzalloc((NFS4_PNFS_MAX_MULTI_CNT + 1) *
-			       (sizeof(u16) + sizeof(struct list_head *)),
-			       GFP_KERNEL);
-	if (!ds_page_list)
-		goto mem_error;
-	indices_used = (u16 *) (ds_page_list + NFS4_PNFS_MAX_MULTI_CNT + 1);
-	/*
-	 * Sort pages based on which ds to send to.
-	 * MDS is given index equal to NFS4_PNFS_MAX_MULTI_CNT.
-	 * Note we are assuming there is only a single lseg in play.
-	 * When that is not true, we could first sort on lseg, then
-	 * sort within each as we do here.
-	 */
 	while (!list_empty(&data->pages)) {
 		req = nfs_list_entry(data->pages.next);
 		nfs_list_remove_request(req);
-		if (!req->wb_lseg ||
-		    ((struct nfs4_filelayout_segment *)
-		     FILELAYOUT_LSEG(req->wb_lseg))->commit_through_mds)
-			idx = NFS4_PNFS_MAX_MULTI_CNT;
-		else {
-			file_offset = (loff_t)req->wb_index << PAGE_CACHE_SHIFT;
-			idx = nfs4_fl_calc_ds_index(req->wb_lseg, file_offset);
-		}
-		if (ds_page_list[idx]) {
-			/* Already seen this idx */
-			list_add(&req->wb_list, ds_page_list[idx]);
-		} else {
-			/* New idx not seen so far */
-			list_add_tail(&req->wb_list, &head);
-			indices_used[num_indices_seen++] = idx;
+		b = filelayout_commit_bucket(req);
+		if (!b) {
+			list_add_tail(&req->wb_list, &mds_pages);
+			continue;
 		}
-		ds_page_list[idx] = &req->wb_list;
+		if (list_empty(&b->written))
+			list_add_tail(&b->link, &buckets);
+		list_add_tail(&req->wb_list, &b->written);
 	}
-	/* Once created, clone must be released via call_op */
-	clone_list = kzalloc(num_indices_seen *
-			     sizeof(struct nfs_write_data *), GFP_KERNEL);
-	if (!clone_list)
-		goto mem_error;
-	for (i = 0; i < num_indices_seen - 1; i++) {
-		if (indices_used[i] == NFS4_PNFS_MAX_MULTI_CNT) {
-			used_mds = true;
-			clone_list[i] = data;
-		} else {
-			clone_list[i] = filelayout_clone_write_data(data);
-			if (!clone_list[i])
-				goto mem_error;
-		}
-	}
-	if (used_mds) {
-		clone_list[i] = filelayout_clone_write_data(data);
-		if (!clone_list[i])
-			goto mem_error;
-	} else
-		clone_list[i] = data;
+
 	/*
-	 * Now send off the RPCs to each ds.  Note that it is important
-	 * that any RPC to the MDS be sent last (or at least after all
-	 * clones have been made.)
+	 * Clones hold a reference to 'data', so 'data' itself must be the
+	 * last COMMIT sent: it goes to the MDS if any request needs that,
+	 * otherwise to the final data server bucket.
 	 */
-	for (i = 0; i < num_indices_seen; i++) {
-		dsdata = clone_list[i];
-		idx = indices_used[i];
-		list_cut_position(&dsdata->pages, &head, ds_page_list[idx]);
-		if (idx == NFS4_PNFS_MAX_MULTI_CNT) {
-			call_ops = data->pdata.call_ops;;
-			clnt = NFS_CLIENT(dsdata->inode);
-			ds = NULL;
-		} else {
-			struct nfs_fh *fh;
-
-			call_ops = &filelayout_commit_call_ops;
-			req = nfs_list_entry(dsdata->pages.next);
-			ds = nfs4_fl_prepare_ds(req->wb_lseg, idx);
-			if (!ds) {
-				/* Trigger retry of this chunk through MDS */
-				dsdata->task.tk_status = -EIO;
-				data->pdata.call_ops->rpc_release(dsdata);
+	list_for_each_entry_safe(b, tmp, &buckets, link) {
+		list_del_init(&b->link);
+		if (list_empty(&buckets) && list_empty(&mds_pages))
+			dsdata = data;
+		else {
+			dsdata = filelayout_clone_write_data(data);
+			if (!dsdata) {
+				nfs_mark_list_commit(&b->written);
 				continue;
 			}
-			clnt = ds->ds_clp->cl_rpcclient;
-			dsdata->fldata.ds_nfs_client = ds->ds_clp;
-			file_offset = (loff_t)req->wb_index << PAGE_CACHE_SHIFT;
-			fh = nfs4_fl_select_ds_fh(req->wb_lseg, file_offset);
-			if (fh)
-				dsdata->args.fh = fh;
 		}
-		dprintk("%s: Initiating commit: %llu USE DS:\n",
-			__func__, file_offset);
-		ifdebug(FACILITY)
-			print_ds(ds);
-
-		/* Send COMMIT to data server */
-		nfs_initiate_commit(dsdata, clnt, call_ops, sync);
+		list_splice_init(&b->written, &dsdata->pages);
+		filelayout_initiate_ds_commit(dsdata, data->pdata.call_ops,
+					      sync);
 	}
-	kfree(clone_list);
-	kfree(ds_page_list);
-	data->pdata.pnfs_error = 0;
-	return PNFS_ATTEMPTED;
 
- mem_error:
-	if (clone_list) {
-		for (i = 0; i < num_indices_seen - 1; i++) {
-			if (!clone_list[i])
-				break;
-			data->pdata.call_ops->rpc_release(clone_list[i]);
-		}
-		kfree(clone_list);
+	if (!list_empty(&mds_pages)) {
+		list_splice(&mds_pages, &data->pages);
+		dprintk("%s: Initiating commit through MDS\n", __func__);
+		nfs_initiate_commit(data, NFS_CLIENT(data->inode),
+				    data->pdata.call_ops, sync);
 	}
-	kfree(ds_page_list);
-	/* One of these will be empty, but doesn't hurt to do both */
-	nfs_mark_list_commit(&head);
-	nfs_mark_list_commit(&data->pages);
-	data->pdata.call_ops->rpc_release(data);
+	data->pdata.pnfs_error = 0;
 	return PNFS_ATTEMPTED;
 }
 
@@ -656,16 +668,34 @@ filelayout_pg_test(struct nfs_pageio_descriptor *pgio, struct nfs_page *prev,
 	return (p_stripe == r_stripe);
 }
 
+/*
+ * filelayout_io_boundary(). O_DIRECT requests have no nfs_pages for
+ * filelayout_pg_test() to look at; they are cut at the end of the
+ * stripe unit instead, so each goes to a single data server.
+ */
+static u64
+filelayout_io_boundary(struct pnfs_layout_segment *lseg, u64 offset)
+{
+	struct nfs4_filelayout_segment *flseg = FILELAYOUT_LSEG(lseg);
+	u64 tmp;
+	u32 rem;
+
+	tmp = offset - flseg->pattern_offset;
+	rem = do_div(tmp, flseg->stripe_unit);
+	return offset + flseg->stripe_unit - rem;
+}
+
 static struct pnfs_layoutdriver_type filelayout_type = {
 	.id = LAYOUT_NFSV4_1_FILES,
 	.name = "LAYOUT_NFSV4_1_FILES",
 	.owner = THIS_MODULE,
-	.flags                   = PNFS_USE_RPC_CODE,
+	.flags                   = PNFS_USE_RPC_CODE | PNFS_LAYOUT_DIRECT_IO,
 	.set_layoutdriver = filelayout_set_layoutdriver,
 	.clear_layoutdriver = filelayout_clear_layoutdriver,
 	.alloc_lseg              = filelayout_alloc_lseg,
 	.free_lseg               = filelayout_free_lseg,
 	.pg_test                 = filelayout_pg_test,
+	.io_boundary             = filelayout_io_boundary,
 	.read_pagelist           = filelayout_read_pagelist,
 	.write_pagelist          = filelayout_write_pagelist,
 	.commit                  = filelayout_commit,
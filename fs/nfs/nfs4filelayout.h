@@ -46,13 +46,17 @@ enum stripetype4 {
 	STRIPE_DENSE = 2
 };
 
-/* Individual ip address */
+/*
+ * Individual data server, hashed in the shared pnfs_ds_node cache.
+ * ds_rpc[0] is the session's own rpc client; with the ds_nconnect mount
+ * option the session is trunked over ds_nrpc transports in total.
+ */
 struct nfs4_pnfs_ds {
-	struct list_head	ds_node;  /* nfs4_pnfs_dev_hlist dev_dslist */
-	u32			ds_ip_addr;
-	u32			ds_port;
+	struct pnfs_ds_node	ds_node;
 	struct nfs_client	*ds_clp;
-	atomic_t		ds_count;
+	unsigned int		ds_nrpc;
+	atomic_t		ds_rpc_next;
+	struct rpc_clnt		*ds_rpc[NFS_MAX_DS_NCONNECT];
 };
 
 struct nfs4_file_layout_dsaddr {
@@ -63,6 +67,16 @@ struct nfs4_file_layout_dsaddr {
 	struct nfs4_pnfs_ds		*ds_list[1];
 };
 
+/*
+ * Unstable requests destined for a single data server filehandle.  The
+ * buckets are allocated along with the layout segment so that sorting a
+ * COMMIT needs no memory; they are only touched under NFS_INO_COMMIT.
+ */
+struct nfs4_fl_commit_bucket {
+	struct list_head	link;		/* on the current commit's list */
+	struct list_head	written;	/* requests awaiting COMMIT */
+};
+
 struct nfs4_filelayout_segment {
 	struct pnfs_layout_segment generic_hdr;
 	u32 stripe_type;
@@ -73,6 +87,8 @@ struct nfs4_filelayout_segment {
 	struct nfs4_file_layout_dsaddr *dsaddr; /* Point to GETDEVINFO data */
 	unsigned int num_fh;
 	struct nfs_fh **fh_array;
+	u32 num_buckets;
+	struct nfs4_fl_commit_bucket *commit_buckets;
 };
 
 static inline struct nfs4_filelayout_segment *
@@ -88,7 +104,9 @@ nfs4_fl_select_ds_fh(struct pnfs_layout_segment *lseg, loff_t offset);
 
 extern void nfs4_fl_free_deviceid_callback(struct pnfs_deviceid_node *);
 extern void print_ds(struct nfs4_pnfs_ds *ds);
+extern struct rpc_clnt *nfs4_fl_ds_rpcclient(struct nfs4_pnfs_ds *ds);
 extern void print_deviceid(struct nfs4_deviceid *dev_id);
+u32 nfs4_fl_calc_j_index(struct pnfs_layout_segment *lseg, loff_t offset);
 u32 nfs4_fl_calc_ds_index(struct pnfs_layout_segment *lseg, loff_t offset);
 struct nfs4_pnfs_ds *nfs4_fl_prepare_ds(struct pnfs_layout_segment *lseg,
 					u32 ds_idx);
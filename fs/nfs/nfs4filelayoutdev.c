@@ -39,14 +39,12 @@
 /*
  * Data server cache
  *
- * Data servers can be mapped to different device ids.
- * nfs4_pnfs_ds reference counting
+ * Data servers can be mapped to different device ids, and live in the
+ * shared pnfs_ds_node cache.  nfs4_pnfs_ds reference counting
  *   - set to 1 on allocation
  *   - incremented when a device id maps a data server already in the cache.
  *   - decremented when deviceid is removed from the cache.
  */
-DEFINE_SPINLOCK(nfs4_ds_cache_lock);
-static LIST_HEAD(nfs4_data_server_cache);
 
 /* Debug routines */
 void
@@ -56,12 +54,16 @@ print_ds(struct nfs4_pnfs_ds *ds)
 		printk("%s NULL device\n", __func__);
 		return;
 	}
-	printk("        ip_addr %x port %hu\n"
+	printk("        remote %s\n"
 		"        ref count %d\n"
+		"        session %s (error %d)\n"
 		"        client %p\n"
+		"        transports %u\n"
 		"        cl_exchange_flags %x\n",
-		ntohl(ds->ds_ip_addr), ntohs(ds->ds_port),
-		atomic_read(&ds->ds_count), ds->ds_clp,
+		ds->ds_node.dn_remotestr,
+		atomic_read(&ds->ds_node.dn_ref),
+		pnfs_ds_state_name(&ds->ds_node), ds->ds_node.dn_error,
+		ds->ds_clp, ds->ds_nrpc,
 		ds->ds_clp ? ds->ds_clp->cl_exchange_flags : 0);
 }
 
@@ -86,56 +88,78 @@ void print_deviceid(struct nfs4_deviceid *id)
 		p[0], p[1], p[2], p[3]);
 }
 
-/* nfs4_ds_cache_lock is held */
-static struct nfs4_pnfs_ds *
-_data_server_lookup_locked(u32 ip_addr, u32 port)
+/*
+ * Trunk the data server session over the number of transports asked for
+ * with the ds_nconnect mount option.  If some cannot be created, carry on
+ * with the ones we have.
+ */
+static void
+nfs4_pnfs_ds_trunk(struct nfs_server *mds_srv, struct nfs4_pnfs_ds *ds,
+		   struct nfs_client *clp)
 {
-	struct nfs4_pnfs_ds *ds;
-
-	dprintk("_data_server_lookup: ip_addr=%x port=%hu\n",
-			ntohl(ip_addr), ntohs(port));
-
-	list_for_each_entry(ds, &nfs4_data_server_cache, ds_node) {
-		if (ds->ds_ip_addr == ip_addr &&
-		    ds->ds_port == port) {
-			return ds;
+	const struct rpc_timeout *timeo = mds_srv->client->cl_xprt->timeout;
+	unsigned int nconnect = max(mds_srv->ds_nconnect, 1U);
+	struct rpc_clnt *clnt;
+
+	ds->ds_rpc[0] = clp->cl_rpcclient;
+	ds->ds_nrpc = 1;
+	while (ds->ds_nrpc < nconnect) {
+		clnt = nfs4_create_trunked_rpcclient(clp, timeo);
+		if (IS_ERR(clnt)) {
+			printk(KERN_INFO "%s: %s using %u of %u transports\n",
+			       __func__, ds->ds_node.dn_remotestr,
+			       ds->ds_nrpc, nconnect);
+			break;
 		}
+		ds->ds_rpc[ds->ds_nrpc++] = clnt;
 	}
-	return NULL;
 }
 
-/* Create an rpc to the data server defined in 'dev_list' */
+/* Spread RPCs to a trunked data server round-robin over its transports */
+struct rpc_clnt *
+nfs4_fl_ds_rpcclient(struct nfs4_pnfs_ds *ds)
+{
+	unsigned int i;
+
+	if (ds->ds_nrpc <= 1)
+		return ds->ds_clp->cl_rpcclient;
+	i = (unsigned int)atomic_inc_return(&ds->ds_rpc_next) % ds->ds_nrpc;
+	return ds->ds_rpc[i];
+}
+
+/*
+ * Create an rpc to the data server defined in 'dev_list'.  Called through
+ * pnfs_ds_connect(), which serializes connects to the same data server.
+ */
 static int
-nfs4_pnfs_ds_create(struct nfs_server *mds_srv, struct nfs4_pnfs_ds *ds)
+nfs4_pnfs_ds_create(struct nfs_server *mds_srv, struct pnfs_ds_node *node)
 {
+	struct nfs4_pnfs_ds	*ds = container_of(node, struct nfs4_pnfs_ds,
+						   ds_node);
 	struct nfs_server	*tmp;
-	struct sockaddr_in	sin;
+	struct sockaddr		*ds_addr = (struct sockaddr *)&ds->ds_node.dn_addr;
 	struct rpc_clnt		*mds_clnt = mds_srv->client;
 	struct nfs_client	*clp = mds_srv->nfs_client;
 	struct sockaddr		*mds_addr;
 	int err = 0;
 
-	dprintk("--> %s ip:port %x:%hu au_flavor %d\n", __func__,
-		ntohl(ds->ds_ip_addr), ntohs(ds->ds_port),
+	dprintk("--> %s %s au_flavor %d\n", __func__, ds->ds_node.dn_remotestr,
 		mds_clnt->cl_auth->au_flavor);
 
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = ds->ds_ip_addr;
-	sin.sin_port = ds->ds_port;
-
 	/*
 	 * If this DS is also the MDS, use the MDS session only if the
 	 * MDS exchangeid flags show the EXCHGID4_FLAG_USE_PNFS_DS pNFS role.
 	 */
 	mds_addr = (struct sockaddr *)&clp->cl_addr;
-	if (nfs_sockaddr_cmp((struct sockaddr *)&sin, mds_addr)) {
+	if (nfs_sockaddr_cmp(ds_addr, mds_addr)) {
 		if (!(clp->cl_exchange_flags & EXCHGID4_FLAG_USE_PNFS_DS)) {
-			printk(KERN_INFO
-			       "ip:port %x:%hu is not a pNFS Data Server\n",
-			       ntohl(ds->ds_ip_addr), ntohs(ds->ds_port));
+			printk(KERN_INFO "%s is not a pNFS Data Server\n",
+			       ds->ds_node.dn_remotestr);
 			err = -ENODEV;
 		} else {
 			atomic_inc(&clp->cl_count);
+			ds->ds_rpc[0] = clp->cl_rpcclient;
+			ds->ds_nrpc = 1;
 			ds->ds_clp = clp;
 			dprintk("%s Using MDS Session for DS\n", __func__);
 		}
@@ -144,8 +168,10 @@ nfs4_pnfs_ds_create(struct nfs_server *mds_srv, struct nfs4_pnfs_ds *ds)
 
 	/* Temporay server for nfs4_set_client */
 	tmp = kzalloc(sizeof(struct nfs_server), GFP_KERNEL);
-	if (!tmp)
+	if (!tmp) {
+		err = -ENOMEM;
 		goto out;
+	}
 
 	/*
 	 * Set a retrans, timeout interval, and authflavor equual to the MDS
@@ -154,8 +180,8 @@ nfs4_pnfs_ds_create(struct nfs_server *mds_srv, struct nfs4_pnfs_ds *ds)
 	 */
 	err = nfs4_set_client(tmp,
 			      mds_srv->nfs_client->cl_hostname,
-			      (struct sockaddr *)&sin,
-			      sizeof(struct sockaddr),
+			      ds_addr,
+			      ds->ds_node.dn_addrlen,
 			      mds_srv->nfs_client->cl_ipaddr,
 			      mds_clnt->cl_auth->au_flavor,
 			      IPPROTO_TCP,
@@ -177,8 +203,8 @@ nfs4_pnfs_ds_create(struct nfs_server *mds_srv, struct nfs4_pnfs_ds *ds)
 		goto out_put;
 
 	if (!(clp->cl_exchange_flags & EXCHGID4_FLAG_USE_PNFS_DS)) {
-		printk(KERN_INFO "ip:port %x:%hu is not a pNFS Data Server\n",
-		       ntohl(ds->ds_ip_addr), ntohs(ds->ds_port));
+		printk(KERN_INFO "%s is not a pNFS Data Server\n",
+		       ds->ds_node.dn_remotestr);
 		err = -ENODEV;
 		goto out_put;
 	}
@@ -192,11 +218,11 @@ nfs4_pnfs_ds_create(struct nfs_server *mds_srv, struct nfs4_pnfs_ds *ds)
 	clp->cl_last_renewal = jiffies;
 
 	clear_bit(NFS4CLNT_SESSION_RESET, &clp->cl_state);
+	nfs4_pnfs_ds_trunk(mds_srv, ds, clp);
 	ds->ds_clp = clp;
 
-	dprintk("%s: ip=%x, port=%hu, rpcclient %p\n", __func__,
-				ntohl(ds->ds_ip_addr), ntohs(ds->ds_port),
-				clp->cl_rpcclient);
+	dprintk("%s: %s rpcclient %p\n", __func__, ds->ds_node.dn_remotestr,
+		clp->cl_rpcclient);
 out_free:
 	kfree(tmp);
 out:
@@ -210,10 +236,15 @@ out_put:
 static void
 destroy_ds(struct nfs4_pnfs_ds *ds)
 {
+	unsigned int i;
+
 	dprintk("--> %s\n", __func__);
 	ifdebug(FACILITY)
 		print_ds(ds);
 
+	/* ds_rpc[0] belongs to ds_clp */
+	for (i = 1; i < ds->ds_nrpc; i++)
+		rpc_shutdown_client(ds->ds_rpc[i]);
 	if (ds->ds_clp)
 		nfs_put_client(ds->ds_clp);
 	kfree(ds);
@@ -229,14 +260,8 @@ nfs4_fl_free_deviceid(struct nfs4_file_layout_dsaddr *dsaddr)
 
 	for (i = 0; i < dsaddr->ds_num; i++) {
 		ds = dsaddr->ds_list[i];
-		if (ds != NULL) {
-			if (atomic_dec_and_lock(&ds->ds_count,
-						&nfs4_ds_cache_lock)) {
-				list_del_init(&ds->ds_node);
-				spin_unlock(&nfs4_ds_cache_lock);
-				destroy_ds(ds);
-			}
-		}
+		if (ds != NULL && pnfs_put_ds(&ds->ds_node))
+			destroy_ds(ds);
 	}
 	kfree(dsaddr->stripe_indices);
 	kfree(dsaddr);
@@ -252,102 +277,42 @@ nfs4_fl_free_deviceid_callback(struct pnfs_deviceid_node *device)
 }
 
 static struct nfs4_pnfs_ds *
-nfs4_pnfs_ds_add(struct inode *inode, u32 ip_addr, u32 port)
+nfs4_pnfs_ds_add(struct inode *inode, struct sockaddr *sap, size_t salen)
 {
-	struct nfs4_pnfs_ds *tmp_ds, *ds;
+	struct net *net = NFS_SERVER(inode)->client->cl_xprt->xprt_net;
+	struct pnfs_ds_node *node;
+	struct nfs4_pnfs_ds *ds;
+
+	node = pnfs_find_get_ds(LAYOUT_NFSV4_1_FILES, net, sap);
+	if (node)
+		return container_of(node, struct nfs4_pnfs_ds, ds_node);
 
-	ds = kzalloc(sizeof(*tmp_ds), GFP_KERNEL);
+	ds = kzalloc(sizeof(*ds), GFP_KERNEL);
 	if (!ds)
-		goto out;
+		return NULL;
+	pnfs_init_ds_node(&ds->ds_node, LAYOUT_NFSV4_1_FILES, net, sap, salen);
 
-	spin_lock(&nfs4_ds_cache_lock);
-	tmp_ds = _data_server_lookup_locked(ip_addr, port);
-	if (tmp_ds == NULL) {
-		ds->ds_ip_addr = ip_addr;
-		ds->ds_port = port;
-		atomic_set(&ds->ds_count, 1);
-		INIT_LIST_HEAD(&ds->ds_node);
-		ds->ds_clp = NULL;
-		list_add(&ds->ds_node, &nfs4_data_server_cache);
-		dprintk("%s add new data server ip 0x%x\n", __func__,
-			ds->ds_ip_addr);
-	} else {
+	node = pnfs_add_ds(&ds->ds_node);
+	if (node != &ds->ds_node) {
 		kfree(ds);
-		atomic_inc(&tmp_ds->ds_count);
-		dprintk("%s data server found ip 0x%x, inc'ed ds_count to %d\n",
-			__func__, tmp_ds->ds_ip_addr,
-			atomic_read(&tmp_ds->ds_count));
-		ds = tmp_ds;
+		ds = container_of(node, struct nfs4_pnfs_ds, ds_node);
 	}
-	spin_unlock(&nfs4_ds_cache_lock);
-out:
 	return ds;
 }
 
 /*
- * Currently only support ipv4, and one multi-path address.
+ * Currently only support one multi-path address.
  */
 static struct nfs4_pnfs_ds *
 decode_and_add_ds(__be32 **pp, struct inode *inode)
 {
-	struct nfs4_pnfs_ds *ds = NULL;
-	char *buf;
-	const char *ipend, *pstr;
-	u32 ip_addr, port;
-	int nlen, rlen, i;
-	int tmp[2];
-	__be32 *r_netid, *r_addr, *p = *pp;
-
-	/* r_netid */
-	nlen = be32_to_cpup(p++);
-	r_netid = p;
-	p += XDR_QUADLEN(nlen);
-
-	/* r_addr */
-	rlen = be32_to_cpup(p++);
-	r_addr = p;
-	p += XDR_QUADLEN(rlen);
-	*pp = p;
-
-	/* Check that netid is "tcp" */
-	if (nlen != 3 ||  memcmp((char *)r_netid, "tcp", 3)) {
-		dprintk("%s: ERROR: non ipv4 TCP r_netid\n", __func__);
-		goto out_err;
-	}
-
-	/* ipv6 length plus port is legal */
-	if (rlen > INET6_ADDRSTRLEN + 8) {
-		dprintk("%s Invalid address, length %d\n", __func__,
-			rlen);
-		goto out_err;
-	}
-	buf = kmalloc(rlen + 1, GFP_KERNEL);
-	buf[rlen] = '\0';
-	memcpy(buf, r_addr, rlen);
-
-	/* replace the port dots with dashes for the in4_pton() delimiter*/
-	for (i = 0; i < 2; i++) {
-		char *res = strrchr(buf, '.');
-		*res = '-';
-	}
-
-	/* Currently only support ipv4 address */
-	if (in4_pton(buf, rlen, (u8 *)&ip_addr, '-', &ipend) == 0) {
-		dprintk("%s: Only ipv4 addresses supported\n", __func__);
-		goto out_free;
-	}
-
-	/* port */
-	pstr = ipend;
-	sscanf(pstr, "-%d-%d", &tmp[0], &tmp[1]);
-	port = htons((tmp[0] << 8) | (tmp[1]));
+	struct sockaddr_storage ss;
+	size_t salen;
 
-	ds = nfs4_pnfs_ds_add(inode, ip_addr, port);
-	dprintk("%s Decoded address and port %s\n", __func__, buf);
-out_free:
-	kfree(buf);
-out_err:
-	return ds;
+	salen = pnfs_decode_ds_addr(pp, (struct sockaddr *)&ss, sizeof(ss));
+	if (salen == 0)
+		return NULL;
+	return nfs4_pnfs_ds_add(inode, (struct sockaddr *)&ss, salen);
 }
 
 /* Decode opaque device data and return the result */
@@ -454,6 +419,7 @@ decode_and_add_device(struct inode *inode, struct pnfs_device *dev)
 {
 	struct nfs4_file_layout_dsaddr *dsaddr;
 	struct pnfs_deviceid_node *d;
+	int i;
 
 	dsaddr = decode_device(inode, dev);
 	if (!dsaddr) {
@@ -464,8 +430,15 @@ decode_and_add_device(struct inode *inode, struct pnfs_device *dev)
 
 	d = pnfs_add_deviceid(NFS_SERVER(inode)->nfs_client->cl_devid_cache,
 			      &dsaddr->deviceid);
-
-	return container_of(d, struct nfs4_file_layout_dsaddr, deviceid);
+	dsaddr = container_of(d, struct nfs4_file_layout_dsaddr, deviceid);
+
+	/* Bring up all data server sessions in parallel ahead of I/O */
+	for (i = 0; i < dsaddr->ds_num; i++)
+		if (dsaddr->ds_list[i])
+			pnfs_ds_connect_async(NFS_SERVER(inode), d,
+					      &dsaddr->ds_list[i]->ds_node,
+					      nfs4_pnfs_ds_create);
+	return dsaddr;
 }
 
 /*
@@ -554,8 +527,8 @@ nfs4_fl_find_get_deviceid(struct nfs_client *clp, struct nfs4_deviceid *id)
  * Want res = (offset - layout->pattern_offset)/ layout->stripe_unit
  * Then: ((res + fsi) % dsaddr->stripe_count)
  */
-static u32
-_nfs4_fl_calc_j_index(struct pnfs_layout_segment *lseg, loff_t offset)
+u32
+nfs4_fl_calc_j_index(struct pnfs_layout_segment *lseg, loff_t offset)
 {
 	struct nfs4_filelayout_segment *flseg = FILELAYOUT_LSEG(lseg);
 	u64 tmp;
@@ -571,7 +544,7 @@ nfs4_fl_calc_ds_index(struct pnfs_layout_segment *lseg, loff_t offset)
 {
 	u32 j;
 
-	j = _nfs4_fl_calc_j_index(lseg, offset);
+	j = nfs4_fl_calc_j_index(lseg, offset);
 	return FILELAYOUT_LSEG(lseg)->dsaddr->stripe_indices[j];
 }
 
@@ -589,7 +562,7 @@ nfs4_fl_select_ds_fh(struct pnfs_layout_segment *lseg, loff_t offset)
 		else
 			i = nfs4_fl_calc_ds_index(lseg, offset);
 	} else
-		i = _nfs4_fl_calc_j_index(lseg, offset);
+		i = nfs4_fl_calc_j_index(lseg, offset);
 	return flseg->fh_array[i];
 }
 
@@ -597,6 +570,7 @@ struct nfs4_pnfs_ds *
 nfs4_fl_prepare_ds(struct pnfs_layout_segment *lseg, u32 ds_idx)
 {
 	struct nfs4_file_layout_dsaddr *dsaddr;
+	int err;
 
 	dsaddr = FILELAYOUT_LSEG(lseg)->dsaddr;
 	if (dsaddr->ds_list[ds_idx] == NULL) {
@@ -605,16 +579,13 @@ nfs4_fl_prepare_ds(struct pnfs_layout_segment *lseg, u32 ds_idx)
 		return NULL;
 	}
 
-	if (!dsaddr->ds_list[ds_idx]->ds_clp) {
-		int err;
-
-		err = nfs4_pnfs_ds_create(NFS_SERVER(lseg->layout->inode),
-					  dsaddr->ds_list[ds_idx]);
-		if (err) {
-			printk(KERN_ERR "%s nfs4_pnfs_ds_create error %d\n",
-			       __func__, err);
-			return NULL;
-		}
+	err = pnfs_ds_connect(NFS_SERVER(lseg->layout->inode),
+			      &dsaddr->ds_list[ds_idx]->ds_node,
+			      nfs4_pnfs_ds_create);
+	if (err) {
+		printk(KERN_ERR "%s nfs4_pnfs_ds_create error %d\n",
+		       __func__, err);
+		return NULL;
 	}
 	return dsaddr->ds_list[ds_idx];
 }
@@ -408,7 +408,7 @@ static void nfs41_sequence_free_slot(struct nfs4_sequence_res *res)
 	res->sr_slot = NULL;
 }
 
-static int nfs41_sequence_done(struct rpc_task *task, struct nfs4_sequence_res *res)
+int nfs41_sequence_done(struct rpc_task *task, struct nfs4_sequence_res *res)
 {
 	unsigned long timestamp;
 	struct nfs_client *clp;
@@ -463,6 +463,7 @@ out_retry:
 	rpc_delay(task, NFS4_POLL_RETRY_MAX);
 	return 0;
 }
+EXPORT_SYMBOL_GPL(nfs41_sequence_done);
 
 static int nfs4_sequence_done(struct rpc_task *task,
 			       struct nfs4_sequence_res *res)
@@ -609,6 +610,7 @@ out:
 	dprintk("<-- %s status=%d\n", __func__, ret);
 	return ret;
 }
+EXPORT_SYMBOL_GPL(nfs4_setup_sequence);
 
 struct nfs41_call_sync_data {
 	const struct nfs_server *seq_server;
@@ -821,11 +823,12 @@ static void nfs4_opendata_free(struct kref *kref)
 	kfree(p);
 }
 
-static void nfs4_opendata_put(struct nfs4_opendata *p)
+void nfs4_opendata_put(struct nfs4_opendata *p)
 {
 	if (p != NULL)
 		kref_put(&p->kref, nfs4_opendata_free);
 }
+EXPORT_SYMBOL_GPL(nfs4_opendata_put);
 
 static int nfs4_wait_for_completion_rpc_task(struct rpc_task *task)
 {
@@ -1487,18 +1490,10 @@ static const struct rpc_call_ops nfs4_recover_open_ops = {
 static int nfs4_run_open_task(struct nfs4_opendata *data, int isrecover)
 {
 	struct inode *dir = data->dir->d_inode;
-	struct nfs_server *server = NFS_SERVER(dir); /* XXX Cohort CAREFUL */
+	struct nfs_server *server = NFS_SERVER(dir);
 	struct nfs_openargs *o_arg = &data->o_arg;
 	struct nfs_openres *o_res = &data->o_res;
 	struct rpc_task *task;
-#if defined(CONFIG_PNFS_COHORT)
-        struct rpc_clnt *rpc_client =
-                (data->ch_flags & COHORT_OPEN_FLAG_REPLICA) ?
-                data->ch_client : server->client;
-#else
-        struct rpc_clnt *rpc_client = server->client;
-#endif
-
 	struct rpc_message msg = {
 		.rpc_proc = &nfs4_procedures[NFSPROC4_CLNT_OPEN],
 		.rpc_argp = o_arg,
@@ -1506,7 +1501,7 @@ static int nfs4_run_open_task(struct nfs4_opendata *data, int isrecover)
 		.rpc_cred = data->owner->so_cred,
 	};
 	struct rpc_task_setup task_setup_data = {
-		.rpc_client = rpc_client,
+		.rpc_client = server->client,
 		.rpc_message = &msg,
 		.callback_ops = &nfs4_open_ops,
 		.callback_data = data,
@@ -1571,16 +1566,6 @@ int _nfs4_proc_open(struct nfs4_opendata *data)
 	if (status != 0 || !data->rpc_done)
 		return status;
 
-#if defined(CONFIG_PNFS_COHORT)
-        /* XXX If this open is on a replica rmds, do not update
-         * inode state, etc, as these operations have already
-         * succeeded. */
-        if (data->ch_flags & COHORT_OPEN_FLAG_REPLICA) {
-                dprintk("%s replica data %p\n",  __func__, data);
-                goto replica;
-        }
-#endif
-
 	if (o_arg->open_flags & O_CREAT) {
 		update_changeattr(dir, &o_res->cinfo);
 		nfs_post_op_update_inode(dir, o_res->dir_attr);
@@ -1595,10 +1580,6 @@ int _nfs4_proc_open(struct nfs4_opendata *data)
 	}
 	if (!(o_res->f_attr->valid & NFS_ATTR_FATTR))
 		_nfs4_proc_getattr(server, &o_res->fh, o_res->f_attr);
-
-#if defined(CONFIG_PNFS_COHORT)
-replica:
-#endif
 	return 0;
 }
 EXPORT_SYMBOL_GPL(_nfs4_proc_open);
@@ -2820,10 +2801,9 @@ static int nfs4_do_create(struct inode *dir, struct dentry *dentry, struct nfs4_
                 dprintk("%s nfs_instantiate status %d\n", __func__,
                         status);
 #if defined(CONFIG_PNFS_COHORT)
-                /* Schedule the operation to be mirrored on Cohort replicas,
-                 * if any.  Initially updates will be done synchronously.
-                 * (Deferral of replica updates asynchronous queues seems like
-                 * a natural optimization.) 
+                /* Mirror the operation on Cohort replicas, if any.  The
+                 * layout driver fans out to all replicas in parallel and
+                 * returns once its quorum policy is satisfied.
                  */
                 if (cohort_replicas_p(dir)) {
                         int ch_status;
@@ -5458,6 +5438,16 @@ out:
 	return status;
 }
 
+/* Count a completed layout operation and the time it took */
+static void
+nfs4_pnfs_rpc_stats(struct inode *ino, enum nfs_stat_pnfscounters count,
+		    enum nfs_stat_pnfscounters msecs, struct rpc_task *task)
+{
+	nfs_inc_pnfs_stats(ino, count);
+	nfs_add_pnfs_stats(ino, msecs,
+			   ktime_to_ms(ktime_sub(ktime_get(), task->tk_start)));
+}
+
 static void
 nfs4_layoutget_prepare(struct rpc_task *task, void *calldata)
 {
@@ -5614,6 +5604,11 @@ int nfs4_proc_layoutget(struct nfs4_layoutget *lgp)
 	status = nfs4_wait_for_completion_rpc_task(task);
 	if (status == 0)
 		status = task->tk_status;
+	nfs4_pnfs_rpc_stats(lgp->args.inode, NFSIOS_PNFS_LAYOUTGET,
+			    NFSIOS_PNFS_LAYOUTGET_MSECS, task);
+	if (status)
+		nfs_inc_pnfs_stats(lgp->args.inode,
+				   NFSIOS_PNFS_LAYOUTGET_FAIL);
 	if (status == 0)
 		status = pnfs_layout_process(lgp);
 	else {
@@ -5658,8 +5653,12 @@ nfs4_layoutcommit_done(struct rpc_task *task, void *calldata)
 	if (!nfs4_sequence_done(task, &data->res.seq_res))
 		return;
 
-	if (nfs4_async_handle_error(task, server, NULL, NULL) == -EAGAIN)
+	if (nfs4_async_handle_error(task, server, NULL, NULL) == -EAGAIN) {
 		nfs_restart_rpc(task, server->nfs_client);
+		return;
+	}
+	nfs4_pnfs_rpc_stats(data->args.inode, NFSIOS_PNFS_LAYOUTCOMMIT,
+			    NFSIOS_PNFS_LAYOUTCOMMIT_MSECS, task);
 }
 
 static void nfs4_layoutcommit_release(void *lcdata)
@@ -5771,6 +5770,9 @@ static void nfs4_layoutreturn_done(struct rpc_task *task, void *calldata)
 		nfs_restart_rpc(task, lrp->clp);
 		return;
 	}
+	if (lrp->args.return_type == RETURN_FILE)
+		nfs4_pnfs_rpc_stats(lrp->args.inode, NFSIOS_PNFS_LAYOUTRETURN,
+				    NFSIOS_PNFS_LAYOUTRETURN_MSECS, task);
 	if ((task->tk_status == 0) && (lrp->args.return_type == RETURN_FILE)) {
 		struct pnfs_layout_hdr *lo = NFS_I(lrp->args.inode)->layout;
 
@@ -5778,7 +5780,7 @@ static void nfs4_layoutreturn_done(struct rpc_task *task, void *calldata)
 		if (lrp->res.lrs_present)
 			pnfs_set_layout_stateid(lo, &lrp->res.stateid, true);
 		else
-			BUG_ON(!list_empty(&lo->segs));
+			BUG_ON(!RB_EMPTY_ROOT(&lo->segs));
 		spin_unlock(&lo->inode->i_lock);
 	}
 	dprintk("<-- %s\n", __func__);
@@ -5931,6 +5933,11 @@ int nfs4_proc_getdeviceinfo(struct nfs_server *server, struct pnfs_device *pdev)
 	struct nfs4_exception exception = { };
 	int err;
 
+	nfs_add_server_pnfs_stats(server,
+			server->pnfs_meta_ld &&
+			server->pnfs_meta_ld->id == pdev->layout_type ?
+				NFSIOS_PNFS_META : NFSIOS_PNFS_DATA,
+			NFSIOS_PNFS_GETDEVICEINFO, 1);
 	do {
 		err = nfs4_handle_exception(server,
 					_nfs4_proc_getdeviceinfo(server, pdev),
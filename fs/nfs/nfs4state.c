@@ -620,27 +620,15 @@ static void __nfs4_close(struct path *path, struct nfs4_state *state,
 	nfs4_state_set_mode_locked(state, newstate);
 	spin_unlock(&owner->so_lock);
 
+	/* Return or cache the layout if this was the last open */
+	if (newstate == 0)
+		pnfs_layout_close(state->inode, wait);
+
 	if (!call_close) {
 		nfs4_put_open_state(state);
 		nfs4_put_state_owner(owner);
-	} else {
-		u32 roc_iomode;
-		struct nfs_inode *nfsi = NFS_I(state->inode);
-
-		/* FIXME: should return the layout only on last close */
-		if (has_layout(nfsi) &&
-		    (roc_iomode = pnfs_layout_roc_iomode(nfsi)) != 0) {
-			struct pnfs_layout_range range = {
-				.iomode = roc_iomode,
-				.offset = 0,
-				.length = NFS4_MAX_UINT64,
-			};
-
-			pnfs_return_layout(state->inode, &range, wait);
-		}
-
+	} else
 		nfs4_do_close(path, state, gfp_mask, wait);
-	}
 }
 
 void nfs4_close_state(struct path *path, struct nfs4_state *state, fmode_t fmode)
@@ -815,6 +815,13 @@ static int nfs4_stat_to_errno(int);
 #define NFS4_dec_rintegrity_sz	(compound_decode_hdr_maxsz + \
                                 decode_sequence_maxsz + \
 				decode_rintegrity_maxsz)
+#define NFS4_enc_cohort_rpl_log_sz (compound_encode_hdr_maxsz + \
+				encode_sequence_maxsz + \
+				XDR_QUADLEN(COHORT_RPL_LOG_MAXBYTES))
+#define NFS4_dec_cohort_rpl_log_sz (compound_decode_hdr_maxsz + \
+				decode_sequence_maxsz + \
+				COHORT_RPL_LOG_MAXOPS * \
+				(decode_putfh_maxsz + decode_create_maxsz))
 #endif /* CONFIG_PNFS_COHORT */
 const u32 nfs41_maxwrite_overhead = ((RPC_MAX_HEADER_WITH_AUTH +
 				      compound_encode_hdr_maxsz +
@@ -3129,6 +3136,37 @@ static int nfs4_xdr_enc_rintegrity(struct rpc_rqst *req, uint32_t *p,
 
 	return 0;
 }
+
+/*
+ * Encode a replica log batch.  The batch is sized against the replica
+ * session's ca_maxoperations rather than NFS4_MAX_OPS, so the op count
+ * is backfilled here instead of by encode_nops().
+ */
+static int nfs4_xdr_enc_cohort_rpl_log(struct rpc_rqst *req, uint32_t *p,
+				       const struct cohort_rpl_log_args *args)
+{
+	struct cohort_rpl_log_rec *rec;
+	struct xdr_stream xdr;
+	struct compound_hdr hdr = {
+		.minorversion = nfs4_xdr_minorversion(&args->seq_args),
+	};
+
+	xdr_init_encode(&xdr, &req->rq_snd_buf, p);
+	encode_compound_hdr(&xdr, req, &hdr);
+	encode_sequence(&xdr, &args->seq_args, &hdr);
+	list_for_each_entry(rec, args->recs, lr_list) {
+		if (rec->lr_putfh)
+			encode_putfh(&xdr, &rec->lr_dir_fh, &hdr);
+		if (rec->lr_op == OP_CREATE)
+			encode_create(&xdr, &rec->lr_create, &hdr);
+		else
+			encode_remove(&xdr, &rec->lr_name, &hdr);
+	}
+	BUG_ON(hdr.nops > COHORT_RPL_LOG_MAXOPS + 1);
+	*hdr.nops_p = htonl(hdr.nops);
+
+	return 0;
+}
 #endif /* CONFIG_PNFS_COHORT */
 
 #endif /* CONFIG_NFS_V4_1 */
@@ -6945,6 +6983,45 @@ static int nfs4_xdr_dec_rintegrity(struct rpc_rqst *rqstp, uint32_t *p,
 out:
 	return status;
 }
+
+/*
+ * Decode a replica log batch response.  res->ndone counts the records
+ * the replica applied before the first failing op.
+ */
+static int nfs4_xdr_dec_cohort_rpl_log(struct rpc_rqst *rqstp, uint32_t *p,
+				       struct cohort_rpl_log_res *res)
+{
+	struct cohort_rpl_log_rec *rec;
+	struct nfs4_change_info cinfo;
+	struct xdr_stream xdr;
+	struct compound_hdr hdr;
+	int status;
+
+	res->ndone = 0;
+	xdr_init_decode(&xdr, &rqstp->rq_rcv_buf, p);
+	status = decode_compound_hdr(&xdr, &hdr);
+	if (status)
+		goto out;
+	status = decode_sequence(&xdr, &res->seq_res, rqstp);
+	if (status)
+		goto out;
+	list_for_each_entry(rec, res->recs, lr_list) {
+		if (rec->lr_putfh) {
+			status = decode_putfh(&xdr);
+			if (status)
+				goto out;
+		}
+		if (rec->lr_op == OP_CREATE)
+			status = decode_create(&xdr, &cinfo);
+		else
+			status = decode_remove(&xdr, &cinfo);
+		if (status)
+			goto out;
+		res->ndone++;
+	}
+out:
+	return status;
+}
 #endif /* CONFIG_PNFS_COHORT */
 
 #endif /* CONFIG_NFS_V4_1 */
@@ -7151,6 +7228,7 @@ struct rpc_procinfo	nfs4_procedures[] = {
   PROC(PNFS_COMMIT, enc_dscommit,  dec_dscommit),
 #if defined(CONFIG_PNFS_COHORT)
   PROC(RINTEGRITY, enc_rintegrity,  dec_rintegrity),
+  PROC(COHORT_RPL_LOG, enc_cohort_rpl_log, dec_cohort_rpl_log),
 #endif /* CONFIG_PNFS_COHORT */
 #endif /* CONFIG_NFS_V4_1 */
 };
@@ -40,6 +40,9 @@
  */
 
 #include <linux/module.h>
+#include <linux/highmem.h>
+#include <linux/lcm.h>
+#include <linux/async_tx.h>
 #include <scsi/scsi_device.h>
 #include <scsi/osd_attributes.h>
 #include <scsi/osd_initiator.h>
@@ -56,6 +59,18 @@ enum { BIO_MAX_PAGES_KMALLOC =
 		(PAGE_SIZE - sizeof(struct bio)) / sizeof(struct bio_vec),
 };
 
+/* Which component of a mirror group serves a read */
+enum objio_read_policy {
+	OBJIO_READ_FIRST = 0,		/* always the first mirror */
+	OBJIO_READ_ROUND_ROBIN = 1,	/* rotate by stripe unit */
+	OBJIO_READ_LEAST_BUSY = 2,	/* fewest reads in flight on the osd */
+};
+
+static unsigned int mirror_read_policy = OBJIO_READ_ROUND_ROBIN;
+module_param(mirror_read_policy, uint, 0644);
+MODULE_PARM_DESC(mirror_read_policy, "Mirror selection for reads: "
+		 "0 first, 1 round-robin by stripe unit, 2 least busy osd");
+
 /* A per mountpoint struct currently for device cache */
 struct objio_mount_type {
 	struct list_head dev_list;
@@ -66,6 +81,7 @@ struct _dev_ent {
 	struct list_head list;
 	struct nfs4_deviceid d_id;
 	struct osd_dev *od;
+	atomic_t busy;		/* reads in flight */
 };
 
 static void _dev_list_remove_all(struct objio_mount_type *omt)
@@ -84,7 +100,7 @@ static void _dev_list_remove_all(struct objio_mount_type *omt)
 	spin_unlock(&omt->dev_list_lock);
 }
 
-static struct osd_dev *___dev_list_find(struct objio_mount_type *omt,
+static struct _dev_ent *___dev_list_find(struct objio_mount_type *omt,
 	struct nfs4_deviceid *d_id)
 {
 	struct list_head *le;
@@ -93,45 +109,52 @@ static struct osd_dev *___dev_list_find(struct objio_mount_type *omt,
 		struct _dev_ent *de = list_entry(le, struct _dev_ent, list);
 
 		if (0 == memcmp(&de->d_id, d_id, sizeof(*d_id)))
-			return de->od;
+			return de;
 	}
 
 	return NULL;
 }
 
-static struct osd_dev *_dev_list_find(struct objio_mount_type *omt,
+static struct _dev_ent *_dev_list_find(struct objio_mount_type *omt,
 	struct nfs4_deviceid *d_id)
 {
-	struct osd_dev *od;
+	struct _dev_ent *de;
 
 	spin_lock(&omt->dev_list_lock);
-	od = ___dev_list_find(omt, d_id);
+	de = ___dev_list_find(omt, d_id);
 	spin_unlock(&omt->dev_list_lock);
-	return od;
+	return de;
 }
 
-static int _dev_list_add(struct objio_mount_type *omt,
+/* Returns the cached entry for d_id, which is the new one unless someone
+ * raced us to add it, in which case our reference on od is dropped.
+ */
+static struct _dev_ent *_dev_list_add(struct objio_mount_type *omt,
 	struct nfs4_deviceid *d_id, struct osd_dev *od)
 {
 	struct _dev_ent *de = kzalloc(sizeof(*de), GFP_KERNEL);
+	struct _dev_ent *old;
 
 	if (!de)
-		return -ENOMEM;
+		return ERR_PTR(-ENOMEM);
 
 	spin_lock(&omt->dev_list_lock);
 
-	if (___dev_list_find(omt, d_id)) {
+	old = ___dev_list_find(omt, d_id);
+	if (old) {
+		spin_unlock(&omt->dev_list_lock);
 		kfree(de);
-		goto out;
+		osduld_put_device(od);
+		return old;
 	}
 
 	de->d_id = *d_id;
 	de->od = od;
+	atomic_set(&de->busy, 0);
 	list_add(&de->list, &omt->dev_list);
 
-out:
 	spin_unlock(&omt->dev_list_lock);
-	return 0;
+	return de;
 }
 
 struct objio_segment {
@@ -140,16 +163,24 @@ struct objio_segment {
 	unsigned mirrors_p1;
 	unsigned stripe_unit;
 	unsigned group_width;	/* Data stripe_units without integrity comps */
+	unsigned parity;	/* Integrity comps per group: 0, 1 or 2 */
+	bool parity_rotate;	/* RAID-5/PQ; RAID-4 keeps parity last */
 	u64 group_depth;
 	unsigned group_count;
 
+	/* Parity writes in flight, by stripe row; see _raid_lock_rows() */
+	spinlock_t rows_lock;
+	struct list_head rows_locked;
+	wait_queue_head_t rows_wait;
+
 	unsigned num_comps;
 	/* variable length */
-	struct osd_dev	*ods[1];
+	struct _dev_ent	*devs[1];
 };
 
 struct objio_state;
 typedef ssize_t (*objio_done_fn)(struct objio_state *ios);
+struct objio_raid;
 
 struct objio_state {
 	/* Generic layer */
@@ -160,6 +191,8 @@ struct objio_state {
 	struct kref kref;
 	objio_done_fn done;
 	void *private;
+	struct work_struct work;	/* mirror failover, RAID phases */
+	struct objio_raid *raid;	/* parity layouts only */
 
 	unsigned long length;
 	unsigned numdevs; /* Actually used devs in this IO */
@@ -169,18 +202,25 @@ struct objio_state {
 		struct osd_request *or;
 		unsigned long length;
 		u64 offset;
-		unsigned dev;
+		unsigned dev;		/* first component of the mirror group */
+		unsigned mirror;	/* reads: mirror actually used */
+		unsigned tries;		/* reads: mirrors failed so far */
+		struct _dev_ent *busy;	/* reads: accounted in busy */
+		struct osd_sg_entry *sglist;	/* RAID: object extents */
+		unsigned num_sg;
+		bool failed;		/* RAID: this component read failed */
 	} per_dev[];
 };
 
 /* Send and wait for a get_device_info of devices in the layout,
    then look them up with the osd_initiator library */
-static struct osd_dev *_device_lookup(struct pnfs_layout_hdr *pnfslay,
+static struct _dev_ent *_device_lookup(struct pnfs_layout_hdr *pnfslay,
 			       struct objio_segment *objio_seg, unsigned comp)
 {
 	struct pnfs_osd_layout *layout = objio_seg->layout;
 	struct pnfs_osd_deviceaddr *deviceaddr;
 	struct nfs4_deviceid *d_id;
+	struct _dev_ent *de;
 	struct osd_dev *od;
 	struct osd_dev_info odi;
 	struct objio_mount_type *omt = NFS_SERVER(pnfslay->inode)->pnfs_ld_data;
@@ -188,9 +228,9 @@ static struct osd_dev *_device_lookup(struct pnfs_layout_hdr *pnfslay,
 
 	d_id = &layout->olo_comps[comp].oc_object_id.oid_device_id;
 
-	od = _dev_list_find(omt, d_id);
-	if (od)
-		return od;
+	de = _dev_list_find(omt, d_id);
+	if (de)
+		return de;
 
 	err = objlayout_get_deviceinfo(pnfslay, d_id, &deviceaddr);
 	if (unlikely(err)) {
@@ -222,12 +262,16 @@ static struct osd_dev *_device_lookup(struct pnfs_layout_hdr *pnfslay,
 		goto out;
 	}
 
-	_dev_list_add(omt, d_id, od);
+	de = _dev_list_add(omt, d_id, od);
+	if (unlikely(IS_ERR(de))) {
+		osduld_put_device(od);
+		err = PTR_ERR(de);
+	}
 
 out:
 	dprintk("%s: return=%d\n", __func__, err);
 	objlayout_put_deviceinfo(deviceaddr);
-	return err ? ERR_PTR(err) : od;
+	return err ? ERR_PTR(err) : de;
 }
 
 static int objio_devices_lookup(struct pnfs_layout_hdr *pnfslay,
@@ -239,14 +283,14 @@ static int objio_devices_lookup(struct pnfs_layout_hdr *pnfslay,
 
 	/* lookup all devices */
 	for (i = 0; i < num_comps; i++) {
-		struct osd_dev *od;
+		struct _dev_ent *de;
 
-		od = _device_lookup(pnfslay, objio_seg, i);
-		if (unlikely(IS_ERR(od))) {
-			err = PTR_ERR(od);
+		de = _device_lookup(pnfslay, objio_seg, i);
+		if (unlikely(IS_ERR(de))) {
+			err = PTR_ERR(de);
 			goto out;
 		}
-		objio_seg->ods[i] = od;
+		objio_seg->devs[i] = de;
 	}
 	objio_seg->num_comps = num_comps;
 	err = 0;
@@ -261,10 +305,26 @@ static int _verify_data_map(struct pnfs_osd_layout *layout)
 	struct pnfs_osd_data_map *data_map = &layout->olo_map;
 	u64 stripe_length;
 	u32 group_width;
-
-/* FIXME: Only raid0 for now. if not go through MDS */
-	if (data_map->odm_raid_algorithm != PNFS_OSD_RAID_0) {
-		printk(KERN_ERR "Only RAID_0 for now\n");
+	unsigned parity;
+
+	switch (data_map->odm_raid_algorithm) {
+	case PNFS_OSD_RAID_0:
+		parity = 0;
+		break;
+	case PNFS_OSD_RAID_4:
+	case PNFS_OSD_RAID_5:
+		parity = 1;
+		break;
+	case PNFS_OSD_RAID_PQ:
+		parity = 2;
+		break;
+	default:
+		printk(KERN_ERR "Unsupported raid_algorithm=%u\n",
+		       data_map->odm_raid_algorithm);
+		return -ENOTSUPP;
+	}
+	if (parity && data_map->odm_mirror_cnt) {
+		printk(KERN_ERR "Mirrored parity layouts are not supported\n");
 		return -ENOTSUPP;
 	}
 	if (0 != (data_map->odm_num_comps % (data_map->odm_mirror_cnt + 1))) {
@@ -279,6 +339,17 @@ static int _verify_data_map(struct pnfs_osd_layout *layout)
 		group_width = data_map->odm_num_comps /
 						(data_map->odm_mirror_cnt + 1);
 
+	/* P+Q needs at least two data units for the syndrome */
+	if (parity && (group_width < parity + parity ||
+		       data_map->odm_num_comps % group_width)) {
+		printk(KERN_ERR "Data Map wrong, group_width=%u num_comps=%u "
+			  "for raid_algorithm=%u\n", group_width,
+			  data_map->odm_num_comps,
+			  data_map->odm_raid_algorithm);
+		return -EINVAL;
+	}
+	group_width -= parity;
+
 	stripe_length = (u64)data_map->odm_stripe_unit * group_width;
 	if (stripe_length >= (1ULL << 32)) {
 		printk(KERN_ERR "Total Stripe length(0x%llx)"
@@ -309,18 +380,35 @@ int objio_alloc_lseg(void **outp,
 		return err;
 
 	objio_seg = kzalloc(sizeof(*objio_seg) +
-			(layout->olo_num_comps - 1) * sizeof(objio_seg->ods[0]),
+			(layout->olo_num_comps - 1) * sizeof(objio_seg->devs[0]),
 			GFP_KERNEL);
 	if (!objio_seg)
 		return -ENOMEM;
 
 	objio_seg->layout = layout;
+	spin_lock_init(&objio_seg->rows_lock);
+	INIT_LIST_HEAD(&objio_seg->rows_locked);
+	init_waitqueue_head(&objio_seg->rows_wait);
 	err = objio_devices_lookup(pnfslay, objio_seg);
 	if (err)
 		goto free_seg;
 
 	objio_seg->mirrors_p1 = layout->olo_map.odm_mirror_cnt + 1;
 	objio_seg->stripe_unit = layout->olo_map.odm_stripe_unit;
+	switch (layout->olo_map.odm_raid_algorithm) {
+	case PNFS_OSD_RAID_PQ:
+		objio_seg->parity = 2;
+		objio_seg->parity_rotate = true;
+		break;
+	case PNFS_OSD_RAID_5:
+		objio_seg->parity_rotate = true;
+		/* fallthrough */
+	case PNFS_OSD_RAID_4:
+		objio_seg->parity = 1;
+		break;
+	default:
+		break;
+	}
 	if (layout->olo_map.odm_group_width) {
 		objio_seg->group_width = layout->olo_map.odm_group_width;
 		objio_seg->group_depth = layout->olo_map.odm_group_depth;
@@ -333,6 +421,7 @@ int objio_alloc_lseg(void **outp,
 		objio_seg->group_depth = -1;
 		objio_seg->group_count = 1;
 	}
+	objio_seg->group_width -= objio_seg->parity;
 
 	*outp = objio_seg;
 	return 0;
@@ -373,11 +462,16 @@ int objio_alloc_io_state(void *seg, struct objlayout_io_state **outp)
 	return 0;
 }
 
+static void _raid_unlock_rows(struct objio_state *ios);
+static void _raid_free(struct objio_raid *raid);
+
 void objio_free_io_state(struct objlayout_io_state *ol_state)
 {
 	struct objio_state *ios = container_of(ol_state, struct objio_state,
 					       ol_state);
 
+	_raid_unlock_rows(ios);
+	_raid_free(ios->raid);
 	kfree(ios);
 }
 
@@ -455,7 +549,9 @@ static int _io_check(struct objio_state *ios, bool is_write)
 
 			continue; /* we recovered */
 		}
-		objlayout_io_set_result(&ios->ol_state, ios->per_dev[i].dev,
+		objlayout_io_set_result(&ios->ol_state,
+					ios->per_dev[i].dev +
+						ios->per_dev[i].mirror,
 					osd_pri_2_pnfs_err(osi.osd_err_pri),
 					ios->per_dev[i].offset,
 					ios->per_dev[i].length,
@@ -473,6 +569,18 @@ static int _io_check(struct objio_state *ios, bool is_write)
 /*
  * Common IO state helpers.
  */
+static void _io_end_request(struct _objio_per_comp *per_dev)
+{
+	if (per_dev->or) {
+		osd_end_request(per_dev->or);
+		per_dev->or = NULL;
+	}
+	if (per_dev->busy) {
+		atomic_dec(&per_dev->busy->busy);
+		per_dev->busy = NULL;
+	}
+}
+
 static void _io_free(struct objio_state *ios)
 {
 	unsigned i;
@@ -480,25 +588,29 @@ static void _io_free(struct objio_state *ios)
 	for (i = 0; i < ios->numdevs; i++) {
 		struct _objio_per_comp *per_dev = &ios->per_dev[i];
 
-		if (per_dev->or) {
-			osd_end_request(per_dev->or);
-			per_dev->or = NULL;
-		}
+		_io_end_request(per_dev);
 
 		if (per_dev->bio) {
 			bio_put(per_dev->bio);
 			per_dev->bio = NULL;
 		}
+		kfree(per_dev->sglist);
+		per_dev->sglist = NULL;
 	}
 }
 
-struct osd_dev * _io_od(struct objio_state *ios, unsigned dev)
+static struct _dev_ent *_io_dev(struct objio_state *ios, unsigned dev)
 {
 	unsigned min_dev = ios->objio_seg->layout->olo_comps_index;
 	unsigned max_dev = min_dev + ios->ol_state.num_comps;
 
 	BUG_ON(dev < min_dev || max_dev <= dev);
-	return ios->objio_seg->ods[dev - min_dev];
+	return ios->objio_seg->devs[dev - min_dev];
+}
+
+struct osd_dev * _io_od(struct objio_state *ios, unsigned dev)
+{
+	return _io_dev(ios, dev)->od;
 }
 
 struct _striping_info {
@@ -508,6 +620,9 @@ struct _striping_info {
 	u64 Major;
 	unsigned dev;
 	unsigned unit_off;
+	/* parity layouts only */
+	unsigned first_dev;	/* first component of the group */
+	unsigned par_dev;	/* component of P; Q, if any, follows it */
 };
 
 static void _calc_stripe_info(struct objio_state *ios, u64 file_offset,
@@ -536,9 +651,26 @@ static void _calc_stripe_info(struct objio_state *ios, u64 file_offset,
 	si->obj_offset = si->unit_off + (N * stripe_unit) +
 				  (M * group_depth * stripe_unit);
 
-	/* "H - (N * U)" is just "H % U" so it's bound to u32 */
-	si->dev = (u32)(H - (N * U)) / stripe_unit + G * group_width;
-	si->dev *= ios->objio_seg->mirrors_p1;
+	if (ios->objio_seg->parity) {
+		/* Data units of stripe N start right after its parity, which
+		 * rotates down by parity components per stripe (RAID-4 keeps
+		 * it on the last components).  A group spans W components.
+		 */
+		u32 P = ios->objio_seg->parity;
+		u32 W = group_width + P;
+		u32 RxP = 0;
+
+		if (ios->objio_seg->parity_rotate)
+			RxP = (N % (lcm(W, P) / P)) * P;
+		si->first_dev = G * W;
+		si->par_dev = (W + W - P - RxP) % W + si->first_dev;
+		si->dev = (W + (u32)(H - (N * U)) / stripe_unit - RxP) % W +
+			  si->first_dev;
+	} else {
+		/* "H - (N * U)" is just "H % U" so it's bound to u32 */
+		si->dev = (u32)(H - (N * U)) / stripe_unit + G * group_width;
+		si->dev *= ios->objio_seg->mirrors_p1;
+	}
 
 	si->group_length = T - H;
 	si->total_group_length = T;
@@ -755,10 +887,25 @@ static ssize_t _io_exec(struct objio_state *ios)
 /*
  * read
  */
+static bool _read_failover_needed(struct objio_state *ios);
+static ssize_t _read_failover(struct objio_state *ios);
+static void _read_failover_work(struct work_struct *work);
+
 static ssize_t _read_done(struct objio_state *ios)
 {
 	ssize_t status;
-	int ret = _io_check(ios, false);
+	int ret;
+
+	if (_read_failover_needed(ios)) {
+		/* Async completion runs with ints-off from the block layer */
+		if (ios->ol_state.sync)
+			return _read_failover(ios);
+		INIT_WORK(&ios->work, _read_failover_work);
+		schedule_work(&ios->work);
+		return 0;
+	}
+
+	ret = _io_check(ios, false);
 
 	_io_free(ios);
 
@@ -775,7 +922,7 @@ static int _read_mirrors(struct objio_state *ios, unsigned cur_comp)
 {
 	struct osd_request *or = NULL;
 	struct _objio_per_comp *per_dev = &ios->per_dev[cur_comp];
-	unsigned dev = per_dev->dev;
+	unsigned dev = per_dev->dev + per_dev->mirror;
 	struct pnfs_osd_object_cred *cred =
 			&ios->objio_seg->layout->olo_comps[dev];
 	struct osd_obj_id obj = {
@@ -790,6 +937,8 @@ static int _read_mirrors(struct objio_state *ios, unsigned cur_comp)
 		goto err;
 	}
 	per_dev->or = or;
+	per_dev->busy = _io_dev(ios, dev);
+	atomic_inc(&per_dev->busy->busy);
 
 	osd_req_read(or, &obj, per_dev->offset, per_dev->bio, per_dev->length);
 
@@ -808,6 +957,167 @@ err:
 	return ret;
 }
 
+/* Choose which mirror of the group starting at cur_comp to read from */
+static unsigned _read_pick_mirror(struct objio_state *ios, unsigned cur_comp)
+{
+	struct _objio_per_comp *per_dev = &ios->per_dev[cur_comp];
+	unsigned mirrors_p1 = ios->objio_seg->mirrors_p1;
+	unsigned rr, m, i, busy, best_busy;
+
+	if (mirrors_p1 == 1)
+		return 0;
+
+	/* Consecutive stripe units of a component, and the same stripe unit
+	 * of neighbouring groups, go to different mirrors.
+	 */
+	rr = (unsigned)div_u64(per_dev->offset, ios->objio_seg->stripe_unit);
+	rr = (rr + cur_comp / mirrors_p1) % mirrors_p1;
+
+	switch (mirror_read_policy) {
+	case OBJIO_READ_FIRST:
+		return 0;
+	case OBJIO_READ_LEAST_BUSY:
+		/* ties go round-robin so an idle group still spreads reads */
+		m = rr;
+		best_busy = UINT_MAX;
+		for (i = 0; i < mirrors_p1; i++) {
+			unsigned cand = (rr + i) % mirrors_p1;
+
+			busy = atomic_read(
+				&_io_dev(ios, per_dev->dev + cand)->busy);
+			if (busy < best_busy) {
+				best_busy = busy;
+				m = cand;
+			}
+		}
+		return m;
+	case OBJIO_READ_ROUND_ROBIN:
+	default:
+		return rr;
+	}
+}
+
+/* Make a fresh copy of per_dev's bio for resubmission to another mirror */
+static struct bio *_read_reclone_bio(struct objio_state *ios,
+				     struct _objio_per_comp *per_dev)
+{
+	struct request_queue *q = osd_request_queue(
+				_io_od(ios, per_dev->dev + per_dev->mirror));
+	struct bio *old = per_dev->bio;
+	struct bio *bio;
+	struct bio_vec *bv;
+	unsigned i;
+
+	bio = bio_kmalloc(GFP_KERNEL, old->bi_vcnt);
+	if (unlikely(!bio))
+		return NULL;
+
+	__bio_for_each_segment(bv, old, i, 0) {
+		if (bio_add_pc_page(q, bio, bv->bv_page, bv->bv_len,
+				    bv->bv_offset) != bv->bv_len) {
+			bio_put(bio);
+			return NULL;
+		}
+	}
+	return bio;
+}
+
+/*
+ * A read that failed on one mirror is retried on the next one rather
+ * than failing the whole I/O back to the MDS.  Only done when every
+ * failed component still has an untried mirror.
+ */
+static bool _read_failover_needed(struct objio_state *ios)
+{
+	unsigned mirrors_p1 = ios->objio_seg->mirrors_p1;
+	bool needed = false;
+	unsigned i;
+
+	if (mirrors_p1 == 1)
+		return false;
+
+	for (i = 0; i < ios->numdevs; i += mirrors_p1) {
+		struct _objio_per_comp *per_dev = &ios->per_dev[i];
+		struct osd_sense_info osi;
+
+		if (!per_dev->or)
+			continue;
+		if (likely(!osd_req_decode_sense(per_dev->or, &osi)) ||
+		    osi.osd_err_pri == OSD_ERR_PRI_CLEAR_PAGES)
+			continue;
+		if (per_dev->tries + 1 >= mirrors_p1)
+			return false;
+		needed = true;
+	}
+	return needed;
+}
+
+static ssize_t _read_failover(struct objio_state *ios)
+{
+	unsigned mirrors_p1 = ios->objio_seg->mirrors_p1;
+	unsigned i;
+	int ret;
+
+	for (i = 0; i < ios->numdevs; i += mirrors_p1) {
+		struct _objio_per_comp *per_dev = &ios->per_dev[i];
+		struct osd_sense_info osi;
+		struct bio *bio;
+
+		if (!per_dev->or)
+			continue;
+
+		ret = osd_req_decode_sense(per_dev->or, &osi);
+		if (likely(!ret) ||
+		    osi.osd_err_pri == OSD_ERR_PRI_CLEAR_PAGES) {
+			/* Done with this one; only the failed are resent */
+			if (ret)
+				_clear_bio(per_dev->bio);
+			_io_end_request(per_dev);
+			continue;
+		}
+
+		/* Still reported at layout-return should the retry fail */
+		objlayout_io_set_result(&ios->ol_state,
+					per_dev->dev + per_dev->mirror,
+					osd_pri_2_pnfs_err(osi.osd_err_pri),
+					per_dev->offset, per_dev->length,
+					false);
+		_io_end_request(per_dev);
+
+		per_dev->tries++;
+		per_dev->mirror = (per_dev->mirror + 1) % mirrors_p1;
+		dprintk("%s: comp %u failed %d, retrying on dev %u\n",
+			__func__, i, ret, per_dev->dev + per_dev->mirror);
+
+		bio = _read_reclone_bio(ios, per_dev);
+		if (unlikely(!bio)) {
+			ret = -ENOMEM;
+			goto err;
+		}
+		bio_put(per_dev->bio);
+		per_dev->bio = bio;
+
+		ret = _read_mirrors(ios, i);
+		if (unlikely(ret))
+			goto err;
+	}
+
+	ios->done = _read_done;
+	return _io_exec(ios);
+
+err:
+	_io_free(ios);
+	objlayout_read_done(&ios->ol_state, ret, ios->ol_state.sync);
+	return ret;
+}
+
+static void _read_failover_work(struct work_struct *work)
+{
+	struct objio_state *ios = container_of(work, struct objio_state, work);
+
+	_read_failover(ios);
+}
+
 static ssize_t _read_exec(struct objio_state *ios)
 {
 	unsigned i;
@@ -816,6 +1126,7 @@ static ssize_t _read_exec(struct objio_state *ios)
 	for (i = 0; i < ios->numdevs; i += ios->objio_seg->mirrors_p1) {
 		if (!ios->per_dev[i].length)
 			continue;
+		ios->per_dev[i].mirror = _read_pick_mirror(ios, i);
 		ret = _read_mirrors(ios, i);
 		if (unlikely(ret))
 			goto err;
@@ -829,12 +1140,17 @@ err:
 	return ret;
 }
 
+static ssize_t _raid_read(struct objio_state *ios);
+
 ssize_t objio_read_pagelist(struct objlayout_io_state *ol_state)
 {
 	struct objio_state *ios = container_of(ol_state, struct objio_state,
 					       ol_state);
 	int ret;
 
+	if (ios->objio_seg->parity)
+		return _raid_read(ios);
+
 	ret = _io_rw_pagelist(ios);
 	if (unlikely(ret))
 		return ret;
@@ -865,7 +1181,47 @@ static ssize_t _write_done(struct objio_state *ios)
 	return status;
 }
 
-static int _write_mirrors(struct objio_state *ios, unsigned cur_comp)
+/*
+ * Mirror write bios, each with its own copy of the master's bio_vecs.
+ * An I/O keeps its mirror bios until it completes, so two writers each
+ * holding part of the pool could wait on each other forever.  A writer
+ * therefore allocates all its mirror bios under _mirror_bio_mutex: every
+ * I/O that has let go of the mutex holds a complete set and is about to
+ * be submitted, so the pool always refills.  An I/O needing more mirror
+ * bios than the pool holds gets them from kmalloc instead.
+ */
+#define OBJIO_MIRROR_BIOS 64
+
+static struct bio_set *_mirror_bio_set;
+static DEFINE_MUTEX(_mirror_bio_mutex);
+
+static void _mirror_bio_destructor(struct bio *bio)
+{
+	bio_free(bio, _mirror_bio_set);
+}
+
+static struct bio *_mirror_bio(struct bio *master, bool pooled)
+{
+	struct bio *bio = NULL;
+
+	if (pooled)
+		bio = bio_clone_bioset(master, GFP_NOIO, _mirror_bio_set);
+	if (likely(bio))
+		bio->bi_destructor = _mirror_bio_destructor;
+	else {
+		/* too many for the pool, or more vectors than it serves */
+		bio = bio_kmalloc(GFP_NOIO, master->bi_max_vecs);
+		if (unlikely(!bio))
+			return NULL;
+		__bio_clone(bio, master);
+	}
+	bio->bi_bdev = NULL;
+	bio->bi_next = NULL;
+	return bio;
+}
+
+static int _write_mirrors(struct objio_state *ios, unsigned cur_comp,
+			  bool pooled)
 {
 	struct _objio_per_comp *master_dev = &ios->per_dev[cur_comp];
 	unsigned dev = ios->per_dev[cur_comp].dev;
@@ -883,7 +1239,7 @@ static int _write_mirrors(struct objio_state *ios, unsigned cur_comp)
 		struct _objio_per_comp *per_dev = &ios->per_dev[cur_comp];
 		struct bio *bio;
 
-		or = osd_start_request(_io_od(ios, dev), GFP_KERNEL);
+		or = osd_start_request(_io_od(ios, dev), GFP_NOIO);
 		if (unlikely(!or)) {
 			ret = -ENOMEM;
 			goto err;
@@ -891,18 +1247,13 @@ static int _write_mirrors(struct objio_state *ios, unsigned cur_comp)
 		per_dev->or = or;
 
 		if (per_dev != master_dev) {
-			bio = bio_kmalloc(GFP_KERNEL,
-					  master_dev->bio->bi_max_vecs);
+			bio = _mirror_bio(master_dev->bio, pooled);
 			if (unlikely(!bio)) {
-				dprintk("Faild to allocate BIO size=%u\n",
-					master_dev->bio->bi_max_vecs);
+				dprintk("Faild to allocate mirror BIO\n");
 				ret = -ENOMEM;
 				goto err;
 			}
 
-			__bio_clone(bio, master_dev->bio);
-			bio->bi_bdev = NULL;
-			bio->bi_next = NULL;
 			per_dev->bio = bio;
 			per_dev->dev = dev;
 			per_dev->length = master_dev->length;
@@ -933,16 +1284,29 @@ err:
 
 static ssize_t _write_exec(struct objio_state *ios)
 {
-	unsigned i;
-	int ret;
+	unsigned mirrors_p1 = ios->objio_seg->mirrors_p1;
+	unsigned i, nr_mirror_bios = 0;
+	bool pooled;
+	int ret = 0;
 
-	for (i = 0; i < ios->numdevs; i += ios->objio_seg->mirrors_p1) {
+	for (i = 0; i < ios->numdevs; i += mirrors_p1)
+		if (ios->per_dev[i].length)
+			nr_mirror_bios += mirrors_p1 - 1;
+	pooled = nr_mirror_bios && nr_mirror_bios <= OBJIO_MIRROR_BIOS;
+
+	if (pooled)
+		mutex_lock(&_mirror_bio_mutex);
+	for (i = 0; i < ios->numdevs; i += mirrors_p1) {
 		if (!ios->per_dev[i].length)
 			continue;
-		ret = _write_mirrors(ios, i);
+		ret = _write_mirrors(ios, i, pooled);
 		if (unlikely(ret))
-			goto err;
+			break;
 	}
+	if (pooled)
+		mutex_unlock(&_mirror_bio_mutex);
+	if (unlikely(ret))
+		goto err;
 
 	ios->done = _write_done;
 	return _io_exec(ios); /* In sync mode exec returns the io->status */
@@ -952,6 +1316,797 @@ err:
 	return ret;
 }
 
+/*
+ * RAID-4/5/PQ
+ *
+ * A stripe row of a parity layout is group_width data units plus parity
+ * units, spread over the W = group_width + parity components of a group
+ * as _calc_stripe_info() describes.  Reads go to the data units only,
+ * with one scatter-gather request per component.  Writes are widened to
+ * whole rows so that parity can be computed in memory: the parts of the
+ * first and last row that the write does not cover are read first
+ * (read-modify-write), then every unit of every row is written.  A read
+ * that fails on up to parity components of a group is rebuilt from the
+ * rest of the rows it touched (degraded read).
+ */
+struct _raid_row {
+	u64 file_off;		/* file offset of the row's first data byte */
+	u64 obj_off;		/* offset of the row in each of its objects */
+	unsigned first_dev;	/* first component of the row's group */
+	unsigned par;		/* index in the group of the P unit */
+	bool recover;		/* rebuilt by a degraded read */
+	struct page **pages;	/* W units of ppu pages, in component order */
+	struct page **io;	/* pages this phase transfers, NULL to skip */
+};
+
+struct objio_raid {
+	unsigned W;		/* components per group */
+	unsigned ppu;		/* pages per stripe unit */
+	unsigned nrows;
+	unsigned nslots;	/* nrows * W * ppu */
+	bool clip;		/* io pages are the caller's: clip to the I/O */
+	u64 first_row;		/* stripe rows covered by this I/O */
+	u64 last_row;
+	struct list_head rows_list;	/* on objio_segment->rows_locked */
+	objio_done_fn next;	/* phase to run from the workqueue */
+	struct _raid_row *rows;
+	struct page **slots;	/* backs every row's pages and io */
+	struct page **blocks;	/* async_tx scratch: data, P, Q */
+	unsigned ntmp;
+	struct page **tmp;	/* pages we allocated */
+};
+
+static void _raid_free(struct objio_raid *raid)
+{
+	unsigned i;
+
+	if (!raid)
+		return;
+
+	for (i = 0; i < raid->ntmp; i++)
+		__free_page(raid->tmp[i]);
+	kfree(raid->tmp);
+	kfree(raid->blocks);
+	kfree(raid->slots);
+	kfree(raid->rows);
+	kfree(raid);
+}
+
+static int _raid_alloc(struct objio_state *ios)
+{
+	struct objio_segment *seg = ios->objio_seg;
+	struct objlayout_io_state *ol = &ios->ol_state;
+	u64 U = (u64)seg->stripe_unit * seg->group_width;
+	u64 first = div64_u64(ol->offset, U);
+	u64 last = div64_u64(ol->offset + ol->count - 1, U);
+	struct objio_raid *raid;
+	struct _striping_info si;
+	unsigned r;
+
+	/* _raid_user_page() needs the pages to be file-page aligned */
+	if (unlikely((ol->offset - ol->pgbase) & ~PAGE_MASK))
+		return -EINVAL;
+
+	raid = kzalloc(sizeof(*raid), GFP_KERNEL);
+	if (unlikely(!raid))
+		return -ENOMEM;
+	ios->raid = raid; /* freed along with ios */
+
+	INIT_LIST_HEAD(&raid->rows_list);
+	raid->first_row = first;
+	raid->last_row = last;
+	raid->W = seg->group_width + seg->parity;
+	raid->ppu = seg->stripe_unit / PAGE_SIZE;
+	raid->nrows = last - first + 1;
+	raid->nslots = raid->nrows * raid->W * raid->ppu;
+	raid->rows = kcalloc(raid->nrows, sizeof(*raid->rows), GFP_KERNEL);
+	raid->slots = kcalloc(2 * raid->nslots, sizeof(*raid->slots),
+			      GFP_KERNEL);
+	raid->blocks = kcalloc(raid->W, sizeof(*raid->blocks), GFP_KERNEL);
+	raid->tmp = kcalloc(raid->nslots, sizeof(*raid->tmp), GFP_KERNEL);
+	if (unlikely(!raid->rows || !raid->slots || !raid->blocks ||
+		     !raid->tmp))
+		return -ENOMEM;
+
+	for (r = 0; r < raid->nrows; r++) {
+		struct _raid_row *row = &raid->rows[r];
+
+		row->file_off = (first + r) * U;
+		_calc_stripe_info(ios, row->file_off, &si);
+		row->obj_off = si.obj_offset;
+		row->first_dev = si.first_dev;
+		row->par = si.par_dev - si.first_dev;
+		row->pages = raid->slots + r * raid->W * raid->ppu;
+		row->io = row->pages + raid->nslots;
+	}
+
+	ios->numdevs = ol->num_comps;
+	ios->length = ol->count;
+	return 0;
+}
+
+/*
+ * A parity write rewrites whole stripe rows: a partial row is read, merged
+ * and written back together with its parity.  Two writes to the same rows
+ * would each merge only their own bytes into the old data, losing one of
+ * them and leaving parity that matches neither, so writes hold their rows
+ * from before the read until the I/O state is freed.
+ */
+static bool _raid_try_lock_rows(struct objio_state *ios)
+{
+	struct objio_segment *seg = ios->objio_seg;
+	struct objio_raid *raid = ios->raid, *other;
+	unsigned long flags;
+	bool locked = true;
+
+	spin_lock_irqsave(&seg->rows_lock, flags);
+	list_for_each_entry(other, &seg->rows_locked, rows_list)
+		if (other->first_row <= raid->last_row &&
+		    raid->first_row <= other->last_row) {
+			locked = false;
+			break;
+		}
+	if (locked)
+		list_add_tail(&raid->rows_list, &seg->rows_locked);
+	spin_unlock_irqrestore(&seg->rows_lock, flags);
+	return locked;
+}
+
+static void _raid_lock_rows(struct objio_state *ios)
+{
+	wait_event(ios->objio_seg->rows_wait, _raid_try_lock_rows(ios));
+}
+
+/* Called from the completion path, possibly with interrupts off */
+static void _raid_unlock_rows(struct objio_state *ios)
+{
+	struct objio_segment *seg = ios->objio_seg;
+	struct objio_raid *raid = ios->raid;
+	unsigned long flags;
+
+	if (!raid || list_empty(&raid->rows_list))
+		return;
+	spin_lock_irqsave(&seg->rows_lock, flags);
+	list_del_init(&raid->rows_list);
+	spin_unlock_irqrestore(&seg->rows_lock, flags);
+	wake_up_all(&seg->rows_wait);
+}
+
+static struct page *_raid_tmp_page(struct objio_raid *raid)
+{
+	struct page *page = alloc_page(GFP_KERNEL);
+
+	if (likely(page)) {
+		BUG_ON(raid->ntmp >= raid->nslots);
+		raid->tmp[raid->ntmp++] = page;
+	}
+	return page;
+}
+
+/* Position of component w's unit in async_tx order: data, then P and Q */
+static unsigned _raid_block(struct objio_state *ios, struct _raid_row *row,
+			    unsigned w)
+{
+	struct objio_segment *seg = ios->objio_seg;
+	unsigned W = seg->group_width + seg->parity;
+	unsigned k = (w + W - row->par) % W;
+
+	return k < seg->parity ? seg->group_width + k : k - seg->parity;
+}
+
+/* Inverse of _raid_block() */
+static unsigned _raid_block_dev(struct objio_state *ios, struct _raid_row *row,
+				unsigned b)
+{
+	struct objio_segment *seg = ios->objio_seg;
+	unsigned W = seg->group_width + seg->parity;
+
+	if (b < seg->group_width)
+		return (row->par + seg->parity + b) % W;
+	return (row->par + b - seg->group_width) % W;
+}
+
+/* File offset of page i of the data unit at block b of row */
+static u64 _raid_file_off(struct objio_state *ios, struct _raid_row *row,
+			  unsigned b, unsigned i)
+{
+	return row->file_off + (u64)b * ios->objio_seg->stripe_unit +
+	       i * PAGE_SIZE;
+}
+
+/* The caller's page at file offset f, or NULL if f is outside the I/O */
+static struct page *_raid_user_page(struct objio_state *ios, u64 f)
+{
+	struct objlayout_io_state *ol = &ios->ol_state;
+
+	if (f + PAGE_SIZE <= ol->offset || f >= ol->offset + ol->count)
+		return NULL;
+	return ol->pages[(f - (ol->offset - ol->pgbase)) >> PAGE_SHIFT];
+}
+
+/* The part of the page at file offset f that the I/O covers */
+static void _raid_clip(struct objio_state *ios, u64 f, unsigned *pofs,
+		       unsigned *plen)
+{
+	struct objlayout_io_state *ol = &ios->ol_state;
+	u64 start = max_t(u64, f, ol->offset);
+	u64 end = min_t(u64, f + PAGE_SIZE, ol->offset + ol->count);
+
+	*pofs = start - f;
+	*plen = end - start;
+}
+
+/* Build each component's bio and object extents from the rows' io pages,
+ * then start its request.
+ */
+static int _raid_prepare(struct objio_state *ios, bool write)
+{
+	struct objio_raid *raid = ios->raid;
+	unsigned r, w, i, n;
+	int ret;
+
+	for (n = 0; n < ios->numdevs; n++) {
+		ios->per_dev[n].dev = n;
+		ios->per_dev[n].length = 0;
+		ios->per_dev[n].num_sg = 0;
+	}
+	for (r = 0; r < raid->nrows; r++) {
+		struct _raid_row *row = &raid->rows[r];
+
+		for (w = 0; w < raid->W; w++)
+			for (i = 0; i < raid->ppu; i++)
+				if (row->io[w * raid->ppu + i])
+					ios->per_dev[row->first_dev + w].num_sg++;
+	}
+	for (n = 0; n < ios->numdevs; n++) {
+		struct _objio_per_comp *per_dev = &ios->per_dev[n];
+
+		if (!per_dev->num_sg)
+			continue;
+		per_dev->bio = bio_kmalloc(GFP_KERNEL, per_dev->num_sg);
+		per_dev->sglist = kcalloc(per_dev->num_sg,
+					  sizeof(*per_dev->sglist), GFP_KERNEL);
+		if (unlikely(!per_dev->bio || !per_dev->sglist))
+			return -ENOMEM;
+		per_dev->num_sg = 0;
+	}
+
+	for (r = 0; r < raid->nrows; r++) {
+		struct _raid_row *row = &raid->rows[r];
+
+		for (w = 0; w < raid->W; w++) {
+			struct _objio_per_comp *per_dev =
+					&ios->per_dev[row->first_dev + w];
+			struct request_queue *q =
+				osd_request_queue(_io_od(ios, per_dev->dev));
+
+			for (i = 0; i < raid->ppu; i++) {
+				struct page *page = row->io[w * raid->ppu + i];
+				struct osd_sg_entry *sg;
+				unsigned pofs = 0, plen = PAGE_SIZE;
+				u64 obj_off;
+
+				if (!page)
+					continue;
+				if (raid->clip)
+					_raid_clip(ios, _raid_file_off(ios, row,
+						_raid_block(ios, row, w), i),
+						&pofs, &plen);
+				obj_off = row->obj_off + i * PAGE_SIZE + pofs;
+
+				if (bio_add_pc_page(q, per_dev->bio, page, plen,
+						    pofs) != plen)
+					return -ENOMEM;
+
+				sg = per_dev->num_sg ?
+				     &per_dev->sglist[per_dev->num_sg - 1] :
+				     NULL;
+				if (sg && sg->offset + sg->len == obj_off) {
+					sg->len += plen;
+				} else {
+					sg = &per_dev->sglist[per_dev->num_sg++];
+					sg->offset = obj_off;
+					sg->len = plen;
+				}
+				per_dev->length += plen;
+			}
+		}
+	}
+
+	for (n = 0; n < ios->numdevs; n++) {
+		struct _objio_per_comp *per_dev = &ios->per_dev[n];
+		struct pnfs_osd_object_cred *cred =
+				&ios->objio_seg->layout->olo_comps[n];
+		struct osd_obj_id obj = {
+			.partition = cred->oc_object_id.oid_partition_id,
+			.id = cred->oc_object_id.oid_object_id,
+		};
+		struct osd_request *or;
+
+		if (!per_dev->length)
+			continue;
+
+		or = osd_start_request(_io_od(ios, n), GFP_KERNEL);
+		if (unlikely(!or))
+			return -ENOMEM;
+		per_dev->or = or;
+		per_dev->offset = per_dev->sglist[0].offset;
+
+		ret = 0;
+		if (write) {
+			/* FIXME: bio_set_dir() */
+			per_dev->bio->bi_rw |= REQ_WRITE;
+			if (per_dev->num_sg == 1)
+				osd_req_write(or, &obj, per_dev->offset,
+					      per_dev->bio, per_dev->length);
+			else
+				ret = osd_req_write_sg(or, &obj, per_dev->bio,
+						       per_dev->sglist,
+						       per_dev->num_sg);
+		} else {
+			if (per_dev->num_sg == 1)
+				osd_req_read(or, &obj, per_dev->offset,
+					     per_dev->bio, per_dev->length);
+			else
+				ret = osd_req_read_sg(or, &obj, per_dev->bio,
+						      per_dev->sglist,
+						      per_dev->num_sg);
+		}
+		if (unlikely(ret))
+			return ret;
+
+		ret = osd_finalize_request(or, 0, cred->oc_cap.cred, NULL);
+		if (unlikely(ret)) {
+			dprintk("%s: Faild to osd_finalize_request() => %d\n",
+				__func__, ret);
+			return ret;
+		}
+
+		dprintk("%s: %s dev=%d obj=0x%llx start=0x%llx length=0x%lx "
+			"extents=%u\n", __func__, write ? "write" : "read", n,
+			obj.id, _LLU(per_dev->offset), per_dev->length,
+			per_dev->num_sg);
+	}
+	return 0;
+}
+
+static void _raid_work(struct work_struct *work)
+{
+	struct objio_state *ios = container_of(work, struct objio_state, work);
+
+	ios->raid->next(ios);
+}
+
+/* Run the next phase of a parity I/O in process context; async
+ * completions are called with ints-off from the block layer.
+ */
+static ssize_t _raid_continue(struct objio_state *ios, objio_done_fn next)
+{
+	if (ios->ol_state.sync)
+		return next(ios);
+
+	ios->raid->next = next;
+	INIT_WORK(&ios->work, _raid_work);
+	schedule_work(&ios->work);
+	return 0;
+}
+
+/* Fail a parity I/O from a later phase */
+static ssize_t _raid_fail(struct objio_state *ios, bool write, int ret)
+{
+	_io_free(ios);
+	if (write)
+		objlayout_write_done(&ios->ol_state, ret, ios->ol_state.sync);
+	else
+		objlayout_read_done(&ios->ol_state, ret, ios->ol_state.sync);
+	return ret;
+}
+
+static void _raid_gen_parity(struct objio_state *ios, struct _raid_row *row)
+{
+	struct objio_segment *seg = ios->objio_seg;
+	struct objio_raid *raid = ios->raid;
+	unsigned D = seg->group_width;
+	struct dma_async_tx_descriptor *tx;
+	struct async_submit_ctl submit;
+	unsigned i, b;
+
+	for (i = 0; i < raid->ppu; i++) {
+		for (b = 0; b < D + seg->parity; b++)
+			raid->blocks[b] = row->pages[
+				_raid_block_dev(ios, row, b) * raid->ppu + i];
+
+		if (seg->parity == 1) {
+			init_async_submit(&submit, ASYNC_TX_XOR_ZERO_DST, NULL,
+					  NULL, NULL, NULL);
+			tx = async_xor(raid->blocks[D], raid->blocks, 0, D,
+				       PAGE_SIZE, &submit);
+		} else {
+			init_async_submit(&submit, 0, NULL, NULL, NULL, NULL);
+			tx = async_gen_syndrome(raid->blocks, 0, D + 2,
+						PAGE_SIZE, &submit);
+		}
+		async_tx_quiesce(&tx);
+	}
+}
+
+/* Rebuild the failed data units of row from the others, all in tmp pages */
+static void _raid_rebuild_row(struct objio_state *ios, struct _raid_row *row)
+{
+	struct objio_segment *seg = ios->objio_seg;
+	struct objio_raid *raid = ios->raid;
+	unsigned D = seg->group_width;
+	struct dma_async_tx_descriptor *tx;
+	struct async_submit_ctl submit;
+	unsigned fail[2], nfail = 0;
+	unsigned i, b, n, x;
+
+	for (b = 0; b < D + seg->parity; b++)
+		if (ios->per_dev[row->first_dev +
+				 _raid_block_dev(ios, row, b)].failed)
+			fail[nfail++] = b;	/* ascending, at most parity */
+
+	/* Q is not needed to rebuild a single unit */
+	if (nfail == 2 && fail[1] == D + 1)
+		nfail = 1;
+	if (!nfail || fail[0] >= D)
+		return; /* only parity is missing */
+
+	for (i = 0; i < raid->ppu; i++) {
+		for (b = 0; b < D + seg->parity; b++)
+			raid->blocks[b] = row->pages[
+				_raid_block_dev(ios, row, b) * raid->ppu + i];
+
+		if (nfail == 1) {
+			/* Data and P xor to zero */
+			struct page *dest = raid->blocks[fail[0]];
+
+			for (n = 0, x = 0; x <= D; x++)
+				if (x != fail[0])
+					raid->blocks[n++] = raid->blocks[x];
+			init_async_submit(&submit, ASYNC_TX_XOR_ZERO_DST, NULL,
+					  NULL, NULL, NULL);
+			tx = async_xor(dest, raid->blocks, 0, D, PAGE_SIZE,
+				       &submit);
+		} else if (fail[1] == D) {
+			init_async_submit(&submit, 0, NULL, NULL, NULL, NULL);
+			tx = async_raid6_datap_recov(D + 2, PAGE_SIZE, fail[0],
+						     raid->blocks, &submit);
+		} else {
+			init_async_submit(&submit, 0, NULL, NULL, NULL, NULL);
+			tx = async_raid6_2data_recov(D + 2, PAGE_SIZE, fail[0],
+						     fail[1], raid->blocks,
+						     &submit);
+		}
+		async_tx_quiesce(&tx);
+	}
+}
+
+/*
+ * read
+ */
+static ssize_t _raid_recover(struct objio_state *ios)
+{
+	struct objio_raid *raid = ios->raid;
+	unsigned r, w, i;
+	int ret;
+
+	ret = _io_check(ios, false);
+	if (unlikely(ret))
+		return _raid_fail(ios, false, ret);
+	_io_free(ios);
+
+	for (r = 0; r < raid->nrows; r++) {
+		struct _raid_row *row = &raid->rows[r];
+
+		if (!row->recover)
+			continue;
+		_raid_rebuild_row(ios, row);
+
+		/* Copy what the caller asked for out of the rebuilt units */
+		for (w = 0; w < raid->W; w++) {
+			unsigned b = _raid_block(ios, row, w);
+
+			if (!ios->per_dev[row->first_dev + w].failed ||
+			    b >= ios->objio_seg->group_width)
+				continue;
+			for (i = 0; i < raid->ppu; i++) {
+				u64 f = _raid_file_off(ios, row, b, i);
+				struct page *page = _raid_user_page(ios, f);
+				unsigned pofs, plen;
+				void *dst;
+
+				if (!page)
+					continue;
+				_raid_clip(ios, f, &pofs, &plen);
+				dst = kmap_atomic(page, KM_USER0);
+				memcpy(dst + pofs, page_address(
+					row->pages[w * raid->ppu + i]) + pofs,
+				       plen);
+				kunmap_atomic(dst, KM_USER0);
+				flush_dcache_page(page);
+			}
+		}
+	}
+
+	objlayout_read_done(&ios->ol_state, ios->length, ios->ol_state.sync);
+	return ios->length;
+}
+
+static ssize_t _raid_recover_done(struct objio_state *ios)
+{
+	return _raid_continue(ios, _raid_recover);
+}
+
+/* Read every other unit of the rows that lost data on a failed component */
+static ssize_t _raid_read_degraded(struct objio_state *ios)
+{
+	struct objio_segment *seg = ios->objio_seg;
+	struct objio_raid *raid = ios->raid;
+	unsigned r, w, i, n;
+	int ret;
+
+	/* Keep what the good components returned */
+	for (n = 0; n < ios->numdevs; n++) {
+		struct _objio_per_comp *per_dev = &ios->per_dev[n];
+		struct osd_sense_info osi;
+
+		if (!per_dev->or || !osd_req_decode_sense(per_dev->or, &osi))
+			continue;
+		if (osi.osd_err_pri == OSD_ERR_PRI_CLEAR_PAGES)
+			_clear_bio(per_dev->bio);
+		else
+			/* Reported at layout-return should the rebuild fail */
+			objlayout_io_set_result(&ios->ol_state, n,
+					osd_pri_2_pnfs_err(osi.osd_err_pri),
+					per_dev->offset, per_dev->length,
+					false);
+	}
+	_io_free(ios);
+
+	for (r = 0; r < raid->nrows; r++) {
+		struct _raid_row *row = &raid->rows[r];
+		unsigned nfailed = 0;
+
+		row->recover = false;
+		for (w = 0; w < raid->W; w++) {
+			if (!ios->per_dev[row->first_dev + w].failed)
+				continue;
+			nfailed++;
+			for (i = 0; i < raid->ppu; i++)
+				if (row->io[w * raid->ppu + i])
+					row->recover = true;
+		}
+		if (row->recover && nfailed > seg->parity) {
+			dprintk("%s: %u components of a group failed\n",
+				__func__, nfailed);
+			return _raid_fail(ios, false, -EIO);
+		}
+
+		for (w = 0; w < raid->W; w++) {
+			bool failed = ios->per_dev[row->first_dev + w].failed;
+
+			for (i = 0; i < raid->ppu; i++) {
+				unsigned slot = w * raid->ppu + i;
+
+				row->io[slot] = NULL;
+				if (!row->recover)
+					continue;
+				row->pages[slot] = _raid_tmp_page(raid);
+				if (unlikely(!row->pages[slot]))
+					return _raid_fail(ios, false, -ENOMEM);
+				if (!failed)
+					row->io[slot] = row->pages[slot];
+			}
+		}
+	}
+
+	raid->clip = false;
+	ret = _raid_prepare(ios, false);
+	if (unlikely(ret))
+		return _raid_fail(ios, false, ret);
+
+	ios->done = _raid_recover_done;
+	return _io_exec(ios);
+}
+
+static ssize_t _raid_read_done(struct objio_state *ios)
+{
+	bool failed = false;
+	unsigned n;
+
+	for (n = 0; n < ios->numdevs; n++) {
+		struct _objio_per_comp *per_dev = &ios->per_dev[n];
+		struct osd_sense_info osi;
+
+		if (!per_dev->or || !osd_req_decode_sense(per_dev->or, &osi) ||
+		    osi.osd_err_pri == OSD_ERR_PRI_CLEAR_PAGES)
+			continue;
+		per_dev->failed = true;
+		failed = true;
+	}
+
+	if (likely(!failed))
+		return _read_done(ios);
+	return _raid_continue(ios, _raid_read_degraded);
+}
+
+static ssize_t _raid_read(struct objio_state *ios)
+{
+	struct objio_segment *seg = ios->objio_seg;
+	struct objio_raid *raid;
+	unsigned r, b, i;
+	int ret;
+
+	ret = _raid_alloc(ios);
+	if (unlikely(ret))
+		return ret;
+	raid = ios->raid;
+
+	for (r = 0; r < raid->nrows; r++) {
+		struct _raid_row *row = &raid->rows[r];
+
+		for (b = 0; b < seg->group_width; b++) {
+			unsigned w = _raid_block_dev(ios, row, b);
+
+			for (i = 0; i < raid->ppu; i++)
+				row->io[w * raid->ppu + i] = _raid_user_page(
+					ios, _raid_file_off(ios, row, b, i));
+		}
+	}
+
+	raid->clip = true;
+	ret = _raid_prepare(ios, false);
+	if (unlikely(ret)) {
+		_io_free(ios);
+		return ret;
+	}
+
+	ios->done = _raid_read_done;
+	return _io_exec(ios); /* In sync mode exec returns the io status */
+}
+
+/*
+ * write
+ */
+static ssize_t _raid_write_rows(struct objio_state *ios, bool first_phase)
+{
+	struct objio_raid *raid = ios->raid;
+	unsigned r;
+	int ret;
+
+	for (r = 0; r < raid->nrows; r++) {
+		struct _raid_row *row = &raid->rows[r];
+
+		_raid_gen_parity(ios, row);
+		memcpy(row->io, row->pages,
+		       raid->W * raid->ppu * sizeof(*row->io));
+	}
+
+	raid->clip = false;
+	ret = _raid_prepare(ios, true);
+	if (unlikely(ret)) {
+		if (!first_phase)
+			return _raid_fail(ios, true, ret);
+		_io_free(ios);
+		return ret;
+	}
+
+	ios->done = _write_done;
+	return _io_exec(ios);
+}
+
+/* Merge the caller's data into the partially written pages we read */
+static ssize_t _raid_rmw_merge(struct objio_state *ios)
+{
+	struct objio_segment *seg = ios->objio_seg;
+	struct objio_raid *raid = ios->raid;
+	unsigned r, b, i;
+	int ret;
+
+	ret = _io_check(ios, false);
+	if (unlikely(ret))
+		return _raid_fail(ios, true, ret);
+	_io_free(ios);
+
+	for (r = 0; r < raid->nrows; r++) {
+		struct _raid_row *row = &raid->rows[r];
+
+		for (b = 0; b < seg->group_width; b++) {
+			unsigned w = _raid_block_dev(ios, row, b);
+
+			for (i = 0; i < raid->ppu; i++) {
+				unsigned slot = w * raid->ppu + i;
+				u64 f = _raid_file_off(ios, row, b, i);
+				struct page *page = _raid_user_page(ios, f);
+				unsigned pofs, plen;
+				void *src;
+
+				if (!row->io[slot] || !page)
+					continue;
+				_raid_clip(ios, f, &pofs, &plen);
+				src = kmap_atomic(page, KM_USER0);
+				memcpy(page_address(row->pages[slot]) + pofs,
+				       src + pofs, plen);
+				kunmap_atomic(src, KM_USER0);
+			}
+		}
+	}
+
+	return _raid_write_rows(ios, false);
+}
+
+static ssize_t _raid_rmw_done(struct objio_state *ios)
+{
+	return _raid_continue(ios, _raid_rmw_merge);
+}
+
+static ssize_t _raid_write(struct objio_state *ios)
+{
+	struct objio_segment *seg = ios->objio_seg;
+	struct objlayout_io_state *ol = &ios->ol_state;
+	struct objio_raid *raid;
+	bool rmw = false;
+	unsigned r, w, i;
+	int ret;
+
+	ret = _raid_alloc(ios);
+	if (unlikely(ret))
+		return ret;
+	raid = ios->raid;
+	_raid_lock_rows(ios);
+
+	for (r = 0; r < raid->nrows; r++) {
+		struct _raid_row *row = &raid->rows[r];
+
+		for (w = 0; w < raid->W; w++) {
+			unsigned b = _raid_block(ios, row, w);
+
+			for (i = 0; i < raid->ppu; i++) {
+				unsigned slot = w * raid->ppu + i;
+				struct page *page = NULL;
+				bool covered = false;
+				u64 f = 0;
+
+				if (b < seg->group_width) {
+					f = _raid_file_off(ios, row, b, i);
+					page = _raid_user_page(ios, f);
+					covered = f >= ol->offset &&
+					     f + PAGE_SIZE <= ol->offset + ol->count;
+				}
+				/* Parity is computed from page_address() */
+				if (covered && !PageHighMem(page)) {
+					row->pages[slot] = page;
+					continue;
+				}
+
+				row->pages[slot] = _raid_tmp_page(raid);
+				if (unlikely(!row->pages[slot]))
+					return -ENOMEM;
+				if (covered)
+					copy_highpage(row->pages[slot], page);
+				else if (b < seg->group_width) {
+					row->io[slot] = row->pages[slot];
+					rmw = true;
+				}
+			}
+		}
+	}
+
+	if (!rmw)
+		return _raid_write_rows(ios, true);
+
+	raid->clip = false;
+	ret = _raid_prepare(ios, false);
+	if (unlikely(ret)) {
+		_io_free(ios);
+		return ret;
+	}
+
+	ios->done = _raid_rmw_done;
+	return _io_exec(ios);
+}
+
 ssize_t objio_write_pagelist(struct objlayout_io_state *ol_state, bool stable)
 {
 	struct objio_state *ios = container_of(ol_state, struct objio_state,
@@ -959,6 +2114,9 @@ ssize_t objio_write_pagelist(struct objlayout_io_state *ol_state, bool stable)
 	int ret;
 
 	/* TODO: ios->stable = stable; */
+	if (ios->objio_seg->parity)
+		return _raid_write(ios);
+
 	ret = _io_rw_pagelist(ios);
 	if (unlikely(ret))
 		return ret;
@@ -990,7 +2148,8 @@ objlayout_get_blocksize(void)
 static struct pnfs_layoutdriver_type objlayout_type = {
 	.id = LAYOUT_OSD2_OBJECTS,
 	.name = "LAYOUT_OSD2_OBJECTS",
-	.flags                   = PNFS_LAYOUTRET_ON_SETATTR,
+	.flags                   = PNFS_LAYOUTRET_ON_SETATTR |
+				   PNFS_LAYOUT_DIRECT_IO,
 
 	.set_layoutdriver        = objlayout_set_layoutdriver,
 	.clear_layoutdriver      = objlayout_clear_layoutdriver,
@@ -1036,15 +2195,22 @@ MODULE_LICENSE("GPL");
 static int __init
 objlayout_init(void)
 {
-	int ret = pnfs_register_layoutdriver(&objlayout_type);
+	int ret;
 
-	if (ret)
+	_mirror_bio_set = bioset_create(OBJIO_MIRROR_BIOS, 0);
+	if (unlikely(!_mirror_bio_set))
+		return -ENOMEM;
+
+	ret = pnfs_register_layoutdriver(&objlayout_type);
+	if (ret) {
+		bioset_free(_mirror_bio_set);
 		printk(KERN_INFO
 			"%s: Registering OSD pNFS Layout Driver failed: error=%d\n",
 			__func__, ret);
-	else
+	} else {
 		printk(KERN_INFO "%s: Registered OSD pNFS Layout Driver\n",
 			__func__);
+	}
 	return ret;
 }
 
@@ -1052,6 +2218,7 @@ static void __exit
 objlayout_exit(void)
 {
 	pnfs_unregister_layoutdriver(&objlayout_type);
+	bioset_free(_mirror_bio_set);
 	printk(KERN_INFO "%s: Unregistered OSD pNFS Layout Driver\n",
 	       __func__);
 }
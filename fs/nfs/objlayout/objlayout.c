@@ -347,6 +347,21 @@ objlayout_read_done(struct objlayout_io_state *state, ssize_t status, bool sync)
 	}
 }
 
+/*
+ * O_DIRECT buffers are user memory and need not sit at the same offset
+ * within a page as the file data.  The RAID engine works on whole file
+ * pages, so leave such requests to the MDS rather than failing them
+ * after they were accepted.
+ */
+static bool
+objlayout_direct_io_ok(struct pnfs_call_data *pdata, loff_t offset,
+		       unsigned pgbase)
+{
+	if (!(pdata->pnfsflags & PNFS_DIRECT_IO))
+		return true;
+	return !((offset - pgbase) & ~PAGE_MASK);
+}
+
 /*
  * Perform sync or async reads.
  */
@@ -356,19 +371,28 @@ objlayout_read_pagelist(struct nfs_read_data *rdata, unsigned nr_pages)
 	loff_t offset = rdata->args.offset;
 	size_t count = rdata->args.count;
 	struct objlayout_io_state *state;
-	ssize_t status = 0;
+	ssize_t status;
 	loff_t eof;
 
 	dprintk("%s: Begin inode %p offset %llu count %d\n",
 		__func__, rdata->inode, offset, (int)count);
 
+	if (!objlayout_direct_io_ok(&rdata->pdata, offset, rdata->args.pgbase))
+		return PNFS_NOT_ATTEMPTED;
+
 	eof = i_size_read(rdata->inode);
 	if (unlikely(offset + count > eof)) {
 		if (offset >= eof) {
-			status = 0;
+			/* Nothing to read, but the caller still waits for
+			 * pnfs_read_done() (O_DIRECT can read past EOF).
+			 */
 			rdata->res.count = 0;
 			rdata->res.eof = 1;
-			goto out;
+			rdata->task.tk_status = 0;
+			rdata->pdata.pnfs_error = 0;
+			INIT_WORK(&rdata->task.u.tk_work, _rpc_read_complete);
+			schedule_work(&rdata->task.u.tk_work);
+			return PNFS_ATTEMPTED;
 		}
 		count = eof - offset;
 	}
@@ -377,15 +401,12 @@ objlayout_read_pagelist(struct nfs_read_data *rdata, unsigned nr_pages)
 					 rdata->args.pages, rdata->args.pgbase,
 					 nr_pages, offset, count,
 					 rdata->pdata.lseg, rdata);
-	if (unlikely(!state)) {
-		status = -ENOMEM;
-		goto out;
-	}
+	if (unlikely(!state))
+		return PNFS_NOT_ATTEMPTED;
 
 	state->eof = state->offset + state->count >= eof;
 
 	status = objio_read_pagelist(state);
- out:
 	dprintk("%s: Return status %Zd\n", __func__, status);
 	rdata->pdata.pnfs_error = status;
 	return PNFS_ATTEMPTED;
@@ -451,6 +472,10 @@ objlayout_write_pagelist(struct nfs_write_data *wdata,
 	dprintk("%s: Begin inode %p offset %llu count %u\n",
 		__func__, wdata->inode, wdata->args.offset, wdata->args.count);
 
+	if (!objlayout_direct_io_ok(&wdata->pdata, wdata->args.offset,
+				    wdata->args.pgbase))
+		return PNFS_NOT_ATTEMPTED;
+
 	state = objlayout_alloc_io_state(NFS_I(wdata->inode)->layout,
 					 wdata->args.pages,
 					 wdata->args.pgbase,
@@ -458,15 +483,12 @@ objlayout_write_pagelist(struct nfs_write_data *wdata,
 					 wdata->args.offset,
 					 wdata->args.count,
 					 wdata->pdata.lseg, wdata);
-	if (unlikely(!state)) {
-		status = -ENOMEM;
-		goto out;
-	}
+	if (unlikely(!state))
+		return PNFS_NOT_ATTEMPTED;
 
 	state->sync = how & FLUSH_SYNC;
 
 	status = objio_write_pagelist(state, how & FLUSH_STABLE);
- out:
 	dprintk("%s: Return status %Zd\n", __func__, status);
 	wdata->pdata.pnfs_error = status;
 	return PNFS_ATTEMPTED;
@@ -650,7 +650,8 @@ panlayout_get_blocksize(void)
 static struct pnfs_layoutdriver_type panlayout_type = {
 	.id = PNFS_LAYOUT_PANOSD,
 	.name = "PNFS_LAYOUT_PANOSD",
-	.flags                   = PNFS_LAYOUTRET_ON_SETATTR,
+	.flags                   = PNFS_LAYOUTRET_ON_SETATTR |
+				   PNFS_LAYOUT_DIRECT_IO,
 
 	.set_layoutdriver        = objlayout_set_layoutdriver,
 	.clear_layoutdriver      = objlayout_clear_layoutdriver,
@@ -28,6 +28,8 @@
  */
 
 #include <linux/nfs_fs.h>
+#include <linux/jhash.h>
+#include <linux/module.h>
 #include "internal.h"
 #include "pnfs.h"
 #include "iostat.h"
@@ -124,9 +126,14 @@ pnfs_update_last_write(struct nfs_inode *nfsi, loff_t offset, size_t extent)
 	spin_unlock(&nfsi->vfs_inode.i_lock);
 }
 
+static void pnfs_ds_connect_wait(struct nfs_server *nfss);
+
 void
 unset_pnfs_layoutdrivers(struct nfs_server *nfss)
 {
+	/* Background data server connects may still reference nfss */
+	pnfs_ds_connect_wait(nfss);
+
 	/* Unset pnfs driver */
 	if (nfss->pnfs_curr_ld) {
 		nfss->pnfs_curr_ld->clear_layoutdriver(nfss);
@@ -297,6 +304,36 @@ pnfs_find_inode_layout(struct inode *ino)
 }
 EXPORT_SYMBOL_GPL(pnfs_find_inode_layout);
 
+/*
+ * Idle layout cache.  Layouts the server did not mark return-on-close stay
+ * attached to their inode after the last close, so reopening the file does
+ * not cost a LAYOUTRETURN/LAYOUTGET pair.  Idle layouts sit on a global LRU
+ * that holds no references; the oldest are returned once there are more
+ * than layout_cache_max of them or when the VM asks us to shrink.
+ */
+static unsigned int pnfs_layout_cache_max = 1024;
+module_param_named(layout_cache_max, pnfs_layout_cache_max, uint, 0644);
+MODULE_PARM_DESC(layout_cache_max,
+		 "Maximum number of idle pNFS layouts kept after close");
+
+static DEFINE_SPINLOCK(pnfs_layout_lru_lock);
+static LIST_HEAD(pnfs_layout_lru_list);
+static atomic_long_t pnfs_layout_nr_idle;
+static long pnfs_layout_lru_scan;	/* shrinker request, under lru_lock */
+
+static void
+pnfs_layout_lru_del(struct pnfs_layout_hdr *lo)
+{
+	if (!test_bit(NFS_LAYOUT_LRU, &lo->plh_flags))
+		return;
+	spin_lock(&pnfs_layout_lru_lock);
+	if (test_and_clear_bit(NFS_LAYOUT_LRU, &lo->plh_flags)) {
+		list_del_init(&lo->plh_lru);
+		atomic_long_dec(&pnfs_layout_nr_idle);
+	}
+	spin_unlock(&pnfs_layout_lru_lock);
+}
+
 static struct pnfs_layout_hdr *
 pnfs_alloc_layout_hdr(struct inode *ino)
 {
@@ -348,6 +385,7 @@ destroy_layout_hdr(struct pnfs_layout_hdr *lo)
 {
 	dprintk("%s: freeing layout cache %p\n", __func__, lo);
 	BUG_ON(!list_empty(&lo->layouts)); /* XXXX valid for metadata? */
+	pnfs_layout_lru_del(lo);
 	NFS_I(lo->inode)->layout = NULL;
 	pnfs_free_layout_hdr(lo);
 }
@@ -374,10 +412,187 @@ put_layout_hdr(struct pnfs_layout_hdr *lo)
 	}
 }
 
+/*
+ * Layout segment interval tree
+ *
+ * lo->segs is an rbtree ordered by pnfs_lseg_cmp() and augmented with
+ * the last byte covered by each subtree, so that lookups and range
+ * invalidation visit O(log n) segments plus the ones that match.  All
+ * of it is protected by the inode's i_lock.
+ */
+static inline u64
+pnfs_range_last(const struct pnfs_layout_range *range)
+{
+	u64 last = range->offset + range->length - 1;
+
+	/* a zero length covers nothing; pruning treats it as one byte */
+	if (range->length == 0)
+		return range->offset;
+	if (range->length == NFS4_MAX_UINT64 || last < range->offset)
+		return NFS4_MAX_UINT64;
+	return last;
+}
+
+/*
+ * Order by offset, then length.  For identical ranges RW sorts first so
+ * lookups prefer it over READ.
+ */
+static int
+pnfs_lseg_cmp(const struct pnfs_layout_range *l1,
+	      const struct pnfs_layout_range *l2)
+{
+	if (l1->offset != l2->offset)
+		return l1->offset < l2->offset ? -1 : 1;
+	if (l1->length != l2->length)
+		return l1->length < l2->length ? -1 : 1;
+	return (int)(l1->iomode == IOMODE_READ) -
+		(int)(l2->iomode == IOMODE_READ);
+}
+
+static inline struct pnfs_layout_segment *
+pnfs_lseg_entry(struct rb_node *node)
+{
+	return node ? rb_entry(node, struct pnfs_layout_segment, pls_node) :
+		NULL;
+}
+
+static void
+pnfs_lseg_augment_cb(struct rb_node *node, void *unused)
+{
+	struct pnfs_layout_segment *lseg = pnfs_lseg_entry(node);
+	struct pnfs_layout_segment *child;
+	u64 last = pnfs_range_last(&lseg->range);
+
+	child = pnfs_lseg_entry(node->rb_left);
+	if (child && child->pls_subtree_last > last)
+		last = child->pls_subtree_last;
+	child = pnfs_lseg_entry(node->rb_right);
+	if (child && child->pls_subtree_last > last)
+		last = child->pls_subtree_last;
+	lseg->pls_subtree_last = last;
+}
+
+static void
+pnfs_lseg_tree_insert(struct pnfs_layout_hdr *lo,
+		      struct pnfs_layout_segment *lseg)
+{
+	struct rb_node **p = &lo->segs.rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (pnfs_lseg_cmp(&lseg->range,
+				  &pnfs_lseg_entry(parent)->range) < 0)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	if (RB_EMPTY_ROOT(&lo->segs))
+		nfs_inc_pnfs_stats(lo->inode, NFSIOS_PNFS_LAYOUTS);
+	nfs_inc_pnfs_stats(lo->inode, NFSIOS_PNFS_LSEGS);
+	lseg->pls_subtree_last = pnfs_range_last(&lseg->range);
+	rb_link_node(&lseg->pls_node, parent, p);
+	rb_insert_color(&lseg->pls_node, &lo->segs);
+	rb_augment_insert(&lseg->pls_node, pnfs_lseg_augment_cb, NULL);
+}
+
+static void
+pnfs_lseg_tree_erase(struct pnfs_layout_hdr *lo,
+		     struct pnfs_layout_segment *lseg)
+{
+	struct rb_node *deepest;
+
+	if (RB_EMPTY_NODE(&lseg->pls_node))
+		return;
+	deepest = rb_augment_erase_begin(&lseg->pls_node);
+	rb_erase(&lseg->pls_node, &lo->segs);
+	RB_CLEAR_NODE(&lseg->pls_node);
+	rb_augment_erase_end(deepest, pnfs_lseg_augment_cb, NULL);
+	nfs_add_pnfs_stats(lo->inode, NFSIOS_PNFS_LSEGS, -1);
+	if (RB_EMPTY_ROOT(&lo->segs))
+		nfs_add_pnfs_stats(lo->inode, NFSIOS_PNFS_LAYOUTS, -1);
+}
+
+/* Leftmost segment under node overlapping [start, last] */
+static struct pnfs_layout_segment *
+pnfs_lseg_subtree_first(struct pnfs_layout_segment *lseg, u64 start, u64 last)
+{
+	struct pnfs_layout_segment *child;
+
+	for (;;) {
+		child = pnfs_lseg_entry(lseg->pls_node.rb_left);
+		if (child && start <= child->pls_subtree_last) {
+			lseg = child;
+			continue;
+		}
+		if (lseg->range.offset > last)
+			return NULL;
+		if (start <= pnfs_range_last(&lseg->range))
+			return lseg;
+		child = pnfs_lseg_entry(lseg->pls_node.rb_right);
+		if (!child || start > child->pls_subtree_last)
+			return NULL;
+		lseg = child;
+	}
+}
+
+/* First segment, in tree order, overlapping [start, last] */
+static struct pnfs_layout_segment *
+pnfs_lseg_iter_first(struct pnfs_layout_hdr *lo, u64 start, u64 last)
+{
+	struct pnfs_layout_segment *root = pnfs_lseg_entry(lo->segs.rb_node);
+
+	if (!root || start > root->pls_subtree_last)
+		return NULL;
+	return pnfs_lseg_subtree_first(root, start, last);
+}
+
+/*
+ * Next segment after lseg overlapping [start, last].  Callers that may
+ * erase lseg must fetch its successor before doing so.
+ */
+static struct pnfs_layout_segment *
+pnfs_lseg_iter_next(struct pnfs_layout_segment *lseg, u64 start, u64 last)
+{
+	struct rb_node *rb = lseg->pls_node.rb_right, *prev;
+	struct pnfs_layout_segment *child;
+
+	for (;;) {
+		child = pnfs_lseg_entry(rb);
+		if (child && start <= child->pls_subtree_last)
+			return pnfs_lseg_subtree_first(child, start, last);
+
+		/* climb until we come up from a left child */
+		do {
+			rb = rb_parent(&lseg->pls_node);
+			if (!rb)
+				return NULL;
+			prev = &lseg->pls_node;
+			lseg = pnfs_lseg_entry(rb);
+			rb = lseg->pls_node.rb_right;
+		} while (prev == rb);
+
+		if (lseg->range.offset > last)
+			return NULL;
+		if (start <= pnfs_range_last(&lseg->range))
+			return lseg;
+	}
+}
+
+#define pnfs_for_each_lseg_overlap(lseg, next, lo, range)		     \
+	for (lseg = pnfs_lseg_iter_first(lo, (range)->offset,		     \
+					 pnfs_range_last(range)),	     \
+	     next = lseg ? pnfs_lseg_iter_next(lseg, (range)->offset,	     \
+					       pnfs_range_last(range)) : NULL; \
+	     lseg;							     \
+	     lseg = next,						     \
+	     next = lseg ? pnfs_lseg_iter_next(lseg, (range)->offset,	     \
+					       pnfs_range_last(range)) : NULL)
+
 static void
 init_lseg(struct pnfs_layout_hdr *lo, struct pnfs_layout_segment *lseg)
 {
 	INIT_LIST_HEAD(&lseg->fi_list);
+	RB_CLEAR_NODE(&lseg->pls_node);
 	atomic_set(&lseg->pls_refcount, 1);
 	smp_mb();
 	set_bit(NFS_LSEG_VALID, &lseg->pls_flags);
@@ -417,8 +632,8 @@ _put_lseg_common(struct pnfs_layout_segment *lseg)
 	struct inode *ino = lseg->layout->inode;
 
 	BUG_ON(test_bit(NFS_LSEG_VALID, &lseg->pls_flags));
-	list_del(&lseg->fi_list);
-	if (list_empty(&lseg->layout->segs)) {
+	pnfs_lseg_tree_erase(lseg->layout, lseg);
+	if (RB_EMPTY_ROOT(&lseg->layout->segs)) {
 		struct nfs_client *clp;
 
 		clp = NFS_SERVER(ino)->nfs_client;
@@ -426,6 +641,7 @@ _put_lseg_common(struct pnfs_layout_segment *lseg)
 		/* List does not take a reference, so no need for put here */
 		list_del_init(&lseg->layout->layouts);
 		spin_unlock(&clp->cl_lock);
+		pnfs_layout_lru_del(lseg->layout);
 		clear_bit(NFS_LAYOUT_BULK_RECALL, &lseg->layout->plh_flags);
 		if (!pnfs_layoutgets_blocked(lseg->layout, NULL))
 			rpc_wake_up(&NFS_I(ino)->lo_rpcwaitq_stateid);
@@ -600,7 +816,7 @@ pnfs_clear_lseg_list(struct pnfs_layout_hdr *lo, struct list_head *tmp_list,
 		__func__, lo, range->offset, range->length, range->iomode);
 
 	assert_spin_locked(&lo->inode->i_lock);
-	list_for_each_entry_safe(lseg, next, &lo->segs, fi_list)
+	pnfs_for_each_lseg_overlap(lseg, next, lo, range)
 		if (should_free_lseg(&lseg->range, range)) {
 			dprintk("%s: freeing lseg %p iomode %d "
 				"offset %llu length %llu\n", __func__,
@@ -637,9 +853,10 @@ pnfs_destroy_layout(struct nfs_inode *nfsi)
 	spin_lock(&nfsi->vfs_inode.i_lock);
 	lo = nfsi->layout;
 	if (lo) {
+		pnfs_layout_lru_del(lo);
 		pnfs_clear_lseg_list(lo, &tmp_list, &range);
 /* XXX Fixme--have segs: */
-		WARN_ON(!list_empty(&nfsi->layout->segs));
+		WARN_ON(!RB_EMPTY_ROOT(&nfsi->layout->segs));
 		WARN_ON(!list_empty(&nfsi->layout->layouts));
 		WARN_ON(atomic_read(&nfsi->layout->plh_refcount) != 1);
 
@@ -720,7 +937,7 @@ pnfs_choose_layoutget_stateid(nfs4_stateid *dst, struct pnfs_layout_hdr *lo,
 		 * some callers.
 		 */
 		status = -NFS4ERR_LAYOUTTRYLATER;
-	} else if (open_state && list_empty(&lo->segs)) {
+	} else if (open_state && RB_EMPTY_ROOT(&lo->segs)) {
 		int seq;
 
 		do {
@@ -804,7 +1021,7 @@ void nfs4_asynch_forget_layouts(struct pnfs_layout_hdr *lo,
 	struct pnfs_layout_segment *lseg, *tmp;
 
 	assert_spin_locked(&lo->inode->i_lock);
-	list_for_each_entry_safe(lseg, tmp, &lo->segs, fi_list)
+	pnfs_for_each_lseg_overlap(lseg, tmp, lo, range)
 		if (should_free_lseg(&lseg->range, range)) {
 			lseg->pls_notify_mask |= (1 << notify_bit);
 			atomic_inc(notify_count);
@@ -820,11 +1037,11 @@ bool
 pnfs_return_layout_barrier(struct nfs_inode *nfsi,
 			   struct pnfs_layout_range *range)
 {
-	struct pnfs_layout_segment *lseg;
+	struct pnfs_layout_segment *lseg, *next;
 	bool ret = false;
 
 	spin_lock(&nfsi->vfs_inode.i_lock);
-	list_for_each_entry(lseg, &nfsi->layout->segs, fi_list)
+	pnfs_for_each_lseg_overlap(lseg, next, nfsi->layout, range)
 		if (should_free_lseg(&lseg->range, range)) {
 			ret = true;
 			break;
@@ -899,6 +1116,7 @@ _pnfs_return_layout(struct inode *ino, struct pnfs_layout_range *range,
 		dprintk("%s: no layout segments to return\n", __func__);
 		goto out;
 	}
+	pnfs_layout_lru_del(lo);
 	lo->plh_block_lgets++;
 	/* Reference matched in nfs4_layoutreturn_release */
 	get_layout_hdr(lo);
@@ -938,66 +1156,318 @@ int pnfs_return_layout(struct inode *ino,
 }
 EXPORT_SYMBOL_GPL(pnfs_return_layout);
 
+static void pnfs_layout_lru_work_fn(struct work_struct *work);
+static DECLARE_WORK(pnfs_layout_lru_work, pnfs_layout_lru_work_fn);
+
 /*
- * Compare two layout segments for sorting into layout cache.
- * We want to preferentially return RW over RO layouts, so ensure those
- * are seen first.
+ * Called when an open state of @ino gives up its last open mode.  Nothing
+ * happens while other opens remain.  On the last close, return-on-close
+ * segments go back to the server, and any other segments are put on the
+ * idle layout LRU.
  */
-static s64
-cmp_layout(struct pnfs_layout_range *l1,
-	   struct pnfs_layout_range *l2)
+void
+pnfs_layout_close(struct inode *ino, bool wait)
 {
-	s64 d;
+	struct nfs_inode *nfsi = NFS_I(ino);
+	struct pnfs_layout_hdr *lo;
+	long nr_idle = 0;
+	u32 roc_iomode;
 
-	/* higher offset > lower offset */
-	d = l1->offset - l2->offset;
-	if (d)
-		return d;
+	if (!pnfs_enabled_sb(NFS_SERVER(ino)))
+		return;
+	spin_lock(&ino->i_lock);
+	lo = nfsi->layout;
+	if (!lo || !list_empty(&nfsi->open_files)) {
+		spin_unlock(&ino->i_lock);
+		return;
+	}
+	roc_iomode = lo->roc_iomode;
+	spin_unlock(&ino->i_lock);
 
-	/* longer length > shorter length */
-	d = l1->length - l2->length;
-	if (d)
-		return d;
+	if (roc_iomode) {
+		struct pnfs_layout_range range = {
+			.iomode = roc_iomode,
+			.offset = 0,
+			.length = NFS4_MAX_UINT64,
+		};
+
+		_pnfs_return_layout(ino, &range, wait);
+	}
+
+	if (!S_ISREG(ino->i_mode))
+		return;
+	spin_lock(&ino->i_lock);
+	lo = nfsi->layout;
+	if (lo && !RB_EMPTY_ROOT(&lo->segs) && !lo->plh_block_lgets) {
+		spin_lock(&pnfs_layout_lru_lock);
+		if (!test_and_set_bit(NFS_LAYOUT_LRU, &lo->plh_flags)) {
+			list_add_tail(&lo->plh_lru, &pnfs_layout_lru_list);
+			nr_idle = atomic_long_inc_return(&pnfs_layout_nr_idle);
+		}
+		spin_unlock(&pnfs_layout_lru_lock);
+	}
+	spin_unlock(&ino->i_lock);
+
+	if (nr_idle > pnfs_layout_cache_max)
+		queue_work(nfsiod_workqueue, &pnfs_layout_lru_work);
+}
+
+#define PNFS_LRU_BATCH	32
 
-	/* read > read/write */
-	return (int)(l2->iomode == IOMODE_READ) -
-		(int)(l1->iomode == IOMODE_READ);
+/*
+ * Take up to @nr of the oldest idle layouts off the LRU, restricted to @sb
+ * if it is set.  Inodes already being evicted return their own layout from
+ * nfs4_evict_inode(), so their @batch slot is left NULL.
+ */
+static int
+pnfs_layout_lru_isolate(struct super_block *sb, struct inode **batch, int nr)
+{
+	struct pnfs_layout_hdr *lo, *next;
+	struct inode *ino;
+	int n = 0;
+
+	spin_lock(&pnfs_layout_lru_lock);
+	list_for_each_entry_safe(lo, next, &pnfs_layout_lru_list, plh_lru) {
+		if (n == nr)
+			break;
+		if (sb && lo->inode->i_sb != sb)
+			continue;
+		/* Once off the LRU, lo may be freed under us */
+		ino = lo->inode;
+		list_del_init(&lo->plh_lru);
+		clear_bit(NFS_LAYOUT_LRU, &lo->plh_flags);
+		atomic_long_dec(&pnfs_layout_nr_idle);
+		batch[n++] = igrab(ino);
+	}
+	spin_unlock(&pnfs_layout_lru_lock);
+	return n;
+}
+
+static bool
+pnfs_same_fsid(struct inode *a, struct inode *b)
+{
+	struct nfs_server *sa = NFS_SERVER(a), *sb = NFS_SERVER(b);
+
+	return sa->nfs_client == sb->nfs_client &&
+	       !memcmp(&sa->fsid, &sb->fsid, sizeof(struct nfs_fsid));
+}
+
+/*
+ * Return the idle layouts of @group, which all live on one fsid.  If they
+ * are the only layouts the client holds on that fsid, drop them locally and
+ * send a single LAYOUTRETURN(FSID), blocking new LAYOUTGETs on the client
+ * while it is in flight.  Otherwise return each file's layout on its own.
+ *
+ * The layouts picked are referenced and flagged NFS_LAYOUT_IDLE_RETURN,
+ * which keeps pnfs_update_layout() from handing out their segments.  A
+ * file opened again before the return is under way keeps its layout, and
+ * then no LAYOUTRETURN(FSID) may be sent.
+ */
+static void
+pnfs_return_idle_group(struct inode **group, int n)
+{
+	struct nfs_client *clp = NFS_SERVER(group[0])->nfs_client;
+	struct pnfs_layout_range range = {
+		.iomode = IOMODE_ANY,
+		.offset = 0,
+		.length = NFS4_MAX_UINT64,
+	};
+	struct pnfs_layout_hdr *lo, *los[PNFS_LRU_BATCH];
+	struct nfs4_layoutreturn *lrp;
+	LIST_HEAD(tmp_list);
+	bool bulk;
+	int i, idle = 0, skipped = 0;
+
+	/* Move the layouts that are still idle to the front of group */
+	for (i = 0; i < n; i++) {
+		struct inode *ino = group[i];
+		struct nfs_inode *nfsi = NFS_I(ino);
+
+		spin_lock(&ino->i_lock);
+		lo = nfsi->layout;
+		if (lo && list_empty(&nfsi->open_files) &&
+		    !RB_EMPTY_ROOT(&lo->segs)) {
+			set_bit(NFS_LAYOUT_IDLE_RETURN, &lo->plh_flags);
+			get_layout_hdr(lo);
+			los[idle] = lo;
+			group[i] = group[idle];
+			group[idle++] = ino;
+		}
+		spin_unlock(&ino->i_lock);
+	}
+	if (idle == 0)
+		return;
+
+	bulk = idle > 1;
+	spin_lock(&clp->cl_lock);
+	list_for_each_entry(lo, &clp->cl_layouts, layouts) {
+		if (!bulk)
+			break;
+		if (pnfs_same_fsid(lo->inode, group[0]) &&
+		    !test_bit(NFS_LAYOUT_IDLE_RETURN, &lo->plh_flags))
+			bulk = false;
+	}
+	if (bulk)
+		atomic_inc(&clp->cl_bulk_returns);
+	spin_unlock(&clp->cl_lock);
+
+	for (i = 0; bulk && i < idle; i++)
+		if (layoutcommit_needed(NFS_I(group[i])))
+			pnfs_layoutcommit_inode(group[i], true);
+
+	/* Leave out the files that were opened again meanwhile */
+	for (i = 0; i < idle; i++) {
+		struct inode *ino = group[i];
+
+		spin_lock(&ino->i_lock);
+		if (!list_empty(&NFS_I(ino)->open_files)) {
+			clear_bit(NFS_LAYOUT_IDLE_RETURN, &los[i]->plh_flags);
+			put_layout_hdr_locked(los[i]);
+			los[i] = NULL;
+			skipped++;
+		}
+		spin_unlock(&ino->i_lock);
+	}
+	if (bulk && skipped) {
+		atomic_dec(&clp->cl_bulk_returns);
+		bulk = false;
+	}
+
+	for (i = 0; i < idle; i++) {
+		struct inode *ino = group[i];
+
+		lo = los[i];
+		if (!lo)
+			continue;
+		if (!bulk)
+			_pnfs_return_layout(ino, NULL, true);
+		spin_lock(&ino->i_lock);
+		if (bulk)
+			pnfs_clear_lseg_list(lo, &tmp_list, &range);
+		clear_bit(NFS_LAYOUT_IDLE_RETURN, &lo->plh_flags);
+		put_layout_hdr_locked(lo);
+		spin_unlock(&ino->i_lock);
+	}
+	if (!bulk)
+		return;
+	pnfs_free_lseg_list(&tmp_list);
+
+	dprintk("%s: returning %d idle layouts in bulk\n", __func__, idle);
+	lrp = kzalloc(sizeof(*lrp), GFP_KERNEL);
+	if (lrp) {
+		lrp->args.reclaim = 0;
+		lrp->args.layout_type = NFS_SERVER(group[0])->pnfs_curr_ld->id;
+		lrp->args.return_type = RETURN_FSID;
+		lrp->args.range = range;
+		/* Any file on the fsid will do for the PUTFH */
+		lrp->args.inode = group[0];
+		lrp->clp = clp;
+		nfs4_proc_layoutreturn(lrp, true);
+	}
+	atomic_dec(&clp->cl_bulk_returns);
+}
+
+/* Return the layouts of the pinned inodes in @batch and unpin them. */
+static void
+pnfs_return_idle_batch(struct inode **batch, int n)
+{
+	struct inode *group[PNFS_LRU_BATCH];
+	int i, j, count;
+
+	for (i = 0; i < n; i++) {
+		struct inode *ino = batch[i];
+
+		if (!ino)
+			continue;
+		count = 0;
+		for (j = i; j < n; j++) {
+			if (batch[j] && pnfs_same_fsid(batch[j], ino)) {
+				group[count++] = batch[j];
+				batch[j] = NULL;
+			}
+		}
+		pnfs_return_idle_group(group, count);
+		for (j = 0; j < count; j++)
+			iput(group[j]);
+	}
+}
+
+static void
+pnfs_layout_lru_evict(struct super_block *sb, long nr)
+{
+	struct inode *batch[PNFS_LRU_BATCH];
+	int n;
+
+	while (nr > 0) {
+		n = pnfs_layout_lru_isolate(sb, batch,
+					    min_t(long, nr, PNFS_LRU_BATCH));
+		if (n == 0)
+			break;
+		pnfs_return_idle_batch(batch, n);
+		nr -= n;
+	}
+}
+
+static void
+pnfs_layout_lru_work_fn(struct work_struct *work)
+{
+	long nr, over;
+
+	spin_lock(&pnfs_layout_lru_lock);
+	nr = pnfs_layout_lru_scan;
+	pnfs_layout_lru_scan = 0;
+	spin_unlock(&pnfs_layout_lru_lock);
+
+	over = atomic_long_read(&pnfs_layout_nr_idle) - pnfs_layout_cache_max;
+	pnfs_layout_lru_evict(NULL, max(nr, over));
+}
+
+/*
+ * Called on unmount, before the inodes go away, so that the idle layouts
+ * of @sb are returned in bulk rather than one by one at eviction.
+ */
+void
+pnfs_return_idle_layouts(struct super_block *sb)
+{
+	flush_work(&pnfs_layout_lru_work);
+	pnfs_layout_lru_evict(sb, LONG_MAX);
+}
+
+/*
+ * Returns run from nfsiod, never from reclaim context itself: returning a
+ * layout may need a LAYOUTCOMMIT and both want memory.
+ */
+int
+pnfs_layout_cache_shrinker(struct shrinker *shrink, int nr_to_scan,
+			   gfp_t gfp_mask)
+{
+	if (nr_to_scan) {
+		if ((gfp_mask & GFP_KERNEL) != GFP_KERNEL)
+			return -1;
+		spin_lock(&pnfs_layout_lru_lock);
+		pnfs_layout_lru_scan += nr_to_scan;
+		spin_unlock(&pnfs_layout_lru_lock);
+		queue_work(nfsiod_workqueue, &pnfs_layout_lru_work);
+	}
+	return (atomic_long_read(&pnfs_layout_nr_idle) / 100) *
+		sysctl_vfs_cache_pressure;
 }
 
 static void
 pnfs_insert_layout(struct pnfs_layout_hdr *lo,
 		   struct pnfs_layout_segment *lseg)
 {
-	struct pnfs_layout_segment *lp;
-	int found = 0;
+	bool was_empty = RB_EMPTY_ROOT(&lo->segs);
 
 	dprintk("%s:Begin\n", __func__);
 
 	assert_spin_locked(&lo->inode->i_lock);
-	list_for_each_entry(lp, &lo->segs, fi_list) {
-		if (cmp_layout(&lp->range, &lseg->range) > 0)
-			continue;
-		list_add_tail(&lseg->fi_list, &lp->fi_list);
-		dprintk("%s: inserted lseg %p "
-			"iomode %d offset %llu length %llu before "
-			"lp %p iomode %d offset %llu length %llu\n",
-			__func__, lseg, lseg->range.iomode,
-			lseg->range.offset, lseg->range.length,
-			lp, lp->range.iomode, lp->range.offset,
-			lp->range.length);
-		found = 1;
-		break;
-	}
-	if (!found) {
-		list_add_tail(&lseg->fi_list, &lo->segs);
-		if (list_is_singular(&lo->segs) &&
-		    !pnfs_layoutgets_blocked(lo, NULL))
-			rpc_wake_up(&NFS_I(lo->inode)->lo_rpcwaitq_stateid);
-		dprintk("%s: inserted lseg %p "
-			"iomode %d offset %llu length %llu at tail\n",
-			__func__, lseg, lseg->range.iomode,
-			lseg->range.offset, lseg->range.length);
-	}
+	pnfs_lseg_tree_insert(lo, lseg);
+	if (was_empty && !pnfs_layoutgets_blocked(lo, NULL))
+		rpc_wake_up(&NFS_I(lo->inode)->lo_rpcwaitq_stateid);
+	dprintk("%s: inserted lseg %p iomode %d offset %llu length %llu\n",
+		__func__, lseg, lseg->range.iomode,
+		lseg->range.offset, lseg->range.length);
 	get_layout_hdr(lo);
 
 	dprintk("%s:Return\n", __func__);
@@ -1011,8 +1481,12 @@ alloc_init_layout_hdr(struct inode *ino)
 		return NULL;
 	atomic_set(&lo->plh_refcount, 1);
 	INIT_LIST_HEAD(&lo->layouts);
-	INIT_LIST_HEAD(&lo->segs);
+	lo->segs = RB_ROOT;
 	INIT_LIST_HEAD(&lo->plh_bulk_recall);
+	INIT_LIST_HEAD(&lo->plh_lru);
+	lo->plh_ra_next = 0;
+	lo->plh_ra_end = 0;
+	lo->plh_ra_window = 0;
 	lo->inode = ino;
 	return lo;
 }
@@ -1080,16 +1554,16 @@ pnfs_find_lseg(struct pnfs_layout_hdr *lo,
 	dprintk("%s:Begin\n", __func__);
 
 	assert_spin_locked(&lo->inode->i_lock);
-	list_for_each_entry(lseg, &lo->segs, fi_list) {
+	/* only segments holding the first byte of range can match */
+	for (lseg = pnfs_lseg_iter_first(lo, range->offset, range->offset);
+	     lseg;
+	     lseg = pnfs_lseg_iter_next(lseg, range->offset, range->offset))
 		if (test_bit(NFS_LSEG_VALID, &lseg->pls_flags) &&
 		    is_matching_lseg(lseg, range)) {
 			get_lseg(lseg);
 			ret = lseg;
 			break;
 		}
-		if (cmp_layout(range, &lseg->range) > 0)
-			break;
-	}
 
 	dprintk("%s:Return lseg %p ref %d valid %d\n",
 		__func__, ret, ret ? atomic_read(&ret->pls_refcount) : 0,
@@ -1128,6 +1602,13 @@ pnfs_update_layout(struct inode *ino,
 		goto out_unlock;
 	}
 
+	/* The layout is in use again, keep it out of the idle LRU */
+	pnfs_layout_lru_del(lo);
+
+	/* Being returned as idle: go through the MDS until that is done */
+	if (test_bit(NFS_LAYOUT_IDLE_RETURN, &lo->plh_flags))
+		goto out_unlock;
+
 	/* Check to see if the layout for the given range already exists */
 	lseg = pnfs_find_lseg(lo, &arg);
 	if (lseg)
@@ -1137,22 +1618,27 @@ pnfs_update_layout(struct inode *ino,
 	if (test_bit(lo_fail_bit(iomode), &nfsi->layout->plh_flags))
 		goto out_unlock;
 
+	spin_lock(&clp->cl_lock);
+	/* A LAYOUTRETURN(FSID) would take the new layout with it */
+	if (atomic_read(&clp->cl_bulk_returns)) {
+		spin_unlock(&clp->cl_lock);
+		goto out_unlock;
+	}
 	get_layout_hdr(lo); /* Matched in pnfs_layoutget_release */
-	if (list_empty(&lo->segs)) {
+	if (RB_EMPTY_ROOT(&lo->segs)) {
 		/* The lo must be on the clp list if there is any
 		 * chance of a CB_LAYOUTRECALL(FILE) coming in.
 		 */
-		spin_lock(&clp->cl_lock);
 		BUG_ON(!list_empty(&lo->layouts));
 		list_add_tail(&lo->layouts, &clp->cl_layouts);
-		spin_unlock(&clp->cl_lock);
 	}
+	spin_unlock(&clp->cl_lock);
 	spin_unlock(&ino->i_lock);
 
 	lseg = send_layoutget(lo, ctx, &arg);
 	if (!lseg) {
 		spin_lock(&ino->i_lock);
-		if (list_empty(&lo->segs)) {
+		if (RB_EMPTY_ROOT(&lo->segs)) {
 			spin_lock(&clp->cl_lock);
 			list_del_init(&lo->layouts);
 			spin_unlock(&clp->cl_lock);
@@ -1178,7 +1664,7 @@ pnfs_layoutgets_blocked(struct pnfs_layout_hdr *lo, nfs4_stateid *stateid)
 		return true;
 	return lo->plh_block_lgets ||
 		test_bit(NFS_LAYOUT_BULK_RECALL, &lo->plh_flags) ||
-		(list_empty(&lo->segs) &&
+		(RB_EMPTY_ROOT(&lo->segs) &&
 		 (atomic_read(&lo->plh_outstanding) != 0));
 }
 
@@ -1321,6 +1807,112 @@ pnfs_set_pg_test(struct inode *ino, struct nfs_pageio_descriptor *pgio)
 	pgio->pg_test = ld->pg_test;
 }
 
+/* Largest range requested by a single read-ahead LAYOUTGET */
+#define PNFS_LAYOUT_PREFETCH_MAX	(64ULL << 20)
+
+struct pnfs_layout_prefetch {
+	struct work_struct		work;
+	struct inode			*inode;
+	struct nfs_open_context		*ctx;
+	struct pnfs_layout_range	range;
+};
+
+static void
+pnfs_layout_prefetch_work(struct work_struct *work)
+{
+	struct pnfs_layout_prefetch *pf =
+		container_of(work, struct pnfs_layout_prefetch, work);
+	struct inode *ino = pf->inode;
+	struct pnfs_layout_segment *lseg;
+
+	lseg = pnfs_update_layout(ino, pf->ctx, pf->range.offset,
+				  pf->range.length, pf->range.iomode);
+	dprintk("%s: ino %lu offset %llu length %llu lseg %p\n", __func__,
+		ino->i_ino, pf->range.offset, pf->range.length, lseg);
+	if (lseg)
+		put_lseg(lseg);
+
+	spin_lock(&ino->i_lock);
+	if (NFS_I(ino)->layout)
+		clear_bit(NFS_LAYOUT_PREFETCH, &NFS_I(ino)->layout->plh_flags);
+	spin_unlock(&ino->i_lock);
+	put_nfs_open_context(pf->ctx);
+	iput(ino);
+	kfree(pf);
+}
+
+/*
+ * Sequential reads get the layout for the next window from nfsiod before
+ * the reader runs off the end of the segment it is using, so the reader
+ * doesn't wait for a LAYOUTGET at each segment boundary.  The window
+ * starts at the size of the read and doubles with each prefetch, up to
+ * PNFS_LAYOUT_PREFETCH_MAX; any non-sequential read starts over.
+ */
+static void
+pnfs_layout_readahead(struct inode *ino, struct nfs_open_context *ctx,
+		      struct pnfs_layout_segment *lseg, loff_t pos,
+		      size_t count)
+{
+	struct pnfs_layout_hdr *lo;
+	struct pnfs_layout_prefetch *pf;
+	loff_t i_size = i_size_read(ino);
+	loff_t end = pos + count;
+	loff_t start;
+	u64 len;
+
+	/* nothing left to prefetch past a whole-file segment */
+	if (lseg->range.length == NFS4_MAX_UINT64)
+		return;
+
+	spin_lock(&ino->i_lock);
+	lo = NFS_I(ino)->layout;
+	if (!lo)
+		goto out_unlock;
+	if (pos != lo->plh_ra_next) {
+		lo->plh_ra_next = end;
+		lo->plh_ra_end = 0;
+		lo->plh_ra_window = 0;
+		goto out_unlock;
+	}
+	lo->plh_ra_next = end;
+	if (!lo->plh_ra_window)
+		lo->plh_ra_window = count;
+
+	start = max_t(loff_t, lseg->range.offset + lseg->range.length,
+		      lo->plh_ra_end);
+	if (start >= i_size || start - end > lo->plh_ra_window ||
+	    test_bit(NFS_LAYOUT_PREFETCH, &lo->plh_flags))
+		goto out_unlock;
+	len = min_t(u64, lo->plh_ra_window, i_size - start);
+	lo->plh_ra_end = start + len;
+	lo->plh_ra_window = min_t(u64, lo->plh_ra_window << 1,
+				  PNFS_LAYOUT_PREFETCH_MAX);
+	set_bit(NFS_LAYOUT_PREFETCH, &lo->plh_flags);
+	spin_unlock(&ino->i_lock);
+
+	pf = kmalloc(sizeof(*pf), GFP_NOFS);
+	if (!pf || !igrab(ino)) {
+		kfree(pf);
+		spin_lock(&ino->i_lock);
+		clear_bit(NFS_LAYOUT_PREFETCH, &lo->plh_flags);
+		spin_unlock(&ino->i_lock);
+		return;
+	}
+	INIT_WORK(&pf->work, pnfs_layout_prefetch_work);
+	pf->inode = ino;
+	pf->ctx = get_nfs_open_context(ctx);
+	pf->range.iomode = IOMODE_READ;
+	pf->range.offset = start;
+	pf->range.length = len;
+	dprintk("%s: ino %lu prefetch offset %llu length %llu\n", __func__,
+		ino->i_ino, start, len);
+	queue_work(nfsiod_workqueue, &pf->work);
+	return;
+
+out_unlock:
+	spin_unlock(&ino->i_lock);
+}
+
 /*
  * rsize is already set by caller to MDS rsize.
  */
@@ -1347,6 +1939,7 @@ pnfs_pageio_init_read(struct nfs_pageio_descriptor *pgio,
 	if (pgio->pg_lseg) {
 		pnfs_set_pg_test(inode, pgio);
 		*rsize = NFS_SERVER(inode)->ds_rsize;
+		pnfs_layout_readahead(inode, ctx, pgio->pg_lseg, loff, count);
 	}
 }
 
@@ -1422,7 +2015,14 @@ pnfs_write_retry(struct work_struct *work)
 	range.iomode = IOMODE_RW;
 	range.offset = wdata->args.offset;
 	range.length = wdata->args.count;
+	nfs_inc_pnfs_stats(wdata->inode, NFSIOS_PNFS_WRITE_RETRY);
 	_pnfs_return_layout(wdata->inode, &range, true);
+	if (wdata->pdata.pnfsflags & PNFS_DIRECT_IO) {
+		pnfs_direct_write_reset(wdata);
+		nfs_initiate_write(wdata, NFS_CLIENT(wdata->inode),
+				   wdata->pdata.call_ops, wdata->pdata.how);
+		return;
+	}
 	pnfs_initiate_write(wdata, NFS_CLIENT(wdata->inode),
 			    wdata->pdata.call_ops, wdata->pdata.how);
 }
@@ -1476,12 +2076,12 @@ static void _pnfs_clear_lseg_from_pages(struct list_head *head)
  */
 enum pnfs_try_status
 pnfs_try_to_write_data(struct nfs_write_data *wdata,
-			const struct rpc_call_ops *call_ops, int how)
+			const struct rpc_call_ops *call_ops, int how,
+			struct pnfs_layout_segment *lseg)
 {
 	struct inode *inode = wdata->inode;
 	enum pnfs_try_status trypnfs;
 	struct nfs_server *nfss = NFS_SERVER(inode);
-	struct pnfs_layout_segment *lseg = wdata->req->wb_lseg;
 
 	wdata->pdata.call_ops = call_ops;
 	wdata->pdata.pnfs_error = 0;
@@ -1506,6 +2106,8 @@ pnfs_try_to_write_data(struct nfs_write_data *wdata,
 		_pnfs_clear_lseg_from_pages(&wdata->pages);
 	} else {
 		nfs_inc_stats(inode, NFSIOS_PNFS_WRITE);
+		nfs_add_pnfs_stats(inode, NFSIOS_PNFS_DSWRITTENBYTES,
+				   wdata->args.count);
 	}
 	dprintk("%s End (trypnfs:%d)\n", __func__, trypnfs);
 	return trypnfs;
@@ -1527,7 +2129,14 @@ pnfs_read_retry(struct work_struct *work)
 	range.iomode = IOMODE_RW;
 	range.offset = rdata->args.offset;
 	range.length = rdata->args.count;
+	nfs_inc_pnfs_stats(rdata->inode, NFSIOS_PNFS_READ_RETRY);
 	_pnfs_return_layout(rdata->inode, &range, true);
+	if (rdata->pdata.pnfsflags & PNFS_DIRECT_IO) {
+		pnfs_direct_read_reset(rdata);
+		nfs_initiate_read(rdata, NFS_CLIENT(rdata->inode),
+				  rdata->pdata.call_ops);
+		return;
+	}
 	pnfs_initiate_read(rdata, NFS_CLIENT(rdata->inode),
 			   rdata->pdata.call_ops);
 }
@@ -1553,11 +2162,11 @@ EXPORT_SYMBOL_GPL(pnfs_read_done);
  */
 enum pnfs_try_status
 pnfs_try_to_read_data(struct nfs_read_data *rdata,
-		       const struct rpc_call_ops *call_ops)
+		       const struct rpc_call_ops *call_ops,
+		       struct pnfs_layout_segment *lseg)
 {
 	struct inode *inode = rdata->inode;
 	struct nfs_server *nfss = NFS_SERVER(inode);
-	struct pnfs_layout_segment *lseg = rdata->req->wb_lseg;
 	enum pnfs_try_status trypnfs;
 
 	rdata->pdata.call_ops = call_ops;
@@ -1580,11 +2189,119 @@ pnfs_try_to_read_data(struct nfs_read_data *rdata,
 		_pnfs_clear_lseg_from_pages(&rdata->pages);
 	} else {
 		nfs_inc_stats(inode, NFSIOS_PNFS_READ);
+		nfs_add_pnfs_stats(inode, NFSIOS_PNFS_DSREADBYTES,
+				   rdata->args.count);
 	}
 	dprintk("%s End (trypnfs:%d)\n", __func__, trypnfs);
 	return trypnfs;
 }
 
+/*
+ * O_DIRECT requests have no nfs_page list to carry a layout segment, so
+ * nfs_direct_*_schedule_segment() ask for one here per request.  The
+ * request is trimmed so it stays within the segment, within one stripe
+ * unit when the driver stripes (->io_boundary) and within the data
+ * server I/O size.  Requests are issued asynchronously, so consecutive
+ * stripe units go to their data servers in parallel.
+ *
+ * Returns a referenced segment, or NULL to send the request to the MDS.
+ */
+struct pnfs_layout_segment *
+pnfs_direct_get_lseg(struct inode *inode, struct nfs_open_context *ctx,
+		     loff_t pos, size_t *count, enum pnfs_iomode iomode)
+{
+	struct nfs_server *nfss = NFS_SERVER(inode);
+	struct pnfs_layoutdriver_type *ld = nfss->pnfs_curr_ld;
+	struct pnfs_layout_segment *lseg;
+	size_t iosize;
+	u64 end;
+
+	if (!pnfs_enabled_sb(nfss) || !(ld->flags & PNFS_LAYOUT_DIRECT_IO))
+		return NULL;
+
+	lseg = pnfs_update_layout(inode, ctx, pos, *count, iomode);
+	if (!lseg)
+		return NULL;
+
+	iosize = iomode == IOMODE_READ ? nfss->ds_rsize : nfss->ds_wsize;
+	end = pos + min_t(size_t, *count, iosize);
+	if (lseg->range.length != NFS4_MAX_UINT64 &&
+	    lseg->range.offset + lseg->range.length < end)
+		end = lseg->range.offset + lseg->range.length;
+	if (ld->io_boundary)
+		end = min(end, ld->io_boundary(lseg, pos));
+	if (end <= pos) {
+		put_lseg(lseg);
+		return NULL;
+	}
+
+	dprintk("%s: %s %Zu@%llu -> %llu\n", __func__,
+		iomode == IOMODE_READ ? "read" : "write", *count,
+		(unsigned long long)pos, (unsigned long long)(end - pos));
+	*count = end - pos;
+	return lseg;
+}
+
+/* Hand an O_DIRECT request to the layout driver */
+enum pnfs_try_status
+pnfs_direct_try_to_read(struct nfs_read_data *rdata,
+			const struct rpc_call_ops *call_ops,
+			struct pnfs_layout_segment *lseg)
+{
+	enum pnfs_try_status trypnfs;
+
+	rdata->pdata.pnfsflags |= PNFS_DIRECT_IO;
+	trypnfs = pnfs_try_to_read_data(rdata, call_ops, lseg);
+	if (trypnfs == PNFS_NOT_ATTEMPTED)
+		pnfs_direct_read_reset(rdata);
+	return trypnfs;
+}
+
+enum pnfs_try_status
+pnfs_direct_try_to_write(struct nfs_write_data *wdata,
+			 const struct rpc_call_ops *call_ops,
+			 struct pnfs_layout_segment *lseg)
+{
+	enum pnfs_try_status trypnfs;
+
+	wdata->pdata.pnfsflags |= PNFS_DIRECT_IO;
+	trypnfs = pnfs_try_to_write_data(wdata, call_ops, FLUSH_STABLE, lseg);
+	if (trypnfs == PNFS_NOT_ATTEMPTED)
+		pnfs_direct_write_reset(wdata);
+	return trypnfs;
+}
+
+/*
+ * Take back whatever a layout driver set up in an O_DIRECT request so
+ * it can be sent to the MDS: after a failed data server attempt, or
+ * when a direct write is resent with stable semantics.
+ */
+void
+pnfs_direct_read_reset(struct nfs_read_data *rdata)
+{
+	rdata->pdata.pnfsflags = 0;
+	rdata->pdata.pnfs_error = 0;
+	rdata->fldata.ds_nfs_client = NULL;
+	rdata->fldata.orig_offset = 0;
+	rdata->args.fh = NFS_FH(rdata->inode);
+	rdata->res.count = rdata->args.count;
+	rdata->res.eof = 0;
+	nfs_fattr_init(&rdata->fattr);
+}
+
+void
+pnfs_direct_write_reset(struct nfs_write_data *wdata)
+{
+	wdata->pdata.pnfsflags = 0;
+	wdata->pdata.pnfs_error = 0;
+	wdata->pdata.orig_count = 0;
+	wdata->fldata.ds_nfs_client = NULL;
+	wdata->fldata.orig_offset = 0;
+	wdata->args.fh = NFS_FH(wdata->inode);
+	wdata->res.count = wdata->args.count;
+	nfs_fattr_init(&wdata->fattr);
+}
+
 /*
  * This gives the layout driver an opportunity to read in page "around"
  * the data to be written.  It returns 0 on success, otherwise an error code
@@ -1635,6 +2352,7 @@ pnfs_commit_done(struct nfs_write_data *data)
 			.length = data->args.count,
 		};
 		dprintk("%s: retrying\n", __func__);
+		nfs_inc_pnfs_stats(data->inode, NFSIOS_PNFS_COMMIT_RETRY);
 		_pnfs_return_layout(data->inode, &range, true);
 		pnfs_initiate_commit(data, NFS_CLIENT(data->inode),
 				     pdata->call_ops, pdata->how, 1);
@@ -1936,9 +2654,9 @@ pnfs_delete_deviceid(struct pnfs_deviceid_cache *c,
 }
 EXPORT_SYMBOL_GPL(pnfs_delete_deviceid);
 
-/* Find and reference a deviceid */
-struct pnfs_deviceid_node *
-pnfs_find_get_deviceid(struct pnfs_deviceid_cache *c, struct nfs4_deviceid *id)
+static struct pnfs_deviceid_node *
+__pnfs_find_get_deviceid(struct pnfs_deviceid_cache *c,
+			 struct nfs4_deviceid *id)
 {
 	struct pnfs_deviceid_node *d;
 	struct hlist_node *n;
@@ -1960,6 +2678,16 @@ fail:
 	rcu_read_unlock();
 	return NULL;
 }
+
+/* Find and reference a deviceid */
+struct pnfs_deviceid_node *
+pnfs_find_get_deviceid(struct pnfs_deviceid_cache *c, struct nfs4_deviceid *id)
+{
+	struct pnfs_deviceid_node *d = __pnfs_find_get_deviceid(c, id);
+
+	atomic_inc(d ? &c->dc_hits : &c->dc_misses);
+	return d;
+}
 EXPORT_SYMBOL_GPL(pnfs_find_get_deviceid);
 
 /*
@@ -1974,7 +2702,7 @@ pnfs_add_deviceid(struct pnfs_deviceid_cache *c, struct pnfs_deviceid_node *new)
 
 	dprintk("--> %s hash %ld\n", __func__, hash);
 	spin_lock(&c->dc_lock);
-	d = pnfs_find_get_deviceid(c, &new->de_id);
+	d = __pnfs_find_get_deviceid(c, &new->de_id);
 	if (d) {
 		spin_unlock(&c->dc_lock);
 		dprintk("%s [discard]\n", __func__);
@@ -2012,3 +2740,327 @@ pnfs_put_deviceid_cache(struct nfs_client *clp)
 	}
 }
 EXPORT_SYMBOL_GPL(pnfs_put_deviceid_cache);
+
+/*
+ * Data server cache.  Lookups walk the hash chains under RCU only; the
+ * lock serializes insertion and removal.
+ */
+static DEFINE_SPINLOCK(pnfs_ds_cache_lock);
+static struct hlist_head pnfs_ds_cache[NFS4_DS_HASH_SIZE];
+
+static u32
+pnfs_ds_hash(u32 layout_type, struct net *net, const struct sockaddr *sap)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sap;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sap;
+	u32 initval = layout_type ^ (u32)(unsigned long)net;
+
+	switch (sap->sa_family) {
+	case AF_INET:
+		return jhash_2words((__force u32)sin->sin_addr.s_addr,
+				    (__force u32)sin->sin_port,
+				    initval) & NFS4_DS_HASH_MASK;
+	case AF_INET6:
+		return jhash2((__force u32 *)sin6->sin6_addr.s6_addr32, 4,
+			      initval ^ (__force u32)sin6->sin6_port) &
+			NFS4_DS_HASH_MASK;
+	}
+	return 0;
+}
+
+void
+pnfs_init_ds_node(struct pnfs_ds_node *ds, u32 layout_type, struct net *net,
+		  const struct sockaddr *sap, size_t salen)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	INIT_HLIST_NODE(&ds->dn_node);
+	ds->dn_layout_type = layout_type;
+	ds->dn_net = net;
+	memcpy(&ds->dn_addr, sap, salen);
+	ds->dn_addrlen = salen;
+	atomic_set(&ds->dn_ref, 1);
+	ds->dn_flags = 0;
+	ds->dn_state = PNFS_DS_IDLE;
+	ds->dn_error = 0;
+
+	if (rpc_ntop(sap, buf, sizeof(buf)) == 0)
+		strcpy(buf, "?");
+	snprintf(ds->dn_remotestr, sizeof(ds->dn_remotestr),
+		 sap->sa_family == AF_INET6 ? "[%s]:%hu" : "%s:%hu",
+		 buf, rpc_get_port(sap));
+}
+EXPORT_SYMBOL_GPL(pnfs_init_ds_node);
+
+/* Must be called with rcu_read_lock or pnfs_ds_cache_lock held */
+static struct pnfs_ds_node *
+_pnfs_lookup_ds(u32 layout_type, struct net *net, const struct sockaddr *sap)
+{
+	struct pnfs_ds_node *ds;
+	struct hlist_node *n;
+	u32 hash = pnfs_ds_hash(layout_type, net, sap);
+
+	hlist_for_each_entry_rcu(ds, n, &pnfs_ds_cache[hash], dn_node)
+		if (ds->dn_layout_type == layout_type && ds->dn_net == net &&
+		    nfs_sockaddr_cmp((struct sockaddr *)&ds->dn_addr, sap))
+			return ds;
+	return NULL;
+}
+
+/* Find and reference a data server */
+struct pnfs_ds_node *
+pnfs_find_get_ds(u32 layout_type, struct net *net, const struct sockaddr *sap)
+{
+	struct pnfs_ds_node *ds;
+
+	rcu_read_lock();
+	ds = _pnfs_lookup_ds(layout_type, net, sap);
+	if (ds && !atomic_inc_not_zero(&ds->dn_ref))
+		ds = NULL;
+	rcu_read_unlock();
+	return ds;
+}
+EXPORT_SYMBOL_GPL(pnfs_find_get_ds);
+
+/*
+ * Add a data server to the cache.  Devices sharing a data server can be
+ * decoded concurrently; if it is already cached, the cached entry is
+ * referenced and returned and the caller must discard new.
+ */
+struct pnfs_ds_node *
+pnfs_add_ds(struct pnfs_ds_node *new)
+{
+	struct sockaddr *sap = (struct sockaddr *)&new->dn_addr;
+	struct pnfs_ds_node *ds;
+
+	spin_lock(&pnfs_ds_cache_lock);
+	ds = _pnfs_lookup_ds(new->dn_layout_type, new->dn_net, sap);
+	if (ds && atomic_inc_not_zero(&ds->dn_ref)) {
+		spin_unlock(&pnfs_ds_cache_lock);
+		dprintk("%s %s found, ref %d\n", __func__, ds->dn_remotestr,
+			atomic_read(&ds->dn_ref));
+		return ds;
+	}
+	hlist_add_head_rcu(&new->dn_node,
+			   &pnfs_ds_cache[pnfs_ds_hash(new->dn_layout_type,
+						       new->dn_net, sap)]);
+	spin_unlock(&pnfs_ds_cache_lock);
+	dprintk("%s %s [new]\n", __func__, new->dn_remotestr);
+	return new;
+}
+EXPORT_SYMBOL_GPL(pnfs_add_ds);
+
+/*
+ * Drop a data server reference.  Returns nonzero if that was the last
+ * one, in which case ds is unhashed, no RCU reader can still see it, and
+ * the caller must free it.
+ */
+int
+pnfs_put_ds(struct pnfs_ds_node *ds)
+{
+	if (!atomic_dec_and_lock(&ds->dn_ref, &pnfs_ds_cache_lock))
+		return 0;
+	hlist_del_rcu(&ds->dn_node);
+	spin_unlock(&pnfs_ds_cache_lock);
+	synchronize_rcu();
+	return 1;
+}
+EXPORT_SYMBOL_GPL(pnfs_put_ds);
+
+/*
+ * Decode a netaddr4 (r_netid, r_addr) at *pp, advancing *pp past it.
+ * Returns the length of the decoded address, or 0 if it is not a TCP
+ * universal address.
+ */
+size_t
+pnfs_decode_ds_addr(__be32 **pp, struct sockaddr *sap, size_t salen)
+{
+	__be32 *p = *pp;
+	char *r_netid, *r_addr;
+	u32 nlen, rlen;
+	size_t len;
+
+	nlen = be32_to_cpup(p++);
+	r_netid = (char *)p;
+	p += XDR_QUADLEN(nlen);
+	rlen = be32_to_cpup(p++);
+	r_addr = (char *)p;
+	p += XDR_QUADLEN(rlen);
+	*pp = p;
+
+	if (!((nlen == 3 && !memcmp(r_netid, "tcp", 3)) ||
+	      (nlen == 4 && !memcmp(r_netid, "tcp6", 4)))) {
+		dprintk("%s: unsupported r_netid\n", __func__);
+		return 0;
+	}
+	if (rlen > RPCBIND_MAXUADDRLEN) {
+		dprintk("%s: invalid address, length %u\n", __func__, rlen);
+		return 0;
+	}
+	len = rpc_uaddr2sockaddr(r_addr, rlen, sap, salen);
+	if (len == 0)
+		dprintk("%s: could not parse r_addr %.*s\n", __func__,
+			(int)rlen, r_addr);
+	return len;
+}
+EXPORT_SYMBOL_GPL(pnfs_decode_ds_addr);
+
+/*
+ * Data server sessions.  At most one EXCHANGE_ID/CREATE_SESSION per data
+ * server is in progress at a time: whoever wins PNFS_DS_CONNECT_BIT runs
+ * the layout driver's connect routine, anyone else needing that data
+ * server sleeps on the bit.  GETDEVICEINFO kicks connects for every data
+ * server of a new device in parallel, so I/O normally finds the session
+ * ready, or waits only for the one it is about to use.
+ */
+static const char * const pnfs_ds_state_names[] = {
+	[PNFS_DS_IDLE]		= "idle",
+	[PNFS_DS_CONNECTING]	= "connecting",
+	[PNFS_DS_READY]		= "ready",
+	[PNFS_DS_FAILED]	= "failed",
+};
+
+const char *
+pnfs_ds_state_name(struct pnfs_ds_node *ds)
+{
+	return pnfs_ds_state_names[ds->dn_state];
+}
+EXPORT_SYMBOL_GPL(pnfs_ds_state_name);
+
+static void
+pnfs_ds_connect_unlock(struct pnfs_ds_node *ds)
+{
+	smp_mb__before_clear_bit();
+	clear_bit(PNFS_DS_CONNECT_BIT, &ds->dn_flags);
+	smp_mb__after_clear_bit();
+	wake_up_bit(&ds->dn_flags, PNFS_DS_CONNECT_BIT);
+}
+
+/* Returns nonzero if the caller must now connect ds */
+static int
+pnfs_ds_connect_begin(struct pnfs_ds_node *ds)
+{
+	if (test_and_set_bit(PNFS_DS_CONNECT_BIT, &ds->dn_flags))
+		return 0;
+	if (ds->dn_state == PNFS_DS_READY) {
+		pnfs_ds_connect_unlock(ds);
+		return 0;
+	}
+	ds->dn_state = PNFS_DS_CONNECTING;
+	ds->dn_connect_start = jiffies;
+	dprintk("%s %s\n", __func__, ds->dn_remotestr);
+	return 1;
+}
+
+static void
+pnfs_ds_connect_end(struct pnfs_ds_node *ds, int err)
+{
+	dprintk("%s %s err %d after %ums\n", __func__, ds->dn_remotestr, err,
+		jiffies_to_msecs(jiffies - ds->dn_connect_start));
+	ds->dn_error = err;
+	/* order the driver's session pointer before the state */
+	smp_wmb();
+	ds->dn_state = err ? PNFS_DS_FAILED : PNFS_DS_READY;
+	pnfs_ds_connect_unlock(ds);
+}
+
+/*
+ * Make sure ds has a session before I/O is sent to it.  If nobody is
+ * connecting, connect inline (retrying a failed data server); otherwise
+ * wait for the attempt in progress and return its result.
+ */
+int
+pnfs_ds_connect(struct nfs_server *mds_srv, struct pnfs_ds_node *ds,
+		pnfs_ds_connect_t connect)
+{
+	int err;
+
+	if (ds->dn_state == PNFS_DS_READY) {
+		smp_rmb();
+		return 0;
+	}
+	if (pnfs_ds_connect_begin(ds)) {
+		err = connect(mds_srv, ds);
+		pnfs_ds_connect_end(ds, err);
+		return err;
+	}
+	err = wait_on_bit(&ds->dn_flags, PNFS_DS_CONNECT_BIT,
+			  nfs_wait_bit_killable, TASK_KILLABLE);
+	if (err)
+		return err;
+	smp_rmb();
+	if (ds->dn_state == PNFS_DS_READY)
+		return 0;
+	return ds->dn_error ? ds->dn_error : -EIO;
+}
+EXPORT_SYMBOL_GPL(pnfs_ds_connect);
+
+struct pnfs_ds_connect_work {
+	struct work_struct		work;
+	struct nfs_server		*mds_srv;
+	struct pnfs_deviceid_node	*devid;
+	struct pnfs_ds_node		*ds;
+	pnfs_ds_connect_t		connect;
+};
+
+static DECLARE_WAIT_QUEUE_HEAD(pnfs_ds_connect_wq);
+
+/*
+ * Wait for the background connects queued for nfss.  This only waits on
+ * those work items, never on nfsiod as a whole, so it is safe from the
+ * kill_sb paths that themselves run from nfsiod.
+ */
+static void
+pnfs_ds_connect_wait(struct nfs_server *nfss)
+{
+	wait_event(pnfs_ds_connect_wq,
+		   atomic_read(&nfss->pnfs_ds_connects) == 0);
+}
+
+static void
+pnfs_ds_connect_work(struct work_struct *work)
+{
+	struct pnfs_ds_connect_work *cw =
+		container_of(work, struct pnfs_ds_connect_work, work);
+	struct nfs_server *mds_srv = cw->mds_srv;
+
+	if (pnfs_ds_connect_begin(cw->ds))
+		pnfs_ds_connect_end(cw->ds, cw->connect(mds_srv, cw->ds));
+	pnfs_put_deviceid(mds_srv->nfs_client->cl_devid_cache, cw->devid);
+	kfree(cw);
+	/* mds_srv may be freed as soon as the count drops */
+	if (atomic_dec_and_test(&mds_srv->pnfs_ds_connects))
+		wake_up_all(&pnfs_ds_connect_wq);
+}
+
+/*
+ * Start connecting ds, which belongs to the cached device devid, in the
+ * background.  The devid reference pins ds until the work has run, and
+ * mds_srv->pnfs_ds_connects makes unset_pnfs_layoutdrivers() wait for it
+ * before mds_srv goes away.
+ * Data servers that already failed are left to the next I/O to retry.
+ */
+void
+pnfs_ds_connect_async(struct nfs_server *mds_srv,
+		      struct pnfs_deviceid_node *devid,
+		      struct pnfs_ds_node *ds, pnfs_ds_connect_t connect)
+{
+	struct pnfs_ds_connect_work *cw;
+
+	if (ds->dn_state != PNFS_DS_IDLE ||
+	    test_bit(PNFS_DS_CONNECT_BIT, &ds->dn_flags))
+		return;
+
+	cw = kmalloc(sizeof(*cw), GFP_KERNEL);
+	if (!cw)
+		return;		/* first I/O will connect inline */
+	INIT_WORK(&cw->work, pnfs_ds_connect_work);
+	cw->mds_srv = mds_srv;
+	cw->devid = devid;
+	cw->ds = ds;
+	cw->connect = connect;
+	atomic_inc(&devid->de_ref);
+	atomic_inc(&mds_srv->pnfs_ds_connects);
+	queue_work(nfsiod_workqueue, &cw->work);
+}
+EXPORT_SYMBOL_GPL(pnfs_ds_connect_async);
@@ -31,6 +31,8 @@
 #define FS_NFS_PNFS_H
 
 #include <linux/nfs_page.h>
+#include <linux/inet.h>
+#include <linux/rbtree.h>
 #include "nfs4_fs.h"
 #include "callback.h"
 
@@ -39,7 +41,9 @@ enum {
 };
 
 struct pnfs_layout_segment {
-	struct list_head fi_list;
+	struct list_head fi_list;	/* on a free list once unhashed */
+	struct rb_node pls_node;	/* in pnfs_layout_hdr segs */
+	u64 pls_subtree_last;		/* last byte covered by subtree */
 	struct pnfs_layout_range range;
 	atomic_t pls_refcount;
 	unsigned long pls_flags;
@@ -67,6 +71,9 @@ enum {
 	NFS_LAYOUT_RW_FAILED,		/* get rw layout failed stop trying */
 	NFS_LAYOUT_BULK_RECALL,		/* bulk recall affecting layout */
 	NFS_LAYOUT_NEED_LCOMMIT,	/* LAYOUTCOMMIT needed */
+	NFS_LAYOUT_PREFETCH,		/* read-ahead LAYOUTGET in flight */
+	NFS_LAYOUT_LRU,			/* on the idle layout LRU */
+	NFS_LAYOUT_IDLE_RETURN,		/* idle layout being returned */
 };
 
 enum layoutdriver_policy_flags {
@@ -75,6 +82,9 @@ enum layoutdriver_policy_flags {
 
 	/* Should the pNFS client commit and return the layout upon a setattr */
 	PNFS_LAYOUTRET_ON_SETATTR	= 1 << 1,
+
+	/* Can read/write_pagelist take O_DIRECT requests (no nfs_page list) */
+	PNFS_LAYOUT_DIRECT_IO		= 1 << 2,
 };
 
 /* Per-layout driver specific registration structure */
@@ -96,6 +106,11 @@ struct pnfs_layoutdriver_type {
 	/* test for nfs page cache coalescing */
 	int (*pg_test)(struct nfs_pageio_descriptor *, struct nfs_page *, struct nfs_page *);
 
+	/* End of the stripe unit holding offset; O_DIRECT requests are
+	 * split there so each one goes to a single data server.
+	 */
+	u64 (*io_boundary)(struct pnfs_layout_segment *lseg, u64 offset);
+
 	/* Retreive the block size of the file system.
 	 * If gather_across_stripes == 1, then the file system will gather
 	 * requests into the block size.
@@ -160,7 +175,7 @@ struct pnfs_layout_hdr {
 	atomic_t		plh_refcount;
 	struct list_head	layouts;   /* other client layouts */
 	struct list_head	plh_bulk_recall; /* clnt list of bulk recalls */
-	struct list_head	segs;      /* layout segments list */
+	struct rb_root		segs;      /* layout segment interval tree */
 	int			roc_iomode;/* return on close iomode, 0=none */
 	nfs4_stateid		stateid;
 	atomic_t		plh_outstanding; /* number of RPCs out */
@@ -173,6 +188,11 @@ struct pnfs_layout_hdr {
 	 */
 	loff_t			write_begin_pos;
 	loff_t			write_end_pos;
+	/* sequential read LAYOUTGET prefetch, protected by i_lock */
+	loff_t			plh_ra_next;	/* expected next read offset */
+	loff_t			plh_ra_end;	/* prefetched up to here */
+	u64			plh_ra_window;	/* next prefetch length */
+	struct list_head	plh_lru;	/* idle layout LRU */
 	struct inode		*inode;
 };
 
@@ -246,9 +266,66 @@ struct pnfs_deviceid_cache {
 	spinlock_t		dc_lock;
 	atomic_t		dc_ref;
 	void			(*dc_free_callback)(struct pnfs_deviceid_node *);
+	atomic_t		dc_hits;	/* pnfs_find_get_deviceid() */
+	atomic_t		dc_misses;
 	struct hlist_head	dc_deviceids[NFS4_DEVICE_ID_HASH_SIZE];
 };
 
+/*
+ * Data server RCU cache, shared by the layout drivers that talk NFSv4.1
+ * to their data servers.  A data server is unique per layout type,
+ * network namespace and address (IPv4 or IPv6, including the port).
+ */
+#define NFS4_DS_HASH_BITS	8
+#define NFS4_DS_HASH_SIZE	(1 << NFS4_DS_HASH_BITS)
+#define NFS4_DS_HASH_MASK	(NFS4_DS_HASH_SIZE - 1)
+
+/* "[" IPv6 "]:" port, NUL */
+#define NFS4_DS_REMOTESTR_LEN	(INET6_ADDRSTRLEN + 9)
+
+/* pnfs_ds_node dn_state */
+enum pnfs_ds_state {
+	PNFS_DS_IDLE = 0,	/* no session yet, nobody trying */
+	PNFS_DS_CONNECTING,
+	PNFS_DS_READY,
+	PNFS_DS_FAILED,		/* last attempt failed with dn_error */
+};
+
+/* pnfs_ds_node dn_flags */
+#define PNFS_DS_CONNECT_BIT	0	/* held while a session is set up */
+
+struct pnfs_ds_node {
+	struct hlist_node	dn_node;
+	u32			dn_layout_type;
+	struct net		*dn_net;
+	struct sockaddr_storage	dn_addr;
+	size_t			dn_addrlen;
+	atomic_t		dn_ref;
+	unsigned long		dn_flags;
+	int			dn_state;
+	int			dn_error;
+	unsigned long		dn_connect_start;	/* jiffies */
+	char			dn_remotestr[NFS4_DS_REMOTESTR_LEN];
+};
+
+/* Layout driver routine that sets up the session to a data server */
+typedef int (*pnfs_ds_connect_t)(struct nfs_server *mds_srv,
+				 struct pnfs_ds_node *);
+
+extern void pnfs_init_ds_node(struct pnfs_ds_node *, u32 layout_type,
+			      struct net *, const struct sockaddr *, size_t);
+extern struct pnfs_ds_node *pnfs_find_get_ds(u32 layout_type, struct net *,
+					     const struct sockaddr *);
+extern struct pnfs_ds_node *pnfs_add_ds(struct pnfs_ds_node *);
+extern int pnfs_put_ds(struct pnfs_ds_node *);
+extern size_t pnfs_decode_ds_addr(__be32 **pp, struct sockaddr *, size_t);
+extern const char *pnfs_ds_state_name(struct pnfs_ds_node *);
+extern int pnfs_ds_connect(struct nfs_server *, struct pnfs_ds_node *,
+			   pnfs_ds_connect_t);
+extern void pnfs_ds_connect_async(struct nfs_server *,
+				  struct pnfs_deviceid_node *,
+				  struct pnfs_ds_node *, pnfs_ds_connect_t);
+
 extern struct pnfs_layout_hdr * pnfs_find_alloc_layout(struct inode *ino);
 extern struct pnfs_layout_hdr * pnfs_find_inode_layout(struct inode *ino);
 extern struct pnfs_layout_segment * pnfs_find_lseg(
@@ -301,9 +378,11 @@ void set_pnfs_layoutdrivers(struct nfs_server *, const struct nfs_fh *mntfh, u32
 void set_pnfs_layoutdriver(struct nfs_server *, const struct nfs_fh *mntfh, u32 id, u32 flags);
 void unset_pnfs_layoutdrivers(struct nfs_server *);
 enum pnfs_try_status pnfs_try_to_write_data(struct nfs_write_data *,
-					     const struct rpc_call_ops *, int);
+					     const struct rpc_call_ops *, int,
+					     struct pnfs_layout_segment *);
 enum pnfs_try_status pnfs_try_to_read_data(struct nfs_read_data *,
-					    const struct rpc_call_ops *);
+					    const struct rpc_call_ops *,
+					    struct pnfs_layout_segment *);
 void pnfs_cleanup_layoutcommit(struct inode *,
 			       struct nfs4_layoutcommit_data *);
 int pnfs_layoutcommit_inode(struct inode *inode, int sync);
@@ -338,12 +417,27 @@ void nfs4_asynch_forget_layouts(struct pnfs_layout_hdr *lo,
 void pnfs_read_done(struct nfs_read_data *);
 void pnfs_writeback_done(struct nfs_write_data *);
 void pnfs_commit_done(struct nfs_write_data *);
+struct pnfs_layout_segment *
+pnfs_direct_get_lseg(struct inode *, struct nfs_open_context *,
+		     loff_t pos, size_t *count, enum pnfs_iomode);
+enum pnfs_try_status pnfs_direct_try_to_read(struct nfs_read_data *,
+					      const struct rpc_call_ops *,
+					      struct pnfs_layout_segment *);
+enum pnfs_try_status pnfs_direct_try_to_write(struct nfs_write_data *,
+					       const struct rpc_call_ops *,
+					       struct pnfs_layout_segment *);
+void pnfs_direct_read_reset(struct nfs_read_data *);
+void pnfs_direct_write_reset(struct nfs_write_data *);
 int _pnfs_write_begin(struct inode *inode, struct page *page,
 		      loff_t pos, unsigned len,
 		      struct pnfs_layout_segment *lseg,
 		      struct pnfs_fsdata **fsdata);
 extern int pnfs_return_layout(struct inode *ino,
                               struct pnfs_layout_range *range, bool wait);
+void pnfs_layout_close(struct inode *ino, bool wait);
+void pnfs_return_idle_layouts(struct super_block *sb);
+int pnfs_layout_cache_shrinker(struct shrinker *shrink, int nr_to_scan,
+			       gfp_t gfp_mask);
 
 static inline bool
 has_layout(struct nfs_inode *nfsi)
@@ -458,6 +552,12 @@ static inline int pnfs_get_read_status(struct nfs_read_data *data)
 	return data->pdata.pnfs_error;
 }
 
+/* Was this O_DIRECT write carried out by the layout driver? */
+static inline bool pnfs_direct_write_by_layout(struct nfs_write_data *data)
+{
+	return data->pdata.pnfsflags & PNFS_DIRECT_IO;
+}
+
 static inline struct pnfs_layout_segment *
 nfs4_pull_lseg_from_fsdata(struct file *filp, void *fsdata)
 {
@@ -481,6 +581,11 @@ static inline void pnfs_destroy_layout(struct nfs_inode *nfsi)
 {
 }
 
+static inline int pnfs_enabled_sb(struct nfs_server *nfss)
+{
+	return 0;
+}
+
 static inline void get_lseg(struct pnfs_layout_segment *lseg)
 {
 }
@@ -516,18 +621,51 @@ static inline int pnfs_grow_ok(struct pnfs_layout_segment *lseg,
 
 static inline enum pnfs_try_status
 pnfs_try_to_read_data(struct nfs_read_data *data,
-		      const struct rpc_call_ops *call_ops)
+		      const struct rpc_call_ops *call_ops,
+		      struct pnfs_layout_segment *lseg)
 {
 	return PNFS_NOT_ATTEMPTED;
 }
 
 static inline enum pnfs_try_status
 pnfs_try_to_write_data(struct nfs_write_data *data,
-		       const struct rpc_call_ops *call_ops, int how)
+		       const struct rpc_call_ops *call_ops, int how,
+		       struct pnfs_layout_segment *lseg)
+{
+	return PNFS_NOT_ATTEMPTED;
+}
+
+static inline struct pnfs_layout_segment *
+pnfs_direct_get_lseg(struct inode *inode, struct nfs_open_context *ctx,
+		     loff_t pos, size_t *count, enum pnfs_iomode iomode)
+{
+	return NULL;
+}
+
+static inline enum pnfs_try_status
+pnfs_direct_try_to_read(struct nfs_read_data *rdata,
+			const struct rpc_call_ops *call_ops,
+			struct pnfs_layout_segment *lseg)
 {
 	return PNFS_NOT_ATTEMPTED;
 }
 
+static inline enum pnfs_try_status
+pnfs_direct_try_to_write(struct nfs_write_data *wdata,
+			 const struct rpc_call_ops *call_ops,
+			 struct pnfs_layout_segment *lseg)
+{
+	return PNFS_NOT_ATTEMPTED;
+}
+
+static inline void pnfs_direct_read_reset(struct nfs_read_data *rdata)
+{
+}
+
+static inline void pnfs_direct_write_reset(struct nfs_write_data *wdata)
+{
+}
+
 static inline enum pnfs_try_status
 pnfs_try_to_commit(struct nfs_write_data *data,
 		   const struct rpc_call_ops *call_ops, int how)
@@ -564,6 +702,14 @@ static inline int pnfs_return_layout(struct inode *ino,
 	return 0;
 }
 
+static inline void pnfs_layout_close(struct inode *ino, bool wait)
+{
+}
+
+static inline void pnfs_return_idle_layouts(struct super_block *sb)
+{
+}
+
 static inline void set_pnfs_layoutdriver(struct nfs_server *s, const struct nfs_fh *mntfh, u32 id)
 {
 }
@@ -607,6 +753,11 @@ static inline int pnfs_get_read_status(struct nfs_read_data *data)
 	return 0;
 }
 
+static inline bool pnfs_direct_write_by_layout(struct nfs_write_data *data)
+{
+	return false;
+}
+
 static inline void
 pnfs_pageio_init_read(struct nfs_pageio_descriptor *pgio, struct inode *ino,
 		      struct nfs_open_context *ctx, struct list_head *pages,
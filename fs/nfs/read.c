@@ -145,12 +145,17 @@ int nfs_readpage_async(struct nfs_open_context *ctx, struct inode *inode,
 	return 0;
 }
 
-static void nfs_readpage_release(struct nfs_page *req)
+static void nfs_readpage_release(struct nfs_page *req,
+				 struct nfs_fscache_store *store)
 {
 	struct inode *d_inode = req->wb_context->path.dentry->d_inode;
 
-	if (PageUptodate(req->wb_page))
-		nfs_readpage_to_fscache(d_inode, req->wb_page, 0);
+	if (PageUptodate(req->wb_page)) {
+		if (store)
+			nfs_fscache_store_add(store, req->wb_page);
+		else
+			nfs_readpage_to_fscache(d_inode, req->wb_page, 0);
+	}
 
 	unlock_page(req->wb_page);
 
@@ -206,9 +211,13 @@ int pnfs_initiate_read(struct nfs_read_data *data, struct rpc_clnt *clnt,
 		       const struct rpc_call_ops *call_ops)
 {
 	if (data->req->wb_lseg &&
-	    (pnfs_try_to_read_data(data, call_ops) == PNFS_ATTEMPTED))
+	    (pnfs_try_to_read_data(data, call_ops, data->req->wb_lseg) ==
+	     PNFS_ATTEMPTED))
 		return pnfs_get_read_status(data);
 
+	if (pnfs_enabled_sb(NFS_SERVER(data->inode)))
+		nfs_add_pnfs_stats(data->inode, NFSIOS_PNFS_MDSREADBYTES,
+				   data->args.count);
 	return nfs_initiate_read(data, clnt, call_ops);
 }
 
@@ -250,7 +259,7 @@ nfs_async_read_error(struct list_head *head)
 		req = nfs_list_entry(head->next);
 		nfs_list_remove_request(req);
 		SetPageError(req->wb_page);
-		nfs_readpage_release(req);
+		nfs_readpage_release(req, NULL);
 	}
 }
 
@@ -323,7 +332,7 @@ out_bad:
 		nfs_readdata_free(data);
 	}
 	SetPageError(page);
-	nfs_readpage_release(req);
+	nfs_readpage_release(req, NULL);
 	return -ENOMEM;
 }
 
@@ -438,7 +447,7 @@ static void nfs_readpage_release_partial(void *calldata)
 	if (atomic_dec_and_test(&req->wb_complete)) {
 		if (!PageError(page))
 			SetPageUptodate(page);
-		nfs_readpage_release(req);
+		nfs_readpage_release(req, NULL);
 	}
 	nfs_readdata_release(calldata);
 }
@@ -518,13 +527,20 @@ static void nfs_readpage_result_full(struct rpc_task *task, void *calldata)
 static void nfs_readpage_release_full(void *calldata)
 {
 	struct nfs_read_data *data = calldata;
+	struct nfs_fscache_store *store = NULL;
+
+	/* Pages read from data servers go to fscache from nfsiod */
+	if (!list_empty(&data->pages) &&
+	    nfs_list_entry(data->pages.next)->wb_lseg)
+		store = nfs_fscache_store_alloc(data->inode, data->npages);
 
 	while (!list_empty(&data->pages)) {
 		struct nfs_page *req = nfs_list_entry(data->pages.next);
 
 		nfs_list_remove_request(req);
-		nfs_readpage_release(req);
+		nfs_readpage_release(req, store);
 	}
+	nfs_fscache_store_submit(store);
 	nfs_readdata_release(calldata);
 }
 
@@ -101,6 +101,7 @@ enum {
 	Opt_mountvers,
 	Opt_nfsvers,
 	Opt_minorversion,
+	Opt_ds_nconnect,
 
 	/* Mount options that take string arguments */
 	Opt_sec, Opt_proto, Opt_mountproto, Opt_mounthost,
@@ -168,6 +169,7 @@ static const match_table_t nfs_mount_option_tokens = {
 	{ Opt_nfsvers, "nfsvers=%s" },
 	{ Opt_nfsvers, "vers=%s" },
 	{ Opt_minorversion, "minorversion=%s" },
+	{ Opt_ds_nconnect, "ds_nconnect=%s" },
 
 	{ Opt_sec, "sec=%s" },
 	{ Opt_proto, "proto=%s" },
@@ -378,6 +380,13 @@ static struct shrinker acl_shrinker = {
 	.seeks		= DEFAULT_SEEKS,
 };
 
+#ifdef CONFIG_NFS_V4_1
+static struct shrinker layout_shrinker = {
+	.shrink		= pnfs_layout_cache_shrinker,
+	.seeks		= DEFAULT_SEEKS,
+};
+#endif
+
 static struct kmem_cache * nfs_sb_fsinfo_cachep;
 
 int __init nfs_init_sb_fsinfo_cache(void)
@@ -418,6 +427,9 @@ int __init register_nfs_fs(void)
 		goto error_2;
 #endif
 	register_shrinker(&acl_shrinker);
+#ifdef CONFIG_NFS_V4_1
+	register_shrinker(&layout_shrinker);
+#endif
 	return 0;
 
 #ifdef CONFIG_NFS_V4
@@ -435,6 +447,9 @@ error_0:
  */
 void __exit unregister_nfs_fs(void)
 {
+#ifdef CONFIG_NFS_V4_1
+	unregister_shrinker(&layout_shrinker);
+#endif
 	unregister_shrinker(&acl_shrinker);
 #ifdef CONFIG_NFS_V4
 	unregister_filesystem(&nfs4_fs_type);
@@ -450,6 +465,7 @@ void nfs_sb_active(struct super_block *sb)
 	if (atomic_inc_return(&server->active) == 1)
 		atomic_inc(&sb->s_active);
 }
+EXPORT_SYMBOL_GPL(nfs_sb_active);
 
 void nfs_sb_deactive(struct super_block *sb)
 {
@@ -458,6 +474,7 @@ void nfs_sb_deactive(struct super_block *sb)
 	if (atomic_dec_and_test(&server->active))
 		deactivate_super(sb);
 }
+EXPORT_SYMBOL_GPL(nfs_sb_deactive);
 
 /*
  * Deliver file system statistics to userspace
@@ -634,6 +651,8 @@ static void nfs_show_nfsv4_options(struct seq_file *m, struct nfs_server *nfss,
 
 	seq_printf(m, ",clientaddr=%s", clp->cl_ipaddr);
 	seq_printf(m, ",minorversion=%u", clp->cl_minorversion);
+	if (nfss->ds_nconnect > 1 || showdefaults)
+		seq_printf(m, ",ds_nconnect=%u", nfss->ds_nconnect);
 }
 #else
 static void nfs_show_nfsv4_options(struct seq_file *m, struct nfs_server *nfss,
@@ -764,8 +783,38 @@ void show_pnfs(struct seq_file *m, struct nfs_server *server)
 	else
 		seq_printf(m, "not configured");
 }
+
+static void show_pnfs_class(struct seq_file *m, const char *tag,
+			    struct pnfs_layoutdriver_type *ld,
+			    unsigned long long *counters)
+{
+	int i;
+
+	if (!ld)
+		return;
+	seq_printf(m, "\n\t%s:\t%s ", tag, ld->name);
+	for (i = 0; i < __NFSIOS_PNFSMAX; i++)
+		seq_printf(m, "%Lu ", counters[i]);
+}
+
+static void show_pnfs_stats(struct seq_file *m, struct nfs_server *server,
+			    struct nfs_iostats *totals)
+{
+	struct pnfs_deviceid_cache *c = server->nfs_client->cl_devid_cache;
+
+	show_pnfs_class(m, "pnfs", server->pnfs_curr_ld,
+			totals->pnfs[NFSIOS_PNFS_DATA]);
+	show_pnfs_class(m, "pnfs-meta", server->pnfs_meta_ld,
+			totals->pnfs[NFSIOS_PNFS_META]);
+	if (c)
+		seq_printf(m, "\n\tpnfs-devid:\t%d %d",
+			   atomic_read(&c->dc_hits),
+			   atomic_read(&c->dc_misses));
+}
 #else  /* CONFIG_NFS_V4_1 */
 void show_pnfs(struct seq_file *m, struct nfs_server *server) {}
+static void show_pnfs_stats(struct seq_file *m, struct nfs_server *server,
+			    struct nfs_iostats *totals) {}
 #endif /* CONFIG_NFS_V4_1 */
 
 /*
@@ -822,6 +871,9 @@ static int nfs_show_stats(struct seq_file *m, struct vfsmount *mnt)
 	 */
 	for_each_possible_cpu(cpu) {
 		struct nfs_iostats *stats;
+#ifdef CONFIG_NFS_V4_1
+		int j;
+#endif
 
 		preempt_disable();
 		stats = per_cpu_ptr(nfss->io_stats, cpu);
@@ -834,6 +886,11 @@ static int nfs_show_stats(struct seq_file *m, struct vfsmount *mnt)
 		for (i = 0; i < __NFSIOS_FSCACHEMAX; i++)
 			totals.fscache[i] += stats->fscache[i];
 #endif
+#ifdef CONFIG_NFS_V4_1
+		for (j = 0; j < __NFSIOS_PNFSCLASSES; j++)
+			for (i = 0; i < __NFSIOS_PNFSMAX; i++)
+				totals.pnfs[j][i] += stats->pnfs[j][i];
+#endif
 
 		preempt_enable();
 	}
@@ -851,6 +908,8 @@ static int nfs_show_stats(struct seq_file *m, struct vfsmount *mnt)
 			seq_printf(m, "%Lu ", totals.bytes[i]);
 	}
 #endif
+	if (pnfs_enabled_sb(nfss))
+		show_pnfs_stats(m, nfss, &totals);
 	seq_printf(m, "\n");
 
 	rpc_print_iostats(m, nfss->client);
@@ -894,6 +953,7 @@ static struct nfs_parsed_mount_data *nfs_alloc_parsed_mount_data(unsigned int ve
 		data->auth_flavor_len	= 1;
 		data->version		= version;
 		data->minorversion	= 0;
+		data->ds_nconnect	= 1;
 	}
 	return data;
 }
@@ -1354,6 +1414,18 @@ static int nfs_parse_mount_options(char *raw,
 				goto out_invalid_value;
 			mnt->minorversion = option;
 			break;
+		case Opt_ds_nconnect:
+			string = match_strdup(args);
+			if (string == NULL)
+				goto out_nomem;
+			rc = strict_strtoul(string, 10, &option);
+			kfree(string);
+			if (rc != 0)
+				goto out_invalid_value;
+			if (option < 1 || option > NFS_MAX_DS_NCONNECT)
+				goto out_invalid_value;
+			mnt->ds_nconnect = option;
+			break;
 
 		/*
 		 * options that take text values
@@ -3016,6 +3088,7 @@ static void nfs4_kill_super(struct super_block *sb)
 	/* before delegations, which we might be relying on */
 	cohort_rpl_return_layouts(sb);
 #endif
+	pnfs_return_idle_layouts(sb);
 	nfs_super_return_all_delegations(sb);
 	kill_anon_super(sb);
 	nfs_fscache_release_super_cookie(sb);
@@ -860,9 +860,13 @@ int pnfs_initiate_write(struct nfs_write_data *data,
 			int how)
 {
 	if (data->req->wb_lseg &&
-	    (pnfs_try_to_write_data(data, call_ops, how) == PNFS_ATTEMPTED))
+	    (pnfs_try_to_write_data(data, call_ops, how, data->req->wb_lseg) ==
+	     PNFS_ATTEMPTED))
 		return pnfs_get_write_status(data);
 
+	if (pnfs_enabled_sb(NFS_SERVER(data->inode)))
+		nfs_add_pnfs_stats(data->inode, NFSIOS_PNFS_MDSWRITTENBYTES,
+				   data->args.count);
 	return nfs_initiate_write(data, clnt, call_ops, how);
 }
 
@@ -28,6 +28,7 @@
 #include <linux/dm-ioctl.h>
 #include <asm/uaccess.h>
 #include <linux/falloc.h>
+#include <linux/rbtree.h>
 #include <linux/nfsd4_block.h>
 
 #include "pnfsd.h"
@@ -68,9 +69,24 @@ typedef struct bl_layout_rec {
 	u64			blr_orig_size,
 				blr_commit_size,
 				blr_ext_size;
-	spinlock_t		blr_lock;	// Protects blr_layouts
+	struct rb_root		blr_fiemap;	// bl_fiemap_snap_t by offset
+	struct timespec		blr_fiemap_ctime; // i_ctime blr_fiemap is for
+	spinlock_t		blr_lock;	// Protects blr_layouts, blr_fiemap
 } bl_layout_rec_t;
 
+/*
+ * ---- fiemap snapshot ----
+ * The extents the file system's fiemap returned for the range
+ * [bfs_foff, bfs_foff + bfs_len). Snapshots of one inode never overlap.
+ */
+typedef struct bl_fiemap_snap {
+	struct rb_node		bfs_node;
+	u64			bfs_foff,
+				bfs_len;
+	int			bfs_count;
+	struct fiemap_extent	bfs_extents[0];
+} bl_fiemap_snap_t;
+
 static struct list_head layout_hash;
 static struct list_head layout_hashtbl[BL_LAYOUT_HASH_SIZE];
 static spinlock_t layout_hashtbl_lock;
@@ -115,6 +131,13 @@ static boolean_t extents_process(struct fiemap_extent_info *fei,
     struct list_head *bl_candidates, struct nfsd4_layout_seg *, dev_t dev,
     pnfs_blocklayout_layout_t *b);
 static void extents_cleanup(struct fiemap_extent_info *fei);
+static boolean_t extents_cached(bl_layout_rec_t *r,
+    struct fiemap_extent_info *fei, u64 foff, u64 len);
+static void extents_remember(bl_layout_rec_t *r,
+    struct fiemap_extent_info *fei, u64 foff, u64 len);
+static boolean_t extents_allocated(struct inode *i, u64 foff, u64 len);
+static void extents_forget(bl_layout_rec_t *r, u64 foff, u64 len);
+static void extents_forget_inode(struct inode *i, u64 foff, u64 len);
 
 void
 nfsd_bl_init(void)
@@ -384,10 +407,20 @@ bl_layoutget(struct inode *i, struct exp_xdr_stream *xdr,
 	res->lg_seg.offset -= adj;
 	res->lg_seg.length = (res->lg_seg.length + adj + 511) & ~511;
 	
-	if (res->lg_seg.iomode != IOMODE_READ)
+	/*
+	 * No need to fallocate a range the fiemap cache already knows to
+	 * be fully backed. Otherwise the block map may be about to change
+	 * under the cached extents.
+	 */
+	if (res->lg_seg.iomode != IOMODE_READ &&
+	    extents_allocated(i, res->lg_seg.offset,
+			      res->lg_seg.length) == False) {
 		if (i->i_op->fallocate(i, FALLOC_FL_KEEP_SIZE,
 				       res->lg_seg.offset, res->lg_seg.length))
 			return NFS4ERR_IO;
+		extents_forget_inode(i, res->lg_seg.offset,
+				     res->lg_seg.length);
+	}
 		
 	INIT_LIST_HEAD(&bl_possible);
 	
@@ -476,6 +509,14 @@ bl_layoutcommit(struct inode *i,
 	dprintk("--> %s (ino [0x%x:%lu])\n", __func__, i->i_sb->s_dev, i->i_ino);
 	r = layout_inode_find(i);
 	if (r) {
+		/*
+		 * The client may have converted INVALID extents, so the
+		 * block map cached from fiemap can no longer be trusted.
+		 */
+		spin_lock(&r->blr_lock);
+		extents_forget(r, 0, NFS4_MAX_UINT64);
+		spin_unlock(&r->blr_lock);
+
 		lw_plus = args->lc_last_wr + 1;
 		if (args->lc_newoffset) {
 			dprintk("  lc_last_wr %Lu\n", lw_plus);
@@ -587,6 +628,12 @@ bl_layoutrecall(struct inode *inode, int type, u64 offset, u64 len)
 			return -EINVAL;
 	}
 	
+	/*
+	 * A recall means the range is being written through the MDS or
+	 * truncated; either way its cached block map is stale.
+	 */
+	extents_forget_inode(inode, offset, len);
+
 restart:
 	r = layout_inode_find(inode);
 	if (r && len && !r->blr_recalled) {
@@ -778,6 +825,8 @@ layout_cache_iter(bl_layout_rec_t *r, struct list_head *bl_possible,
 	struct fiemap_extent_info	fei;
 	struct inode			*i;
 	dev_t				dev;
+	boolean_t			cached,
+					rval;
 	
 	dev	= r->blr_rdev;
 	i	= r->blr_inode;
@@ -792,7 +841,17 @@ layout_cache_iter(bl_layout_rec_t *r, struct list_head *bl_possible,
 	list_for_each_entry(b, bl_possible, bll_list) {
 		if (b->bll_cache_state == BLOCK_LAYOUT_NEW) {
 			
-			extents_count(&fei, i, b->bll_foff, b->bll_len);
+			cached = extents_cached(r, &fei, b->bll_foff,
+			    b->bll_len);
+			if (cached == False) {
+				extents_count(&fei, i, b->bll_foff, b->bll_len);
+				if (fei.fi_extents_mapped &&
+				    extents_get(&fei, i, b->bll_foff,
+				    b->bll_len) == False)
+					goto cleanup;
+				extents_remember(r, &fei, b->bll_foff,
+				    b->bll_len);
+			}
 			if (fei.fi_extents_mapped) {
 				
 				/*
@@ -800,13 +859,15 @@ layout_cache_iter(bl_layout_rec_t *r, struct list_head *bl_possible,
 				 * extents. Now get those extents and process
 				 * them into pNFS extents.
 				 */
-				if (extents_get(&fei, i, b->bll_foff,
-				    b->bll_len) == False)
-					goto cleanup;
-				if (extents_process(&fei, bl_candidates,
-				    seg, dev, b) == False)
+				rval = extents_process(&fei, bl_candidates,
+				    seg, dev, b);
+				/* ---- cached extents belong to blr_fiemap ---- */
+				if (cached == True)
+					fei.fi_extents_start = NULL;
+				else
+					extents_cleanup(&fei);
+				if (rval == False)
 					goto cleanup;
-				extents_cleanup(&fei);
 				
 			} else if (seg->iomode == IOMODE_READ) {
 				
@@ -1383,6 +1444,223 @@ extents_cleanup(struct fiemap_extent_info *fei)
 	}
 }
 
+/*
+ * []------------------------------------------------------------------[]
+ * | fiemap cache.							|
+ * | Each layout record keeps the fiemap results it has seen in an	|
+ * | rbtree of non-overlapping snapshots, so that repeat LAYOUTGETs of	|
+ * | a hot file are served without walking the block map again. The	|
+ * | cache is dropped when the inode's ctime moves (truncate, local	|
+ * | writes), on layoutcommit and layoutrecall, and per range before a	|
+ * | fallocate. All of it runs under blr_lock.				|
+ * []------------------------------------------------------------------[]
+ */
+
+/*
+ * snap_find -- returns the last snapshot starting at or before foff.
+ */
+static bl_fiemap_snap_t *
+snap_find(bl_layout_rec_t *r, u64 foff)
+{
+	struct rb_node		*n	= r->blr_fiemap.rb_node;
+	bl_fiemap_snap_t	*s,
+				*found	= NULL;
+	
+	while (n) {
+		s = rb_entry(n, bl_fiemap_snap_t, bfs_node);
+		if (foff < s->bfs_foff)
+			n = n->rb_left;
+		else {
+			found = s;
+			n = n->rb_right;
+		}
+	}
+	return found;
+}
+
+/*
+ * snap_covering -- returns the snapshot holding all of [foff, foff + len)
+ */
+static bl_fiemap_snap_t *
+snap_covering(bl_layout_rec_t *r, u64 foff, u64 len)
+{
+	bl_fiemap_snap_t	*s;
+	
+	/* ---- truncate, or a local write, changes the block map ---- */
+	if (!timespec_equal(&r->blr_inode->i_ctime, &r->blr_fiemap_ctime)) {
+		extents_forget(r, 0, NFS4_MAX_UINT64);
+		r->blr_fiemap_ctime = r->blr_inode->i_ctime;
+		return NULL;
+	}
+	
+	s = snap_find(r, foff);
+	if (s && (foff + len <= s->bfs_foff + s->bfs_len))
+		return s;
+	return NULL;
+}
+
+/*
+ * extents_cached -- the cache's answer to extents_count()/extents_get().
+ *
+ * On a hit fei points at the snapshot's extents which overlap the range,
+ * exactly those fiemap would have returned. They belong to the cache and
+ * must not be passed to extents_cleanup().
+ */
+static boolean_t
+extents_cached(bl_layout_rec_t *r, struct fiemap_extent_info *fei, u64 foff,
+    u64 len)
+{
+	bl_fiemap_snap_t	*s;
+	struct fiemap_extent	*fep;
+	u64			end;
+	int			first,
+				last;
+	
+	s = snap_covering(r, foff, len);
+	if (!s)
+		return False;
+	
+	end = foff + len + (1 << r->blr_inode->i_sb->s_blocksize_bits) - 1;
+	for (first = 0; first < s->bfs_count; first++) {
+		fep = &s->bfs_extents[first];
+		if (fep->fe_logical + fep->fe_length > foff)
+			break;
+	}
+	for (last = first; last < s->bfs_count; last++)
+		if (s->bfs_extents[last].fe_logical >= end)
+			break;
+	
+	fei->fi_extents_start	= &s->bfs_extents[first];
+	fei->fi_extents_mapped	= last - first;
+	fei->fi_extents_max	= last - first;
+	dprintk("    fiemap cache hit %Ld:%Ld, %d extents\n", _2SECTS(foff),
+	    _2SECTS(len), last - first);
+	return True;
+}
+
+/*
+ * extents_remember -- keep what fiemap returned for [foff, foff + len)
+ *
+ * A result which may have been cut short, because the file grew extents
+ * between extents_count() and extents_get(), is not kept. Failure to
+ * allocate just means a miss next time.
+ */
+static void
+extents_remember(bl_layout_rec_t *r, struct fiemap_extent_info *fei,
+    u64 foff, u64 len)
+{
+	bl_fiemap_snap_t	*s,
+				*p;
+	struct fiemap_extent	*fe_last;
+	struct rb_node		**n	= &r->blr_fiemap.rb_node,
+				*parent	= NULL;
+	int			m_space;
+	
+	if (fei->fi_extents_mapped) {
+		fe_last = &fei->fi_extents_start[fei->fi_extents_mapped - 1];
+		if (!(fe_last->fe_flags & FIEMAP_EXTENT_LAST) &&
+		    (fe_last->fe_logical + fe_last->fe_length < foff + len))
+			return;
+	}
+	
+	m_space = fei->fi_extents_mapped * sizeof (struct fiemap_extent);
+	s = kmalloc(sizeof (*s) + m_space, GFP_ATOMIC);
+	if (!s)
+		return;
+	s->bfs_foff	= foff;
+	s->bfs_len	= len;
+	s->bfs_count	= fei->fi_extents_mapped;
+	if (m_space)
+		memcpy(s->bfs_extents, fei->fi_extents_start, m_space);
+	
+	extents_forget(r, foff, len);
+	while (*n) {
+		parent = *n;
+		p = rb_entry(parent, bl_fiemap_snap_t, bfs_node);
+		if (foff < p->bfs_foff)
+			n = &parent->rb_left;
+		else
+			n = &parent->rb_right;
+	}
+	rb_link_node(&s->bfs_node, parent, n);
+	rb_insert_color(&s->bfs_node, &r->blr_fiemap);
+}
+
+/*
+ * extents_forget -- drop every snapshot overlapping [foff, foff + len)
+ */
+static void
+extents_forget(bl_layout_rec_t *r, u64 foff, u64 len)
+{
+	bl_fiemap_snap_t	*s;
+	struct rb_node		*n;
+	u64			end	= foff + len;
+	
+	if (end < foff)
+		end = NFS4_MAX_UINT64;
+	
+	s = snap_find(r, foff);
+	n = s ? &s->bfs_node : rb_first(&r->blr_fiemap);
+	while (n) {
+		s = rb_entry(n, bl_fiemap_snap_t, bfs_node);
+		if (s->bfs_foff >= end)
+			break;
+		n = rb_next(n);
+		if (s->bfs_foff + s->bfs_len > foff) {
+			rb_erase(&s->bfs_node, &r->blr_fiemap);
+			kfree(s);
+		}
+	}
+}
+
+static void
+extents_forget_inode(struct inode *i, u64 foff, u64 len)
+{
+	bl_layout_rec_t	*r	= layout_inode_find(i);
+	
+	if (r) {
+		spin_lock(&r->blr_lock);
+		extents_forget(r, foff, len);
+		spin_unlock(&r->blr_lock);
+	}
+}
+
+/*
+ * extents_allocated -- does the cache know [foff, foff + len) to be fully
+ * backed by storage, so that fallocate would have nothing to do?
+ */
+static boolean_t
+extents_allocated(struct inode *i, u64 foff, u64 len)
+{
+	bl_layout_rec_t		*r	= layout_inode_find(i);
+	bl_fiemap_snap_t	*s;
+	struct fiemap_extent	*fep;
+	boolean_t		rval	= False;
+	u64			next	= foff;
+	int			j;
+	
+	if (!r)
+		return False;
+	
+	spin_lock(&r->blr_lock);
+	s = snap_covering(r, foff, len);
+	for (j = 0; s && j < s->bfs_count && next < foff + len; j++) {
+		fep = &s->bfs_extents[j];
+		if (fep->fe_logical + fep->fe_length <= next)
+			continue;
+		if ((fep->fe_logical > next) ||
+		    (fep->fe_flags & (FIEMAP_EXTENT_UNKNOWN |
+				      FIEMAP_EXTENT_DELALLOC)))
+			break;
+		next = fep->fe_logical + fep->fe_length;
+	}
+	if (s && next >= foff + len)
+		rval = True;
+	spin_unlock(&r->blr_lock);
+	
+	return rval;
+}
+
 /*
  * device_slice -- check to see if device is a slice or DM
  */
@@ -1446,6 +1724,8 @@ layout_inode_add(struct inode *i, bl_layout_rec_t **p)
 	r->blr_orig_size = i->i_size;
 	r->blr_ext_size	= 0;
 	r->blr_recalled	= 0;
+	r->blr_fiemap	= RB_ROOT;
+	r->blr_fiemap_ctime = i->i_ctime;
 	INIT_LIST_HEAD(&r->blr_layouts);
 	spin_lock_init(&r->blr_lock);
 	spin_lock(&layout_hashtbl_lock);
@@ -1499,6 +1779,7 @@ layout_inode_del(struct inode *i)
 		spin_lock(&r->blr_lock);
 		if (list_empty(&r->blr_layouts)) {
 			list_del(&r->blr_hash);
+			extents_forget(r, 0, NFS4_MAX_UINT64);
 			spin_unlock(&r->blr_lock);
 			kfree(r);
 		} else {
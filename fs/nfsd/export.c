@@ -363,6 +363,7 @@ static struct pnfsd_cb_operations pnfsd_cb_op = {
 	.cb_device_notify = nfsd_device_notify_cb,
 
 	.cb_get_state = nfs4_pnfs_cb_get_state,
+	.cb_get_state_batch = nfs4_pnfs_cb_get_state_batch,
 	.cb_change_state = nfs4_pnfs_cb_change_state,
 };
 
@@ -84,12 +84,15 @@ enum nfs_cb_opnum4 {
 #define NFS4_dec_cb_recall_sz		(cb_compound_dec_hdr_sz  +      \
 					cb_sequence_dec_sz +            \
 					op_dec_sz)
+#define cb_layout_enc_sz		(1 + 4 + enc_nfs4_fh_sz + 4 +   \
+					enc_stateid_sz)
 #define NFS4_enc_cb_layout_sz		(cb_compound_enc_hdr_sz +       \
 					cb_sequence_enc_sz +            \
-					1 + 3 +                         \
-					enc_nfs4_fh_sz + 4)
+					NFSD4_CB_LAYOUT_MAX_OPS *       \
+					cb_layout_enc_sz)
 #define NFS4_dec_cb_layout_sz		(cb_compound_dec_hdr_sz  +      \
 					cb_sequence_dec_sz +            \
+					NFSD4_CB_LAYOUT_MAX_OPS *       \
 					op_dec_sz)
 #define NFS4_enc_cb_device_sz		(cb_compound_enc_hdr_sz +       \
 					cb_sequence_enc_sz +            \
@@ -431,16 +434,18 @@ nfs4_xdr_enc_cb_layout(struct rpc_rqst *req, u32 *p,
 		       struct nfsd4_callback *cb)
 {
 	struct xdr_stream xdr;
-	struct nfs4_layoutrecall *args = cb->cb_op;
+	struct nfs4_layoutrecall_batch *lrb = cb->cb_op;
 	struct nfs4_cb_compound_hdr hdr = {
 		.ident = 0,
 		.minorversion = cb->cb_minorversion,
 	};
+	int i;
 
 	xdr_init_encode(&xdr, &req->rq_snd_buf, p);
 	encode_cb_compound_hdr(&xdr, &hdr);
 	encode_cb_sequence(&xdr, cb, &hdr);
-	encode_cb_layout(&xdr, args, &hdr);
+	for (i = lrb->lrb_first; i < lrb->lrb_count; i++)
+		encode_cb_layout(&xdr, lrb->lrb_recalls[i], &hdr);
 	encode_cb_nops(&hdr);
 	return 0;
 }
@@ -587,18 +592,26 @@ nfs4_xdr_dec_cb_layout(struct rpc_rqst *rqstp, __be32 *p,
 {
 	struct xdr_stream xdr;
 	struct nfs4_cb_compound_hdr hdr;
-	int status;
+	struct nfs4_layoutrecall_batch *lrb;
+	int i, status;
 
 	xdr_init_decode(&xdr, &rqstp->rq_rcv_buf, p);
 	status = decode_cb_compound_hdr(&xdr, &hdr);
 	if (status)
 		goto out;
-	if (cb) {
-		status = decode_cb_sequence(&xdr, cb, rqstp);
+	if (!cb)
+		goto out;
+	status = decode_cb_sequence(&xdr, cb, rqstp);
+	if (status)
+		goto out;
+	/* The client stops at the first op that fails; remember which */
+	lrb = cb->cb_op;
+	for (i = lrb->lrb_first; i < lrb->lrb_count; i++) {
+		status = decode_cb_op_hdr(&xdr, OP_CB_LAYOUT);
 		if (status)
-			goto out;
+			break;
 	}
-	status = decode_cb_op_hdr(&xdr, OP_CB_LAYOUT);
+	lrb->lrb_failed = i;
 out:
 	return status;
 }
@@ -1047,27 +1060,50 @@ void nfsd4_cb_recall(struct nfs4_delegation *dp)
 static void nfsd4_cb_layout_prepare(struct rpc_task *task, void *calldata)
 {
 	struct nfsd4_callback *cb = calldata;
-	struct nfs4_layoutrecall *clr = container_of(cb, struct nfs4_layoutrecall, clr_recall);
-	
-	nfsd4_cb_prepare_sequence(task, cb, clr->clr_client);
+	struct nfs4_layoutrecall_batch *lrb = cb->cb_op;
+
+	/* until a reply says otherwise, nothing was processed */
+	lrb->lrb_failed = lrb->lrb_first;
+	nfsd4_cb_prepare_sequence(task, cb, cb->cb_clp);
+}
+
+/*
+ * Resend the ops from lrb_first on.  nfsd4_cb_done_sequence() cleared
+ * rpc_resp, which the decoder needs to get at the batch.
+ */
+static void nfsd4_cb_layout_restart(struct rpc_task *task,
+				    struct nfsd4_callback *cb)
+{
+	struct nfs4_layoutrecall_batch *lrb = cb->cb_op;
+
+	atomic_add(lrb->lrb_count - lrb->lrb_first,
+		   &pnfsd_recall_stats.rs_ops);
+	task->tk_status = 0;
+	task->tk_msg.rpc_resp = cb;
+	rpc_restart_call_prepare(task);
 }
 
 static void nfsd4_cb_layout_done(struct rpc_task *task, void *calldata)
 {
 	struct nfsd4_callback *cb = calldata;
-	struct nfs4_layoutrecall *clr = container_of(cb, struct nfs4_layoutrecall, clr_recall);
-	struct nfs4_client *clp = clr->clr_client;
+	struct nfs4_layoutrecall_batch *lrb = cb->cb_op;
+	struct nfs4_client *clp = cb->cb_clp;
+	struct nfs4_layoutrecall *clr;
 
 	nfsd4_cb_done_sequence(task, clp);
 
+	atomic_add(lrb->lrb_failed - lrb->lrb_first,
+		   &pnfsd_recall_stats.rs_completed);
 	if (!task->tk_status)
 		return;
 
+	clr = lrb->lrb_failed < lrb->lrb_count ?
+		lrb->lrb_recalls[lrb->lrb_failed] : NULL;
 	printk("%s: clp %p cb_client %p fp %p failed with status %d\n",
 	       __func__,
 	       clp,
 	       clp->cl_cb_client,
-	       clr->clr_file,
+	       clr ? clr->clr_file : NULL,
 	       task->tk_status);
 
 	switch (task->tk_status) {
@@ -1082,23 +1118,39 @@ static void nfsd4_cb_layout_done(struct rpc_task *task, void *calldata)
 		 */
 		break;
 	case -NFS4ERR_DELAY:
+		if (!clr)
+			break;
+		atomic_inc(&pnfsd_recall_stats.rs_delayed);
 		/* Poll the client until it's done with the layout */
+		lrb->lrb_first = lrb->lrb_failed;
 		rpc_delay(task, HZ/100); /* 10 mili-seconds */
-		task->tk_status = 0;
-		rpc_restart_call_prepare(task);
-		break;
+		nfsd4_cb_layout_restart(task, cb);
+		return;
 	case -NFS4ERR_NOMATCHING_LAYOUT:
+		if (!clr)
+			break;
+		atomic_inc(&pnfsd_recall_stats.rs_nomatching);
 		task->tk_status = 0;
 		nomatching_layout(clr);
+		/* carry on with the ops the client did not get to */
+		lrb->lrb_first = lrb->lrb_failed + 1;
+		if (lrb->lrb_first < lrb->lrb_count)
+			nfsd4_cb_layout_restart(task, cb);
+		return;
 	}
+	atomic_inc(&pnfsd_recall_stats.rs_failed);
 }
 
 static void nfsd4_cb_layout_release(void *calldata)
 {
 	struct nfsd4_callback *cb = calldata;
-	struct nfs4_layoutrecall *clr = container_of(cb, struct nfs4_layoutrecall, clr_recall);
+	struct nfs4_layoutrecall_batch *lrb = cb->cb_op;
+	int i;
 
-	put_layoutrecall(clr);
+	for (i = 0; i < lrb->lrb_count; i++)
+		put_layoutrecall(lrb->lrb_recalls[i]);
+	lrb->lrb_count = 0;
+	nfsd4_layout_recall_batch_done(cb->cb_clp);
 }
 
 static const struct rpc_call_ops nfsd4_cb_layout_ops = {
@@ -1108,21 +1160,26 @@ static const struct rpc_call_ops nfsd4_cb_layout_ops = {
 };
 
 /*
- * Called with state lock.
+ * Send one CB_COMPOUND carrying all the layoutrecalls in the batch.
+ * Called from the client's layout recall work, without the state lock.
  */
 void
-nfsd4_cb_layout(struct nfs4_layoutrecall *clr)
+nfsd4_cb_layout(struct nfs4_layoutrecall_batch *lrb)
 {
-	struct nfsd4_callback *cb = &clr->clr_recall;
+	struct nfsd4_callback *cb = &lrb->lrb_cb;
+	struct nfs4_client *clp = container_of(lrb, struct nfs4_client,
+					       cl_recall_batch);
 
-	cb->cb_op = clr;
-	cb->cb_clp = clr->clr_client;
+	cb->cb_op = lrb;
+	cb->cb_clp = clp;
 	cb->cb_msg.rpc_proc = &nfs4_cb_procedures[NFSPROC4_CLNT_CB_LAYOUT];
 	cb->cb_msg.rpc_argp = cb;
 	cb->cb_msg.rpc_resp = cb;
 	cb->cb_msg.rpc_cred = callback_cred;
 
 	cb->cb_ops = &nfsd4_cb_layout_ops;
+	atomic_inc(&pnfsd_recall_stats.rs_batches);
+	atomic_add(lrb->lrb_count, &pnfsd_recall_stats.rs_ops);
 	queue_work(callback_wq, &cb->cb_work);
 }
 
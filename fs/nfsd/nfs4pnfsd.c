@@ -21,30 +21,79 @@
  *
  *****************************************************************************/
 
+#include <linux/seq_file.h>
+
 #include "pnfsd.h"
 
 #define NFSDDBG_FACILITY                NFSDDBG_PROC
 
 /* Globals */
-static u32 current_layoutid = 1;
+static atomic_t current_layoutid = ATOMIC_INIT(0);
 
 /*
- * Currently used for manipulating the layout state.
+ * Layout state locking:
+ *
+ * fp->fi_layout_lock protects the file's fi_layouts list, the ls_layouts
+ * lists and stateids of its layout states and the lo_seg of its layouts.
+ * clp->cl_layout_lock protects the client's cl_layouts and
+ * cl_layoutrecalls lists.  When both are needed, the file lock is taken
+ * first.
+ *
+ * Layout states are hashed by (client, file) and looked up under RCU;
+ * the hash chains are protected by per-bucket locks.  The client's
+ * layoutrecall list is also walked under RCU by is_layout_recalled().
+ * cl_layout_lock also protects the client's cl_recall_queue and
+ * cl_recall_batch.lrb_busy; layout_recall_lock, which nests inside it,
+ * protects the layout recall dispatch slots.
  */
-static DEFINE_SPINLOCK(layout_lock);
-
 #if defined(CONFIG_DEBUG_SPINLOCK) || defined(CONFIG_SMP)
-#  define BUG_ON_UNLOCKED_LAYOUT() BUG_ON(!spin_is_locked(&layout_lock))
+#  define BUG_ON_UNLOCKED_LAYOUT(lock) BUG_ON(!spin_is_locked(lock))
 #else
-#  define BUG_ON_UNLOCKED_LAYOUT()
+#  define BUG_ON_UNLOCKED_LAYOUT(lock)
 #endif
 
+#define LAYOUT_STATE_HASH_BITS	8
+#define LAYOUT_STATE_HASH_SIZE	(1 << LAYOUT_STATE_HASH_BITS)
+
+struct layout_state_bucket {
+	spinlock_t		lock;
+	struct hlist_head	chain;
+};
+
+static struct layout_state_bucket layout_state_hashtbl[LAYOUT_STATE_HASH_SIZE];
+
+static inline struct layout_state_bucket *
+layout_state_hashval(struct nfs4_client *clp, struct nfs4_file *fp)
+{
+	return &layout_state_hashtbl[hash_ptr(clp, LAYOUT_STATE_HASH_BITS) ^
+				     hash_ptr(fp, LAYOUT_STATE_HASH_BITS)];
+}
+
 /*
  * Layout state - NFSv4.1 pNFS
  */
 static struct kmem_cache *pnfs_layout_slab;
 static struct kmem_cache *pnfs_layoutrecall_slab;
 
+/*
+ * Layout recall dispatch
+ *
+ * spawn_layout_recall() only queues recalls on the client's
+ * cl_recall_queue.  The client's cl_recall_work then sends them outside
+ * of the state lock, coalesced into CB_COMPOUNDs of up to
+ * NFSD4_CB_LAYOUT_MAX_OPS recalls.  At most LAYOUT_RECALL_MAX_INFLIGHT
+ * compounds are in flight across all clients; a client that finds no
+ * free slot waits on layout_recall_waiters until a batch completes.
+ */
+#define LAYOUT_RECALL_MAX_INFLIGHT	64
+
+static struct workqueue_struct *layout_recall_wq;
+static DEFINE_SPINLOCK(layout_recall_lock);
+static LIST_HEAD(layout_recall_waiters);
+static unsigned int layout_recall_inflight;
+
+struct pnfsd_recall_stats pnfsd_recall_stats;
+
 /* hash table for nfsd4_pnfs_deviceid.sbid */
 #define SBID_HASH_BITS	8
 #define SBID_HASH_SIZE	(1 << SBID_HASH_BITS)
@@ -58,6 +107,7 @@ struct sbid_tracker {
 
 static u64 current_sbid;
 static struct list_head sbid_hashtbl[SBID_HASH_SIZE];
+static DEFINE_SPINLOCK(sbid_lock);
 
 static inline unsigned long
 sbid_hashval(struct super_block *sb)
@@ -74,9 +124,9 @@ alloc_sbid(void)
 static void
 destroy_sbid(struct sbid_tracker *sbid)
 {
-	spin_lock(&layout_lock);
+	spin_lock(&sbid_lock);
 	list_del(&sbid->hash);
-	spin_unlock(&layout_lock);
+	spin_unlock(&sbid_lock);
 	kfree(sbid);
 }
 
@@ -88,6 +138,10 @@ nfsd4_free_pnfs_slabs(void)
 
 	nfsd4_free_slab(&pnfs_layout_slab);
 	nfsd4_free_slab(&pnfs_layoutrecall_slab);
+	if (layout_recall_wq) {
+		destroy_workqueue(layout_recall_wq);
+		layout_recall_wq = NULL;
+	}
 
 	for (i = 0; i < SBID_HASH_SIZE; i++) {
 		while (!list_empty(&sbid_hashtbl[i])) {
@@ -112,11 +166,20 @@ nfsd4_init_pnfs_slabs(void)
 			sizeof(struct nfs4_layoutrecall), 0, 0, NULL);
 	if (pnfs_layoutrecall_slab == NULL)
 		return -ENOMEM;
+	layout_recall_wq = alloc_workqueue("nfsd4_layoutrecall",
+					   WQ_UNBOUND, 0);
+	if (layout_recall_wq == NULL)
+		return -ENOMEM;
 
 	for (i = 0; i < SBID_HASH_SIZE; i++) {
 		INIT_LIST_HEAD(&sbid_hashtbl[i]);
 	}
 
+	for (i = 0; i < LAYOUT_STATE_HASH_SIZE; i++) {
+		spin_lock_init(&layout_state_hashtbl[i].lock);
+		INIT_HLIST_HEAD(&layout_state_hashtbl[i].chain);
+	}
+
 	return 0;
 }
 
@@ -149,18 +212,50 @@ void pnfs_clear_device_notify(struct nfs4_client *clp)
 		__func__, clp, atomic_read(&clp->cl_deviceref));
 }
 
+/*
+ * Search the layout state hash for the layout state of a client and file.
+ * If not found, then this is a 'first open/delegation/lock stateid' from
+ * the client for this file.
+ */
+static struct nfs4_layout_state *
+find_get_layout_state(struct nfs4_client *clp, struct nfs4_file *fp)
+{
+	struct layout_state_bucket *b = layout_state_hashval(clp, fp);
+	struct nfs4_layout_state *ls;
+	struct hlist_node *pos;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(ls, pos, &b->chain, ls_hash) {
+		if (ls->ls_client == clp && ls->ls_file == fp &&
+		    atomic_inc_not_zero(&ls->ls_ref.refcount)) {
+			rcu_read_unlock();
+			dprintk("pNFS %s: after GET ls %p ls_ref %d\n",
+				__func__, ls,
+				atomic_read(&ls->ls_ref.refcount));
+			return ls;
+		}
+	}
+	rcu_read_unlock();
+	return NULL;
+}
+
+/*
+ * Returns a referenced layout state.  A racing caller may have hashed
+ * one for the same client and file first, in which case that one is
+ * returned instead.
+ */
 static struct nfs4_layout_state *
 alloc_init_layout_state(struct nfs4_client *clp, struct nfs4_file *fp,
 			stateid_t *stateid)
 {
-	struct nfs4_layout_state *new;
+	struct layout_state_bucket *b = layout_state_hashval(clp, fp);
+	struct nfs4_layout_state *new, *ls;
+	struct hlist_node *pos;
 
 	/* FIXME: use a kmem_cache */
 	new = kzalloc(sizeof(*new), GFP_KERNEL);
 	if (!new)
 		return new;
-	get_nfs4_file(fp);
-	INIT_LIST_HEAD(&new->ls_perfile);
 	INIT_LIST_HEAD(&new->ls_layouts);
 	kref_init(&new->ls_ref);
 	new->ls_client = clp;
@@ -168,10 +263,19 @@ alloc_init_layout_state(struct nfs4_client *clp, struct nfs4_file *fp,
 	new->ls_stateid.si_boot = stateid->si_boot;
 	new->ls_stateid.si_stateownerid = 0; /* identifies layout stateid */
 	new->ls_stateid.si_generation = 1;
-	spin_lock(&layout_lock);
-	new->ls_stateid.si_fileid = current_layoutid++;
-	list_add(&new->ls_perfile, &fp->fi_layout_states);
-	spin_unlock(&layout_lock);
+
+	spin_lock(&b->lock);
+	hlist_for_each_entry(ls, pos, &b->chain, ls_hash)
+		if (ls->ls_client == clp && ls->ls_file == fp &&
+		    atomic_inc_not_zero(&ls->ls_ref.refcount)) {
+			spin_unlock(&b->lock);
+			kfree(new);
+			return ls;
+		}
+	get_nfs4_file(fp);
+	new->ls_stateid.si_fileid = atomic_inc_return(&current_layoutid);
+	hlist_add_head_rcu(&new->ls_hash, &b->chain);
+	spin_unlock(&b->lock);
 	return new;
 }
 
@@ -182,37 +286,28 @@ get_layout_state(struct nfs4_layout_state *ls)
 }
 
 static void
-destroy_layout_state_common(struct nfs4_layout_state *ls)
+free_layout_state_rcu(struct rcu_head *head)
 {
-	struct nfs4_file *fp = ls->ls_file;
-
-	dprintk("pNFS %s: ls %p fp %p clp %p\n", __func__, ls, fp,
-		ls->ls_client);
-	BUG_ON(!list_empty(&ls->ls_layouts));
-	kfree(ls);
-	put_nfs4_file(fp);
+	kfree(container_of(head, struct nfs4_layout_state, ls_rcu));
 }
 
+/* Must not be called with any layout lock held */
 static void
 destroy_layout_state(struct kref *kref)
 {
 	struct nfs4_layout_state *ls =
 			container_of(kref, struct nfs4_layout_state, ls_ref);
+	struct nfs4_file *fp = ls->ls_file;
+	struct layout_state_bucket *b = layout_state_hashval(ls->ls_client, fp);
 
-	spin_lock(&layout_lock);
-	list_del(&ls->ls_perfile);
-	spin_unlock(&layout_lock);
-	destroy_layout_state_common(ls);
-}
-
-static void
-destroy_layout_state_locked(struct kref *kref)
-{
-	struct nfs4_layout_state *ls =
-			container_of(kref, struct nfs4_layout_state, ls_ref);
-
-	list_del(&ls->ls_perfile);
-	destroy_layout_state_common(ls);
+	dprintk("pNFS %s: ls %p fp %p clp %p\n", __func__, ls, fp,
+		ls->ls_client);
+	BUG_ON(!list_empty(&ls->ls_layouts));
+	spin_lock(&b->lock);
+	hlist_del_rcu(&ls->ls_hash);
+	spin_unlock(&b->lock);
+	call_rcu(&ls->ls_rcu, free_layout_state_rcu);
+	put_nfs4_file(fp);
 }
 
 static inline void
@@ -223,38 +318,6 @@ put_layout_state(struct nfs4_layout_state *ls)
 	kref_put(&ls->ls_ref, destroy_layout_state);
 }
 
-static inline void
-put_layout_state_locked(struct nfs4_layout_state *ls)
-{
-	dprintk("pNFS %s: ls %p ls_ref %d\n", __func__, ls,
-		atomic_read(&ls->ls_ref.refcount));
-	kref_put(&ls->ls_ref, destroy_layout_state_locked);
-}
-
-/*
- * Search the fp->fi_layout_state list for a layout state with the clientid.
- * If not found, then this is a 'first open/delegation/lock stateid' from
- * the client for this file.
- * Called under the layout_lock.
- */
-static struct nfs4_layout_state *
-find_get_layout_state(struct nfs4_client *clp, struct nfs4_file *fp)
-{
-	struct nfs4_layout_state *ls;
-
-	BUG_ON_UNLOCKED_LAYOUT();
-	list_for_each_entry(ls, &fp->fi_layout_states, ls_perfile) {
-		if (ls->ls_client == clp) {
-			dprintk("pNFS %s: before GET ls %p ls_ref %d\n",
-				__func__, ls,
-				atomic_read(&ls->ls_ref.refcount));
-			get_layout_state(ls);
-			return ls;
-		}
-	}
-	return NULL;
-}
-
 static __be32
 verify_stateid(struct nfs4_file *fp, stateid_t *stateid)
 {
@@ -300,9 +363,7 @@ nfs4_process_layout_stateid(struct nfs4_client *clp, struct nfs4_file *fp,
 		goto out;
 
 	/* Is this the first use of this layout ? */
-	spin_lock(&layout_lock);
 	ls = find_get_layout_state(clp, fp);
-	spin_unlock(&layout_lock);
 	if (!ls) {
 		/* Only alloc layout state on layoutget (which sets lsp). */
 		if (!lsp) {
@@ -413,22 +474,30 @@ init_layout(struct nfs4_layout_state *ls,
 	get_layout_state(ls);
 	lp->lo_state = ls;
 	memcpy(&lp->lo_seg, seg, sizeof(lp->lo_seg));
-	spin_lock(&layout_lock);
+	spin_lock(&fp->fi_layout_lock);
 	update_layout_stateid(ls, stateid);
 	list_add_tail(&lp->lo_perstate, &ls->ls_layouts);
-	list_add_tail(&lp->lo_perclnt, &clp->cl_layouts);
 	list_add_tail(&lp->lo_perfile, &fp->fi_layouts);
-	spin_unlock(&layout_lock);
+	spin_lock(&clp->cl_layout_lock);
+	list_add_tail(&lp->lo_perclnt, &clp->cl_layouts);
+	spin_unlock(&clp->cl_layout_lock);
+	spin_unlock(&fp->fi_layout_lock);
 	dprintk("pNFS %s end\n", __func__);
 }
 
+/*
+ * Unhash a layout and queue it on @reaplist for destroy_layout_list(),
+ * which drops the references it holds once the locks are released.
+ * Called with both the file and the client layout locks held.
+ */
 static void
-dequeue_layout(struct nfs4_layout *lp)
+dequeue_layout(struct nfs4_layout *lp, struct list_head *reaplist)
 {
-	BUG_ON_UNLOCKED_LAYOUT();
+	BUG_ON_UNLOCKED_LAYOUT(&lp->lo_file->fi_layout_lock);
+	BUG_ON_UNLOCKED_LAYOUT(&lp->lo_client->cl_layout_lock);
 	list_del(&lp->lo_perclnt);
-	list_del(&lp->lo_perfile);
 	list_del(&lp->lo_perstate);
+	list_move(&lp->lo_perfile, reaplist);
 }
 
 static void
@@ -438,7 +507,6 @@ destroy_layout(struct nfs4_layout *lp)
 	struct nfs4_file *fp;
 	struct nfs4_layout_state *ls;
 
-	BUG_ON_UNLOCKED_LAYOUT();
 	clp = lp->lo_client;
 	fp = lp->lo_file;
 	ls = lp->lo_state;
@@ -448,10 +516,22 @@ destroy_layout(struct nfs4_layout *lp)
 
 	kmem_cache_free(pnfs_layout_slab, lp);
 	/* release references taken by init_layout */
-	put_layout_state_locked(ls);
+	put_layout_state(ls);
 	put_nfs4_file(fp);
 }
 
+static void
+destroy_layout_list(struct list_head *reaplist)
+{
+	struct nfs4_layout *lp;
+
+	while (!list_empty(reaplist)) {
+		lp = list_first_entry(reaplist, struct nfs4_layout, lo_perfile);
+		list_del(&lp->lo_perfile);
+		destroy_layout(lp);
+	}
+}
+
 void fs_layout_return(struct super_block *sb, struct inode *ino,
 		      struct nfsd4_pnfs_layoutreturn *lrp, int flags,
 		      void *recall_cookie)
@@ -484,7 +564,7 @@ alloc_init_sbid(struct super_block *sb)
 	u64 id = 0;
 
 	if (likely(new)) {
-		spin_lock(&layout_lock);
+		spin_lock(&sbid_lock);
 		id = ++current_sbid;
 		new->id = (id << SBID_HASH_BITS) | (hash_idx & SBID_HASH_MASK);
 		id = new->id;
@@ -495,11 +575,11 @@ alloc_init_sbid(struct super_block *sb)
 			if (sbid->sb == sb) {
 				kfree(new);
 				id = sbid->id;
-				spin_unlock(&layout_lock);
+				spin_unlock(&sbid_lock);
 				return id;
 			}
 		list_add(&new->hash, &sbid_hashtbl[hash_idx]);
-		spin_unlock(&layout_lock);
+		spin_unlock(&sbid_lock);
 	}
 	return id;
 }
@@ -512,7 +592,7 @@ find_sbid_id(u64 id)
 	unsigned long hash_idx = id & SBID_HASH_MASK;
 	int pos = 0;
 
-	spin_lock(&layout_lock);
+	spin_lock(&sbid_lock);
 	list_for_each_entry (sbid, &sbid_hashtbl[hash_idx], hash) {
 		pos++;
 		if (sbid->id != id)
@@ -522,7 +602,7 @@ find_sbid_id(u64 id)
 		sb = sbid->sb;
 		break;
 	}
-	spin_unlock(&layout_lock);
+	spin_unlock(&sbid_lock);
 	return sb;
 }
 
@@ -534,7 +614,7 @@ find_create_sbid(struct super_block *sb)
 	int pos = 0;
 	u64 id = 0;
 
-	spin_lock(&layout_lock);
+	spin_lock(&sbid_lock);
 	list_for_each_entry (sbid, &sbid_hashtbl[hash_idx], hash) {
 		pos++;
 		if (sbid->sb != sb)
@@ -544,7 +624,7 @@ find_create_sbid(struct super_block *sb)
 		id = sbid->id;
 		break;
 	}
-	spin_unlock(&layout_lock);
+	spin_unlock(&sbid_lock);
 
 	if (!id)
 		id = alloc_init_sbid(sb);
@@ -579,6 +659,7 @@ alloc_init_layoutrecall(struct nfsd4_pnfs_cb_layout *cbl,
 
 	kref_init(&clr->clr_ref);
 	INIT_LIST_HEAD(&clr->clr_perclnt);
+	INIT_LIST_HEAD(&clr->clr_pending);
 
 	dprintk("NFSD %s return %p\n", __func__, clr);
 	return clr;
@@ -592,6 +673,24 @@ get_layoutrecall(struct nfs4_layoutrecall *clr)
 	kref_get(&clr->clr_ref);
 }
 
+/*
+ * Is the layoutrecall on its client's cl_layoutrecalls list?  Entries are
+ * unhashed with list_del_rcu(), which poisons the back pointer.
+ */
+static inline int
+layoutrecall_hashed(struct nfs4_layoutrecall *clr)
+{
+	return clr->clr_perclnt.prev != LIST_POISON2 &&
+	       !list_empty(&clr->clr_perclnt);
+}
+
+static void
+free_layoutrecall_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(pnfs_layoutrecall_slab,
+			container_of(head, struct nfs4_layoutrecall, clr_rcu));
+}
+
 static void
 destroy_layoutrecall(struct kref *kref)
 {
@@ -599,10 +698,10 @@ destroy_layoutrecall(struct kref *kref)
 			container_of(kref, struct nfs4_layoutrecall, clr_ref);
 	dprintk("pNFS %s: clr %p fp %p clp %p\n", __func__, clr,
 		clr->clr_file, clr->clr_client);
-	BUG_ON(!list_empty(&clr->clr_perclnt));
+	BUG_ON(layoutrecall_hashed(clr));
 	if (clr->clr_file)
 		put_nfs4_file(clr->clr_file);
-	kmem_cache_free(pnfs_layoutrecall_slab, clr);
+	call_rcu(&clr->clr_rcu, free_layoutrecall_rcu);
 }
 
 int
@@ -613,19 +712,51 @@ put_layoutrecall(struct nfs4_layoutrecall *clr)
 	return kref_put(&clr->clr_ref, destroy_layoutrecall);
 }
 
+/*
+ * Drop a reference under cl_layout_lock.  destroy_layoutrecall() puts the
+ * nfs4_file, which may sleep, so the last reference is moved to @reap
+ * instead, for put_layoutrecall_list() to drop after unlocking.
+ * Returns nonzero if the reference was the last one.
+ */
+static int
+put_layoutrecall_locked(struct nfs4_layoutrecall *clr, struct list_head *reap)
+{
+	if (atomic_add_unless(&clr->clr_ref.refcount, -1, 1))
+		return 0;
+	list_add(&clr->clr_reap, reap);
+	return 1;
+}
+
+void
+put_layoutrecall_list(struct list_head *reap)
+{
+	struct nfs4_layoutrecall *clr, *next;
+
+	list_for_each_entry_safe (clr, next, reap, clr_reap) {
+		list_del(&clr->clr_reap);
+		put_layoutrecall(clr);
+	}
+}
+
+/*
+ * Called with cl_layout_lock held; references that are dropped last end
+ * up on @reap, which the caller passes to put_layoutrecall_list() once
+ * the lock is released.
+ */
 void *
-layoutrecall_done(struct nfs4_layoutrecall *clr)
+layoutrecall_done(struct nfs4_layoutrecall *clr, struct list_head *reap)
 {
 	void *recall_cookie = clr->cb.cbl_cookie;
 	struct nfs4_layoutrecall *parent = clr->parent;
 
 	dprintk("pNFS %s: clr %p clr_ref %d\n", __func__, clr,
 		atomic_read(&clr->clr_ref.refcount));
-	BUG_ON_UNLOCKED_LAYOUT();
-	list_del_init(&clr->clr_perclnt);
-	put_layoutrecall(clr);
+	BUG_ON_UNLOCKED_LAYOUT(&clr->clr_client->cl_layout_lock);
+	if (layoutrecall_hashed(clr))
+		list_del_rcu(&clr->clr_perclnt);
+	put_layoutrecall_locked(clr, reap);
 
-	if (parent && !put_layoutrecall(parent))
+	if (parent && !put_layoutrecall_locked(parent, reap))
 		recall_cookie = NULL;
 
 	return recall_cookie;
@@ -707,8 +838,8 @@ is_layout_recalled(struct nfs4_client *clp,
 {
 	struct nfs4_layoutrecall *clr;
 
-	spin_lock(&layout_lock);
-	list_for_each_entry (clr, &clp->cl_layoutrecalls, clr_perclnt) {
+	rcu_read_lock();
+	list_for_each_entry_rcu(clr, &clp->cl_layoutrecalls, clr_perclnt) {
 		if (clr->cb.cbl_seg.layout_type != seg->layout_type)
 			continue;
 		if (clr->cb.cbl_recall_type == RETURN_ALL)
@@ -724,10 +855,10 @@ is_layout_recalled(struct nfs4_client *clp,
 		    lo_seg_overlapping(&clr->cb.cbl_seg, seg))
 			goto found;
 	}
-	spin_unlock(&layout_lock);
+	rcu_read_unlock();
 	return 0;
 found:
-	spin_unlock(&layout_lock);
+	rcu_read_unlock();
 	return 1;
 }
 
@@ -771,25 +902,30 @@ extend_layout(struct nfsd4_layout_seg *lo, struct nfsd4_layout_seg *lg)
 		      lo_end : lo_end - lo_start;
 }
 
+/*
+ * The layout state holds exactly the client's layouts for this file, so
+ * only those need to be searched for one to merge with.
+ */
 static struct nfs4_layout *
-merge_layout(struct nfs4_file *fp,
-	     struct nfs4_client *clp,
+merge_layout(struct nfs4_layout_state *ls,
 	     struct nfsd4_layout_seg *seg)
 {
-	struct nfs4_layout *lp = NULL;
+	struct nfs4_file *fp = ls->ls_file;
+	struct nfs4_layout *lp, *found = NULL;
 
-	spin_lock(&layout_lock);
-	list_for_each_entry (lp, &fp->fi_layouts, lo_perfile)
+	spin_lock(&fp->fi_layout_lock);
+	list_for_each_entry (lp, &ls->ls_layouts, lo_perstate)
 		if (lp->lo_seg.layout_type == seg->layout_type &&
 		    lp->lo_seg.clientid == seg->clientid &&
 		    lp->lo_seg.iomode == seg->iomode &&
 		    lo_seg_mergeable(&lp->lo_seg, seg)) {
 			extend_layout(&lp->lo_seg, seg);
+			found = lp;
 			break;
 		}
-	spin_unlock(&layout_lock);
+	spin_unlock(&fp->fi_layout_lock);
 
-	return lp;
+	return found;
 }
 
 __be32
@@ -909,7 +1045,7 @@ nfs4_pnfs_get_layout(struct nfsd4_pnfs_layoutget *lgp,
 	 * Can the new layout be merged into an existing one?
 	 * If so, free unused layout struct
 	 */
-	if (can_merge && merge_layout(fp, clp, &res.lg_seg))
+	if (can_merge && merge_layout(ls, &res.lg_seg))
 		goto out_freelayout;
 
 	/* Can't merge, so let's initialize this new layout */
@@ -974,17 +1110,25 @@ pnfs_return_file_layouts(struct nfs4_client *clp, struct nfs4_file *fp,
 {
 	int layouts_found = 0;
 	struct nfs4_layout *lp, *nextlp;
+	struct nfs4_layout_state *lsp = ls;
+	LIST_HEAD(reaplist);
 
 	dprintk("%s: clp %p fp %p\n", __func__, clp, fp);
-	spin_lock(&layout_lock);
-	list_for_each_entry_safe (lp, nextlp, &fp->fi_layouts, lo_perfile) {
+	if (!lsp) {
+		lsp = find_get_layout_state(clp, fp);
+		if (!lsp)
+			return 0;
+	}
+
+	spin_lock(&fp->fi_layout_lock);
+	spin_lock(&clp->cl_layout_lock);
+	list_for_each_entry_safe (lp, nextlp, &lsp->ls_layouts, lo_perstate) {
 		dprintk("%s: lp %p client %p,%p lo_type %x,%x iomode %d,%d\n",
 			__func__, lp,
 			lp->lo_client, clp,
 			lp->lo_seg.layout_type, lrp->args.lr_seg.layout_type,
 			lp->lo_seg.iomode, lrp->args.lr_seg.iomode);
-		if (lp->lo_client != clp ||
-		    lp->lo_seg.layout_type != lrp->args.lr_seg.layout_type ||
+		if (lp->lo_seg.layout_type != lrp->args.lr_seg.layout_type ||
 		    (lp->lo_seg.iomode != lrp->args.lr_seg.iomode &&
 		     lrp->args.lr_seg.iomode != IOMODE_ANY) ||
 		     !lo_seg_overlapping(&lp->lo_seg, &lrp->args.lr_seg))
@@ -993,40 +1137,81 @@ pnfs_return_file_layouts(struct nfs4_client *clp, struct nfs4_file *fp,
 		trim_layout(&lp->lo_seg, &lrp->args.lr_seg);
 		if (!lp->lo_seg.length) {
 			lrp->lrs_present = 0;
-			dequeue_layout(lp);
-			destroy_layout(lp);
+			dequeue_layout(lp, &reaplist);
 		}
 	}
+	spin_unlock(&clp->cl_layout_lock);
 	if (ls && layouts_found && lrp->lrs_present)
 		update_layout_stateid(ls, &lrp->lr_sid);
-	spin_unlock(&layout_lock);
+	spin_unlock(&fp->fi_layout_lock);
+
+	destroy_layout_list(&reaplist);
+	if (!ls)
+		put_layout_state(lsp);
 
 	return layouts_found;
 }
 
+static int
+client_layout_matches(struct nfs4_layout *lp,
+		      struct nfsd4_pnfs_layoutreturn *lrp, u64 ex_fsid)
+{
+	if (lrp->args.lr_seg.layout_type != lp->lo_seg.layout_type ||
+	   (lrp->args.lr_seg.iomode != lp->lo_seg.iomode &&
+	    lrp->args.lr_seg.iomode != IOMODE_ANY))
+		return 0;
+
+	if (lrp->args.lr_return_type == RETURN_FSID &&
+	    !same_fsid_major(&lp->lo_file->fi_fsid, ex_fsid))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Layouts are unhashed under their file's lock, which nests outside the
+ * client's.  So pick a file with a matching layout under the client lock,
+ * then return all of the client's matching layouts on that file, until
+ * none are left.
+ */
 static int
 pnfs_return_client_layouts(struct nfs4_client *clp,
 			   struct nfsd4_pnfs_layoutreturn *lrp, u64 ex_fsid)
 {
 	int layouts_found = 0;
 	struct nfs4_layout *lp, *nextlp;
+	struct nfs4_file *fp;
+	LIST_HEAD(reaplist);
 
-	spin_lock(&layout_lock);
-	list_for_each_entry_safe (lp, nextlp, &clp->cl_layouts, lo_perclnt) {
-		if (lrp->args.lr_seg.layout_type != lp->lo_seg.layout_type ||
-		   (lrp->args.lr_seg.iomode != lp->lo_seg.iomode &&
-		    lrp->args.lr_seg.iomode != IOMODE_ANY))
-			continue;
+	for (;;) {
+		fp = NULL;
+		spin_lock(&clp->cl_layout_lock);
+		list_for_each_entry (lp, &clp->cl_layouts, lo_perclnt)
+			if (client_layout_matches(lp, lrp, ex_fsid)) {
+				fp = lp->lo_file;
+				get_nfs4_file(fp);
+				break;
+			}
+		spin_unlock(&clp->cl_layout_lock);
+		if (!fp)
+			break;
 
-		if (lrp->args.lr_return_type == RETURN_FSID &&
-		    !same_fsid_major(&lp->lo_file->fi_fsid, ex_fsid))
-			continue;
+		spin_lock(&fp->fi_layout_lock);
+		spin_lock(&clp->cl_layout_lock);
+		list_for_each_entry_safe (lp, nextlp, &clp->cl_layouts,
+					  lo_perclnt) {
+			if (lp->lo_file != fp ||
+			    !client_layout_matches(lp, lrp, ex_fsid))
+				continue;
+			layouts_found++;
+			dequeue_layout(lp, &reaplist);
+		}
+		spin_unlock(&clp->cl_layout_lock);
+		spin_unlock(&fp->fi_layout_lock);
 
-		layouts_found++;
-		dequeue_layout(lp);
-		destroy_layout(lp);
+		destroy_layout_list(&reaplist);
+		put_nfs4_file(fp);
 	}
-	spin_unlock(&layout_lock);
 
 	return layouts_found;
 }
@@ -1090,6 +1275,7 @@ int nfs4_pnfs_return_layout(struct super_block *sb, struct svc_fh *current_fh,
 	struct nfs4_layoutrecall *clr, *nextclr;
 	u64 ex_fsid = current_fh->fh_export->ex_fsid;
 	void *recall_cookie = NULL;
+	LIST_HEAD(reaplist);
 
 	dprintk("NFSD: %s\n", __func__);
 
@@ -1133,19 +1319,20 @@ int nfs4_pnfs_return_layout(struct super_block *sb, struct svc_fh *current_fh,
 	/* update layoutrecalls
 	 * note: for RETURN_{FSID,ALL}, fp may be NULL
 	 */
-	spin_lock(&layout_lock);
+	spin_lock(&clp->cl_layout_lock);
 	list_for_each_entry_safe (clr, nextclr, &clp->cl_layoutrecalls,
 				  clr_perclnt) {
 		if (clr->cb.cbl_seg.layout_type != lrp->args.lr_seg.layout_type)
 			continue;
 
 		if (recall_return_perfect_match(clr, lrp, fp, current_fh))
-			recall_cookie = layoutrecall_done(clr);
+			recall_cookie = layoutrecall_done(clr, &reaplist);
 		else if (layouts_found &&
 			 recall_return_partial_match(clr, lrp, fp, current_fh))
 			clr->clr_time = CURRENT_TIME;
 	}
-	spin_unlock(&layout_lock);
+	spin_unlock(&clp->cl_layout_lock);
+	put_layoutrecall_list(&reaplist);
 
 out_put_file:
 	if (fp)
@@ -1170,8 +1357,9 @@ out:
  * returns status, or pnfs_get_state* with pnfs_get_state->status set.
  *
  */
-int
-nfs4_pnfs_cb_get_state(struct super_block *sb, struct pnfs_get_state *arg)
+static int
+__nfs4_pnfs_cb_get_state(struct super_block *sb, struct pnfs_get_state *arg,
+			 struct nfs4_stateid **stpp)
 {
 	struct nfs4_stateid *stp;
 	int flags = LOCK_STATE | OPEN_STATE; /* search both hash tables */
@@ -1183,7 +1371,7 @@ nfs4_pnfs_cb_get_state(struct super_block *sb, struct pnfs_get_state *arg)
 	dprintk("NFSD: %s sid=" STATEID_FMT " ino %llu\n", __func__,
 		STATEID_VAL(stid), arg->ino);
 
-	nfs4_lock_state();
+	*stpp = NULL;
 	stp = find_stateid(stid, flags);
 	if (!stp) {
 		ino = iget_locked(sb, arg->ino);
@@ -1211,41 +1399,114 @@ nfs4_pnfs_cb_get_state(struct super_block *sb, struct pnfs_get_state *arg)
 		arg->access = stp->st_access_bmap;
 		*(clientid_t *)&arg->clid =
 			stp->st_stateowner->so_client->cl_clientid;
+		*stpp = stp;
 	}
 out:
+	return status;
+}
+
+int
+nfs4_pnfs_cb_get_state(struct super_block *sb, struct pnfs_get_state *arg)
+{
+	struct nfs4_stateid *stp;
+	int status;
+
+	nfs4_lock_state();
+	status = __nfs4_pnfs_cb_get_state(sb, arg, &stp);
 	nfs4_unlock_state();
 	return status;
 }
 
+/*
+ * Append the other open stateids clp holds on files of sb to a get_state
+ * batch, so that the data server learns them before the client uses them.
+ * Called with the state lock held.
+ */
+static void
+nfs4_pnfs_prefetch_client(struct super_block *sb,
+			  struct pnfs_get_state_batch *gsb,
+			  struct nfs4_client *clp)
+{
+	struct nfs4_stateowner *sop;
+	struct nfs4_stateid *stp;
+	struct pnfs_get_state *gs;
+	int i;
+
+	list_for_each_entry(sop, &clp->cl_openowners, so_perclient) {
+		list_for_each_entry(stp, &sop->so_stateids, st_perstateowner) {
+			if (gsb->gsb_count >= gsb->gsb_max)
+				return;
+			if (stp->st_file->fi_inode->i_sb != sb)
+				continue;
+			for (i = 0; i < gsb->gsb_count; i++)
+				if (!memcmp(&gsb->gsb_states[i].stid,
+					    &stp->st_stateid,
+					    sizeof(stateid_t)))
+					break;
+			if (i < gsb->gsb_count)
+				continue;
+			if (nfs4_add_pnfs_ds_dev(stp, gsb->gsb_dsid))
+				return;
+
+			gs = &gsb->gsb_states[gsb->gsb_count++];
+			memset(gs, 0, sizeof(*gs));
+			gs->dsid = gsb->gsb_dsid;
+			gs->ino = stp->st_file->fi_inode->i_ino;
+			memcpy(&gs->stid, &stp->st_stateid, sizeof(stateid_t));
+			*(clientid_t *)&gs->clid = clp->cl_clientid;
+			gs->access = stp->st_access_bmap;
+			dprintk("NFSD: %s prefetch sid=" STATEID_FMT "\n",
+				__func__, STATEID_VAL(&stp->st_stateid));
+		}
+	}
+}
+
+/*
+ * PNFS Metadata server export operations callback for a batch of
+ * get_state requests: all of them are validated under one state lock,
+ * each with its own status in gsb_states[].status.
+ */
+int
+nfs4_pnfs_cb_get_state_batch(struct super_block *sb,
+			     struct pnfs_get_state_batch *gsb)
+{
+	struct nfs4_stateid *stp;
+	struct pnfs_get_state *gs;
+	int i, count = gsb->gsb_count;
+
+	dprintk("NFSD: %s count %d max %d\n", __func__, count, gsb->gsb_max);
+
+	nfs4_lock_state();
+	for (i = 0; i < count; i++) {
+		gs = &gsb->gsb_states[i];
+		gs->dsid = gsb->gsb_dsid;
+		gs->status = __nfs4_pnfs_cb_get_state(sb, gs, &stp);
+		if (stp && gsb->gsb_prefetch)
+			nfs4_pnfs_prefetch_client(sb, gsb,
+						  stp->st_stateowner->so_client);
+	}
+	nfs4_unlock_state();
+	return 0;
+}
+
 static int
 cl_has_file_layout(struct nfs4_client *clp, struct nfs4_file *lrfile,
 		   stateid_t *lsid)
 {
 	int found = 0;
-	struct nfs4_layout *lp;
 	struct nfs4_layout_state *ls;
 
-	spin_lock(&layout_lock);
-	list_for_each_entry(lp, &clp->cl_layouts, lo_perclnt) {
-		if (lp->lo_file != lrfile)
-			continue;
+	ls = find_get_layout_state(clp, lrfile);
+	if (!ls)
+		return 0;
 
-		ls = find_get_layout_state(clp, lrfile);
-		if (!ls) {
-			/* This shouldn't happen as the file should have a
-			 * layout stateid if it has a layout.
-			 */
-			printk(KERN_ERR "%s: file %p has no layout stateid\n",
-				__func__, lrfile);
-			WARN_ON(1);
-			break;
-		}
+	spin_lock(&lrfile->fi_layout_lock);
+	if (!list_empty(&ls->ls_layouts)) {
 		update_layout_stateid(ls, lsid);
-		put_layout_state_locked(ls);
 		found = 1;
-		break;
 	}
-	spin_unlock(&layout_lock);
+	spin_unlock(&lrfile->fi_layout_lock);
+	put_layout_state(ls);
 
 	return found;
 }
@@ -1257,13 +1518,13 @@ cl_has_fsid_layout(struct nfs4_client *clp, struct nfs4_fsid *fsid)
 	struct nfs4_layout *lp;
 
 	/* note: minor version unused */
-	spin_lock(&layout_lock);
+	spin_lock(&clp->cl_layout_lock);
 	list_for_each_entry(lp, &clp->cl_layouts, lo_perclnt)
 		if (lp->lo_file->fi_fsid.major == fsid->major) {
 			found = 1;
 			break;
 		}
-	spin_unlock(&layout_lock);
+	spin_unlock(&clp->cl_layout_lock);
 	return found;
 }
 
@@ -1288,7 +1549,7 @@ cl_has_layout(struct nfs4_client *clp, struct nfsd4_pnfs_cb_layout *cbl,
 }
 
 /*
- * Called without the layout_lock.
+ * Called without any layout locks held.
  */
 void
 nomatching_layout(struct nfs4_layoutrecall *clr)
@@ -1299,6 +1560,7 @@ nomatching_layout(struct nfs4_layoutrecall *clr)
 	};
 	struct inode *inode;
 	void *recall_cookie;
+	LIST_HEAD(reaplist);
 
 	if (clr->clr_file) {
 		inode = igrab(clr->clr_file->fi_inode);
@@ -1318,27 +1580,177 @@ nomatching_layout(struct nfs4_layoutrecall *clr)
 		pnfs_return_client_layouts(clr->clr_client, &lr,
 					   clr->cb.cbl_fsid.major);
 
-	spin_lock(&layout_lock);
-	recall_cookie = layoutrecall_done(clr);
-	spin_unlock(&layout_lock);
+	spin_lock(&clr->clr_client->cl_layout_lock);
+	recall_cookie = layoutrecall_done(clr, &reaplist);
+	spin_unlock(&clr->clr_client->cl_layout_lock);
+	put_layoutrecall_list(&reaplist);
 
 	fs_layout_return(clr->clr_sb, inode, &lr, LR_FLAG_INTERN,
 			 recall_cookie);
 	iput(inode);
 }
 
+/*
+ * Recalls per CB_COMPOUND: no more than the backchannel maxops the client
+ * set at CREATE_SESSION allows, one op of which is CB_SEQUENCE.
+ */
+static int
+layout_recall_batch_max(struct nfs4_client *clp)
+{
+	struct nfsd4_session *ses = clp->cl_cb_session;
+
+	if (!ses || ses->se_bchannel.maxops < 2)
+		return 1;
+	return min_t(u32, NFSD4_CB_LAYOUT_MAX_OPS,
+		     ses->se_bchannel.maxops - 1);
+}
+
+/*
+ * Send the client's queued layoutrecalls as a single CB_COMPOUND if it has
+ * no batch in flight and a dispatch slot is free.
+ */
+void
+nfsd4_layout_recall_work(struct work_struct *work)
+{
+	struct nfs4_client *clp = container_of(work, struct nfs4_client,
+					       cl_recall_work);
+	struct nfs4_layoutrecall_batch *lrb = &clp->cl_recall_batch;
+	struct nfs4_layoutrecall *clr;
+	int max;
+
+	spin_lock(&clp->cl_layout_lock);
+	if (lrb->lrb_busy || list_empty(&clp->cl_recall_queue))
+		goto out_unlock;
+
+	spin_lock(&layout_recall_lock);
+	if (layout_recall_inflight >= LAYOUT_RECALL_MAX_INFLIGHT) {
+		if (list_empty(&clp->cl_recall_wait))
+			list_add_tail(&clp->cl_recall_wait,
+				      &layout_recall_waiters);
+		spin_unlock(&layout_recall_lock);
+		goto out_unlock;
+	}
+	layout_recall_inflight++;
+	list_del_init(&clp->cl_recall_wait);
+	spin_unlock(&layout_recall_lock);
+
+	lrb->lrb_busy = true;
+	lrb->lrb_first = 0;
+	lrb->lrb_count = 0;
+	max = layout_recall_batch_max(clp);
+	while (lrb->lrb_count < max &&
+	       !list_empty(&clp->cl_recall_queue)) {
+		clr = list_first_entry(&clp->cl_recall_queue,
+				       struct nfs4_layoutrecall, clr_pending);
+		list_del_init(&clr->clr_pending);
+		lrb->lrb_recalls[lrb->lrb_count++] = clr;
+	}
+	spin_unlock(&clp->cl_layout_lock);
+
+	dprintk("%s: clp %p sending %d layoutrecalls\n", __func__, clp,
+		lrb->lrb_count);
+	nfsd4_cb_layout(lrb);
+	return;
+
+out_unlock:
+	spin_unlock(&clp->cl_layout_lock);
+}
+
+/*
+ * Called once the client's batch has been released: send what was queued
+ * meanwhile and hand the dispatch slot to the next waiting client.
+ */
+void
+nfsd4_layout_recall_batch_done(struct nfs4_client *clp)
+{
+	struct nfs4_client *next;
+
+	spin_lock(&clp->cl_layout_lock);
+	clp->cl_recall_batch.lrb_busy = false;
+	if (!list_empty(&clp->cl_recall_queue))
+		queue_work(layout_recall_wq, &clp->cl_recall_work);
+	spin_unlock(&clp->cl_layout_lock);
+
+	/* queue under the lock so pnfs_expire_client can't miss the work */
+	spin_lock(&layout_recall_lock);
+	layout_recall_inflight--;
+	if (!list_empty(&layout_recall_waiters)) {
+		next = list_first_entry(&layout_recall_waiters,
+					struct nfs4_client, cl_recall_wait);
+		list_del_init(&next->cl_recall_wait);
+		queue_work(layout_recall_wq, &next->cl_recall_work);
+	}
+	spin_unlock(&layout_recall_lock);
+}
+
+static int
+layout_recall_stats_show(struct seq_file *m, void *v)
+{
+	struct nfs4_client *clp;
+	unsigned int inflight, waiting = 0;
+
+	spin_lock(&layout_recall_lock);
+	inflight = layout_recall_inflight;
+	list_for_each_entry(clp, &layout_recall_waiters, cl_recall_wait)
+		waiting++;
+	spin_unlock(&layout_recall_lock);
+
+	seq_printf(m, "# queued batches ops completed nomatching delayed "
+		   "failed inflight waiting\n");
+	seq_printf(m, "%u %u %u %u %u %u %u %u %u\n",
+		   atomic_read(&pnfsd_recall_stats.rs_queued),
+		   atomic_read(&pnfsd_recall_stats.rs_batches),
+		   atomic_read(&pnfsd_recall_stats.rs_ops),
+		   atomic_read(&pnfsd_recall_stats.rs_completed),
+		   atomic_read(&pnfsd_recall_stats.rs_nomatching),
+		   atomic_read(&pnfsd_recall_stats.rs_delayed),
+		   atomic_read(&pnfsd_recall_stats.rs_failed),
+		   inflight, waiting);
+	return 0;
+}
+
+int
+nfsd4_layout_recall_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, layout_recall_stats_show, NULL);
+}
+
 void pnfs_expire_client(struct nfs4_client *clp)
 {
+	LIST_HEAD(unsent);
+
+	/*
+	 * Stop dispatching.  Once cl_recall_queue is empty the work can't
+	 * put the client back on layout_recall_waiters, and any work
+	 * already queued is cancelled below.  The unsent recalls are still
+	 * on cl_layoutrecalls and are completed with the others.
+	 */
+	spin_lock(&clp->cl_layout_lock);
+	list_splice_init(&clp->cl_recall_queue, &unsent);
+	spin_unlock(&clp->cl_layout_lock);
+	spin_lock(&layout_recall_lock);
+	list_del_init(&clp->cl_recall_wait);
+	spin_unlock(&layout_recall_lock);
+	cancel_work_sync(&clp->cl_recall_work);
+	while (!list_empty(&unsent)) {
+		struct nfs4_layoutrecall *clr;
+
+		clr = list_first_entry(&unsent, struct nfs4_layoutrecall,
+				       clr_pending);
+		list_del_init(&clr->clr_pending);
+		put_layoutrecall(clr);
+	}
+
 	for (;;) {
 		struct nfs4_layoutrecall *lrp = NULL;
 
-		spin_lock(&layout_lock);
+		spin_lock(&clp->cl_layout_lock);
 		if (!list_empty(&clp->cl_layoutrecalls)) {
 			lrp = list_entry(clp->cl_layoutrecalls.next,
 					 struct nfs4_layoutrecall, clr_perclnt);
 			get_layoutrecall(lrp);
 		}
-		spin_unlock(&layout_lock);
+		spin_unlock(&clp->cl_layout_lock);
 		if (!lrp)
 			break;
 
@@ -1350,26 +1762,48 @@ void pnfs_expire_client(struct nfs4_client *clp)
 
 	for (;;) {
 		struct nfs4_layout *lp = NULL;
+		struct nfs4_file *fp = NULL;
 		struct inode *inode = NULL;
 		struct nfsd4_pnfs_layoutreturn lr;
 		bool empty = false;
+		LIST_HEAD(reaplist);
+
+		spin_lock(&clp->cl_layout_lock);
+		if (!list_empty(&clp->cl_layouts)) {
+			lp = list_entry(clp->cl_layouts.next,
+					struct nfs4_layout, lo_perclnt);
+			fp = lp->lo_file;
+			get_nfs4_file(fp);
+		}
+		spin_unlock(&clp->cl_layout_lock);
+		if (!fp)
+			break;
 
-		spin_lock(&layout_lock);
+		/* recheck the head now that the file lock pins its layouts */
+		spin_lock(&fp->fi_layout_lock);
+		spin_lock(&clp->cl_layout_lock);
+		lp = NULL;
 		if (!list_empty(&clp->cl_layouts)) {
 			lp = list_entry(clp->cl_layouts.next,
 					struct nfs4_layout, lo_perclnt);
-			inode = igrab(lp->lo_file->fi_inode);
+			if (lp->lo_file != fp)
+				lp = NULL;
+		}
+		if (lp) {
+			inode = igrab(fp->fi_inode);
 			memset(&lr, 0, sizeof(lr));
 			lr.args.lr_return_type = RETURN_FILE;
 			lr.args.lr_seg = lp->lo_seg;
-			empty = list_empty(&lp->lo_file->fi_layouts);
 			BUG_ON(lp->lo_client != clp);
-			dequeue_layout(lp);
-			destroy_layout(lp); /* do not access lp after this */
+			dequeue_layout(lp, &reaplist);
+			empty = list_empty(&fp->fi_layouts);
 		}
-		spin_unlock(&layout_lock);
+		spin_unlock(&clp->cl_layout_lock);
+		spin_unlock(&fp->fi_layout_lock);
+		destroy_layout_list(&reaplist); /* do not access lp after this */
+		put_nfs4_file(fp);
 		if (!lp)
-			break;
+			continue;
 
 		if (WARN_ON(!inode))
 			break;
@@ -1470,6 +1904,7 @@ spawn_layout_recall(struct super_block *sb, struct list_head *todolist,
 {
 	struct nfs4_layoutrecall *pending;
 	struct nfs4_layoutrecall *parent = NULL;
+	struct nfs4_client *clp;
 	int status = 0;
 
 	dprintk("%s: -->\n", __func__);
@@ -1528,12 +1963,18 @@ spawn_layout_recall(struct super_block *sb, struct list_head *todolist,
 				get_layoutrecall(parent);
 		}
 		pending->parent = parent;
+		/* Matching put done when the callback is released */
 		get_layoutrecall(pending);
-		/* Add to list so corresponding layoutreturn can find req */
-		list_add(&pending->clr_perclnt,
-			 &pending->clr_client->cl_layoutrecalls);
-
-		nfsd4_cb_layout(pending);
+		/* Add to list so corresponding layoutreturn can find req,
+		 * and queue it for the client's next CB_COMPOUND */
+		clp = pending->clr_client;
+		spin_lock(&clp->cl_layout_lock);
+		list_add_rcu(&pending->clr_perclnt, &clp->cl_layoutrecalls);
+		list_add_tail(&pending->clr_pending, &clp->cl_recall_queue);
+		spin_unlock(&clp->cl_layout_lock);
+		atomic_inc(&pnfsd_recall_stats.rs_queued);
+
+		queue_work(layout_recall_wq, &clp->cl_recall_work);
 		--todo_len;
 	}
 
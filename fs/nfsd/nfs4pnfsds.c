@@ -42,6 +42,8 @@
 #include <linux/nfs4.h>
 #include <linux/exportfs.h>
 #include <linux/sched.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 
 #include "nfsd.h"
 #include "pnfsd.h"
@@ -62,7 +64,9 @@
  *			from any MDS.
  *
  * ds_stid_hashtbl[]: uses stateid_hashval(), hash of all stateids obtained
- *			from any MDS.
+ *			from any MDS.  Sized to the memory of the machine at
+ *			init.  Entries are added and removed under ds_mutex
+ *			but looked up under RCU, see nfs4_ds_stateid_valid().
  *
  */
 /* Hash tables for clientid state */
@@ -74,8 +78,9 @@
 	((id) & CLIENT_HASH_MASK)
 
 /* hash table for pnfs_ds_stateid */
-#define STATEID_HASH_BITS              10
-#define STATEID_HASH_SIZE              (1 << STATEID_HASH_BITS)
+#define STATEID_HASH_MIN_BITS          10
+#define STATEID_HASH_MAX_BITS          16
+#define STATEID_HASH_SIZE              (1 << ds_stid_hash_bits)
 #define STATEID_HASH_MASK              (STATEID_HASH_SIZE - 1)
 
 #define stateid_hashval(owner_id, file_id)  \
@@ -83,7 +88,8 @@
 
 static struct list_head mds_id_tbl;
 static struct list_head mds_clid_hashtbl[CLIENT_HASH_SIZE];
-static struct list_head ds_stid_hashtbl[STATEID_HASH_SIZE];
+static unsigned int ds_stid_hash_bits;
+static struct hlist_head *ds_stid_hashtbl;
 
 static inline void put_ds_clientid(struct pnfs_ds_clientid *dcp);
 static inline void put_ds_mdsid(struct pnfs_mds_id *mdp);
@@ -115,18 +121,42 @@ cmp_clid(const clientid_t *cl1, const clientid_t *cl2)
 	       (cl1->cl_id == cl2->cl_id);
 }
 
-void
+int
 nfs4_pnfs_state_init(void)
 {
+	unsigned int bits;
 	int i;
 
 	for (i = 0; i < CLIENT_HASH_SIZE; i++)
 		INIT_LIST_HEAD(&mds_clid_hashtbl[i]);
 
-	for (i = 0; i < STATEID_HASH_SIZE; i++)
-		INIT_LIST_HEAD(&ds_stid_hashtbl[i]);
+	/* One bucket per 32 pages of memory, within the bounds */
+	bits = ilog2(totalram_pages) - 5;
+	bits = clamp_t(unsigned int, bits, STATEID_HASH_MIN_BITS,
+		       STATEID_HASH_MAX_BITS);
+	for (; bits >= STATEID_HASH_MIN_BITS; bits--) {
+		ds_stid_hashtbl = kcalloc(1 << bits, sizeof(struct hlist_head),
+					  GFP_KERNEL | __GFP_NOWARN);
+		if (ds_stid_hashtbl)
+			break;
+	}
+	if (!ds_stid_hashtbl)
+		return -ENOMEM;
+	ds_stid_hash_bits = bits;
+	dprintk("pNFSD: %s %u stateid hash buckets\n", __func__,
+		STATEID_HASH_SIZE);
 
 	INIT_LIST_HEAD(&mds_id_tbl);
+	return 0;
+}
+
+void
+nfs4_pnfs_state_free(void)
+{
+	/* wait for free_ds_stateid_rcu() callbacks before the module goes */
+	rcu_barrier();
+	kfree(ds_stid_hashtbl);
+	ds_stid_hashtbl = NULL;
 }
 
 static struct pnfs_mds_id *
@@ -162,6 +192,7 @@ static struct pnfs_ds_stateid *
 find_pnfs_ds_stateid(stateid_t *stid)
 {
 	struct pnfs_ds_stateid *local = NULL;
+	struct hlist_node *pos;
 	u32 st_id = stid->si_stateownerid;
 	u32 f_id = stid->si_fileid;
 	unsigned int hashval;
@@ -169,7 +200,7 @@ find_pnfs_ds_stateid(stateid_t *stid)
 	dprintk("pNFSD: %s\n", __func__);
 
 	hashval = stateid_hashval(st_id, f_id);
-	list_for_each_entry(local, &ds_stid_hashtbl[hashval], ds_hash)
+	hlist_for_each_entry(local, pos, &ds_stid_hashtbl[hashval], ds_hash)
 		if ((local->ds_stid.si_stateownerid == st_id) &&
 				(local->ds_stid.si_fileid == f_id) &&
 				(local->ds_stid.si_boot == stid->si_boot)) {
@@ -212,6 +243,12 @@ release_ds_clientid(struct kref *kref)
 	kfree(dcp);
 }
 
+static void
+free_ds_stateid_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct pnfs_ds_stateid, ds_rcu));
+}
+
 static void
 release_ds_stateid(struct kref *kref)
 {
@@ -224,9 +261,10 @@ release_ds_stateid(struct kref *kref)
 	if (dcp)
 		put_ds_clientid(dcp);
 
-	list_del(&dsp->ds_hash);
+	hlist_del_rcu(&dsp->ds_hash);
 	list_del(&dsp->ds_perclid);
-	kfree(dsp);
+	/* lockless lookups may still be looking at it */
+	call_rcu(&dsp->ds_rcu, free_ds_stateid_rcu);
 }
 
 static inline void
@@ -287,9 +325,9 @@ nfs4_pnfs_state_shutdown(void)
 
 	ds_lock_state();
 	for (i = 0; i < STATEID_HASH_SIZE; i++) {
-		while (!list_empty(&ds_stid_hashtbl[i])) {
-			dsp = list_entry(ds_stid_hashtbl[i].next,
-					 struct pnfs_ds_stateid, ds_hash);
+		while (!hlist_empty(&ds_stid_hashtbl[i])) {
+			dsp = hlist_entry(ds_stid_hashtbl[i].first,
+					  struct pnfs_ds_stateid, ds_hash);
 			put_ds_stateid(dsp);
 		}
 	}
@@ -363,8 +401,9 @@ alloc_init_ds_stateid(struct svc_fh *cfh, stateid_t *stidp)
 	if (!dsp)
 		return dsp;
 
-	INIT_LIST_HEAD(&dsp->ds_hash);
+	INIT_HLIST_NODE(&dsp->ds_hash);
 	INIT_LIST_HEAD(&dsp->ds_perclid);
+	seqcount_init(&dsp->ds_seq);
 	memcpy(&dsp->ds_stid, stidp, sizeof(stateid_t));
 	fh_copy_shallow(&dsp->ds_fh, &cfh->fh_handle);
 	dsp->ds_access = 0;
@@ -377,7 +416,7 @@ alloc_init_ds_stateid(struct svc_fh *cfh, stateid_t *stidp)
 	init_waitqueue_head(&dsp->ds_waitq);
 
 	hashval = stateid_hashval(st_id, f_id);
-	list_add(&dsp->ds_hash, &ds_stid_hashtbl[hashval]);
+	hlist_add_head_rcu(&dsp->ds_hash, &ds_stid_hashtbl[hashval]);
 	dprintk("pNFSD: %s <-- dsp %p\n", __func__, dsp);
 	return dsp;
 }
@@ -404,6 +443,7 @@ update_ds_stateid(struct pnfs_ds_stateid *dsp, struct svc_fh *cfh,
 			get_ds_clientid(dcp);
 	}
 
+	write_seqcount_begin(&dsp->ds_seq);
 	memcpy(&dsp->ds_stid, &gsp->stid, sizeof(stateid_t));
 	dsp->ds_access = gsp->access;
 	dsp->ds_status = 0;
@@ -413,6 +453,7 @@ update_ds_stateid(struct pnfs_ds_stateid *dsp, struct svc_fh *cfh,
 	set_bit(DS_STATEID_VALID, &dsp->ds_flags);
 	clear_bit(DS_STATEID_ERROR, &dsp->ds_flags);
 	clear_bit(DS_STATEID_NEW, &dsp->ds_flags);
+	write_seqcount_end(&dsp->ds_seq);
 	return 0;
 }
 
@@ -534,6 +575,56 @@ out_noput:
 	return dsp;
 }
 
+/*
+ * Lockless check of a stateid the DS already validated with the MDS.
+ *
+ * The stateid hash is walked under RCU and each entry's stateid is read
+ * under its seqcount, so the common READ or WRITE takes neither ds_mutex
+ * nor the nfs4 state mutex.  Only a valid entry whose generation matches
+ * is decided here; everything else returns -EAGAIN for the slow path,
+ * which may have to ask the MDS.
+ */
+static int
+nfs4_ds_stateid_valid(struct svc_fh *cfh, stateid_t *stid)
+{
+	struct pnfs_ds_stateid *dsp;
+	struct hlist_node *pos;
+	unsigned int hashval, seq;
+	int status = -EAGAIN;
+	bool match;
+
+	hashval = stateid_hashval(stid->si_stateownerid, stid->si_fileid);
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(dsp, pos, &ds_stid_hashtbl[hashval],
+				 ds_hash) {
+		do {
+			seq = read_seqcount_begin(&dsp->ds_seq);
+			match = dsp->ds_stid.si_stateownerid ==
+					stid->si_stateownerid &&
+				dsp->ds_stid.si_fileid == stid->si_fileid &&
+				dsp->ds_stid.si_boot == stid->si_boot;
+			status = -EAGAIN;
+			if (match &&
+			    test_bit(DS_STATEID_VALID, &dsp->ds_flags) &&
+			    !test_bit(DS_STATEID_ERROR, &dsp->ds_flags) &&
+			    dsp->ds_stid.si_generation == stid->si_generation)
+				status = 0;
+		} while (read_seqcount_retry(&dsp->ds_seq, seq));
+		if (!match)
+			continue;
+
+		/* ds_fh is set when the entry is created and never changes */
+		if (!status &&
+		    ((cfh->fh_handle.fh_size != dsp->ds_fh.fh_size) ||
+		     memcmp(&cfh->fh_handle.fh_base, &dsp->ds_fh.fh_base,
+			    dsp->ds_fh.fh_size)))
+			status = nfserr_bad_stateid;
+		break;
+	}
+	rcu_read_unlock();
+	return status;
+}
+
 int
 nfs4_preprocess_pnfs_ds_stateid(struct svc_fh *cfh, stateid_t *stateid)
 {
@@ -543,6 +634,14 @@ nfs4_preprocess_pnfs_ds_stateid(struct svc_fh *cfh, stateid_t *stateid)
 	dprintk("pNFSD: %s --> " STATEID_FMT "\n", __func__,
 		STATEID_VAL(stateid));
 
+	status = nfs4_ds_stateid_valid(cfh, stateid);
+	if (status != -EAGAIN) {
+		dprintk("pNFSD: %s <-- cached status %d\n", __func__,
+			be32_to_cpu(status));
+		return status;
+	}
+	status = 0;
+
 	/* Must release state lock while verifying stateid on mds */
 	nfs4_unlock_state();
 	ds_lock_state();
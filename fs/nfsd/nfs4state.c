@@ -39,6 +39,7 @@
 #include <linux/swap.h>
 #include <linux/sunrpc/svcauth_gss.h>
 #include <linux/sunrpc/clnt.h>
+#include <linux/nfsd4_spnfs.h>
 #include "xdr4.h"
 #include "vfs.h"
 
@@ -125,6 +126,9 @@ put_nfs4_file(struct nfs4_file *fi)
 	if (atomic_dec_and_lock(&fi->fi_ref, &recall_lock)) {
 		list_del(&fi->fi_hash);
 		spin_unlock(&recall_lock);
+#if defined(CONFIG_SPNFS)
+		spnfs_put_stripe_files(fi->fi_spnfs);
+#endif /* CONFIG_SPNFS */
 		iput(fi->fi_inode);
 		kmem_cache_free(file_slab, fi);
 	}
@@ -774,6 +778,7 @@ static struct nfsd4_session *alloc_init_session(struct svc_rqst *rqstp, struct n
 		return NULL;
 	}
 	init_forechannel_attrs(&new->se_fchannel, fchan, numslots, slotsize);
+	new->se_bchannel.maxops = cses->back_channel.maxops;
 
 	new->se_client = clp;
 	gen_sessionid(new);
@@ -1085,8 +1090,13 @@ static struct nfs4_client *create_client(struct xdr_netobj name, char *recdir,
 	INIT_LIST_HEAD(&clp->cl_openowners);
 	INIT_LIST_HEAD(&clp->cl_delegations);
 #if defined(CONFIG_PNFSD)
+	spin_lock_init(&clp->cl_layout_lock);
 	INIT_LIST_HEAD(&clp->cl_layouts);
 	INIT_LIST_HEAD(&clp->cl_layoutrecalls);
+	INIT_LIST_HEAD(&clp->cl_recall_queue);
+	INIT_LIST_HEAD(&clp->cl_recall_wait);
+	INIT_WORK(&clp->cl_recall_work, nfsd4_layout_recall_work);
+	INIT_WORK(&clp->cl_recall_batch.lrb_cb.cb_work, nfsd4_do_callback_rpc);
 	atomic_set(&clp->cl_deviceref, 0);
 #endif /* CONFIG_PNFSD */
 	INIT_LIST_HEAD(&clp->cl_lru);
@@ -2075,8 +2085,8 @@ alloc_init_file(struct inode *ino, struct svc_fh *current_fh)
 		memset(fp->fi_fds, 0, sizeof(fp->fi_fds));
 		memset(fp->fi_access, 0, sizeof(fp->fi_access));
 #if defined(CONFIG_PNFSD)
+		spin_lock_init(&fp->fi_layout_lock);
 		INIT_LIST_HEAD(&fp->fi_layouts);
-		INIT_LIST_HEAD(&fp->fi_layout_states);
 		fp->fi_fsid.major = current_fh->fh_export->ex_fsid;
 		fp->fi_fsid.minor = 0;
 		fp->fi_fhlen = current_fh->fh_handle.fh_size;
@@ -2084,6 +2094,9 @@ alloc_init_file(struct inode *ino, struct svc_fh *current_fh)
 		memcpy(fp->fi_fhval, &current_fh->fh_handle.fh_base,
 		       fp->fi_fhlen);
 #endif /* CONFIG_PNFSD */
+#if defined(CONFIG_SPNFS)
+		fp->fi_spnfs = NULL;
+#endif /* CONFIG_SPNFS */
 		spin_lock(&recall_lock);
 		list_add(&fp->fi_hash, &file_hashtbl[hashval]);
 		spin_unlock(&recall_lock);
@@ -2109,6 +2122,7 @@ nfsd4_free_slabs(void)
 	nfsd4_free_slab(&stateid_slab);
 	nfsd4_free_slab(&deleg_slab);
 	nfsd4_free_pnfs_slabs();
+	nfs4_pnfs_state_free();
 }
 
 static int
@@ -4326,7 +4340,11 @@ nfs4_state_init(void)
 	INIT_LIST_HEAD(&del_recall_lru);
 	reclaim_str_hashtbl_size = 0;
 #if defined(CONFIG_PNFSD)
-	nfs4_pnfs_state_init();
+	status = nfs4_pnfs_state_init();
+	if (status) {
+		nfsd4_free_slabs();
+		return status;
+	}
 #endif /* CONFIG_PNFSD */
 	return 0;
 }
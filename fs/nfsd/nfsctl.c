@@ -58,6 +58,7 @@ enum {
 #endif
 #ifdef CONFIG_PNFSD
 	NFSD_pnfs_dlm_device,
+	NFSD_pnfs_layoutrecall_stats,
 #endif
 };
 
@@ -210,6 +211,19 @@ static const struct file_operations pool_stats_operations = {
 	.owner		= THIS_MODULE,
 };
 
+#ifdef CONFIG_PNFSD
+extern int nfsd4_layout_recall_stats_open(struct inode *inode,
+					  struct file *file);
+
+static const struct file_operations layout_recall_stats_operations = {
+	.open		= nfsd4_layout_recall_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	.owner		= THIS_MODULE,
+};
+#endif /* CONFIG_PNFSD */
+
 /*----------------------------------------------------------------------------*/
 /*
  * payload - write methods
@@ -1479,6 +1493,9 @@ static int nfsd_fill_super(struct super_block * sb, void * data, int silent)
 #ifdef CONFIG_PNFSD
 		[NFSD_pnfs_dlm_device] = {"pnfs_dlm_device", &transaction_ops,
 					   S_IWUSR|S_IRUSR},
+		[NFSD_pnfs_layoutrecall_stats] = {"pnfs_layoutrecall_stats",
+					&layout_recall_stats_operations,
+					S_IRUGO},
 #endif
 		/* last one */ {""}
 	};
@@ -1579,6 +1596,7 @@ static void __exit exit_nfsd(void)
 	remove_proc_entry("fs/nfs/spnfs/layoutseg", NULL);
 	remove_proc_entry("fs/nfs/spnfs/getfh", NULL);
 	remove_proc_entry("fs/nfs/spnfs/config", NULL);
+	remove_proc_entry("fs/spnfs/device", NULL);
 	remove_proc_entry("fs/nfs/spnfs/ctl", NULL);
 	remove_proc_entry("fs/nfs/spnfs", NULL);
 #endif /* CONFIG_PROC_FS && CONFIG_SPNFS */
@@ -1588,6 +1606,11 @@ static void __exit exit_nfsd(void)
 	remove_proc_entry("fs/nfs/spnfs/layoutsegsize", NULL);
 #endif /* CONFIG_PROC_FS && CONFIG_SPNFS_LAYOUTSEGMENTS */
 
+#if defined(CONFIG_SPNFS)
+	spnfs_set_device(NULL);	/* drop the cached layout device */
+	flush_scheduled_work();	/* stripe files still being closed */
+#endif /* CONFIG_SPNFS */
+
 	nfsd_export_shutdown();
 	nfsd4_pnfs_dlm_shutdown();
 	nfsd_reply_cache_shutdown();
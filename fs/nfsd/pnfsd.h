@@ -35,6 +35,7 @@
 #define LINUX_NFSD_PNFSD_H
 
 #include <linux/list.h>
+#include <linux/rculist.h>
 #include <linux/nfsd/nfsd4_pnfs.h>
 
 #include "state.h"
@@ -42,7 +43,8 @@
 
 /* outstanding layout stateid */
 struct nfs4_layout_state {
-	struct list_head	ls_perfile;
+	struct hlist_node	ls_hash;    /* hash by (client, file) */
+	struct rcu_head		ls_rcu;
 	struct list_head	ls_layouts; /* list of nfs4_layouts */
 	struct kref		ls_ref;
 	struct nfs4_client	*ls_client;
@@ -61,6 +63,19 @@ struct nfs4_layout {
 	struct nfsd4_layout_seg 	lo_seg;
 };
 
+/* layout recall counters, reported in /proc/fs/nfsd/pnfs_layoutrecall_stats */
+struct pnfsd_recall_stats {
+	atomic_t		rs_queued;	/* layoutrecalls queued to send */
+	atomic_t		rs_batches;	/* CB_COMPOUNDs sent */
+	atomic_t		rs_ops;		/* CB_LAYOUTRECALL ops sent */
+	atomic_t		rs_completed;	/* ops accepted by the client */
+	atomic_t		rs_nomatching;	/* NFS4ERR_NOMATCHING_LAYOUT */
+	atomic_t		rs_delayed;	/* NFS4ERR_DELAY */
+	atomic_t		rs_failed;	/* any other error */
+};
+
+extern struct pnfsd_recall_stats pnfsd_recall_stats;
+
 struct pnfs_inval_state {
 	struct knfsd_fh		mdsfh; /* needed only by invalidate all */
 	stateid_t		stid;
@@ -74,8 +89,10 @@ struct pnfs_inval_state {
 #define DS_STATEID_NEW     2
 
 struct pnfs_ds_stateid {
-	struct list_head	ds_hash;        /* ds_stateid hash entry */
+	struct hlist_node	ds_hash;        /* ds_stateid hash entry, RCU */
 	struct list_head	ds_perclid;     /* per client hash entry */
+	seqcount_t		ds_seq;         /* ds_stid, ds_flags updates */
+	struct rcu_head		ds_rcu;
 	stateid_t		ds_stid;
 	struct knfsd_fh		ds_fh;
 	unsigned long		ds_access;
@@ -120,12 +137,16 @@ __be32 nfs4_pnfs_get_layout(struct nfsd4_pnfs_layoutget *, struct exp_xdr_stream
 int nfs4_pnfs_return_layout(struct super_block *, struct svc_fh *,
 					struct nfsd4_pnfs_layoutreturn *);
 int nfs4_pnfs_cb_get_state(struct super_block *, struct pnfs_get_state *);
+int nfs4_pnfs_cb_get_state_batch(struct super_block *,
+				 struct pnfs_get_state_batch *);
 int nfs4_pnfs_cb_change_state(struct pnfs_get_state *);
 void nfs4_ds_get_verifier(stateid_t *, struct super_block *, u32 *);
 int put_layoutrecall(struct nfs4_layoutrecall *);
 void nomatching_layout(struct nfs4_layoutrecall *);
-void *layoutrecall_done(struct nfs4_layoutrecall *);
-void nfsd4_cb_layout(struct nfs4_layoutrecall *);
+void *layoutrecall_done(struct nfs4_layoutrecall *, struct list_head *);
+void put_layoutrecall_list(struct list_head *);
+void nfsd4_cb_layout(struct nfs4_layoutrecall_batch *);
+void nfsd4_layout_recall_batch_done(struct nfs4_client *);
 int nfsd_layout_recall_cb(struct super_block *, struct inode *,
 			  struct nfsd4_pnfs_cb_layout *);
 int nfsd_device_notify_cb(struct super_block *,
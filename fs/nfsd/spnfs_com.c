@@ -136,6 +136,8 @@ nfsd_spnfs_delete(void)
 	rpc_put_mount();
 	global_spnfs = NULL;
 	kfree(spnfs);
+	/* a restarted spnfsd may serve another device */
+	spnfs_set_device(NULL);
 }
 
 /* RPC pipefs upcall/downcall routines */
@@ -300,6 +302,8 @@ int spnfs_enabled(void)
  * recall - recall a layout from the command line, for example:
  *		echo <path> > /proc/fs/spnfs/recall
  * config - configuration info, e.g., stripe size, num ds, etc.
+ * device - the device layouts are handed out from (struct spnfs_device);
+ *		an empty write forgets it
  */
 
 /*-------------- start ctl -------------------------*/
@@ -343,6 +347,36 @@ static const struct file_operations config_ops = {
 };
 /*-------------- end config ---------------------------*/
 
+/*-------------- start device -------------------------*/
+static ssize_t device_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *offset)
+{
+	struct spnfs_device *dev;
+
+	if (count == 0) {
+		spnfs_set_device(NULL);
+		return 0;
+	}
+	if (count != sizeof(*dev))
+		return -EINVAL;
+
+	dev = kmalloc(sizeof(*dev), GFP_KERNEL);
+	if (dev == NULL)
+		return -ENOMEM;
+	if (copy_from_user(dev, buf, count)) {
+		kfree(dev);
+		return -EFAULT;
+	}
+	spnfs_set_device(dev);
+	kfree(dev);
+	return count;
+}
+
+static const struct file_operations device_ops = {
+	.write		= device_write,
+};
+/*-------------- end device ---------------------------*/
+
 /*-------------- start getfh -----------------------*/
 static int getfh_open(struct inode *inode, struct file *file)
 {
@@ -508,6 +542,11 @@ spnfs_init_proc(void)
 		return -ENOMEM;
 	entry->proc_fops = &config_ops;
 
+	entry = create_proc_entry("fs/spnfs/device", 0, NULL);
+	if (!entry)
+		return -ENOMEM;
+	entry->proc_fops = &device_ops;
+
 	entry = create_proc_entry("fs/spnfs/getfh", 0, NULL);
 	if (!entry)
 		return -ENOMEM;
@@ -29,7 +29,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <linux/sched.h>
 #include <linux/file.h>
 #include <linux/namei.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
 #include <linux/nfs_fs.h>
+#include <linux/magic.h>
 #include <linux/nfsd4_spnfs.h>
 #include <linux/nfsd/debug.h>
 #include <linux/nfsd/nfsd4_pnfs.h>
@@ -54,6 +57,11 @@ extern uint64_t layoutsegment_size;
 #endif /* CONFIG_SPNFS_LAYOUTSEGMENTS */
 extern struct spnfs *global_spnfs;
 
+static void spnfs_cache_stripe_files(struct inode *, fmode_t);
+static int spnfs_policy_layoutget(struct inode *,
+				  struct spnfs_msg_layoutget_res *);
+static int spnfs_policy_getdeviceinfo(u64, struct spnfs_device *);
+
 int
 spnfs_layout_type(struct super_block *sb)
 {
@@ -88,8 +96,9 @@ spnfs_layoutget(struct inode *inode, struct exp_xdr_stream *xdr,
 	im->im_args.layoutget_args.inode = inode->i_ino;
 	im->im_args.layoutget_args.generation = inode->i_generation;
 
-	/* call function to queue the msg for upcall */
-	if (spnfs_upcall(spnfs, im, res) != 0) {
+	/* the upcall is only needed when the policy cache can't answer */
+	if (spnfs_policy_layoutget(inode, &res->layoutget_res) != 0 &&
+	    spnfs_upcall(spnfs, im, res) != 0) {
 		dprintk("failed spnfs upcall: layoutget\n");
 		nfserr = NFS4ERR_LAYOUTUNAVAILABLE;
 		goto layoutget_cleanup;
@@ -414,18 +423,21 @@ spnfs_getdeviceinfo(struct super_block *sb, struct exp_xdr_stream *xdr,
 	/* XXX FIX: figure out what to do about fsid */
 	im->im_args.getdeviceinfo_args.devid = devid->devid;
 
-	/* call function to queue the msg for upcall */
-	status = spnfs_upcall(spnfs, im, res);
-	if (status != 0) {
-		dprintk("%s spnfs upcall failure: %d\n", __func__, status);
-		status = -EIO;
-		goto getdeviceinfo_out;
-	}
-	status = res->getdeviceinfo_res.status;
-	if (status != 0)
-		goto getdeviceinfo_out;
-
 	dev = &res->getdeviceinfo_res.devinfo;
+	if (spnfs_policy_getdeviceinfo(devid->devid, dev) != 0) {
+		/* call function to queue the msg for upcall */
+		status = spnfs_upcall(spnfs, im, res);
+		if (status != 0) {
+			dprintk("%s spnfs upcall failure: %d\n",
+				__func__, status);
+			status = -EIO;
+			goto getdeviceinfo_out;
+		}
+		status = res->getdeviceinfo_res.status;
+		if (status != 0)
+			goto getdeviceinfo_out;
+		spnfs_set_device(dev);
+	}
 
 	/* Fill in the device data, i.e., nfs4_1_file_layout_ds_addr4 */
 	fldev = kzalloc(sizeof(struct pnfs_filelayout_device), GFP_KERNEL);
@@ -573,6 +585,10 @@ spnfs_open(struct inode *inode, struct nfsd4_open *open)
 		goto open_out;
 	}
 	status = res->open_res.status;
+	if (status == 0)
+		spnfs_cache_stripe_files(inode,
+			open->op_share_access & NFS4_SHARE_ACCESS_WRITE ?
+			FMODE_READ | FMODE_WRITE : FMODE_READ);
 
 open_out:
 	kfree(im);
@@ -633,203 +649,511 @@ remove_out:
 	return status;
 }
 
-static int
-read_one(struct inode *inode, loff_t offset, size_t len, char *buf,
-	 struct file **filp)
-{
-	loff_t bufoffset = 0, soffset, pos, snum, soff, tmp;
-	size_t iolen;
-	int completed = 0, ds, err;
-
-	while (len > 0) {
-		tmp = offset;
-		soff = do_div(tmp, spnfs_config->stripe_size);
-		snum = tmp;
-		ds = do_div(tmp, spnfs_config->num_ds);
-		if (spnfs_config->dense_striping == 0)
-			soffset = offset;
-		else {
-			tmp = snum;
-			do_div(tmp, spnfs_config->num_ds);
-			soffset = tmp * spnfs_config->stripe_size + soff;
-		}
-		if (len < spnfs_config->stripe_size - soff)
-			iolen = len;
-		else
-			iolen = spnfs_config->stripe_size - soff;
-
-		pos = soffset;
-		err = vfs_read(filp[ds], buf + bufoffset, iolen, &pos);
-		if (err < 0)
-			return -EIO;
-		if (err == 0)
-			break;
-		filp[ds]->f_pos = pos;
-		iolen = err;
-		completed += iolen;
-		len -= iolen;
-		offset += iolen;
-		bufoffset += iolen;
-	}
+/*
+ * Stripe file cache
+ *
+ * The stripe files of an MDS file are opened once, at OPEN, and hung off
+ * its nfs4_file; the nfs4_file holds a reference on them until the last
+ * open or delegation stateid goes away on close or client expiry.  The
+ * cached set is only used by an nfsd running with the credentials it was
+ * opened with, and for a WRITE only if it was opened read-write.  Any
+ * other READ or WRITE opens a set of its own, which replaces the cached
+ * one when it is more capable (e.g. read-write where the first opener
+ * could only get read-only access).
+ *
+ * The last reference may be dropped under spinlocks, by put_nfs4_file(),
+ * so the files are closed from a work item.
+ */
+static DEFINE_SPINLOCK(spnfs_stripe_lock);	/* protects fi_spnfs */
 
-	return completed;
+static void
+spnfs_release_stripe_files(struct work_struct *work)
+{
+	struct spnfs_stripe_files *sf =
+		container_of(work, struct spnfs_stripe_files, sf_release);
+	int i;
+
+	for (i = 0; i < sf->sf_num_ds; i++)
+		if (sf->sf_filp[i])
+			filp_close(sf->sf_filp[i], NULL);
+	put_cred(sf->sf_cred);
+	kfree(sf);
 }
 
-static __be32
-read(struct inode *inode, loff_t offset, unsigned long *lenp, int vlen,
-     struct svc_rqst *rqstp)
+static void
+spnfs_free_stripe_files(struct kref *kref)
 {
-	int i, vnum, err, bytecount = 0;
-	char path[128];
-	struct file *filp[SPNFS_MAX_DATA_SERVERS];
-	size_t iolen;
-	__be32 status = nfs_ok;
+	struct spnfs_stripe_files *sf =
+		container_of(kref, struct spnfs_stripe_files, sf_ref);
 
-	/*
-	 * XXX We should just be doing this at open time, but it gets
-	 * kind of messy storing this info in nfsd's state structures
-	 * and piggybacking its path through the various state handling
-	 * functions.  Revisit this.
-	 */
-	memset(filp, 0, SPNFS_MAX_DATA_SERVERS * sizeof(struct file *));
-	for (i = 0; i < spnfs_config->num_ds; i++) {
-		sprintf(path, "%s/%ld.%u", spnfs_config->ds_dir[i],
-			inode->i_ino, inode->i_generation);
-		filp[i] = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
-		if (filp[i] == NULL) {
-			status = nfserr_io;
-			goto read_out;
-		}
-		get_file(filp[i]);
-	}
+	INIT_WORK(&sf->sf_release, spnfs_release_stripe_files);
+	schedule_work(&sf->sf_release);
+}
 
-	for (vnum = 0 ; vnum < vlen ; vnum++) {
-		iolen = rqstp->rq_vec[vnum].iov_len;
-		err = read_one(inode, offset + bytecount, iolen,
-			       (char *)rqstp->rq_vec[vnum].iov_base, filp);
-		if (err < 0) {
-			status = nfserr_io;
-			goto read_out;
+void
+spnfs_put_stripe_files(struct spnfs_stripe_files *sf)
+{
+	if (sf)
+		kref_put(&sf->sf_ref, spnfs_free_stripe_files);
+}
+
+/* Open the stripe files; a read-only mode settles for O_RDONLY */
+static struct spnfs_stripe_files *
+spnfs_open_stripe_files(struct inode *inode, fmode_t mode)
+{
+	struct spnfs_stripe_files *sf;
+	struct file *filp;
+	char path[128];
+	int i;
+
+	sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+	if (sf == NULL)
+		return NULL;
+
+	kref_init(&sf->sf_ref);
+	sf->sf_cred = get_current_cred();
+	sf->sf_mode = FMODE_READ | FMODE_WRITE;
+	sf->sf_num_ds = spnfs_config->num_ds;
+	for (i = 0; i < sf->sf_num_ds; i++) {
+		snprintf(path, sizeof(path), "%s/%ld.%u",
+			 spnfs_config->ds_dir[i], inode->i_ino,
+			 inode->i_generation);
+		filp = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+		if (IS_ERR(filp) && !(mode & FMODE_WRITE)) {
+			filp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+			sf->sf_mode = FMODE_READ;
 		}
-		if (err < iolen) {
-			bytecount += err;
-			goto read_out;
+		if (IS_ERR(filp)) {
+			dprintk("%s: open of %s failed: %ld\n", __func__,
+				path, PTR_ERR(filp));
+			spnfs_put_stripe_files(sf);
+			return NULL;
 		}
-		bytecount += rqstp->rq_vec[vnum].iov_len;
+		sf->sf_filp[i] = filp;
 	}
+	return sf;
+}
 
-read_out:
-	*lenp = bytecount;
-	for (i = 0; i < spnfs_config->num_ds; i++) {
-		if (filp[i]) {
-			filp_close(filp[i], current->files);
-			fput(filp[i]);
-		}
+/* May the current nfsd do I/O of the given mode through sf? */
+static bool
+spnfs_stripe_files_usable(struct spnfs_stripe_files *sf, fmode_t mode)
+{
+	return sf->sf_num_ds == spnfs_config->num_ds &&
+	       (sf->sf_mode & mode) == mode &&
+	       sf->sf_cred->fsuid == current_fsuid() &&
+	       sf->sf_cred->fsgid == current_fsgid();
+}
+
+/* Return a referenced cached set of fp usable for mode, or NULL */
+static struct spnfs_stripe_files *
+spnfs_find_stripe_files(struct nfs4_file *fp, fmode_t mode)
+{
+	struct spnfs_stripe_files *sf;
+
+	spin_lock(&spnfs_stripe_lock);
+	sf = fp->fi_spnfs;
+	if (sf && spnfs_stripe_files_usable(sf, mode))
+		kref_get(&sf->sf_ref);
+	else
+		sf = NULL;
+	spin_unlock(&spnfs_stripe_lock);
+	return sf;
+}
+
+/* Make sf the cached set of fp if it can do more than the current one */
+static void
+spnfs_install_stripe_files(struct nfs4_file *fp,
+			   struct spnfs_stripe_files *sf)
+{
+	struct spnfs_stripe_files *old;
+
+	spin_lock(&spnfs_stripe_lock);
+	old = fp->fi_spnfs;
+	if (old == NULL || old->sf_num_ds != sf->sf_num_ds ||
+	    (sf->sf_mode & ~old->sf_mode)) {
+		kref_get(&sf->sf_ref);
+		fp->fi_spnfs = sf;
+	} else
+		old = NULL;
+	spin_unlock(&spnfs_stripe_lock);
+	spnfs_put_stripe_files(old);
+}
+
+/* Set up the stripe file cache of a freshly opened file */
+static void
+spnfs_cache_stripe_files(struct inode *inode, fmode_t mode)
+{
+	struct nfs4_file *fp;
+	struct spnfs_stripe_files *sf;
+
+	if (spnfs_config == NULL)
+		return;
+	fp = find_file(inode);
+	if (fp == NULL)
+		return;
+	sf = spnfs_find_stripe_files(fp, mode);
+	if (sf == NULL) {
+		sf = spnfs_open_stripe_files(inode, mode);
+		if (sf)
+			spnfs_install_stripe_files(fp, sf);
 	}
-	return status;
+	spnfs_put_stripe_files(sf);
+	put_nfs4_file(fp);
 }
 
-__be32
-spnfs_read(struct inode *inode, loff_t offset, unsigned long *lenp, int vlen,
-	   struct svc_rqst *rqstp)
+/*
+ * Return a referenced stripe file set for I/O of the given mode: the
+ * cached one if the current nfsd may use it, or else a fresh one.
+ */
+static struct spnfs_stripe_files *
+spnfs_get_stripe_files(struct inode *inode, fmode_t mode)
 {
-	if (spnfs_config)
-		return read(inode, offset, lenp, vlen, rqstp);
-	else {
-		printk(KERN_ERR "Please upgrade to latest spnfsd\n");
-		return nfserr_notsupp;
+	struct spnfs_stripe_files *sf = NULL;
+	struct nfs4_file *fp;
+
+	fp = find_file(inode);
+	if (fp)
+		sf = spnfs_find_stripe_files(fp, mode);
+	if (sf == NULL) {
+		sf = spnfs_open_stripe_files(inode, mode);
+		if (sf && fp)
+			spnfs_install_stripe_files(fp, sf);
 	}
+	if (fp)
+		put_nfs4_file(fp);
+	return sf;
+}
+
+/*
+ * Layout policy cache
+ *
+ * spnfsd pushes its stripe configuration once through /proc/fs/spnfs/config
+ * and its device through /proc/fs/spnfs/device; the device is also learnt
+ * from the first GETDEVICEINFO upcall.  With both known, GETDEVICEINFO is
+ * answered from the cached device, and LAYOUTGET of a file whose stripe
+ * files were cached at OPEN is built here: the data server filehandles
+ * are those of the stripe files on the spnfsd's NFS mounts of the data
+ * servers, which is exactly what spnfsd would have looked up.  Everything
+ * else still goes up to spnfsd.
+ */
+static DEFINE_SPINLOCK(spnfs_device_lock);
+static struct spnfs_device *spnfs_device;	/* protected by the above */
+
+/* Cache (or, with NULL, forget) the device spnfsd serves layouts from */
+void
+spnfs_set_device(const struct spnfs_device *dev)
+{
+	struct spnfs_device *new = NULL, *old;
+
+	if (dev && dev->dscount > 0 && dev->dscount <= SPNFS_MAX_DATA_SERVERS)
+		new = kmemdup(dev, sizeof(*dev), GFP_KERNEL);
+
+	spin_lock(&spnfs_device_lock);
+	old = spnfs_device;
+	spnfs_device = new;
+	spin_unlock(&spnfs_device_lock);
+	kfree(old);
 }
 
 static int
-write_one(struct inode *inode, loff_t offset, size_t len, char *buf,
-	  struct file **filp)
-{
-	loff_t bufoffset = 0, soffset, pos, snum, soff, tmp;
-	size_t iolen;
-	int completed = 0, ds, err;
-
-	while (len > 0) {
-		tmp = offset;
-		soff = do_div(tmp, spnfs_config->stripe_size);
-		snum = tmp;
-		ds = do_div(tmp, spnfs_config->num_ds);
-		if (spnfs_config->dense_striping == 0)
-			soffset = offset;
-		else {
-			tmp = snum;
-			do_div(tmp, spnfs_config->num_ds);
-			soffset = tmp * spnfs_config->stripe_size + soff;
-		}
-		if (len < spnfs_config->stripe_size - soff)
-			iolen = len;
-		else
-			iolen = spnfs_config->stripe_size - soff;
+spnfs_policy_getdeviceinfo(u64 devid, struct spnfs_device *dev)
+{
+	int status = -ENOENT;
 
-		pos = soffset;
-		err = vfs_write(filp[ds], buf + bufoffset, iolen, &pos);
-		if (err < 0)
-			return -EIO;
-		filp[ds]->f_pos = pos;
-		iolen = err;
-		completed += iolen;
-		len -= iolen;
-		offset += iolen;
-		bufoffset += iolen;
+	spin_lock(&spnfs_device_lock);
+	if (spnfs_device && spnfs_device->devid == devid) {
+		memcpy(dev, spnfs_device, sizeof(*dev));
+		status = 0;
 	}
+	spin_unlock(&spnfs_device_lock);
+	return status;
+}
 
-	return completed;
+static int
+spnfs_policy_layoutget(struct inode *inode,
+		       struct spnfs_msg_layoutget_res *lgr)
+{
+	struct spnfs_stripe_files *sf;
+	struct nfs4_file *fp;
+	struct inode *ds_inode;
+	struct nfs_fh *fh;
+	u64 devid = 0;
+	int dscount = 0, i;
+	int status = -ENOENT;
+
+	if (spnfs_config == NULL)
+		return -ENOENT;
+
+	spin_lock(&spnfs_device_lock);
+	if (spnfs_device) {
+		devid = spnfs_device->devid;
+		dscount = spnfs_device->dscount;
+	}
+	spin_unlock(&spnfs_device_lock);
+	if (dscount == 0 || dscount != spnfs_config->num_ds)
+		return -ENOENT;
+
+	fp = find_file(inode);
+	if (fp == NULL)
+		return -ENOENT;
+	spin_lock(&spnfs_stripe_lock);
+	sf = fp->fi_spnfs;
+	if (sf)
+		kref_get(&sf->sf_ref);
+	spin_unlock(&spnfs_stripe_lock);
+	put_nfs4_file(fp);
+	if (sf == NULL || sf->sf_num_ds != dscount)
+		goto out;
+
+	for (i = 0; i < dscount; i++) {
+		ds_inode = sf->sf_filp[i]->f_path.dentry->d_inode;
+		if (ds_inode->i_sb->s_magic != NFS_SUPER_MAGIC)
+			goto out;
+		fh = NFS_FH(ds_inode);
+		if (fh->size > sizeof(lgr->flist[i].fh_val))
+			goto out;
+		lgr->flist[i].fh_len = fh->size;
+		memcpy(lgr->flist[i].fh_val, fh->data, fh->size);
+	}
+	lgr->devid = devid;
+	lgr->stripe_size = spnfs_config->stripe_size;
+	lgr->stripe_type = spnfs_config->dense_striping ?
+			   STRIPE_DENSE : STRIPE_SPARSE;
+	lgr->stripe_count = dscount;
+	lgr->status = 0;
+	status = 0;
+	dprintk("%s: ino %lu answered in kernel\n", __func__, inode->i_ino);
+out:
+	spnfs_put_stripe_files(sf);
+	return status;
 }
 
-static __be32
-write(struct inode *inode, loff_t offset, size_t len, int vlen,
-      struct svc_rqst *rqstp)
+/*
+ * Striped I/O
+ *
+ * A READ or WRITE is cut into per-stripe-unit chunks, and the chunks
+ * for each data server are chained together and handed to a work item.
+ * The data servers are thus driven in parallel while the I/O to any one
+ * of them stays in file order.
+ */
+struct spnfs_io_chunk {
+	char			*ic_buf;
+	size_t			ic_len;
+	loff_t			ic_soffset;	/* offset in the stripe file */
+	int			ic_next;	/* next chunk, same ds, or -1 */
+	ssize_t			ic_res;
+};
+
+struct spnfs_stripe_io {
+	struct work_struct	sio_work;
+	struct spnfs_io_req	*sio_req;
+	int			sio_ds;
+	int			sio_first;
+	int			sio_last;
+};
+
+struct spnfs_io_req {
+	struct spnfs_stripe_files *ir_files;
+	int			ir_write;
+	int			ir_error;
+	atomic_t		ir_pending;
+	struct completion	ir_done;
+	int			ir_nchunks;
+	struct spnfs_io_chunk	*ir_chunks;
+	struct spnfs_stripe_io	ir_sio[SPNFS_MAX_DATA_SERVERS];
+};
+
+static void
+spnfs_stripe_io_work(struct work_struct *work)
 {
-	int i, vnum, err, bytecount = 0;
-	char path[128];
-	struct file *filp[SPNFS_MAX_DATA_SERVERS];
-	size_t iolen;
-	__be32 status = nfs_ok;
+	struct spnfs_stripe_io *sio =
+		container_of(work, struct spnfs_stripe_io, sio_work);
+	struct spnfs_io_req *ioreq = sio->sio_req;
+	struct file *filp = ioreq->ir_files->sf_filp[sio->sio_ds];
+	struct spnfs_io_chunk *c;
+	mm_segment_t oldfs;
+	loff_t pos;
+	int i;
+
+	oldfs = get_fs();
+	set_fs(KERNEL_DS);
+	for (i = sio->sio_first; i >= 0; i = c->ic_next) {
+		c = &ioreq->ir_chunks[i];
+		pos = c->ic_soffset;
+		if (ioreq->ir_write)
+			c->ic_res = vfs_write(filp, c->ic_buf, c->ic_len, &pos);
+		else
+			c->ic_res = vfs_read(filp, c->ic_buf, c->ic_len, &pos);
+		if (c->ic_res < 0)
+			break;
+	}
+	/* stripes used to be flushed by the close after every WRITE */
+	if (ioreq->ir_write && filp->f_op && filp->f_op->flush &&
+	    filp->f_op->flush(filp, NULL))
+		ioreq->ir_error = -EIO;
+	set_fs(oldfs);
+
+	if (atomic_dec_and_test(&ioreq->ir_pending))
+		complete(&ioreq->ir_done);
+}
 
-	/*
-	 * XXX We should just be doing this at open time, but it gets
-	 * kind of messy storing this info in nfsd's state structures
-	 * and piggybacking its path through the various state handling
-	 * functions.  Revisit this.
-	 */
-	memset(filp, 0, SPNFS_MAX_DATA_SERVERS * sizeof(struct file *));
-	for (i = 0; i < spnfs_config->num_ds; i++) {
-		sprintf(path, "%s/%ld.%u", spnfs_config->ds_dir[i],
-			inode->i_ino, inode->i_generation);
-		filp[i] = filp_open(path, O_RDWR | O_LARGEFILE, 0);
-		if (filp[i] == NULL) {
-			status = nfserr_io;
-			goto write_out;
-		}
-		get_file(filp[i]);
+/*
+ * Map [offset, offset + sum of vec lengths) onto the stripe files, then
+ * start the I/O and wait for all data servers to finish.
+ */
+static int
+spnfs_stripe_io(struct spnfs_stripe_files *sf, int write, loff_t offset,
+		struct kvec *vec, int vlen)
+{
+	struct spnfs_io_req *ioreq;
+	struct spnfs_io_chunk *c;
+	struct spnfs_stripe_io *sio;
+	loff_t soffset, snum, soff, tmp;
+	size_t len, iolen, vecoff;
+	int i, vnum, ds, nsio = 0;
+
+	ioreq = kzalloc(sizeof(*ioreq), GFP_KERNEL);
+	if (ioreq == NULL)
+		return -ENOMEM;
+	/* each vec crosses at most iov_len / stripe_size + 1 boundaries */
+	for (vnum = 0, i = 0; vnum < vlen; vnum++)
+		i += vec[vnum].iov_len / spnfs_config->stripe_size + 2;
+	ioreq->ir_chunks = kmalloc(i * sizeof(struct spnfs_io_chunk),
+				   GFP_KERNEL);
+	if (ioreq->ir_chunks == NULL) {
+		kfree(ioreq);
+		return -ENOMEM;
 	}
+	ioreq->ir_files = sf;
+	ioreq->ir_write = write;
+	init_completion(&ioreq->ir_done);
+	for (ds = 0; ds < sf->sf_num_ds; ds++)
+		ioreq->ir_sio[ds].sio_first = -1;
 
 	for (vnum = 0; vnum < vlen; vnum++) {
-		iolen = rqstp->rq_vec[vnum].iov_len;
-		err = write_one(inode, offset + bytecount, iolen,
-				(char *)rqstp->rq_vec[vnum].iov_base, filp);
-		if (err != iolen) {
-			dprintk("spnfs_write: err=%d expected %Zd\n", err, len);
-			status = nfserr_io;
-			goto write_out;
+		for (vecoff = 0; vecoff < vec[vnum].iov_len; vecoff += iolen) {
+			len = vec[vnum].iov_len - vecoff;
+			tmp = offset;
+			soff = do_div(tmp, spnfs_config->stripe_size);
+			snum = tmp;
+			ds = do_div(tmp, sf->sf_num_ds);
+			if (spnfs_config->dense_striping == 0)
+				soffset = offset;
+			else {
+				tmp = snum;
+				do_div(tmp, sf->sf_num_ds);
+				soffset = tmp * spnfs_config->stripe_size +
+					  soff;
+			}
+			if (len < spnfs_config->stripe_size - soff)
+				iolen = len;
+			else
+				iolen = spnfs_config->stripe_size - soff;
+
+			i = ioreq->ir_nchunks++;
+			c = &ioreq->ir_chunks[i];
+			c->ic_buf = (char *)vec[vnum].iov_base + vecoff;
+			c->ic_len = iolen;
+			c->ic_soffset = soffset;
+			c->ic_next = -1;
+			c->ic_res = 0;
+
+			sio = &ioreq->ir_sio[ds];
+			if (sio->sio_first < 0) {
+				sio->sio_first = i;
+				nsio++;
+			} else
+				ioreq->ir_chunks[sio->sio_last].ic_next = i;
+			sio->sio_last = i;
+			offset += iolen;
 		}
-		bytecount += rqstp->rq_vec[vnum].iov_len;
 	}
 
-write_out:
-	for (i = 0; i < spnfs_config->num_ds; i++) {
-		if (filp[i]) {
-			filp_close(filp[i], current->files);
-			fput(filp[i]);
+	atomic_set(&ioreq->ir_pending, nsio);
+	for (ds = 0; ds < sf->sf_num_ds; ds++) {
+		sio = &ioreq->ir_sio[ds];
+		if (sio->sio_first < 0)
+			continue;
+		sio->sio_req = ioreq;
+		sio->sio_ds = ds;
+		INIT_WORK(&sio->sio_work, spnfs_stripe_io_work);
+		queue_work(system_unbound_wq, &sio->sio_work);
+	}
+	if (nsio)
+		wait_for_completion(&ioreq->ir_done);
+
+	/*
+	 * Completed bytes are those of the leading run of full chunks, plus
+	 * whatever a short read at the end of that run returned.
+	 */
+	len = 0;
+	for (i = 0; i < ioreq->ir_nchunks; i++) {
+		c = &ioreq->ir_chunks[i];
+		if (c->ic_res < 0) {
+			ioreq->ir_error = -EIO;
+			break;
 		}
+		len += c->ic_res;
+		if (c->ic_res < c->ic_len)
+			break;
 	}
+	i = ioreq->ir_error ? ioreq->ir_error : len;
 
-	return status;
+	kfree(ioreq->ir_chunks);
+	kfree(ioreq);
+	return i;
+}
+
+static __be32
+read(struct inode *inode, loff_t offset, unsigned long *lenp, int vlen,
+     struct svc_rqst *rqstp)
+{
+	struct spnfs_stripe_files *sf;
+	int err;
+
+	*lenp = 0;
+	sf = spnfs_get_stripe_files(inode, FMODE_READ);
+	if (sf == NULL)
+		return nfserr_io;
+
+	err = spnfs_stripe_io(sf, 0, offset, rqstp->rq_vec, vlen);
+	spnfs_put_stripe_files(sf);
+	if (err < 0)
+		return nfserr_io;
+	*lenp = err;
+	return nfs_ok;
+}
+
+__be32
+spnfs_read(struct inode *inode, loff_t offset, unsigned long *lenp, int vlen,
+	   struct svc_rqst *rqstp)
+{
+	if (spnfs_config)
+		return read(inode, offset, lenp, vlen, rqstp);
+	else {
+		printk(KERN_ERR "Please upgrade to latest spnfsd\n");
+		return nfserr_notsupp;
+	}
+}
+
+static __be32
+write(struct inode *inode, loff_t offset, size_t len, int vlen,
+      struct svc_rqst *rqstp)
+{
+	struct spnfs_stripe_files *sf;
+	int err;
+
+	sf = spnfs_get_stripe_files(inode, FMODE_READ | FMODE_WRITE);
+	if (sf == NULL)
+		return nfserr_io;
+
+	err = spnfs_stripe_io(sf, 1, offset, rqstp->rq_vec, vlen);
+	spnfs_put_stripe_files(sf);
+	if (err != len) {
+		dprintk("spnfs_write: err=%d expected %Zd\n", err, len);
+		return nfserr_io;
+	}
+	return nfs_ok;
 }
 
 __be32
@@ -201,6 +201,27 @@ struct nfsd4_sessionid {
  *	o cl_perclient list is used to ensure no dangling stateowner references
  *	  when we expire the nfs4_client
  */
+#if defined(CONFIG_PNFSD)
+/*
+ * CB_LAYOUTRECALLs pending for a client are coalesced into a single
+ * callback compound of up to NFSD4_CB_LAYOUT_MAX_OPS operations, fewer if
+ * the session's backchannel maxops is lower.  There is a single
+ * backchannel slot, so at most one batch per client is in flight.
+ */
+#define NFSD4_CB_LAYOUT_MAX_OPS	8
+
+struct nfs4_layoutrecall;
+
+struct nfs4_layoutrecall_batch {
+	struct nfsd4_callback	lrb_cb;
+	bool			lrb_busy;	/* in flight */
+	int			lrb_first;	/* first op to (re)send */
+	int			lrb_failed;	/* op the reply stopped at */
+	int			lrb_count;
+	struct nfs4_layoutrecall *lrb_recalls[NFSD4_CB_LAYOUT_MAX_OPS];
+};
+#endif /* CONFIG_PNFSD */
+
 struct nfs4_client {
 	struct list_head	cl_idhash; 	/* hash by cl_clientid.id */
 	struct list_head	cl_strhash; 	/* hash by cl_name */
@@ -247,9 +268,14 @@ struct nfs4_client {
 	struct rpc_wait_queue	cl_cb_waitq;	/* backchannel callers may */
 						/* wait here for slots */
 #if defined(CONFIG_PNFSD)
+	spinlock_t		cl_layout_lock;	/* cl_layouts, cl_layoutrecalls */
 	struct list_head	cl_layouts;	/* outstanding layouts */
 	struct list_head	cl_layoutrecalls; /* outstanding layoutrecall
 						     callbacks */
+	struct list_head	cl_recall_queue; /* layoutrecalls not yet sent */
+	struct list_head	cl_recall_wait;	/* waiting for a dispatch slot */
+	struct work_struct	cl_recall_work;
+	struct nfs4_layoutrecall_batch cl_recall_batch;
 	atomic_t		cl_deviceref;	/* Num outstanding devs */
 #endif /* CONFIG_PNFSD */
 };
@@ -369,13 +395,17 @@ struct nfs4_file {
 					     * for stateid_hashtbl hash */
 	bool			fi_had_conflict;
 #if defined(CONFIG_PNFSD)
+	spinlock_t		fi_layout_lock;	/* this file's layouts */
 	struct list_head	fi_layouts;
-	struct list_head	fi_layout_states;
 	/* used by layoutget / layoutrecall */
 	struct nfs4_fsid	fi_fsid;
 	u32			fi_fhlen;
 	u8			fi_fhval[NFS4_FHSIZE];
 #endif /* CONFIG_PNFSD */
+#if defined(CONFIG_SPNFS)
+	/* stripe files opened at OPEN, released with the nfs4_file */
+	struct spnfs_stripe_files *fi_spnfs;
+#endif /* CONFIG_SPNFS */
 };
 
 /* XXX: for first cut may fall back on returning file that doesn't work
@@ -505,8 +535,10 @@ extern int filter_confirmed_clients(int (* func)(struct nfs4_client *, void *),
 extern int nfsd4_init_pnfs_slabs(void);
 extern void nfsd4_free_pnfs_slabs(void);
 extern void pnfs_expire_client(struct nfs4_client *);
+extern void nfsd4_layout_recall_work(struct work_struct *);
 extern void release_pnfs_ds_dev_list(struct nfs4_stateid *);
-extern void nfs4_pnfs_state_init(void);
+extern int nfs4_pnfs_state_init(void);
+extern void nfs4_pnfs_state_free(void);
 extern void nfs4_pnfs_state_shutdown(void);
 extern void nfs4_ds_get_verifier(stateid_t *, struct super_block *, u32 *);
 extern int nfs4_preprocess_pnfs_ds_stateid(struct svc_fh *, stateid_t *);
@@ -515,6 +547,7 @@ static inline void nfsd4_free_pnfs_slabs(void) {}
 static inline int nfsd4_init_pnfs_slabs(void) { return 0; }
 static inline void pnfs_expire_client(struct nfs4_client *clp) {}
 static inline void release_pnfs_ds_dev_list(struct nfs4_stateid *stp) {}
+static inline void nfs4_pnfs_state_free(void) {}
 static inline void nfs4_pnfs_state_shutdown(void) {}
 #endif /* CONFIG_PNFSD */
 
@@ -576,6 +576,7 @@ enum {
 	NFSPROC4_CLNT_PNFS_WRITE,
 	NFSPROC4_CLNT_PNFS_COMMIT,
 	NFSPROC4_CLNT_RINTEGRITY,
+	NFSPROC4_CLNT_COHORT_RPL_LOG,
 };
 
 /* nfs41 types */
@@ -86,6 +86,7 @@ struct nfs_client {
 	struct nfs4_session	*cl_session; 	/* sharred session */
 	struct list_head	cl_layouts;
 	atomic_t		cl_recall_count; /* no. of lsegs in recall */
+	atomic_t		cl_bulk_returns; /* LAYOUTRETURN(FSID)s in flight */
 	struct list_head	cl_layoutrecalls;
 	unsigned long		cl_cb_lrecall_count;
 #define PNFS_MAX_CB_LRECALLS (64)
@@ -184,6 +185,8 @@ struct nfs_server {
 	void			       *pnfs_ld_data; /* Per-mount data */
 	unsigned int			ds_rsize;  /* Data server read size */
 	unsigned int			ds_wsize;  /* Data server write size */
+	unsigned int			ds_nconnect; /* Transports per data server */
+	atomic_t			pnfs_ds_connects; /* background DS connects */
 	u32				pnfs_blksize; /* layout_blksize attr */
 #endif
 	void (*destroy)(struct nfs_server *);
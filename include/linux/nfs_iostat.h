@@ -21,7 +21,7 @@
 #ifndef _LINUX_NFS_IOSTAT
 #define _LINUX_NFS_IOSTAT
 
-#define NFS_IOSTAT_VERS		"1.0"
+#define NFS_IOSTAT_VERS		"1.1"
 
 /*
  * NFS byte counters
@@ -119,6 +119,50 @@ enum nfs_stat_eventcounters {
 	__NFSIOS_COUNTSMAX,
 };
 
+/*
+ * pNFS counters
+ *
+ * Kept separately for the mount's data layout driver and its metadata
+ * layout driver (used for directories by the Cohort replication
+ * layout), and shown on the "pnfs:" and "pnfs-meta:" lines of
+ * mountstats.
+ *
+ * LAYOUTGET, LAYOUTRETURN and LAYOUTCOMMIT are counted as they complete;
+ * the matching _MSECS counters add up the time each took, retries
+ * included, so dividing one by the other gives the mean latency.
+ * LSEGS and LAYOUTS are the number of layout segments currently cached
+ * and of inodes holding any.  DS bytes went to data servers through
+ * the layout driver; MDS bytes are I/O on a pNFS mount that fell back to
+ * the metadata server.  The RETRY counters count I/O resent through the
+ * MDS after a data server error.
+ */
+enum nfs_stat_pnfscounters {
+	NFSIOS_PNFS_LAYOUTGET = 0,
+	NFSIOS_PNFS_LAYOUTGET_FAIL,
+	NFSIOS_PNFS_LAYOUTGET_MSECS,
+	NFSIOS_PNFS_LAYOUTRETURN,
+	NFSIOS_PNFS_LAYOUTRETURN_MSECS,
+	NFSIOS_PNFS_LAYOUTCOMMIT,
+	NFSIOS_PNFS_LAYOUTCOMMIT_MSECS,
+	NFSIOS_PNFS_GETDEVICEINFO,
+	NFSIOS_PNFS_LSEGS,
+	NFSIOS_PNFS_LAYOUTS,
+	NFSIOS_PNFS_DSREADBYTES,
+	NFSIOS_PNFS_DSWRITTENBYTES,
+	NFSIOS_PNFS_MDSREADBYTES,
+	NFSIOS_PNFS_MDSWRITTENBYTES,
+	NFSIOS_PNFS_READ_RETRY,
+	NFSIOS_PNFS_WRITE_RETRY,
+	NFSIOS_PNFS_COMMIT_RETRY,
+	__NFSIOS_PNFSMAX,
+};
+
+enum nfs_stat_pnfsclasses {
+	NFSIOS_PNFS_DATA = 0,
+	NFSIOS_PNFS_META,
+	__NFSIOS_PNFSCLASSES,
+};
+
 /*
  * NFS local caching servicing counters
  */
@@ -1100,6 +1100,7 @@ struct cohort_replication_layout_ds_addr4 {
 };
 
 struct cohort_replication_layoutupdate4 {
+	u64 seq;	/* last replica log record applied by quorum */
 	int len;
 	struct cohort_signed_integrity4 **si_list;
 };
@@ -1116,6 +1117,38 @@ struct nfs41_rintegrity_res {
 	struct nfs4_sequence_res seq_res;
 };
 
+/*
+ * Replica log batch: one compound carrying several namespace ops, each
+ * encoded as [PUTFH] CREATE|REMOVE.
+ */
+#define COHORT_RPL_LOG_MAXOPS	64
+#define COHORT_RPL_LOG_MAXBYTES	8192
+
+struct cohort_rpl_log_rec {
+	struct list_head	lr_list;
+	u64			lr_seq;
+	u32			lr_op;		/* OP_CREATE or OP_REMOVE */
+	unsigned int		lr_putfh : 1;	/* cfh is not yet lr_dir_fh */
+	unsigned int		lr_bytes;	/* bound on encoded size */
+	struct nfs_fh		lr_dir_fh;
+	struct nfs_fh		lr_crt_fh;
+	struct qstr		lr_name;
+	struct iattr		lr_attrs;
+	struct nfs4_create_arg	lr_create;	/* OP_CREATE only */
+	unsigned char		lr_namebuf[0];
+};
+
+struct cohort_rpl_log_args {
+	struct list_head	*recs;
+	struct nfs4_sequence_args seq_args;
+};
+
+struct cohort_rpl_log_res {
+	struct list_head	*recs;
+	u32			ndone;
+	struct nfs4_sequence_res seq_res;
+};
+
 #endif /* CONFIG_PNFS_COHORT */
 
 #endif /* CONFIG_NFS_V4_1 */
@@ -1129,6 +1162,7 @@ struct nfs_page;
 /* pnfsflag values */
 enum pnfs_flags {
 	PNFS_NO_RPC = 1 << 0,	/* non rpc result callback switch */
+	PNFS_DIRECT_IO = 1 << 1,	/* O_DIRECT: ->req is not an nfs_page */
 };
 
 /* pnfs-specific data needed for read, write, and commit calls */
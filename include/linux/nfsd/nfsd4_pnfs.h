@@ -35,6 +35,7 @@
 #define _LINUX_NFSD_NFSD4_PNFS_H
 
 #include <linux/exportfs.h>
+#include <linux/rcupdate.h>
 #include <linux/exp_xdr.h>
 #include <linux/nfs_xdr.h>
 #include <linux/nfsd/export.h>
@@ -123,6 +124,23 @@ struct pnfs_get_state {
 	u32			access;    /* response */
 	u32			stid_gen;    /* response */
 	u32			verifier[2]; /* response */
+	int			status;      /* response, batches only */
+};
+
+/*
+ * Several get_state requests in one, for a cluster fs that forwards its
+ * data servers' get_state calls to the MDS in batches.  gsb_states holds
+ * gsb_count requests and room for gsb_max in all; with gsb_prefetch set
+ * the MDS may append, up to gsb_max, the other open stateids of the
+ * clients the requested ones belong to, and bumps gsb_count to match, so
+ * the fs can answer those on the data server without asking again.
+ */
+struct pnfs_get_state_batch {
+	u32			gsb_dsid;	/* request */
+	int			gsb_count;	/* request;response */
+	int			gsb_max;	/* request */
+	int			gsb_prefetch;	/* request */
+	struct pnfs_get_state	*gsb_states;	/* request;response */
 };
 
 /*
@@ -237,7 +255,9 @@ struct nfs4_layoutrecall {
 	struct nfs4_layoutrecall	*parent; /* The initiating recall */
 
 	/* nfsd internal */
-	struct nfsd4_callback		clr_recall;
+	struct list_head		clr_pending; /* on cl_recall_queue */
+	struct list_head		clr_reap;    /* last put deferred */
+	struct rcu_head			clr_rcu;
 };
 
 struct nfsd4_pnfs_cb_dev_item {
@@ -266,6 +286,8 @@ struct pnfsd_cb_operations {
 
 	/* Callback from fs on MDS only */
 	int (*cb_get_state) (struct super_block *, struct pnfs_get_state *);
+	int (*cb_get_state_batch) (struct super_block *,
+				   struct pnfs_get_state_batch *);
 	/* Callback from fs on DS only */
 	int (*cb_change_state) (struct pnfs_get_state *);
 };
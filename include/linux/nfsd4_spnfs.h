@@ -33,6 +33,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #ifdef __KERNEL__
 #include "exportfs.h"
+#include "kref.h"
+#include "workqueue.h"
 #include "sunrpc/svc.h"
 #include "nfsd/nfsfh.h"
 #else
@@ -308,6 +310,16 @@ struct spnfs {
 
 struct nfsd4_open;
 
+/* the data server stripe files of one MDS file */
+struct spnfs_stripe_files {
+	struct kref		sf_ref;
+	int			sf_num_ds;
+	fmode_t			sf_mode;	/* FMODE_READ, maybe FMODE_WRITE */
+	const struct cred	*sf_cred;	/* of the nfsd that opened them */
+	struct work_struct	sf_release;
+	struct file		*sf_filp[SPNFS_MAX_DATA_SERVERS];
+};
+
 int spnfs_layout_type(struct super_block *);
 enum nfsstat4 spnfs_layoutget(struct inode *, struct exp_xdr_stream *xdr,
 			      const struct nfsd4_pnfs_layoutget_arg *,
@@ -329,6 +341,8 @@ __be32 spnfs_read(struct inode *, loff_t, unsigned long *,
 		  int, struct svc_rqst *);
 __be32 spnfs_write(struct inode *, loff_t, size_t, int, struct svc_rqst *);
 int spnfs_getfh(int, struct nfs_fh *);
+void spnfs_put_stripe_files(struct spnfs_stripe_files *);
+void spnfs_set_device(const struct spnfs_device *);
 int spnfs_test_layoutrecall(char *, u64, u64);
 int spnfs_layoutrecall(struct inode *, int, u64, u64);
 